@@ -0,0 +1,55 @@
+/// The shortcuts example again, in C++, using the uft.hpp binding.
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <string_view>
+
+#include <uft.hpp>
+
+
+int
+main (int argc, char ** argv)
+{
+  // create a transaction, which is ended when 'tx' goes out of scope,
+  // adding everything to it with UFT_ALLOW_NOENT
+  uft::transaction<uft::capture::with<UFT_ALLOW_NOENT>> tx;
+
+  // run it, the lambda's result succeeding or failing it
+  tx.begin([] (auto & tx) {
+    // add both paths at once
+    std::array<std::string_view, 2> paths = { "uft_example_raii_1", "uft_example_raii_2" };
+    if (!tx.add_all(paths))
+      return false;
+
+    // open a file and write to it
+    int fd = uft_open(tx.get(), (char *) "uft_example_raii_1", O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0)
+      return false;
+    if (uft_write(tx.get(), fd, (char *) "some_data\n", 10) != 10)
+      return false;
+    close(fd);
+    fprintf(stderr, "Wrote some_data to uft_example_raii_1 successfully...\n");
+
+    // create a directory
+    if (uft_mkdir(tx.get(), (char *) "uft_example_raii_2", 0777) != 0)
+      return false;
+    fprintf(stderr, "Created directory uft_example_raii_2 successfully...\n");
+
+    return true;
+  });
+
+  // report result of transaction
+  if (tx.ok()) {
+    printf("Transaction successful, good job!\n");
+  } else {
+    printf("Transaction failed!\n\n");
+    int i = 0;
+    for (std::string_view msg : tx.errors())
+      fprintf(stderr, "Tx_%02d error %02d - %.*s\n", tx.id(), i++, (int) msg.size(), msg.data());
+  }
+}
@@ -9,6 +9,9 @@
 #include <string.h>
 
 #include "uft.h"
+#include "uft_tx.h"
+#include "uft_status.h"
+#include "uft_trace.h"
 
 
 /// Pass through to mkdir, but fail the transaction and log a transactional
@@ -17,6 +20,9 @@
 int
 uft_mkdir (uft_tx * tx, char * path, int mode)
 {
+  if (uft_trace_on)
+    uft_trace_call(UFT_TRACE_MKDIR, tx->id, mode, 0, 0, path, NULL);
+
   int retval = mkdir(path, mode);
 
   if (retval != 0) {
@@ -29,10 +35,17 @@ uft_mkdir (uft_tx * tx, char * path, int mode)
 
 
 /// Pass through to open, but fail the transaction and log a transactional
-/// error if the operation fails.
+/// error if the operation fails. Opening for writing first waits for
+/// any background capture of the file (see 'uft_tx_barrier').
 
 int uft_open (uft_tx * tx, char * path, int flags, mode_t mode)
 {
+  if (uft_trace_on)
+    uft_trace_call(UFT_TRACE_OPEN, tx->id, flags, mode, 0, path, NULL);
+
+  if (((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC) != 0) && uft_tx_barrier(tx, path) != 0)
+    return -1;
+
   int retval = open(path, flags, mode);
 
   if (retval < 0) {
@@ -49,6 +62,9 @@ int uft_open (uft_tx * tx, char * path, int flags, mode_t mode)
 
 int uft_read (uft_tx * tx, int fd, char * buf, int len)
 {
+  if (uft_trace_on)
+    uft_trace_fd_call(UFT_TRACE_READ, tx->id, len, 0, fd);
+
   int retval = read(fd, buf, len);
 
   if (retval < 0) {
@@ -61,10 +77,17 @@ int uft_read (uft_tx * tx, int fd, char * buf, int len)
 
 
 /// Pass through to write, but fail the transaction and log a transactional
-/// error if the operation fails.
+/// error if the operation fails. Waits for any background capture of the
+/// file first (see 'uft_tx_barrier').
 
 int uft_write (uft_tx * tx, int fd, char * buf, int len)
 {
+  if (uft_trace_on)
+    uft_trace_fd_call(UFT_TRACE_WRITE, tx->id, len, lseek(fd, 0, SEEK_CUR), fd);
+
+  if (uft_tx_barrier_fd(tx, fd) != 0)
+    return -1;
+
   int retval = write(fd, buf, len);
 
   if (retval != len) {
@@ -74,3 +97,61 @@ int uft_write (uft_tx * tx, int fd, char * buf, int len)
 
   return retval;
 }
+
+
+/// Delete a file (or symlink) as part of the transaction. It is moved to
+/// a trash directory, so no content is copied, and is put back if the
+/// transaction is rolled back. Fails the transaction and logs an error
+/// if the file cannot be deleted.
+
+int
+uft_unlink (uft_tx * tx, char * path)
+{
+  if (uft_trace_on)
+    uft_trace_call(UFT_TRACE_UNLINK, tx->id, 0, 0, 0, path, NULL);
+
+  if (uft_status_error(uft_tx_trash(tx, path, 0))) {
+    uft_tx_fail(tx);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/// Delete a directory and everything in it (or anything else) as part of
+/// the transaction, in the same way as 'uft_unlink'.
+
+int
+uft_rmtree (uft_tx * tx, char * path)
+{
+  if (uft_trace_on)
+    uft_trace_call(UFT_TRACE_RMTREE, tx->id, 0, 0, 0, path, NULL);
+
+  if (uft_status_error(uft_tx_trash(tx, path, 1))) {
+    uft_tx_fail(tx);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/// Rename a file, symlink or directory as part of the transaction. If
+/// 'new_path' exists it is moved to the trash (see 'uft_unlink') first.
+/// A rollback renames it back. Fails the transaction and logs an error
+/// if it cannot be renamed.
+
+int
+uft_rename (uft_tx * tx, char * old_path, char * new_path)
+{
+  if (uft_trace_on)
+    uft_trace_call(UFT_TRACE_RENAME, tx->id, 0, 0, 0, old_path, new_path);
+
+  if (uft_status_error(uft_tx_rename(tx, old_path, new_path))) {
+    uft_tx_fail(tx);
+    return -1;
+  }
+
+  return 0;
+}
@@ -1,12 +1,27 @@
 /// libuft top level / misc functions
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct uft_tx_st uft_tx;
 typedef struct uft_tx_error_st uft_tx_error;
 typedef struct uft_status_st uft_status;
+typedef struct uft_group_st uft_group;
+typedef struct uft_enrol_set_st uft_enrol_set;
 
 
-#define UFT_ALLOW_NOENT 0x00000001
+#define UFT_ALLOW_NOENT   0x00000001
+#define UFT_LOCK_SH       0x00000002
+#define UFT_LOCK_EX       0x00000004
+#define UFT_LOCK_TRY      0x00000008
+#define UFT_DIFF_ROLLBACK 0x00000010
+#define UFT_APPEND_ONLY   0x00000020
+#define UFT_NOCACHE       0x00000040
+#define UFT_DIRECT_IO     0x00000080
+#define UFT_ASYNC_CAPTURE 0x00000100
+#define UFT_META_ONLY     0x00000200
+#define UFT_META_XATTRS   0x00000400
 
 
 #define UFT_TX_SUCCESS         0x00000001
@@ -14,20 +29,41 @@ typedef struct uft_status_st uft_status;
 #define UFT_TX_ROLLBACK_OK     0x00000004
 #define UFT_TX_ROLLBACK_FAILED 0x00000008
 #define UFT_TX_ROLLBACK        0x0000000c
+#define UFT_TX_DURABLE         0x00000010
+
+
+#define UFT_METRICS_PROMETHEUS 1
+#define UFT_METRICS_JSON       2
 
 
 #define uft_tx_ok(tx) ((tx->code & UFT_TX_ROLLBACK) == 0)
 #define uft_tx_rollback_ok(tx) ((tx->code & UFT_TX_ROLLBACK) == UFT_TX_ROLLBACK_OK)
 #define uft_tx_rollback_failed(tx) (tx->code & UFT_TX_ROLLBACK_FAILED)
 #define uft_tx_rollback_attempted(tx) (tx->code & UFT_TX_ROLLBACK)
+#define uft_tx_durable(tx) (tx->code & UFT_TX_DURABLE)
 
 
 extern uft_tx *     uft_tx_new (void * extra);
 extern int          uft_tx_id (uft_tx * tx);
+extern int          uft_tx_code (uft_tx * tx);
 extern uft_tx *     uft_tx_begin (uft_tx * tx, void (*txfp)(uft_tx *));
+extern uft_tx *     uft_tx_begin_async (uft_tx * tx, void (*txfp)(uft_tx *), void (*cb)(uft_tx *));
 extern void         uft_tx_end (uft_tx * tx);
+extern void         uft_tx_reset (uft_tx * tx);
+extern void         uft_tx_pool (int max);
 extern uft_tx *     uft_tx_child (uft_tx * tx, void * extra);
 extern uft_status * uft_tx_add_ent(uft_tx * tx, char * path, int flags);
+extern uft_status * uft_tx_add_ent_at(uft_tx * tx, int dirfd, char * name, int flags);
+extern uft_status * uft_tx_add_fd(uft_tx * tx, int fd);
+extern uft_status * uft_tx_add_tree(uft_tx * tx, char * root, char * filter, int flags);
+extern uft_status * uft_tx_add_glob(uft_tx * tx, char * pattern, int flags);
+extern uft_status * uft_tx_add_set(uft_tx * tx, uft_enrol_set * set);
+extern int          uft_tx_covers(uft_tx * tx, char * path);
+extern int          uft_tx_each_enrolled(uft_tx * tx, char * path, void (*fp)(const char *, void *), void * arg);
+extern int          uft_tx_barrier (uft_tx * tx, char * path);
+extern int          uft_tx_barrier_fd (uft_tx * tx, int fd);
+extern int          uft_tx_share (uft_tx * tx, size_t size);
+extern uft_tx *     uft_tx_join (int fd, int tx_id, void * extra);
 extern void *       uft_tx_extra (uft_tx * tx);
 extern void *       uft_tx_set_extra (uft_tx * tx, void * extra);
 extern uft_tx *     uft_tx_log_error (uft_tx * tx, const char * fmt, ...);
@@ -36,7 +72,34 @@ extern void         uft_tx_fail (uft_tx * tx);
 extern char *       uft_tx_error_msg (uft_tx_error * tx_error);
 extern char **      uft_tx_error_msgs (uft_tx * tx);
 
+extern uft_enrol_set * uft_enrol_set_prepare (char ** paths, int flags);
+extern void            uft_enrol_set_rm (uft_enrol_set * set);
+
+extern int uft_async_fd (void);
+extern int uft_async_dispatch (void);
+extern int uft_async_limit (int max);
+
+extern uft_group * uft_group_new (const char * journal_path, int window_us, int max_count);
+extern void        uft_group_rm (uft_group * group);
+extern void        uft_tx_group (uft_tx * tx, uft_group * group, void (*cb)(uft_tx *));
+extern int         uft_tx_grouped (uft_tx * tx);
+extern int         uft_group_cancel (uft_tx * tx);
+
+extern size_t uft_snap_cache (size_t max);
+
+extern int uft_metrics_dump (int fd, int format);
+
+extern int uft_trace_start (const char * path);
+extern int uft_trace_stop (void);
+
 extern int uft_mkdir (uft_tx * tx, char * path, int mode);
 extern int uft_open (uft_tx * tx, char * path, int flags, mode_t mode);
 extern int uft_read (uft_tx * tx, int fd, char * buf, int len);
 extern int uft_write (uft_tx * tx, int fd, char * buf, int len);
+extern int uft_unlink (uft_tx * tx, char * path);
+extern int uft_rmtree (uft_tx * tx, char * path);
+extern int uft_rename (uft_tx * tx, char * old_path, char * new_path);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,480 @@
+/// libuft C++ binding
+///
+/// A header only C++17 wrapper around the C API, which it calls as is (so
+/// nothing here changes the library's ABI). A 'uft::transaction' owns a
+/// 'uft_tx' and ends it when destroyed. The transaction function may be
+/// any callable, which is called through a trampoline instantiated for
+/// its type, so a lambda is called directly (and can be inlined) rather
+/// than through a function pointer or 'std::function'. What entities are
+/// added with, and how the transaction is committed, are template
+/// policies, so code for the policies not chosen is never instantiated.
+
+
+#ifndef UFT_HPP_INCLUDED
+#define UFT_HPP_INCLUDED
+
+
+#include <sys/types.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "uft.h"
+#include "uft_status.h"
+
+
+namespace uft {
+
+
+/// Capture policies: the flags every entity added to a transaction is
+/// added with (as well as those passed to each call). 'with' combines
+/// any of the UFT_* enrolment flags, as in
+/// 'capture::with<UFT_ASYNC_CAPTURE | UFT_NOCACHE>'.
+namespace capture {
+
+template <int Flags>
+struct with
+{
+  static constexpr int flags = Flags;
+};
+
+using full        = with<0>;
+using diff        = with<UFT_DIFF_ROLLBACK>;
+using append_only = with<UFT_APPEND_ONLY>;
+using nocache     = with<UFT_NOCACHE>;
+using direct_io   = with<UFT_DIRECT_IO>;
+using async       = with<UFT_ASYNC_CAPTURE>;
+using meta_only   = with<UFT_META_ONLY>;
+using meta_xattrs = with<UFT_META_XATTRS>;
+
+} // namespace capture
+
+
+/// Durability policies: 'immediate' commits a transaction when its
+/// function returns (as 'uft_tx_begin' does), 'group' has it committed by
+/// a commit group (see 'uft_tx_group'), in which case the transaction
+/// waits in the group until it is durable or rolled back.
+namespace durability {
+
+struct immediate
+{
+  static constexpr bool grouped = false;
+};
+
+struct group
+{
+  static constexpr bool grouped = true;
+  uft_group * commit_group = nullptr;
+};
+
+} // namespace durability
+
+
+namespace detail {
+
+template <class T, class = void>
+struct has_c_str : std::false_type {};
+
+template <class T>
+struct has_c_str<T, std::void_t<decltype(std::declval<const T &>().c_str())>> : std::true_type {};
+
+/// What the trampolines find in the transactions 'extra' data while its
+/// function runs: the callable, and any exception it threw.
+template <class F>
+struct frame
+{
+  F *                fn;
+  std::exception_ptr error;
+};
+
+} // namespace detail
+
+
+/// The status of adding an entity. It refers to the C library's status,
+/// which is only valid until the next entity is added on the same
+/// thread. A default constructed status is a success.
+class status
+{
+public:
+  status () noexcept : status_(nullptr) {}
+  explicit status (uft_status * s) noexcept : status_(s) {}
+
+  bool ok () const noexcept { return status_ == nullptr || uft_status_success(status_); }
+  bool busy () const noexcept { return status_ != nullptr && uft_status_busy(status_); }
+  explicit operator bool () const noexcept { return ok(); }
+
+  std::string_view
+  error_msg () const noexcept
+  {
+    const char * msg = status_ != nullptr ? uft_status_error_msg(status_) : nullptr;
+    return msg != nullptr ? std::string_view(msg) : std::string_view();
+  }
+
+  uft_status * get () const noexcept { return status_; }
+
+private:
+  uft_status * status_;
+};
+
+
+/// The error messages of a transaction (see 'uft_tx_error_msgs'), as
+/// string views. The messages belong to the transaction, so must not be
+/// used once it has been ended.
+class error_list
+{
+public:
+  class iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type        = std::string_view;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = const std::string_view *;
+    using reference         = std::string_view;
+
+    explicit iterator (char ** msg) noexcept : msg_(msg) {}
+
+    std::string_view operator* () const noexcept { return std::string_view(*msg_); }
+    iterator & operator++ () noexcept { ++msg_; return *this; }
+    iterator operator++ (int) noexcept { iterator it = *this; ++msg_; return it; }
+    bool operator== (const iterator & other) const noexcept { return msg_ == other.msg_; }
+    bool operator!= (const iterator & other) const noexcept { return msg_ != other.msg_; }
+
+  private:
+    char ** msg_;
+  };
+
+  explicit error_list (char ** msgs) : msgs_(msgs), count_(0)
+  {
+    if (msgs_ == nullptr)
+      throw std::bad_alloc();
+    while (msgs_[count_] != nullptr)
+      count_++;
+  }
+
+  error_list (error_list && other) noexcept
+    : msgs_(std::exchange(other.msgs_, nullptr)), count_(std::exchange(other.count_, 0)) {}
+
+  error_list &
+  operator= (error_list && other) noexcept
+  {
+    if (this != &other) {
+      free(msgs_);
+      msgs_ = std::exchange(other.msgs_, nullptr);
+      count_ = std::exchange(other.count_, 0);
+    }
+    return *this;
+  }
+
+  error_list (const error_list &) = delete;
+  error_list & operator= (const error_list &) = delete;
+
+  ~error_list () { free(msgs_); }
+
+  iterator begin () const noexcept { return iterator(msgs_); }
+  iterator end () const noexcept { return iterator(msgs_ + count_); }
+  std::size_t size () const noexcept { return count_; }
+  bool empty () const noexcept { return count_ == 0; }
+
+private:
+  char **     msgs_;
+  std::size_t count_;
+};
+
+
+/// A running transaction, as passed to the transaction function. Every
+/// entity added through it is added with the capture policy's flags too.
+template <class Capture>
+class tx_ref
+{
+public:
+  explicit tx_ref (uft_tx * tx) noexcept : tx_(tx) {}
+
+  uft_tx * get () const noexcept { return tx_; }
+  int id () const noexcept { return uft_tx_id(tx_); }
+  void success () noexcept { uft_tx_success(tx_); }
+  void fail () noexcept { uft_tx_fail(tx_); }
+
+  void
+  log_error (std::string_view msg) noexcept
+  {
+    uft_tx_log_error(tx_, "%.*s", (int) msg.size(), msg.data());
+  }
+
+  status
+  add (const char * path, int flags = 0) noexcept
+  {
+    return status(uft_tx_add_ent(tx_, const_cast<char *>(path), flags | Capture::flags));
+  }
+
+  status add (const std::string & path, int flags = 0) noexcept { return add(path.c_str(), flags); }
+
+  status
+  add_at (int dirfd, const char * name, int flags = 0) noexcept
+  {
+    return status(uft_tx_add_ent_at(tx_, dirfd, const_cast<char *>(name), flags | Capture::flags));
+  }
+
+  status add_fd (int fd) noexcept { return status(uft_tx_add_fd(tx_, fd)); }
+  status add_set (uft_enrol_set * set) noexcept { return status(uft_tx_add_set(tx_, set)); }
+
+  status
+  add_tree (const char * root, const char * filter = nullptr, int flags = 0) noexcept
+  {
+    return status(uft_tx_add_tree(tx_, const_cast<char *>(root), const_cast<char *>(filter), flags | Capture::flags));
+  }
+
+  status
+  add_glob (const char * pattern, int flags = 0) noexcept
+  {
+    return status(uft_tx_add_glob(tx_, const_cast<char *>(pattern), flags | Capture::flags));
+  }
+
+  /// Add each path in 'paths', which may be any range of C strings,
+  /// strings or string views ('std::span', 'std::vector', an array...),
+  /// stopping at the first that cannot be added, whose status is
+  /// returned.
+  template <class Range>
+  status
+  add_all (const Range & paths, int flags = 0)
+  {
+    status added;
+    for (const auto & path : paths) {
+      added = add_path(path, flags);
+      if (!added)
+        break;
+    }
+    return added;
+  }
+
+  bool covers (const char * path) const noexcept { return uft_tx_covers(tx_, const_cast<char *>(path)); }
+
+  /// Wait for the background capture of 'path' (see 'uft_tx_barrier').
+  /// Without 'UFT_ASYNC_CAPTURE' in the capture policy there never is
+  /// one, so this does nothing.
+  int
+  barrier (const char * path) noexcept
+  {
+    if constexpr ((Capture::flags & UFT_ASYNC_CAPTURE) != 0)
+      return uft_tx_barrier(tx_, const_cast<char *>(path));
+    else
+      return 0;
+  }
+
+  /// Run 'f' as a child transaction (see 'uft_tx_child'), returning true
+  /// if it was OK. The child is ended with the top level transaction.
+  template <class F>
+  bool child (F && f);
+
+private:
+  template <class Path>
+  status
+  add_path (const Path & path, int flags)
+  {
+    if constexpr (std::is_convertible_v<const Path &, const char *>) {
+      return add(static_cast<const char *>(path), flags);
+    } else if constexpr (detail::has_c_str<Path>::value) {
+      return add(path.c_str(), flags);
+    } else {
+      std::string copy(path);
+      return add(copy.c_str(), flags);
+    }
+  }
+
+  uft_tx * tx_;
+};
+
+
+namespace detail {
+
+/// The transaction function of every transaction run with a callable of
+/// type 'F'. If 'F' returns something, the transaction succeeds or fails
+/// by it, otherwise the callable calls 'success' or 'fail' itself. An
+/// exception fails the transaction, and is thrown again once it has been
+/// rolled back, rather than through the C library.
+template <class Capture, class F>
+void
+run (uft_tx * tx) noexcept
+{
+  frame<F> * fr = static_cast<frame<F> *>(uft_tx_extra(tx));
+  tx_ref<Capture> ref(tx);
+
+  try {
+    if constexpr (std::is_void_v<std::invoke_result_t<F &, tx_ref<Capture> &>>) {
+      (*fr->fn)(ref);
+    } else {
+      if ((*fr->fn)(ref))
+        uft_tx_success(tx);
+      else
+        uft_tx_fail(tx);
+    }
+  } catch (const std::exception & e) {
+    fr->error = std::current_exception();
+    uft_tx_log_error(tx, "transaction function threw: %s", e.what());
+    uft_tx_fail(tx);
+  } catch (...) {
+    fr->error = std::current_exception();
+    uft_tx_log_error(tx, "transaction function threw");
+    uft_tx_fail(tx);
+  }
+}
+
+} // namespace detail
+
+
+template <class Capture>
+template <class F>
+bool
+tx_ref<Capture>::child (F && f)
+{
+  using fn_type = std::remove_reference_t<F>;
+  detail::frame<fn_type> fr { &f, nullptr };
+
+  uft_tx * child_tx = uft_tx_child(tx_, &fr);
+  if (child_tx == nullptr)
+    throw std::bad_alloc();
+  uft_tx_begin(child_tx, &detail::run<Capture, fn_type>);
+  uft_tx_set_extra(child_tx, nullptr);
+  if (fr.error)
+    std::rethrow_exception(fr.error);
+
+  return (uft_tx_code(child_tx) & UFT_TX_ROLLBACK) == 0;
+}
+
+
+/// A top level transaction. It is created by the constructor and ended
+/// by the destructor (after waiting for its commit group, if it is in
+/// one); it may be moved but not copied.
+template <class Capture = capture::full, class Durability = durability::immediate>
+class transaction : private Durability
+{
+public:
+  using ref = tx_ref<Capture>;
+
+  explicit transaction (Durability durability = Durability())
+    : Durability(durability), tx_(uft_tx_new(nullptr)), pending_(false)
+  {
+    if (tx_ == nullptr)
+      throw std::bad_alloc();
+    uft_tx_set_extra(tx_, this);
+  }
+
+  transaction (transaction && other) noexcept
+    : Durability(std::move(other)), tx_(std::exchange(other.tx_, nullptr)), pending_(std::exchange(other.pending_, false))
+  {
+    if (tx_ != nullptr)
+      uft_tx_set_extra(tx_, this);
+  }
+
+  transaction &
+  operator= (transaction && other) noexcept
+  {
+    if (this != &other) {
+      end();
+      Durability::operator=(std::move(other));
+      tx_ = std::exchange(other.tx_, nullptr);
+      pending_ = std::exchange(other.pending_, false);
+      if (tx_ != nullptr)
+        uft_tx_set_extra(tx_, this);
+    }
+    return *this;
+  }
+
+  transaction (const transaction &) = delete;
+  transaction & operator= (const transaction &) = delete;
+
+  ~transaction () { end(); }
+
+  /// Run the transaction, calling 'f' with a 'ref' to it. Any exception
+  /// 'f' throws is thrown from here, after the rollback. With the group
+  /// durability policy, std::invalid_argument is thrown (before anything
+  /// is run) if there is no commit group.
+  template <class F>
+  transaction &
+  begin (F && f)
+  {
+    using fn_type = std::remove_reference_t<F>;
+    detail::frame<fn_type> fr { &f, nullptr };
+
+    if constexpr (Durability::grouped)
+      if (this->commit_group == nullptr)
+        throw std::invalid_argument("uft::transaction: no commit group");
+
+    uft_tx_set_extra(tx_, &fr);
+    if constexpr (Durability::grouped)
+      uft_tx_group(tx_, this->commit_group, &transaction::on_done);
+    uft_tx_begin(tx_, &detail::run<Capture, fn_type>);
+    uft_tx_set_extra(tx_, this);
+
+    if constexpr (Durability::grouped)
+      pending_ = uft_tx_grouped(tx_) != 0;
+    if (fr.error)
+      std::rethrow_exception(fr.error);
+
+    return *this;
+  }
+
+  /// Wait, dispatching asynchronous callbacks, until the commit group has
+  /// made the transaction durable or rolled it back. Without a commit
+  /// group there is nothing to wait for.
+  void
+  wait () noexcept
+  {
+    if constexpr (Durability::grouped) {
+      struct pollfd pfd = { uft_async_fd(), POLLIN, 0 };
+      while (pending_) {
+        if (poll(&pfd, 1, pfd.fd >= 0 ? -1 : 1) < 0 && errno != EINTR)
+          break;
+        uft_async_dispatch();
+      }
+    }
+  }
+
+  int code () const noexcept { return uft_tx_code(tx_); }
+  bool ok () const noexcept { return (code() & UFT_TX_ROLLBACK) == 0; }
+  bool rollback_ok () const noexcept { return (code() & UFT_TX_ROLLBACK) == UFT_TX_ROLLBACK_OK; }
+  bool rollback_failed () const noexcept { return (code() & UFT_TX_ROLLBACK_FAILED) != 0; }
+  bool rollback_attempted () const noexcept { return (code() & UFT_TX_ROLLBACK) != 0; }
+  bool durable () const noexcept { return (code() & UFT_TX_DURABLE) != 0; }
+  bool pending () const noexcept { return pending_; }
+  int id () const noexcept { return uft_tx_id(tx_); }
+  uft_tx * get () const noexcept { return tx_; }
+
+  error_list errors () const { return error_list(uft_tx_error_msgs(tx_)); }
+
+private:
+  void
+  end () noexcept
+  {
+    if (tx_ != nullptr) {
+      wait();
+      uft_tx_end(tx_);
+      tx_ = nullptr;
+    }
+  }
+
+  static void
+  on_done (uft_tx * tx) noexcept
+  {
+    static_cast<transaction *>(uft_tx_extra(tx))->pending_ = false;
+  }
+
+  uft_tx * tx_;
+  bool     pending_;
+};
+
+
+} // namespace uft
+
+
+#endif // UFT_HPP_INCLUDED
@@ -0,0 +1,438 @@
+/// libuft worker pool and asynchronous transactions
+///
+/// A process wide pool of UFT_ASYNC_THREADS worker threads, started when
+/// first needed, runs submitted jobs in the order they are submitted.
+/// Asynchronous transactions are begun by a worker; when one finishes it
+/// is queued for dispatch and an eventfd is signalled, so the thread that
+/// began it (typically an event loop, polling the eventfd) can call
+/// 'uft_async_dispatch' to run the completion callbacks itself. One that
+/// joins a commit group is only queued once the group has finished with
+/// it, as until then it belongs to the group's flusher.
+
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "uft.h"
+#include "uft_tx.h"
+#include "config.h"
+#include "uft_ll.h"
+#include "uft_async.h"
+
+
+/// A job for the worker pool.
+typedef struct async_job_st
+{
+  void (*fp)(void *);
+  void * arg;
+} async_job;
+
+/// An asynchronous transaction. While it runs it is on the running list,
+/// by its 'node', which is moved to the done list when it finishes, so
+/// finishing it cannot fail for want of memory.
+typedef struct async_tx_st
+{
+  uft_tx *      tx;
+  void          (*txfp)(uft_tx *);
+  void          (*cb)(uft_tx *);
+  int           in_flight;
+  uft_ll_node * node;
+} async_tx;
+
+
+static pthread_once_t  async_once  = PTHREAD_ONCE_INIT;
+static int             async_error = 0;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  async_cond  = PTHREAD_COND_INITIALIZER;
+static uft_ll *        async_jobs  = NULL;
+static uft_ll *        async_done  = NULL;
+static uft_ll *        async_running = NULL;
+static int             async_event_fd   = -1;
+static int             async_in_flight  = 0;
+static int             async_max_flight = UFT_ASYNC_MAX_IN_FLIGHT;
+static __thread int    async_worker_thread = 0;
+static __thread int    async_deferred = 0;
+
+
+static void   async_init (void);
+static void * async_worker (void * arg);
+static void   async_run_tx (void * arg);
+
+
+/// Submit a job to the worker pool, to call 'fp' with 'arg'. Returns 0
+/// on success or -1 (with errno set) if the pool cannot be started or
+/// memory cannot be allocated.
+
+int
+uft_async_submit (void (*fp)(void *), void * arg)
+{
+  pthread_once(&async_once, async_init);
+  if (async_error != 0) {
+    errno = async_error;
+    return -1;
+  }
+
+  async_job * job = (async_job *) malloc(sizeof(async_job));
+  if (job == NULL)
+    return -1;
+  job->fp  = fp;
+  job->arg = arg;
+
+  pthread_mutex_lock(&async_mutex);
+  uft_ll_node * lln = uft_ll_insert_tail(async_jobs, job);
+  if (lln != NULL)
+    pthread_cond_signal(&async_cond);
+  pthread_mutex_unlock(&async_mutex);
+
+  if (lln == NULL) {
+    free(job);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/// Begin a transaction on the worker pool. When it has finished (including
+/// any rollback), 'cb' (if not NULL) is called with the transaction by
+/// 'uft_async_dispatch'. Returns the transaction, or NULL if it could not
+/// be begun; errno is EAGAIN if the limit of transactions in flight (see
+/// 'uft_async_limit') has been reached, or EINVAL if 'tx' is a child
+/// transaction (which must be begun by its parent).
+
+uft_tx *
+uft_tx_begin_async (uft_tx * tx, void (*txfp)(uft_tx *), void (*cb)(uft_tx *))
+{
+  if (tx->parent != NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&async_mutex);
+  int limited = async_in_flight >= async_max_flight;
+  if (!limited)
+    async_in_flight++;
+  pthread_mutex_unlock(&async_mutex);
+
+  if (limited) {
+    errno = EAGAIN;
+    return NULL;
+  }
+
+  pthread_once(&async_once, async_init);
+  async_tx * atx = async_error == 0 ? (async_tx *) malloc(sizeof(async_tx)) : NULL;
+  if (atx != NULL) {
+    atx->tx   = tx;
+    atx->txfp = txfp;
+    atx->cb   = cb;
+    atx->in_flight = 1;
+    pthread_mutex_lock(&async_mutex);
+    atx->node = uft_ll_insert_tail(async_running, atx);
+    pthread_mutex_unlock(&async_mutex);
+    if (atx->node != NULL && uft_async_submit(async_run_tx, atx) == 0)
+      return tx;
+    int error = atx->node != NULL ? errno : ENOMEM;
+    if (atx->node != NULL) {
+      pthread_mutex_lock(&async_mutex);
+      uft_ll_rmnode(atx->node);
+      pthread_mutex_unlock(&async_mutex);
+    }
+    free(atx);
+    errno = error;
+  } else {
+    errno = async_error != 0 ? async_error : ENOMEM;
+  }
+
+  pthread_mutex_lock(&async_mutex);
+  async_in_flight--;
+  pthread_mutex_unlock(&async_mutex);
+
+  return NULL;
+}
+
+
+/// Queue 'cb' to be called with 'tx' by 'uft_async_dispatch', as if an
+/// asynchronous transaction had finished (without counting against the
+/// limit of those in flight). Returns 0 on success or -1 (with errno set).
+
+int
+uft_async_notify (uft_tx * tx, void (*cb)(uft_tx *))
+{
+  uint64_t one = 1;
+
+  pthread_once(&async_once, async_init);
+  if (async_error != 0) {
+    errno = async_error;
+    return -1;
+  }
+
+  async_tx * atx = (async_tx *) malloc(sizeof(async_tx));
+  if (atx == NULL)
+    return -1;
+  atx->tx        = tx;
+  atx->txfp      = NULL;
+  atx->cb        = cb;
+  atx->in_flight = 0;
+
+  pthread_mutex_lock(&async_mutex);
+  uft_ll_node * lln = uft_ll_insert_tail(async_done, atx);
+  pthread_mutex_unlock(&async_mutex);
+  if (lln == NULL) {
+    free(atx);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  while (write(async_event_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+    ;
+
+  return 0;
+}
+
+
+/// Return the eventfd that becomes readable when asynchronous transactions
+/// have finished and are waiting for 'uft_async_dispatch', or -1 (with
+/// errno set) if it cannot be created.
+
+int
+uft_async_fd (void)
+{
+  pthread_once(&async_once, async_init);
+  if (async_error != 0) {
+    errno = async_error;
+    return -1;
+  }
+
+  return async_event_fd;
+}
+
+
+/// Call the callbacks of all finished asynchronous transactions, on the
+/// calling thread, returning how many there were.
+
+int
+uft_async_dispatch (void)
+{
+  uint64_t count;
+  int dispatched = 0;
+
+  if (async_event_fd < 0)
+    return 0;
+
+  // Clear the eventfd before taking the finished transactions, so any
+  // that finish after they are taken signal it again.
+  if (read(async_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    return 0;
+
+  pthread_mutex_lock(&async_mutex);
+  uft_ll * done = async_done;
+  async_done = uft_ll_create();
+  if (async_done == NULL) {
+    async_done = done;
+    done = NULL;
+  } else {
+    for (uft_ll_node * lln = uft_ll_head(done); lln != NULL; lln = uft_ll_next(lln))
+      async_in_flight -= ((async_tx *) uft_ll_data(lln))->in_flight;
+  }
+  pthread_mutex_unlock(&async_mutex);
+
+  if (done == NULL)
+    return 0;
+
+  for (uft_ll_node * lln = uft_ll_head(done); lln != NULL; lln = uft_ll_head(done)) {
+    async_tx * atx = uft_ll_rmnode(lln);
+    if (atx->cb != NULL)
+      atx->cb(atx->tx);
+    free(atx);
+    dispatched++;
+  }
+  uft_ll_rm(done);
+
+  return dispatched;
+}
+
+
+/// Return true if the calling thread is one of the pool's workers. A job
+/// must not wait for another job it submits, as every worker may be
+/// waiting likewise with the other job left queued behind them.
+
+int
+uft_async_on_worker (void)
+{
+  return async_worker_thread;
+}
+
+
+/// Called as a transaction joins its commit group. The entry that
+/// 'uft_async_group_done' queues for its group callback (if it has one)
+/// is made ready now, on the running list, so queueing it cannot fail
+/// for want of memory, and if the transaction is asynchronous it is
+/// left running, for 'uft_async_group_done' to queue for dispatch too.
+/// Returns 0 on success or -1 (with errno set) if the pool cannot be
+/// started or memory cannot be allocated.
+
+int
+uft_async_group_join (uft_tx * tx)
+{
+  pthread_once(&async_once, async_init);
+  if (async_error != 0) {
+    errno = async_error;
+    return -1;
+  }
+
+  if (tx->group_cb != NULL) {
+    async_tx * atx = (async_tx *) malloc(sizeof(async_tx));
+    if (atx == NULL)
+      return -1;
+    atx->tx        = tx;
+    atx->txfp      = NULL;
+    atx->cb        = tx->group_cb;
+    atx->in_flight = 0;
+
+    pthread_mutex_lock(&async_mutex);
+    atx->node = uft_ll_insert_tail(async_running, atx);
+    pthread_mutex_unlock(&async_mutex);
+    if (atx->node == NULL) {
+      free(atx);
+      errno = ENOMEM;
+      return -1;
+    }
+    tx->group_entry = atx;
+  }
+
+  if (tx->async != NULL)
+    async_deferred = 1;
+
+  return 0;
+}
+
+
+/// Called once a commit group has finished with a transaction: queue its
+/// group callback (if it has one, and 'notify') and then, if it is
+/// asynchronous, the transaction itself, for dispatch.
+
+void
+uft_async_group_done (uft_tx * tx, int notify)
+{
+  uint64_t one = 1;
+
+  if (tx->group_entry == NULL && tx->async == NULL)
+    return;
+
+  pthread_mutex_lock(&async_mutex);
+  async_tx * group_atx = tx->group_entry;
+  async_tx * run_atx = tx->async;
+  tx->group_entry = NULL;
+  tx->async = NULL;
+  if (group_atx != NULL && notify)
+    uft_ll_move_tail(async_done, group_atx->node);
+  else if (group_atx != NULL)
+    uft_ll_rmnode(group_atx->node);
+  if (run_atx != NULL)
+    uft_ll_move_tail(async_done, run_atx->node);
+  pthread_mutex_unlock(&async_mutex);
+
+  if (group_atx != NULL && !notify)
+    free(group_atx);
+  if ((group_atx != NULL && notify) || run_atx != NULL)
+    while (write(async_event_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+      ;
+}
+
+
+/// Set the maximum number of asynchronous transactions in flight (begun
+/// but not yet dispatched), returning the previous maximum.
+
+int
+uft_async_limit (int max)
+{
+  pthread_mutex_lock(&async_mutex);
+  int old_max = async_max_flight;
+  async_max_flight = max;
+  pthread_mutex_unlock(&async_mutex);
+
+  return old_max;
+}
+
+
+/// Create the queues and eventfd and start the worker threads.
+
+static void
+async_init (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  async_jobs = uft_ll_create();
+  async_done = uft_ll_create();
+  async_running = uft_ll_create();
+  async_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (async_jobs == NULL || async_done == NULL || async_running == NULL || async_event_fd < 0) {
+    async_error = errno != 0 ? errno : ENOMEM;
+    return;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int i = 0; i < UFT_ASYNC_THREADS; i++) {
+    int result = pthread_create(&thread, &attr, async_worker, NULL);
+    if (result != 0) {
+      if (i == 0)
+        async_error = result;
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+}
+
+
+/// A worker thread, running jobs forever.
+
+static void *
+async_worker (void * arg)
+{
+  async_worker_thread = 1;
+  for (;;) {
+    pthread_mutex_lock(&async_mutex);
+    while (uft_ll_head(async_jobs) == NULL)
+      pthread_cond_wait(&async_cond, &async_mutex);
+    async_job * job = uft_ll_rmnode(uft_ll_head(async_jobs));
+    pthread_mutex_unlock(&async_mutex);
+
+    job->fp(job->arg);
+    free(job);
+  }
+
+  return NULL;
+}
+
+
+/// Run an asynchronous transaction and queue it for dispatch, unless it
+/// has joined a commit group (which then owns both it and 'atx').
+
+static void
+async_run_tx (void * arg)
+{
+  async_tx * atx = arg;
+  uint64_t one = 1;
+
+  atx->tx->async = atx;
+  async_deferred = 0;
+  uft_tx_begin(atx->tx, atx->txfp);
+  if (async_deferred)
+    return;
+
+  pthread_mutex_lock(&async_mutex);
+  atx->tx->async = NULL;
+  uft_ll_move_tail(async_done, atx->node);
+  pthread_mutex_unlock(&async_mutex);
+
+  while (write(async_event_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+    ;
+}
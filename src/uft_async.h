@@ -0,0 +1,17 @@
+/// libuft worker pool
+
+#ifndef UFT_ASYNC_INCLUDED
+#define UFT_ASYNC_INCLUDED
+
+
+struct uft_tx_st;
+
+
+extern int uft_async_submit (void (*fp)(void *), void * arg);
+extern int uft_async_notify (struct uft_tx_st * tx, void (*cb)(struct uft_tx_st *));
+extern int uft_async_on_worker (void);
+extern int  uft_async_group_join (struct uft_tx_st * tx);
+extern void uft_async_group_done (struct uft_tx_st * tx, int notify);
+
+
+#endif // UFT_ASYNC_INCLUDED
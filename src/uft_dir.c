@@ -0,0 +1,144 @@
+/// libuft directory handles
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uft_dir.h"
+
+
+static uft_dir * dir_create (int fd, const char * path, int path_len);
+
+
+/// Open a directory, 'path_len' bytes of 'path' being the directory
+/// path (so a directory can be opened from the leading part of a longer
+/// path). Returns NULL (with errno set) on failure.
+
+uft_dir *
+uft_dir_open (const char * path, int path_len)
+{
+  char dir_path[path_len + 1];
+
+  memcpy(dir_path, path, path_len);
+  dir_path[path_len] = '\0';
+
+  int fd = open(dir_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  return dir_create(fd, dir_path, path_len);
+}
+
+
+/// Create a directory handle from a directory file descriptor, which is
+/// duplicated (the caller keeps ownership of 'dirfd'). Returns NULL
+/// (with errno set) on failure.
+
+uft_dir *
+uft_dir_dup (int dirfd)
+{
+  char dir_path[PATH_MAX];
+  int path_len = uft_fd_path(dirfd, dir_path, sizeof(dir_path));
+
+  int fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0)
+    return NULL;
+
+  return dir_create(fd, dir_path, path_len);
+}
+
+
+/// Take a reference to a directory handle.
+
+uft_dir *
+uft_dir_ref (uft_dir * dir)
+{
+  __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+
+  return dir;
+}
+
+
+/// Release a reference to a directory handle, closing it when there are
+/// no more references.
+
+void
+uft_dir_unref (uft_dir * dir)
+{
+  if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(dir->fd);
+    free(dir->path);
+    free(dir);
+  }
+}
+
+
+/// Return true if the directory has been removed since it was opened,
+/// meaning anything located relative to it should be located by path
+/// instead.
+
+int
+uft_dir_deleted (uft_dir * dir)
+{
+  struct stat statbuf;
+
+  return fstat(dir->fd, &statbuf) != 0 || statbuf.st_nlink == 0;
+}
+
+
+/// Put the path of an open file descriptor in 'buf', returning its
+/// length. If the path cannot be found out, a descriptive placeholder
+/// is used instead.
+
+int
+uft_fd_path (int fd, char * buf, int buf_len)
+{
+  char proc_path[32];
+
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  int path_len = readlink(proc_path, buf, buf_len - 1);
+  if (path_len < 0)
+    path_len = snprintf(buf, buf_len, "(fd %d)", fd);
+  else
+    buf[path_len] = '\0';
+
+  return path_len;
+}
+
+
+/// Create a directory handle with one reference.
+
+static uft_dir *
+dir_create (int fd, const char * path, int path_len)
+{
+  struct stat statbuf;
+  uft_dir * dir = (uft_dir *) malloc(sizeof(uft_dir));
+
+  if (dir == NULL || fstat(fd, &statbuf) != 0) {
+    free(dir);
+    close(fd);
+    return NULL;
+  }
+  dir->path = (char *) malloc(path_len + 1);
+  if (dir->path == NULL) {
+    free(dir);
+    close(fd);
+    return NULL;
+  }
+
+  memcpy(dir->path, path, path_len);
+  dir->path[path_len] = '\0';
+  dir->fd   = fd;
+  dir->refs = 1;
+  dir->dev  = statbuf.st_dev;
+  dir->ino  = statbuf.st_ino;
+
+  return dir;
+}
@@ -0,0 +1,31 @@
+/// libuft directory handles
+
+#ifndef UFT_DIR_INCLUDED
+#define UFT_DIR_INCLUDED
+
+
+#include <sys/types.h>
+
+
+/// A reference counted open directory (an O_PATH descriptor), which
+/// entities are located relative to, so that paths need not be resolved
+/// again and again.
+typedef struct uft_dir_st
+{
+  int    fd;
+  int    refs;
+  dev_t  dev;
+  ino_t  ino;
+  char * path;
+} uft_dir;
+
+
+extern uft_dir * uft_dir_open (const char * path, int path_len);
+extern uft_dir * uft_dir_dup (int dirfd);
+extern uft_dir * uft_dir_ref (uft_dir * dir);
+extern void      uft_dir_unref (uft_dir * dir);
+extern int       uft_dir_deleted (uft_dir * dir);
+extern int       uft_fd_path (int fd, char * buf, int buf_len);
+
+
+#endif // UFT_DIR_INCLUDED
@@ -0,0 +1,392 @@
+/// libuft group commit
+///
+/// A transaction given a group (see 'uft_tx_group') is not finished when
+/// it succeeds: it joins the groups open batch, still holding its locks
+/// and everything needed to roll it back. A flusher thread seals the
+/// batch once it is 'window_us' old or has 'max_count' transactions in
+/// it, makes it durable with one 'syncfs' per file system the batch
+/// touched and then one journal append (and 'fdatasync'), and finishes
+/// each transaction, queueing its callback for 'uft_async_dispatch'.
+/// Until its batch is sealed a transaction may be withdrawn and rolled
+/// back by 'uft_group_cancel'.
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "uft.h"
+#include "uft_tx.h"
+#include "config.h"
+#include "uft_async.h"
+#include "uft_group.h"
+
+
+struct uft_group_st
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  pthread_t       thread;
+  uft_tx *        open_head;
+  uft_tx *        open_tail;
+  int             open_count;
+  struct timespec opened;
+  int             window_us;
+  int             max_count;
+  int             journal_fd;
+  int             stopping;
+};
+
+
+static void * group_flusher (void * arg);
+static void   group_flush (uft_group * group, uft_tx * batch);
+static int    group_sync_tx (uft_tx * tx, dev_t ** devsp, int * dev_countp, int * dev_capp);
+static int    group_journal (uft_group * group, uft_tx * batch);
+
+
+/// Create a commit group, with a journal at 'journal_path' (created if
+/// need be, and appended to) or no journal if it is NULL. A batch is
+/// flushed once it is 'window_us' microseconds old or has 'max_count'
+/// transactions (zero for UFT_GROUP_WINDOW_US and UFT_GROUP_MAX_COUNT).
+/// Returns NULL (with errno set) on failure.
+
+uft_group *
+uft_group_new (const char * journal_path, int window_us, int max_count)
+{
+  pthread_condattr_t condattr;
+
+  uft_group * group = (uft_group *) malloc(sizeof(uft_group));
+  if (group == NULL)
+    return NULL;
+
+  group->journal_fd = -1;
+  if (journal_path != NULL) {
+    group->journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (group->journal_fd < 0) {
+      free(group);
+      return NULL;
+    }
+  }
+
+  pthread_mutex_init(&group->mutex, NULL);
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&group->cond, &condattr);
+  pthread_condattr_destroy(&condattr);
+  group->open_head  = NULL;
+  group->open_tail  = NULL;
+  group->open_count = 0;
+  group->window_us  = window_us > 0 ? window_us : UFT_GROUP_WINDOW_US;
+  group->max_count  = max_count > 0 ? max_count : UFT_GROUP_MAX_COUNT;
+  group->stopping   = 0;
+
+  int result = pthread_create(&group->thread, NULL, group_flusher, group);
+  if (result != 0) {
+    if (group->journal_fd >= 0)
+      close(group->journal_fd);
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->cond);
+    free(group);
+    errno = result;
+    return NULL;
+  }
+
+  return group;
+}
+
+
+/// Flush whatever batch is open, then stop and free a commit group.
+
+void
+uft_group_rm (uft_group * group)
+{
+  pthread_mutex_lock(&group->mutex);
+  group->stopping = 1;
+  pthread_cond_signal(&group->cond);
+  pthread_mutex_unlock(&group->mutex);
+
+  pthread_join(group->thread, NULL);
+
+  if (group->journal_fd >= 0)
+    close(group->journal_fd);
+  pthread_mutex_destroy(&group->mutex);
+  pthread_cond_destroy(&group->cond);
+  free(group);
+}
+
+
+/// Have a top level transaction committed by 'group' if it succeeds,
+/// calling 'cb' (if not NULL) from 'uft_async_dispatch' once it is
+/// durable (or has been rolled back because it could not be made so).
+/// NULL 'group' takes the transaction out of group commit.
+
+void
+uft_tx_group (uft_tx * tx, uft_group * group, void (*cb)(uft_tx *))
+{
+  tx->group = group;
+  tx->group_cb = cb;
+}
+
+
+/// Return true if the transaction was left with its commit group by
+/// 'uft_tx_begin' (so its group callback will be called). Only the thread
+/// that began it sets this, before the group's flusher can see it.
+
+int
+uft_tx_grouped (uft_tx * tx)
+{
+  return tx->group_joined;
+}
+
+
+/// Withdraw a transaction waiting for its group to commit it and roll it
+/// back. Returns 0 on success, or -1 with errno EBUSY if its batch has
+/// already been sealed (or it is not waiting to be committed).
+
+int
+uft_group_cancel (uft_tx * tx)
+{
+  uft_group * group = tx->group;
+  uft_tx * prev = NULL;
+  uft_tx * a_tx;
+
+  if (group == NULL) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  pthread_mutex_lock(&group->mutex);
+  for (a_tx = group->open_head; a_tx != NULL && a_tx != tx; a_tx = a_tx->group_next)
+    prev = a_tx;
+  if (a_tx != NULL) {
+    if (prev != NULL)
+      prev->group_next = tx->group_next;
+    else
+      group->open_head = tx->group_next;
+    if (group->open_tail == tx)
+      group->open_tail = prev;
+    group->open_count--;
+  }
+  pthread_mutex_unlock(&group->mutex);
+
+  if (a_tx == NULL) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  tx->group_next = NULL;
+  uft_tx_group_done(tx, 0);
+  uft_async_group_done(tx, 0);
+
+  return 0;
+}
+
+
+/// Add a successful top level transaction to its groups open batch.
+
+void
+uft_group_add (uft_group * group, uft_tx * tx)
+{
+  tx->group_next = NULL;
+
+  pthread_mutex_lock(&group->mutex);
+  if (group->open_head == NULL) {
+    group->open_head = tx;
+    clock_gettime(CLOCK_MONOTONIC, &group->opened);
+  } else {
+    group->open_tail->group_next = tx;
+  }
+  group->open_tail = tx;
+  if (++group->open_count == 1 || group->open_count >= group->max_count)
+    pthread_cond_signal(&group->cond);
+  pthread_mutex_unlock(&group->mutex);
+}
+
+
+/// The flusher thread: waits for a batch to be opened, then for it to be
+/// due, then seals and flushes it.
+
+static void *
+group_flusher (void * arg)
+{
+  uft_group * group = (uft_group *) arg;
+
+  pthread_mutex_lock(&group->mutex);
+  for (;;) {
+    while (group->open_head == NULL && !group->stopping)
+      pthread_cond_wait(&group->cond, &group->mutex);
+    if (group->open_head == NULL)
+      break;
+
+    struct timespec due = group->opened;
+    due.tv_sec  += group->window_us / 1000000;
+    due.tv_nsec += (group->window_us % 1000000) * 1000;
+    if (due.tv_nsec >= 1000000000) {
+      due.tv_sec++;
+      due.tv_nsec -= 1000000000;
+    }
+    while (group->open_head != NULL && group->open_count < group->max_count && !group->stopping)
+      if (pthread_cond_timedwait(&group->cond, &group->mutex, &due) == ETIMEDOUT)
+        break;
+
+    uft_tx * batch = group->open_head;
+    group->open_head  = NULL;
+    group->open_tail  = NULL;
+    group->open_count = 0;
+    if (batch == NULL)
+      continue;
+
+    pthread_mutex_unlock(&group->mutex);
+    group_flush(group, batch);
+    pthread_mutex_lock(&group->mutex);
+  }
+  pthread_mutex_unlock(&group->mutex);
+
+  return NULL;
+}
+
+
+/// Make a sealed batch of transactions durable and finish them.
+
+static void
+group_flush (uft_group * group, uft_tx * batch)
+{
+  dev_t * devs = NULL;
+  int dev_count = 0;
+  int dev_cap = 0;
+  int error = 0;
+
+  for (uft_tx * tx = batch; tx != NULL && error == 0; tx = tx->group_next)
+    if (group_sync_tx(tx, &devs, &dev_count, &dev_cap) != 0)
+      error = errno;
+  free(devs);
+
+  if (error == 0 && group->journal_fd >= 0 && group_journal(group, batch) != 0)
+    error = errno;
+
+  uft_tx * next;
+  for (uft_tx * tx = batch; tx != NULL; tx = next) {
+    next = tx->group_next;
+    tx->group_next = NULL;
+    if (error != 0)
+      uft_tx_log_error(tx, "error committing transaction %d, could not make it durable: %s", tx->id, strerror(error));
+    uft_tx_group_done(tx, error == 0);
+    uft_async_group_done(tx, 1);
+  }
+}
+
+
+/// Sync the file system of each of a transactions entities, unless it is
+/// already in 'devs' (the file systems already synced, which the synced
+/// ones are added to). Returns 0 on success or -1 (with errno set).
+
+static int
+group_sync_tx (uft_tx * tx, dev_t ** devsp, int * dev_countp, int * dev_capp)
+{
+  struct stat statbuf;
+  char dir_path[PATH_MAX];
+
+  for (uft_ll_node * lln = uft_ll_head(tx->ents); lln != NULL; lln = uft_ll_next(lln)) {
+    uft_ent_state * ent_state = uft_ll_data(lln);
+    int i;
+
+    if (ent_state->dir != NULL) {
+      for (i = 0; i < *dev_countp && (*devsp)[i] != ent_state->dir->dev; i++)
+        ;
+      if (i < *dev_countp)
+        continue;
+    }
+
+    int fd = -1;
+    if (ent_state->dir != NULL)
+      fd = openat(ent_state->dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      char * slash = strrchr(ent_state->path, '/');
+      if (slash == NULL)
+        snprintf(dir_path, sizeof(dir_path), ".");
+      else
+        snprintf(dir_path, sizeof(dir_path), "%.*s", slash == ent_state->path ? 1 : (int) (slash - ent_state->path), ent_state->path);
+      fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0)
+        return -1;
+    }
+    if (fstat(fd, &statbuf) != 0) {
+      close(fd);
+      return -1;
+    }
+
+    for (i = 0; i < *dev_countp && (*devsp)[i] != statbuf.st_dev; i++)
+      ;
+    if (i == *dev_countp) {
+      if (syncfs(fd) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+      }
+      if (*dev_countp == *dev_capp) {
+        int new_cap = *dev_capp > 0 ? *dev_capp * 2 : 4;
+        dev_t * new_devs = (dev_t *) realloc(*devsp, new_cap * sizeof(dev_t));
+        if (new_devs != NULL) {
+          *devsp = new_devs;
+          *dev_capp = new_cap;
+        }
+      }
+      if (*dev_countp < *dev_capp)
+        (*devsp)[(*dev_countp)++] = statbuf.st_dev;
+    }
+    close(fd);
+  }
+
+  return 0;
+}
+
+
+/// Append the IDs of a batch of transactions, one per line, to the
+/// journal in one write, and wait for it to be durable. Returns 0 on
+/// success or -1 (with errno set).
+
+static int
+group_journal (uft_group * group, uft_tx * batch)
+{
+  size_t len = 0;
+  size_t cap = 0;
+  char * buf = NULL;
+
+  for (uft_tx * tx = batch; tx != NULL; tx = tx->group_next) {
+    if (cap - len < 16) {
+      size_t new_cap = cap > 0 ? cap * 2 : 256;
+      char * new_buf = (char *) realloc(buf, new_cap);
+      if (new_buf == NULL) {
+        free(buf);
+        return -1;
+      }
+      buf = new_buf;
+      cap = new_cap;
+    }
+    len += snprintf(buf + len, cap - len, "%d\n", tx->id);
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t result = write(group->journal_fd, buf + done, len - done);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      free(buf);
+      return -1;
+    }
+    done += result;
+  }
+  free(buf);
+
+  return fdatasync(group->journal_fd);
+}
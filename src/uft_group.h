@@ -0,0 +1,10 @@
+/// libuft group commit
+
+#ifndef UFT_GROUP_INCLUDED
+#define UFT_GROUP_INCLUDED
+
+
+extern void uft_group_add (uft_group * group, uft_tx * tx);
+
+
+#endif // UFT_GROUP_INCLUDED
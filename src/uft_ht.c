@@ -0,0 +1,225 @@
+/// libuft hash table
+
+
+#include <unistd.h>
+#include <malloc.h>
+#include <string.h>
+
+#include "uft_ht.h"
+
+
+#define UFT_HT_INITIAL_SIZE 16
+
+
+static int ht_grow (uft_ht * ht);
+
+
+/// Create a hash table.
+
+uft_ht *
+uft_ht_create()
+{
+  uft_ht * ht = (uft_ht *) malloc(sizeof(uft_ht));
+
+  if (ht == NULL)
+    return NULL;
+
+  ht->buckets = (uft_ht_ent **) calloc(UFT_HT_INITIAL_SIZE, sizeof(uft_ht_ent *));
+  if (ht->buckets == NULL) {
+    free(ht);
+    return NULL;
+  }
+  ht->count = 0;
+  ht->size  = UFT_HT_INITIAL_SIZE;
+  ht->spare = NULL;
+
+  return ht;
+}
+
+
+/// Return the hash of a key (FNV-1a).
+
+unsigned int
+uft_ht_hash(const void * key, int keylen)
+{
+  const unsigned char * p = (const unsigned char *) key;
+  unsigned int hash = 2166136261u;
+
+  for (int i = 0; i < keylen; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+
+/// Return the data stored against a key, or NULL if the key is not
+/// present.
+
+void *
+uft_ht_get(uft_ht * ht, const void * key, int keylen)
+{
+  unsigned int hash = uft_ht_hash(key, keylen);
+
+  for (uft_ht_ent * hte = ht->buckets[hash & (ht->size - 1)]; hte != NULL; hte = hte->next)
+    if (hte->hash == hash && hte->keylen == keylen && memcmp(hte->key, key, keylen) == 0)
+      return hte->data;
+
+  return NULL;
+}
+
+
+/// Store data against a key, replacing any existing data for the key.
+/// Returns zero on success, or -1 if memory could not be allocated.
+
+int
+uft_ht_put(uft_ht * ht, const void * key, int keylen, void * data)
+{
+  unsigned int hash = uft_ht_hash(key, keylen);
+  uft_ht_ent ** bucketp = &ht->buckets[hash & (ht->size - 1)];
+
+  for (uft_ht_ent * hte = *bucketp; hte != NULL; hte = hte->next) {
+    if (hte->hash == hash && hte->keylen == keylen && memcmp(hte->key, key, keylen) == 0) {
+      hte->key  = key;
+      hte->data = data;
+      return 0;
+    }
+  }
+
+  uft_ht_ent * hte = ht->spare;
+  if (hte != NULL) {
+    ht->spare = hte->next;
+  } else {
+    hte = (uft_ht_ent *) malloc(sizeof(uft_ht_ent));
+    if (hte == NULL)
+      return -1;
+  }
+
+  hte->hash   = hash;
+  hte->keylen = keylen;
+  hte->key    = key;
+  hte->data   = data;
+  hte->next   = *bucketp;
+  *bucketp    = hte;
+  ht->count++;
+
+  if (ht->count > ht->size)
+    ht_grow(ht);
+
+  return 0;
+}
+
+
+/// Remove a key, returning the data that was stored against it (or
+/// NULL if the key was not present).
+
+void *
+uft_ht_del(uft_ht * ht, const void * key, int keylen)
+{
+  unsigned int hash = uft_ht_hash(key, keylen);
+
+  for (uft_ht_ent ** htep = &ht->buckets[hash & (ht->size - 1)]; *htep != NULL; htep = &(*htep)->next) {
+    uft_ht_ent * hte = *htep;
+    if (hte->hash == hash && hte->keylen == keylen && memcmp(hte->key, key, keylen) == 0) {
+      void * data = hte->data;
+      *htep = hte->next;
+      hte->next = ht->spare;
+      ht->spare = hte;
+      ht->count--;
+      return data;
+    }
+  }
+
+  return NULL;
+}
+
+
+/// Return the number of keys in the hash table.
+
+int
+uft_ht_count(uft_ht * ht)
+{
+  return ht->count;
+}
+
+
+/// Call a function for every key in the hash table, passing the key,
+/// key length, data and 'arg'. The function must not modify the table.
+
+void
+uft_ht_each(uft_ht * ht, void (*fp)(const void *, int, void *, void *), void * arg)
+{
+  for (int i = 0; i < ht->size; i++)
+    for (uft_ht_ent * hte = ht->buckets[i]; hte != NULL; hte = hte->next)
+      fp(hte->key, hte->keylen, hte->data, arg);
+}
+
+
+/// Remove every key from the hash table, keeping the bucket array and
+/// the entries (for reuse).
+
+void
+uft_ht_clear(uft_ht * ht)
+{
+  if (ht->count == 0)
+    return;
+
+  for (int i = 0; i < ht->size; i++) {
+    uft_ht_ent * hte = ht->buckets[i];
+    while (hte != NULL) {
+      uft_ht_ent * next = hte->next;
+      hte->next = ht->spare;
+      ht->spare = hte;
+      hte = next;
+    }
+    ht->buckets[i] = NULL;
+  }
+  ht->count = 0;
+}
+
+
+/// Delete an entire hash table.
+
+void
+uft_ht_rm(uft_ht * ht)
+{
+  uft_ht_clear(ht);
+  while (ht->spare != NULL) {
+    uft_ht_ent * next = ht->spare->next;
+    free(ht->spare);
+    ht->spare = next;
+  }
+  free(ht->buckets);
+  free(ht);
+}
+
+
+/// Double the number of buckets. If memory cannot be allocated the
+/// table is left as it is (it still works, just with longer chains).
+
+static int
+ht_grow (uft_ht * ht)
+{
+  int new_size = ht->size * 2;
+  uft_ht_ent ** new_buckets = (uft_ht_ent **) calloc(new_size, sizeof(uft_ht_ent *));
+
+  if (new_buckets == NULL)
+    return -1;
+
+  for (int i = 0; i < ht->size; i++) {
+    uft_ht_ent * hte = ht->buckets[i];
+    while (hte != NULL) {
+      uft_ht_ent * next = hte->next;
+      hte->next = new_buckets[hte->hash & (new_size - 1)];
+      new_buckets[hte->hash & (new_size - 1)] = hte;
+      hte = next;
+    }
+  }
+
+  free(ht->buckets);
+  ht->buckets = new_buckets;
+  ht->size    = new_size;
+
+  return 0;
+}
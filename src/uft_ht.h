@@ -0,0 +1,43 @@
+/// libuft hash table
+
+#ifndef UFT_HT_INCLUDED
+#define UFT_HT_INCLUDED
+
+
+struct uft_ht_st;
+struct uft_ht_ent_st;
+
+/// An entry in a hash table. The key is not copied, it must stay valid
+/// for as long as it is in the table (typically it is part of the data).
+typedef struct uft_ht_ent_st
+{
+  struct uft_ht_ent_st * next;
+  unsigned int           hash;
+  int                    keylen;
+  const void *           key;
+  void *                 data;
+} uft_ht_ent;
+
+/// A hash table (chained buckets, grown as required). Entries removed
+/// by 'uft_ht_clear' are kept for reuse rather than freed.
+typedef struct uft_ht_st
+{
+  int                     count;
+  int                     size;
+  struct uft_ht_ent_st ** buckets;
+  struct uft_ht_ent_st *  spare;
+} uft_ht;
+
+
+extern uft_ht *     uft_ht_create();
+extern unsigned int uft_ht_hash(const void * key, int keylen);
+extern void *       uft_ht_get(uft_ht * ht, const void * key, int keylen);
+extern int          uft_ht_put(uft_ht * ht, const void * key, int keylen, void * data);
+extern void *       uft_ht_del(uft_ht * ht, const void * key, int keylen);
+extern int          uft_ht_count(uft_ht * ht);
+extern void         uft_ht_each(uft_ht * ht, void (*fp)(const void *, int, void *, void *), void * arg);
+extern void         uft_ht_clear(uft_ht * ht);
+extern void         uft_ht_rm(uft_ht * ht);
+
+
+#endif // UFT_HT_INCLUDED
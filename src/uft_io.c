@@ -0,0 +1,259 @@
+/// libuft file I/O helpers
+///
+/// Positioned reads, writes and copies of any (64 bit) length, done in
+/// as many system calls as it takes (short reads and writes, and
+/// interrupted calls, are carried on from where they left off). Copies
+/// go through a per thread buffer of two UFT_IO_CHUNK byte halves, so
+/// copying a file of any size takes a fixed amount of memory. The buffer
+/// is UFT_IO_ALIGN aligned, so it can be read in to with O_DIRECT.
+
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "config.h"
+#include "uft_io.h"
+
+
+static pthread_once_t io_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  io_buf_key;
+
+
+static void   io_init (void);
+static char * io_buf (void);
+
+
+/// Read up to 'len' bytes at 'off', returning the number read (which is
+/// less than 'len' only at the end of the file) or -1 on error.
+
+off_t
+uft_io_pread (int fd, void * buf, off_t len, off_t off)
+{
+  off_t done = 0;
+
+  while (done < len) {
+    ssize_t result = pread(fd, (char *) buf + done, len - done > SSIZE_MAX ? SSIZE_MAX : len - done, off + done);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (result == 0)
+      break;
+    done += result;
+  }
+
+  return done;
+}
+
+
+/// Write 'len' bytes at 'off', returning 'len' or -1 on error.
+
+off_t
+uft_io_pwrite (int fd, const void * buf, off_t len, off_t off)
+{
+  off_t done = 0;
+
+  while (done < len) {
+    ssize_t result = pwrite(fd, (const char *) buf + done, len - done > SSIZE_MAX ? SSIZE_MAX : len - done, off + done);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += result;
+  }
+
+  return done;
+}
+
+
+/// Copy 'len' bytes from 'in_off' in 'in_fd' to 'out_off' in 'out_fd'
+/// in chunks, returning the number copied (which is less than 'len' only
+/// if the input ends first) or -1 on error.
+
+off_t
+uft_io_copy (int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len)
+{
+  char * buf = io_buf();
+  off_t done = 0;
+
+  if (buf == NULL)
+    return -1;
+
+  while (done < len) {
+    off_t chunk = len - done > UFT_IO_CHUNK ? UFT_IO_CHUNK : len - done;
+    off_t got = uft_io_pread(in_fd, buf, chunk, in_off + done);
+    if (got < 0 || uft_io_pwrite(out_fd, buf, got, out_off + done) < 0)
+      return -1;
+    done += got;
+    if (got < chunk)
+      break;
+  }
+
+  return done;
+}
+
+
+/// Make 'len' bytes at 'out_off' in 'out_fd' (which must be open for
+/// reading and writing) the same as 'len' bytes of 'data', or if 'data'
+/// is NULL, at 'in_off' in 'in_fd', or if that is negative too, zeros.
+/// The existing content is compared chunk by chunk and only chunks that
+/// differ are written. Returns 'len' or -1 on error.
+
+off_t
+uft_io_patch (int out_fd, off_t out_off, const char * data, int in_fd, off_t in_off, off_t len)
+{
+  char * buf = io_buf();
+  char * want_buf = buf + UFT_IO_CHUNK;
+  off_t done = 0;
+
+  if (buf == NULL)
+    return -1;
+  if (data == NULL && in_fd < 0)
+    memset(want_buf, 0, UFT_IO_CHUNK);
+
+  while (done < len) {
+    off_t chunk = len - done > UFT_IO_CHUNK ? UFT_IO_CHUNK : len - done;
+    const char * want = want_buf;
+    if (data != NULL)
+      want = data + done;
+    else if (in_fd >= 0 && uft_io_pread(in_fd, want_buf, chunk, in_off + done) != chunk)
+      return -1;
+
+    off_t got = uft_io_pread(out_fd, buf, chunk, out_off + done);
+    if (got < 0)
+      return -1;
+    if (got != chunk || memcmp(buf, want, chunk) != 0)
+      if (uft_io_pwrite(out_fd, want, chunk, out_off + done) < 0)
+        return -1;
+    done += chunk;
+  }
+
+  return done;
+}
+
+
+/// Copy 'len' bytes from 'in_off' in 'in_fd', which is open with
+/// O_DIRECT, to 'out_off' in 'out_fd', or if 'out_fd' is negative, to
+/// 'out_buf'. The input is read in UFT_IO_ALIGN aligned chunks, taking
+/// from them just the bytes wanted. Returns the number copied (which is
+/// less than 'len' only if the input ends first) or -1 on error (EINVAL
+/// if the file system does not support O_DIRECT after all).
+
+off_t
+uft_io_copy_direct (int in_fd, off_t in_off, int out_fd, char * out_buf, off_t out_off, off_t len)
+{
+  char * buf = io_buf();
+  off_t pos = in_off & ~(off_t) (UFT_IO_ALIGN - 1);
+  off_t done = 0;
+
+  if (buf == NULL)
+    return -1;
+
+  while (done < len) {
+    ssize_t got = pread(in_fd, buf, UFT_IO_CHUNK, pos);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    off_t skip = in_off + done - pos;
+    if (got <= skip)
+      break;
+    off_t chunk = got - skip < len - done ? got - skip : len - done;
+    if (out_fd >= 0) {
+      if (uft_io_pwrite(out_fd, buf + skip, chunk, out_off + done) < 0)
+        return -1;
+    } else {
+      memcpy(out_buf + done, buf + skip, chunk);
+    }
+    done += chunk;
+
+    if ((got & (UFT_IO_ALIGN - 1)) != 0)
+      break;
+    pos += got;
+  }
+
+  return done;
+}
+
+
+/// Drop a range of a file from the page cache. If it has just been
+/// 'written', it is first written back (waiting for it), as dirty pages
+/// cannot be dropped.
+
+void
+uft_io_nocache (int fd, off_t off, off_t len, int written)
+{
+  if (written)
+    sync_file_range(fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+
+/// Create an anonymous temporary file (in TMPDIR, or the system temporary
+/// directory), returning its descriptor or -1 on error.
+
+int
+uft_io_spool (void)
+{
+  const char * tmp_dir = getenv("TMPDIR");
+  char tmp_path[PATH_MAX];
+
+  if (tmp_dir == NULL || tmp_dir[0] == '\0')
+    tmp_dir = P_tmpdir;
+
+  int fd = open(tmp_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+    return fd;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s/uft-spool-XXXXXX", tmp_dir) >= sizeof(tmp_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  fd = mkostemp(tmp_path, O_CLOEXEC);
+  if (fd >= 0)
+    unlink(tmp_path);
+
+  return fd;
+}
+
+
+static void
+io_init (void)
+{
+  pthread_key_create(&io_buf_key, free);
+}
+
+
+/// Return this threads copy buffer, allocating it if need be.
+
+static char *
+io_buf (void)
+{
+  pthread_once(&io_once, io_init);
+
+  char * buf = pthread_getspecific(io_buf_key);
+  if (buf == NULL) {
+    if (posix_memalign((void **) &buf, UFT_IO_ALIGN, UFT_IO_CHUNK * 2) != 0) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    if (pthread_setspecific(io_buf_key, buf) != 0) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+
+  return buf;
+}
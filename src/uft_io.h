@@ -0,0 +1,19 @@
+/// libuft file I/O helpers
+
+#ifndef UFT_IO_INCLUDED
+#define UFT_IO_INCLUDED
+
+
+#include <sys/types.h>
+
+
+extern off_t uft_io_pread (int fd, void * buf, off_t len, off_t off);
+extern off_t uft_io_pwrite (int fd, const void * buf, off_t len, off_t off);
+extern off_t uft_io_copy (int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len);
+extern off_t uft_io_patch (int out_fd, off_t out_off, const char * data, int in_fd, off_t in_off, off_t len);
+extern off_t uft_io_copy_direct (int in_fd, off_t in_off, int out_fd, char * out_buf, off_t out_off, off_t len);
+extern void  uft_io_nocache (int fd, off_t off, off_t len, int written);
+extern int   uft_io_spool (void);
+
+
+#endif // UFT_IO_INCLUDED
@@ -151,6 +151,39 @@ uft_ll_rmnode(uft_ll_node * lln)
 }
 
 
+/// Move a node from whatever list it is in to the end of another list
+/// (which may be the same list), without reallocating it.
+
+uft_ll_node *
+uft_ll_move_tail(uft_ll * ll, uft_ll_node * lln)
+{
+  uft_ll * from_ll = lln->list;
+
+  if (lln->prev == NULL)
+    from_ll->head = lln->next;
+  else
+    lln->prev->next = lln->next;
+  if (lln->next == NULL)
+    from_ll->tail = lln->prev;
+  else
+    lln->next->prev = lln->prev;
+  from_ll->count--;
+
+  lln->list = ll;
+  lln->prev = ll->tail;
+  lln->next = NULL;
+
+  if (ll->tail == NULL)
+    ll->head = lln;
+  else
+    ll->tail->next = lln;
+  ll->tail = lln;
+  ll->count++;
+
+  return lln;
+}
+
+
 /// Delete an entire list.
 
 void
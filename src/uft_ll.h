@@ -41,6 +41,7 @@ extern uft_ll_node * uft_ll_prev(uft_ll_node * lln);
 extern uft_ll_node * uft_ll_prev_or_tail(uft_ll_node * lln);
 extern void *        uft_ll_data(uft_ll_node * lln);
 extern void *        uft_ll_rmnode(uft_ll_node * lln);
+extern uft_ll_node * uft_ll_move_tail(uft_ll * ll, uft_ll_node * lln);
 extern void          uft_ll_rm(uft_ll * ll);
 
 
@@ -0,0 +1,185 @@
+/// libuft entity lock table
+///
+/// A process wide table of entity locks, shared or exclusive, held by
+/// an owner (the ID of a top level transaction). The table is split in
+/// to shards, each with its own mutex, so unrelated entities seldom
+/// contend. Deadlock is avoided by wait-die: an owner may wait for a
+/// lock held by a younger (higher ID) owner, but an owner wanting a lock
+/// held by an older one gives up with UFT_LOCK_DEADLOCK instead.
+
+
+#include <pthread.h>
+#include <malloc.h>
+#include <limits.h>
+
+#include "uft_lock.h"
+
+
+#define UFT_LOCK_SHARDS 64
+
+
+/// An owners hold on a lock (an owner may acquire the same lock more
+/// than once, 'count' times).
+typedef struct lock_hold_st
+{
+  int                   owner;
+  int                   exclusive;
+  int                   count;
+  struct lock_hold_st * next;
+} lock_hold;
+
+/// A lock on an entity, present for as long as anything holds it.
+typedef struct lock_ent_st
+{
+  uft_lock_key         key;
+  lock_hold *          holds;
+  struct lock_ent_st * next;
+} lock_ent;
+
+typedef struct lock_shard_st
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  lock_ent *      ents;
+} lock_shard;
+
+
+static lock_shard lock_shards[UFT_LOCK_SHARDS] = {
+  [0 ... UFT_LOCK_SHARDS - 1] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL }
+};
+
+
+static lock_shard * key_shard (uft_lock_key * key);
+static lock_ent **  shard_find (lock_shard * shard, uft_lock_key * key);
+
+
+/// Acquire a lock on 'key' for 'owner', exclusive or shared. If the lock
+/// is held incompatibly by another owner, this waits for it unless 'try'
+/// is set (in which case UFT_LOCK_BUSY is returned) or waiting could
+/// deadlock (in which case UFT_LOCK_DEADLOCK is returned). An owner
+/// holding a shared lock may upgrade it to exclusive if it is the only
+/// holder.
+
+int
+uft_lock_acquire (uft_lock_key * key, int owner, int exclusive, int try)
+{
+  lock_shard * shard = key_shard(key);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  lock_ent ** entp = shard_find(shard, key);
+  lock_ent * ent = *entp;
+  if (ent == NULL) {
+    ent = (lock_ent *) malloc(sizeof(lock_ent));
+    if (ent == NULL) {
+      pthread_mutex_unlock(&shard->mutex);
+      return UFT_LOCK_NOMEM;
+    }
+    ent->key   = *key;
+    ent->holds = NULL;
+    ent->next  = shard->ents;
+    shard->ents = ent;
+  }
+
+  for (;;) {
+    lock_hold * own_hold = NULL;
+    int oldest_conflict = INT_MAX;
+
+    for (lock_hold * hold = ent->holds; hold != NULL; hold = hold->next) {
+      if (hold->owner == owner)
+        own_hold = hold;
+      else if ((exclusive || hold->exclusive) && hold->owner < oldest_conflict)
+        oldest_conflict = hold->owner;
+    }
+
+    if (oldest_conflict == INT_MAX) {
+      if (own_hold == NULL) {
+        own_hold = (lock_hold *) malloc(sizeof(lock_hold));
+        if (own_hold == NULL) {
+          pthread_mutex_unlock(&shard->mutex);
+          return UFT_LOCK_NOMEM;
+        }
+        own_hold->owner     = owner;
+        own_hold->exclusive = 0;
+        own_hold->count     = 0;
+        own_hold->next      = ent->holds;
+        ent->holds = own_hold;
+      }
+      own_hold->count++;
+      if (exclusive)
+        own_hold->exclusive = 1;
+      pthread_mutex_unlock(&shard->mutex);
+      return UFT_LOCK_OK;
+    }
+
+    if (try || owner > oldest_conflict) {
+      pthread_mutex_unlock(&shard->mutex);
+      return try ? UFT_LOCK_BUSY : UFT_LOCK_DEADLOCK;
+    }
+
+    pthread_cond_wait(&shard->cond, &shard->mutex);
+  }
+}
+
+
+/// Release one acquisition of the lock on 'key' by 'owner'.
+
+void
+uft_lock_release (uft_lock_key * key, int owner)
+{
+  lock_shard * shard = key_shard(key);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  lock_ent ** entp = shard_find(shard, key);
+  lock_ent * ent = *entp;
+  if (ent != NULL) {
+    for (lock_hold ** holdp = &ent->holds; *holdp != NULL; holdp = &(*holdp)->next) {
+      lock_hold * hold = *holdp;
+      if (hold->owner == owner) {
+        if (--hold->count == 0) {
+          *holdp = hold->next;
+          free(hold);
+        }
+        break;
+      }
+    }
+    if (ent->holds == NULL) {
+      *entp = ent->next;
+      free(ent);
+    }
+    pthread_cond_broadcast(&shard->cond);
+  }
+
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+
+/// Return the shard a key belongs in.
+
+static lock_shard *
+key_shard (uft_lock_key * key)
+{
+  unsigned long long hash = (unsigned long long) key->ino * 0x9e3779b97f4a7c15ull;
+
+  hash ^= (unsigned long long) key->dev + key->name_hash;
+  hash ^= hash >> 29;
+
+  return &lock_shards[hash % UFT_LOCK_SHARDS];
+}
+
+
+/// Return a pointer to the shards pointer to the lock for a key (the
+/// pointer pointed to is NULL if there is no such lock).
+
+static lock_ent **
+shard_find (lock_shard * shard, uft_lock_key * key)
+{
+  lock_ent ** entp;
+
+  for (entp = &shard->ents; *entp != NULL; entp = &(*entp)->next)
+    if ((*entp)->key.dev == key->dev && (*entp)->key.ino == key->ino && (*entp)->key.name_hash == key->name_hash)
+      break;
+
+  return entp;
+}
@@ -0,0 +1,32 @@
+/// libuft entity lock table
+
+#ifndef UFT_LOCK_INCLUDED
+#define UFT_LOCK_INCLUDED
+
+
+#include <sys/types.h>
+
+
+#define UFT_LOCK_OK       0
+#define UFT_LOCK_BUSY     1
+#define UFT_LOCK_DEADLOCK 2
+#define UFT_LOCK_NOMEM    3
+
+
+/// The identity of a lockable entity. An entity is identified by the
+/// device and inode of its directory and a hash of its name (with the
+/// low bit set), and one that exists by its device and inode too (and a
+/// zero name hash); existing entities are locked both ways.
+typedef struct uft_lock_key_st
+{
+  dev_t        dev;
+  ino_t        ino;
+  unsigned int name_hash;
+} uft_lock_key;
+
+
+extern int  uft_lock_acquire (uft_lock_key * key, int owner, int exclusive, int try);
+extern void uft_lock_release (uft_lock_key * key, int owner);
+
+
+#endif // UFT_LOCK_INCLUDED
@@ -0,0 +1,392 @@
+/// libuft metrics
+///
+/// Process wide latency histograms and counters. Every thread records in
+/// its own slot, so recording takes no locks and shares no cache lines;
+/// slots are pushed on to a global list (with compare and swap) and never
+/// freed, a slot given up by an exiting thread being taken over by the
+/// next new one. 'uft_metrics_dump' merges the slots as it reads them.
+///
+/// Histograms are log-linear (HDR style): values below 8 have a bucket
+/// each, and every power of two above that is split in to 8 buckets, so
+/// any value is placed to within 12.5% with 496 buckets in all. Times
+/// are recorded in nanoseconds.
+
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "uft.h"
+#include "uft_metrics.h"
+
+
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define ENROL_CLASSES (UFT_HIST_COUNT - UFT_HIST_ENROL)
+
+
+/// A threads metrics slot.
+typedef struct metrics_slot_st
+{
+  struct metrics_slot_st * next;
+  int                      in_use;
+  uint64_t                 counts[UFT_COUNT_COUNT];
+  uint64_t                 sums[UFT_HIST_COUNT];
+  uint64_t                 hists[UFT_HIST_COUNT][HIST_BUCKETS];
+} metrics_slot;
+
+
+static metrics_slot *            metrics_slots = NULL;
+static pthread_once_t            metrics_once  = PTHREAD_ONCE_INIT;
+static pthread_key_t             metrics_key;
+static __thread metrics_slot *   metrics_self  = NULL;
+
+/// The upper bound of each enrolment size class, and its label.
+static const off_t  enrol_class_max[ENROL_CLASSES]   = { 4096, 65536, 1048576, 16777216, 268435456, -1 };
+static const char * enrol_class_label[ENROL_CLASSES] = { "4k", "64k", "1m", "16m", "256m", "inf" };
+
+static const double quantiles[]       = { 0.5, 0.9, 0.99, 0.999 };
+static const char * quantile_labels[] = { "0.5", "0.9", "0.99", "0.999" };
+#define QUANTILE_COUNT 4
+
+
+static void           metrics_init (void);
+static void           metrics_release (void * arg);
+static metrics_slot * metrics_slot_get (void);
+static void           metrics_add (uint64_t * counter, uint64_t n);
+static int            hist_bucket (uint64_t value);
+static uint64_t       hist_bucket_max (int bucket);
+static uint64_t       hist_quantile (uint64_t * hist, uint64_t count, double quantile);
+static void           dump_prometheus (FILE * out, metrics_slot * merged);
+static void           dump_json (FILE * out, metrics_slot * merged);
+static void           dump_summary (FILE * out, const char * name, const char * labels, uint64_t * hist, uint64_t sum);
+static void           dump_json_hist (FILE * out, uint64_t * hist, uint64_t sum);
+
+
+/// Return the time now, in nanoseconds, to be passed to 'uft_metrics_time'.
+
+uint64_t
+uft_metrics_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/// Record the time since 'start' in histogram 'hist'.
+
+void
+uft_metrics_time (int hist, uint64_t start)
+{
+  metrics_slot * slot = metrics_slot_get();
+  if (slot == NULL)
+    return;
+
+  uint64_t value = uft_metrics_now() - start;
+  metrics_add(&slot->hists[hist][hist_bucket(value)], 1);
+  metrics_add(&slot->sums[hist], value);
+}
+
+
+/// Record the time since 'start' taken to enrol an entity of 'size'
+/// bytes, in the histogram for its size class.
+
+void
+uft_metrics_enrol (off_t size, uint64_t start)
+{
+  int class = 0;
+
+  while (class < ENROL_CLASSES - 1 && size > enrol_class_max[class])
+    class++;
+
+  uft_metrics_time(UFT_HIST_ENROL + class, start);
+}
+
+
+/// Count one more of 'counter'.
+
+void
+uft_metrics_count (int counter)
+{
+  metrics_slot * slot = metrics_slot_get();
+
+  if (slot != NULL)
+    metrics_add(&slot->counts[counter], 1);
+}
+
+
+/// Write all the metrics, merged across threads, to 'fd', as Prometheus
+/// text (UFT_METRICS_PROMETHEUS) or JSON (UFT_METRICS_JSON). Returns 0
+/// on success or -1 (with errno set) on failure.
+
+int
+uft_metrics_dump (int fd, int format)
+{
+  char * text = NULL;
+  size_t text_len = 0;
+
+  if (format != UFT_METRICS_PROMETHEUS && format != UFT_METRICS_JSON) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  metrics_slot * merged = (metrics_slot *) calloc(1, sizeof(metrics_slot));
+  if (merged == NULL)
+    return -1;
+  for (metrics_slot * slot = __atomic_load_n(&metrics_slots, __ATOMIC_ACQUIRE); slot != NULL; slot = slot->next) {
+    for (int i = 0; i < UFT_COUNT_COUNT; i++)
+      merged->counts[i] += __atomic_load_n(&slot->counts[i], __ATOMIC_RELAXED);
+    for (int h = 0; h < UFT_HIST_COUNT; h++) {
+      merged->sums[h] += __atomic_load_n(&slot->sums[h], __ATOMIC_RELAXED);
+      for (int b = 0; b < HIST_BUCKETS; b++)
+        merged->hists[h][b] += __atomic_load_n(&slot->hists[h][b], __ATOMIC_RELAXED);
+    }
+  }
+
+  FILE * out = open_memstream(&text, &text_len);
+  if (out == NULL) {
+    free(merged);
+    return -1;
+  }
+  if (format == UFT_METRICS_PROMETHEUS)
+    dump_prometheus(out, merged);
+  else
+    dump_json(out, merged);
+  free(merged);
+  if (fclose(out) != 0) {
+    free(text);
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < text_len) {
+    ssize_t result = write(fd, text + done, text_len - done);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      free(text);
+      return -1;
+    }
+    done += result;
+  }
+  free(text);
+
+  return 0;
+}
+
+
+static void
+metrics_init (void)
+{
+  pthread_key_create(&metrics_key, metrics_release);
+}
+
+
+/// Give up an exiting threads slot, for a new thread to take over.
+
+static void
+metrics_release (void * arg)
+{
+  metrics_slot * slot = (metrics_slot *) arg;
+
+  __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+/// Return this threads slot, taking over a free one or adding a new one
+/// to the list if it has none yet. Returns NULL if memory cannot be
+/// allocated (the metrics are then not recorded).
+
+static metrics_slot *
+metrics_slot_get (void)
+{
+  metrics_slot * slot = metrics_self;
+
+  if (slot != NULL)
+    return slot;
+
+  pthread_once(&metrics_once, metrics_init);
+
+  for (slot = __atomic_load_n(&metrics_slots, __ATOMIC_ACQUIRE); slot != NULL; slot = slot->next) {
+    int free_slot = 0;
+    if (__atomic_compare_exchange_n(&slot->in_use, &free_slot, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (slot == NULL) {
+    slot = (metrics_slot *) calloc(1, sizeof(metrics_slot));
+    if (slot == NULL)
+      return NULL;
+    slot->in_use = 1;
+    slot->next = __atomic_load_n(&metrics_slots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_slots, &slot->next, slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(metrics_key, slot);
+  metrics_self = slot;
+
+  return slot;
+}
+
+
+/// Add to a counter in this threads slot. Only the owning thread writes
+/// it, so this need not be a locked instruction, just untorn.
+
+static void
+metrics_add (uint64_t * counter, uint64_t n)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+
+/// Return the histogram bucket for a value.
+
+static int
+hist_bucket (uint64_t value)
+{
+  if (value < (1 << HIST_SUB_BITS))
+    return value;
+
+  int exp = 63 - __builtin_clzll(value);
+
+  return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+
+/// Return the largest value in a histogram bucket.
+
+static uint64_t
+hist_bucket_max (int bucket)
+{
+  if (bucket < (1 << HIST_SUB_BITS))
+    return bucket;
+
+  int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+  uint64_t width = (uint64_t) 1 << (exp - HIST_SUB_BITS);
+
+  return (((uint64_t) 1 << exp) + sub * width) + (width - 1);
+}
+
+
+/// Return the value (the top of its bucket) at a quantile of a histogram
+/// of 'count' values.
+
+static uint64_t
+hist_quantile (uint64_t * hist, uint64_t count, double quantile)
+{
+  uint64_t rank = (uint64_t) (quantile * count + 0.5);
+  uint64_t seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen >= rank)
+      return hist_bucket_max(b);
+  }
+
+  return 0;
+}
+
+
+static void
+dump_prometheus (FILE * out, metrics_slot * merged)
+{
+  char labels[32];
+
+  fprintf(out, "# HELP uft_tx_seconds Time taken by uft_tx_begin (running and committing or rolling back a transaction).\n");
+  fprintf(out, "# TYPE uft_tx_seconds summary\n");
+  dump_summary(out, "uft_tx_seconds", "", merged->hists[UFT_HIST_TX], merged->sums[UFT_HIST_TX]);
+
+  fprintf(out, "# HELP uft_rollback_seconds Time taken to roll back a transaction.\n");
+  fprintf(out, "# TYPE uft_rollback_seconds summary\n");
+  dump_summary(out, "uft_rollback_seconds", "", merged->hists[UFT_HIST_ROLLBACK], merged->sums[UFT_HIST_ROLLBACK]);
+
+  fprintf(out, "# HELP uft_enrol_seconds Time taken to add an entity to a transaction, by entity size.\n");
+  fprintf(out, "# TYPE uft_enrol_seconds summary\n");
+  for (int c = 0; c < ENROL_CLASSES; c++) {
+    snprintf(labels, sizeof(labels), "size=\"%s\"", enrol_class_label[c]);
+    dump_summary(out, "uft_enrol_seconds", labels, merged->hists[UFT_HIST_ENROL + c], merged->sums[UFT_HIST_ENROL + c]);
+  }
+
+  fprintf(out, "# HELP uft_tx_total Transactions begun.\n");
+  fprintf(out, "# TYPE uft_tx_total counter\n");
+  fprintf(out, "uft_tx_total %llu\n", (unsigned long long) merged->counts[UFT_COUNT_TX]);
+  fprintf(out, "# HELP uft_tx_failed_total Transactions rolled back.\n");
+  fprintf(out, "# TYPE uft_tx_failed_total counter\n");
+  fprintf(out, "uft_tx_failed_total %llu\n", (unsigned long long) merged->counts[UFT_COUNT_TX_FAILED]);
+  fprintf(out, "# HELP uft_rollback_failed_total Transactions whose rollback failed.\n");
+  fprintf(out, "# TYPE uft_rollback_failed_total counter\n");
+  fprintf(out, "uft_rollback_failed_total %llu\n", (unsigned long long) merged->counts[UFT_COUNT_ROLLBACK_FAILED]);
+  fprintf(out, "# HELP uft_enrol_failed_total Entities that could not be added to a transaction.\n");
+  fprintf(out, "# TYPE uft_enrol_failed_total counter\n");
+  fprintf(out, "uft_enrol_failed_total %llu\n", (unsigned long long) merged->counts[UFT_COUNT_ENROL_FAILED]);
+}
+
+
+/// Write one Prometheus summary: its quantiles, sum and count.
+
+static void
+dump_summary (FILE * out, const char * name, const char * labels, uint64_t * hist, uint64_t sum)
+{
+  const char * sep = labels[0] != '\0' ? "," : "";
+  uint64_t count = 0;
+
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    count += hist[b];
+
+  for (int q = 0; q < QUANTILE_COUNT; q++)
+    fprintf(out, "%s{%s%squantile=\"%s\"} %.9f\n", name, labels, sep, quantile_labels[q], hist_quantile(hist, count, quantiles[q]) / 1e9);
+  if (labels[0] != '\0') {
+    fprintf(out, "%s_sum{%s} %.9f\n", name, labels, sum / 1e9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) count);
+  } else {
+    fprintf(out, "%s_sum %.9f\n", name, sum / 1e9);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long) count);
+  }
+}
+
+
+static void
+dump_json (FILE * out, metrics_slot * merged)
+{
+  fprintf(out, "{\"tx_seconds\":");
+  dump_json_hist(out, merged->hists[UFT_HIST_TX], merged->sums[UFT_HIST_TX]);
+  fprintf(out, ",\"rollback_seconds\":");
+  dump_json_hist(out, merged->hists[UFT_HIST_ROLLBACK], merged->sums[UFT_HIST_ROLLBACK]);
+  fprintf(out, ",\"enrol_seconds\":{");
+  for (int c = 0; c < ENROL_CLASSES; c++) {
+    fprintf(out, "%s\"%s\":", c > 0 ? "," : "", enrol_class_label[c]);
+    dump_json_hist(out, merged->hists[UFT_HIST_ENROL + c], merged->sums[UFT_HIST_ENROL + c]);
+  }
+  fprintf(out, "},\"tx_total\":%llu,\"tx_failed_total\":%llu,\"rollback_failed_total\":%llu,\"enrol_failed_total\":%llu}\n",
+          (unsigned long long) merged->counts[UFT_COUNT_TX], (unsigned long long) merged->counts[UFT_COUNT_TX_FAILED],
+          (unsigned long long) merged->counts[UFT_COUNT_ROLLBACK_FAILED], (unsigned long long) merged->counts[UFT_COUNT_ENROL_FAILED]);
+}
+
+
+/// Write one histogram as a JSON object of its count, sum and quantiles.
+
+static void
+dump_json_hist (FILE * out, uint64_t * hist, uint64_t sum)
+{
+  uint64_t count = 0;
+
+  for (int b = 0; b < HIST_BUCKETS; b++)
+    count += hist[b];
+
+  fprintf(out, "{\"count\":%llu,\"sum\":%.9f", (unsigned long long) count, sum / 1e9);
+  for (int q = 0; q < QUANTILE_COUNT; q++)
+    fprintf(out, ",\"%s\":%.9f", quantile_labels[q], hist_quantile(hist, count, quantiles[q]) / 1e9);
+  fprintf(out, "}");
+}
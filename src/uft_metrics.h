@@ -0,0 +1,29 @@
+/// libuft metrics
+
+#ifndef UFT_METRICS_INCLUDED
+#define UFT_METRICS_INCLUDED
+
+
+#include <sys/types.h>
+#include <stdint.h>
+
+
+#define UFT_HIST_TX         0
+#define UFT_HIST_ROLLBACK   1
+#define UFT_HIST_ENROL      2
+#define UFT_HIST_COUNT      8
+
+#define UFT_COUNT_TX              0
+#define UFT_COUNT_TX_FAILED       1
+#define UFT_COUNT_ROLLBACK_FAILED 2
+#define UFT_COUNT_ENROL_FAILED    3
+#define UFT_COUNT_COUNT           4
+
+
+extern uint64_t uft_metrics_now (void);
+extern void     uft_metrics_time (int hist, uint64_t start);
+extern void     uft_metrics_enrol (off_t size, uint64_t start);
+extern void     uft_metrics_count (int counter);
+
+
+#endif // UFT_METRICS_INCLUDED
@@ -0,0 +1,361 @@
+/// libuft tree removal
+///
+/// Trees are removed without recursion and without stat'ing entries: each
+/// directory is read with 'getdents64' in large batches, everything that
+/// the directory entry type says is not a directory is unlinked as it is
+/// read, and the names of subdirectories are kept to be descended into
+/// afterwards (an explicit stack of directories holds the state). When
+/// the top directory has several subdirectories, they are shared out
+/// between the caller and the worker pool.
+
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "config.h"
+#include "uft_async.h"
+#include "uft_rm.h"
+
+
+#define RM_DENTS_LEN 32768
+
+
+/// A directory being removed: its descriptor, the names of its
+/// subdirectories (each NUL terminated) and how far through them the
+/// removal has got. 'name' is the directories name in its parent.
+typedef struct rm_frame_st
+{
+  int    fd;
+  char * name;
+  char * subdirs;
+  size_t subdirs_len;
+  size_t subdirs_cap;
+  size_t next;
+} rm_frame;
+
+/// The subdirectories of a top directory, shared out between the thread
+/// removing it and helpers in the worker pool. Helpers only touch the
+/// top directory while 'active'; the last reference frees it.
+typedef struct rm_share_st
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  rm_frame        top;
+  int             refs;
+  int             active;
+  int             closed;
+  int             error;
+} rm_share;
+
+
+static int  rm_scan (rm_frame * frame, int * errorp);
+static int  rm_subtree (int dirfd, char * name);
+static int  rm_share_subdirs (rm_frame * top, int count);
+static void rm_share_help (void * arg);
+static void rm_share_work (rm_share * share);
+static void rm_share_unref (rm_share * share);
+
+
+/// Remove 'name' (relative to 'dirfd'), and if it is a directory,
+/// everything in it. Symlinks are removed, not followed. Returns 0 on
+/// success (including if 'name' does not exist) or -1 (with errno set)
+/// if anything could not be removed.
+
+int
+uft_rm_tree (int dirfd, const char * name)
+{
+  rm_frame top;
+  int error = 0;
+
+  if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT)
+    return 0;
+  if (errno != EISDIR && errno != EPERM)
+    return -1;
+
+  memset(&top, 0, sizeof(top));
+  top.fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (top.fd < 0)
+    return -1;
+
+  if (rm_scan(&top, &error) != 0) {
+    error = errno;
+  } else if (top.subdirs_len > 0) {
+    int count = 0;
+    for (size_t off = 0; off < top.subdirs_len; off += strlen(top.subdirs + off) + 1)
+      count++;
+    if (count > 1) {
+      int share_error = rm_share_subdirs(&top, count);
+      if (share_error != 0 && error == 0)
+        error = share_error;
+      top.fd = -1;
+      top.subdirs = NULL;
+    } else if (rm_subtree(top.fd, top.subdirs) != 0 && error == 0) {
+      error = errno;
+    }
+  }
+
+  if (top.fd >= 0)
+    close(top.fd);
+  free(top.subdirs);
+
+  if (error == 0 && unlinkat(dirfd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    error = errno;
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/// Read the directory open as 'frame->fd', unlinking everything in it
+/// that is not a directory and keeping the names of subdirectories.
+/// Failures to unlink are put in '*errorp' (if it is still zero), and the
+/// scan goes on. Returns -1 (with errno set) if the directory cannot be
+/// read or memory cannot be allocated, otherwise 0.
+
+static int
+rm_scan (rm_frame * frame, int * errorp)
+{
+  char dents[RM_DENTS_LEN] __attribute__ ((aligned (8)));
+  ssize_t len;
+
+  while ((len = getdents64(frame->fd, dents, sizeof(dents))) > 0) {
+    for (ssize_t off = 0; off < len; ) {
+      struct dirent64 * dent = (struct dirent64 *) (dents + off);
+      char * name = dent->d_name;
+      off += dent->d_reclen;
+
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      if (dent->d_type != DT_DIR) {
+        if (unlinkat(frame->fd, name, 0) == 0 || errno == ENOENT)
+          continue;
+        if (errno != EISDIR) {
+          if (*errorp == 0)
+            *errorp = errno;
+          continue;
+        }
+      }
+
+      size_t name_len = strlen(name) + 1;
+      if (frame->subdirs_len + name_len > frame->subdirs_cap) {
+        size_t cap = frame->subdirs_cap > 0 ? frame->subdirs_cap * 2 : 256;
+        while (cap < frame->subdirs_len + name_len)
+          cap *= 2;
+        char * subdirs = (char *) realloc(frame->subdirs, cap);
+        if (subdirs == NULL)
+          return -1;
+        frame->subdirs = subdirs;
+        frame->subdirs_cap = cap;
+      }
+      memcpy(frame->subdirs + frame->subdirs_len, name, name_len);
+      frame->subdirs_len += name_len;
+    }
+  }
+
+  return len < 0 ? -1 : 0;
+}
+
+
+/// Remove the directory 'name' (relative to 'dirfd') and everything in
+/// it, depth first, keeping a stack of the directories on the way down.
+/// Returns 0 on success or -1 (with errno set, to the first error) if
+/// anything could not be removed.
+
+static int
+rm_subtree (int dirfd, char * name)
+{
+  rm_frame * stack = NULL;
+  int depth = 0;
+  int cap = 0;
+  int error = 0;
+
+  for (;;) {
+    if (name != NULL) {
+      if (depth == cap) {
+        int new_cap = cap > 0 ? cap * 2 : 16;
+        rm_frame * new_stack = (rm_frame *) realloc(stack, new_cap * sizeof(rm_frame));
+        if (new_stack == NULL) {
+          error = errno;
+          break;
+        }
+        stack = new_stack;
+        cap = new_cap;
+      }
+
+      rm_frame * frame = &stack[depth];
+      memset(frame, 0, sizeof(rm_frame));
+      frame->name = name;
+      frame->fd = openat(depth > 0 ? stack[depth - 1].fd : dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (frame->fd < 0) {
+        if (errno != ENOENT && error == 0)
+          error = errno;
+      } else {
+        depth++;
+        if (rm_scan(frame, &error) != 0 && error == 0)
+          error = errno;
+      }
+    }
+    if (depth == 0)
+      break;
+
+    rm_frame * frame = &stack[depth - 1];
+    if (frame->next < frame->subdirs_len) {
+      name = frame->subdirs + frame->next;
+      frame->next += strlen(name) + 1;
+      continue;
+    }
+
+    close(frame->fd);
+    free(frame->subdirs);
+    depth--;
+    if (unlinkat(depth > 0 ? stack[depth - 1].fd : dirfd, frame->name, AT_REMOVEDIR) != 0
+        && errno != ENOENT && error == 0)
+      error = errno;
+    name = NULL;
+  }
+
+  while (depth > 0) {
+    depth--;
+    close(stack[depth].fd);
+    free(stack[depth].subdirs);
+  }
+  free(stack);
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/// Remove the 'count' subdirectories of 'top' with the help of the worker
+/// pool, taking over its descriptor and names. Returns 0 on success or
+/// the first error.
+
+static int
+rm_share_subdirs (rm_frame * top, int count)
+{
+  rm_share * share = (rm_share *) malloc(sizeof(rm_share));
+
+  if (share == NULL) {
+    int error = 0;
+    for (size_t off = 0; off < top->subdirs_len; off += strlen(top->subdirs + off) + 1)
+      if (rm_subtree(top->fd, top->subdirs + off) != 0 && error == 0)
+        error = errno;
+    close(top->fd);
+    free(top->subdirs);
+    return error;
+  }
+
+  pthread_mutex_init(&share->mutex, NULL);
+  pthread_cond_init(&share->cond, NULL);
+  share->top    = *top;
+  share->refs   = 1;
+  share->active = 0;
+  share->closed = 0;
+  share->error  = 0;
+
+  for (int i = 0; i < UFT_ASYNC_THREADS && i < count - 1; i++) {
+    pthread_mutex_lock(&share->mutex);
+    share->refs++;
+    pthread_mutex_unlock(&share->mutex);
+    if (uft_async_submit(rm_share_help, share) != 0) {
+      rm_share_unref(share);
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&share->mutex);
+  share->active++;
+  pthread_mutex_unlock(&share->mutex);
+  rm_share_work(share);
+
+  pthread_mutex_lock(&share->mutex);
+  share->closed = 1;
+  while (share->active > 0)
+    pthread_cond_wait(&share->cond, &share->mutex);
+  int error = share->error;
+  close(share->top.fd);
+  free(share->top.subdirs);
+  pthread_mutex_unlock(&share->mutex);
+
+  rm_share_unref(share);
+
+  return error;
+}
+
+
+/// A worker pool job helping to remove shared subdirectories. Helpers
+/// that only get to run once everything has been taken do nothing.
+
+static void
+rm_share_help (void * arg)
+{
+  rm_share * share = (rm_share *) arg;
+
+  pthread_mutex_lock(&share->mutex);
+  int closed = share->closed;
+  if (!closed)
+    share->active++;
+  pthread_mutex_unlock(&share->mutex);
+
+  if (!closed)
+    rm_share_work(share);
+
+  rm_share_unref(share);
+}
+
+
+/// Take and remove shared subdirectories until there are none left.
+/// Called with 'share->active' counting the caller, which it uncounts.
+
+static void
+rm_share_work (rm_share * share)
+{
+  rm_frame * top = &share->top;
+
+  pthread_mutex_lock(&share->mutex);
+  while (top->next < top->subdirs_len) {
+    char * name = top->subdirs + top->next;
+    top->next += strlen(name) + 1;
+    pthread_mutex_unlock(&share->mutex);
+
+    int error = rm_subtree(top->fd, name) != 0 ? errno : 0;
+
+    pthread_mutex_lock(&share->mutex);
+    if (error != 0 && share->error == 0)
+      share->error = error;
+  }
+  share->closed = 1;
+  if (--share->active == 0)
+    pthread_cond_broadcast(&share->cond);
+  pthread_mutex_unlock(&share->mutex);
+}
+
+
+/// Drop a reference to a share, freeing it with the last.
+
+static void
+rm_share_unref (rm_share * share)
+{
+  pthread_mutex_lock(&share->mutex);
+  int refs = --share->refs;
+  pthread_mutex_unlock(&share->mutex);
+
+  if (refs == 0) {
+    pthread_mutex_destroy(&share->mutex);
+    pthread_cond_destroy(&share->cond);
+    free(share);
+  }
+}
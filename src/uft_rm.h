@@ -0,0 +1,10 @@
+/// libuft tree removal
+
+#ifndef UFT_RM_INCLUDED
+#define UFT_RM_INCLUDED
+
+
+extern int uft_rm_tree (int dirfd, const char * name);
+
+
+#endif // UFT_RM_INCLUDED
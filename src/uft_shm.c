@@ -0,0 +1,321 @@
+/// libuft shared transaction log
+///
+/// A transaction log in a memfd, shared by the transactions owner and any
+/// number of participant processes. Records are appended without locking:
+/// space is reserved by atomically advancing the tail, the record written,
+/// and then marked ready. Open file description (OFD) locks, which are
+/// released by the kernel when a process dies, track who is attached:
+/// the owner write locks byte 1 for as long as it has the log, and every
+/// participant read locks byte 0 for as long as it is attached. Sealing
+/// the log stops new appends and waits (for a write lock on byte 0) until
+/// every participant has detached.
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "uft_shm.h"
+
+
+#define SHM_REC_ALIGN 8
+
+
+static int    shm_lock (int fd, int cmd, short type, off_t start);
+static size_t shm_align (size_t len);
+
+
+/// Create a shared transaction log of 'size' bytes for transaction
+/// 'tx_id', returning the owners view of it, or NULL (with errno set) on
+/// failure. The log's descriptor is close on exec.
+
+uft_shm *
+uft_shm_create (int tx_id, size_t size)
+{
+  uft_shm * shm = (uft_shm *) malloc(sizeof(uft_shm));
+  if (shm == NULL)
+    return NULL;
+
+  char name[32];
+  snprintf(name, sizeof(name), "uft-tx-%d", tx_id);
+
+  shm->fd = memfd_create(name, MFD_CLOEXEC);
+  if (shm->fd < 0) {
+    free(shm);
+    return NULL;
+  }
+  if (ftruncate(shm->fd, size) != 0 || shm_lock(shm->fd, F_OFD_SETLK, F_WRLCK, 1) != 0) {
+    close(shm->fd);
+    free(shm);
+    return NULL;
+  }
+
+  shm->hdr = (uft_shm_hdr *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+  if (shm->hdr == MAP_FAILED) {
+    close(shm->fd);
+    free(shm);
+    return NULL;
+  }
+
+  shm->owner          = 1;
+  shm->hdr->magic     = UFT_SHM_MAGIC;
+  shm->hdr->version   = UFT_SHM_VERSION;
+  shm->hdr->tx_id     = tx_id;
+  shm->hdr->owner_pid = getpid();
+  shm->hdr->size      = size;
+  shm->hdr->tail      = sizeof(uft_shm_hdr);
+  shm->hdr->state     = UFT_SHM_OPEN;
+  shm->hdr->failed    = 0;
+
+  return shm;
+}
+
+
+/// Attach to the shared transaction log open as 'fd' (which is not
+/// needed afterwards) as a participant in transaction 'tx_id'. Returns
+/// NULL (with errno set) if 'fd' is not the log of that transaction, or
+/// the owner has sealed the log or gone away.
+
+uft_shm *
+uft_shm_attach (int fd, int tx_id)
+{
+  struct stat statbuf;
+  struct flock fl;
+  char proc_path[32];
+
+  uft_shm * shm = (uft_shm *) malloc(sizeof(uft_shm));
+  if (shm == NULL)
+    return NULL;
+
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  shm->fd = open(proc_path, O_RDWR | O_CLOEXEC);
+  if (shm->fd < 0) {
+    free(shm);
+    return NULL;
+  }
+  if (fstat(shm->fd, &statbuf) != 0 || statbuf.st_size < sizeof(uft_shm_hdr)) {
+    close(shm->fd);
+    free(shm);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  shm->owner = 0;
+  shm->hdr = (uft_shm_hdr *) mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+  if (shm->hdr == MAP_FAILED) {
+    close(shm->fd);
+    free(shm);
+    return NULL;
+  }
+
+  if (shm->hdr->magic != UFT_SHM_MAGIC || shm->hdr->version != UFT_SHM_VERSION
+      || shm->hdr->tx_id != tx_id || shm->hdr->size != statbuf.st_size) {
+    uft_shm_detach(shm);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type   = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = 1;
+  fl.l_len    = 1;
+  if (fcntl(shm->fd, F_OFD_GETLK, &fl) != 0 || fl.l_type == F_UNLCK) {
+    uft_shm_detach(shm);
+    errno = ESRCH;
+    return NULL;
+  }
+
+  if (shm_lock(shm->fd, F_OFD_SETLK, F_RDLCK, 0) != 0
+      || __atomic_load_n(&shm->hdr->state, __ATOMIC_ACQUIRE) != UFT_SHM_OPEN) {
+    uft_shm_detach(shm);
+    errno = EPIPE;
+    return NULL;
+  }
+
+  return shm;
+}
+
+
+/// Detach from a shared transaction log, releasing any OFD locks held on
+/// it.
+
+void
+uft_shm_detach (uft_shm * shm)
+{
+  munmap(shm->hdr, shm->hdr->size);
+  close(shm->fd);
+  free(shm);
+}
+
+
+/// Append a record to a shared transaction log. Returns 0 on success or
+/// -1 (with errno set) if the log is sealed or full.
+
+int
+uft_shm_append (uft_shm * shm, int flags, const char * path, const void * meta, size_t meta_len, const char * data, size_t data_len)
+{
+  uft_shm_hdr * hdr = shm->hdr;
+  size_t path_len = strlen(path);
+  size_t meta_off = shm_align(sizeof(uft_shm_rec) + path_len + 1) - sizeof(uft_shm_rec);
+  size_t rec_len = shm_align(sizeof(uft_shm_rec) + meta_off + meta_len + data_len);
+
+  if (__atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE) != UFT_SHM_OPEN) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  uint64_t off = __atomic_fetch_add(&hdr->tail, rec_len, __ATOMIC_ACQ_REL);
+  uft_shm_rec * rec = (uft_shm_rec *) ((char *) hdr + off);
+
+  if (off + rec_len > hdr->size) {
+    // Pad out the remainder so readers can see where the records end.
+    if (off + sizeof(uft_shm_rec) <= hdr->size) {
+      rec->flags   = 0;
+      rec->rec_len = hdr->size - off;
+      __atomic_store_n(&rec->ready, 1, __ATOMIC_RELEASE);
+    }
+    errno = ENOSPC;
+    return -1;
+  }
+
+  rec->flags    = flags;
+  rec->path_len = path_len;
+  rec->meta_len = meta_len;
+  rec->rec_len  = rec_len;
+  rec->data_len = data_len;
+  memcpy(rec->bytes, path, path_len + 1);
+  if (meta_len > 0)
+    memcpy(rec->bytes + meta_off, meta, meta_len);
+  if (data_len > 0)
+    memcpy(rec->bytes + meta_off + meta_len, data, data_len);
+  __atomic_store_n(&rec->ready, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+
+/// Mark the shared transaction as failed.
+
+void
+uft_shm_fail (uft_shm * shm)
+{
+  __atomic_store_n(&shm->hdr->failed, 1, __ATOMIC_RELEASE);
+}
+
+
+/// Return true if any process has marked the shared transaction failed.
+
+int
+uft_shm_failed (uft_shm * shm)
+{
+  return __atomic_load_n(&shm->hdr->failed, __ATOMIC_ACQUIRE) != 0;
+}
+
+
+/// Seal a shared transaction log (owner only), so no more processes may
+/// attach and nothing more may be appended, then wait for every attached
+/// participant to detach (or die).
+
+void
+uft_shm_seal (uft_shm * shm)
+{
+  __atomic_store_n(&shm->hdr->state, UFT_SHM_SEALED, __ATOMIC_RELEASE);
+
+  while (shm_lock(shm->fd, F_OFD_SETLKW, F_WRLCK, 0) != 0 && errno == EINTR)
+    ;
+  shm_lock(shm->fd, F_OFD_SETLK, F_UNLCK, 0);
+}
+
+
+/// Return the record after 'rec' (the first record if 'rec' is NULL), or
+/// NULL if there are no more. A record that is not ready (its writer
+/// died part way through) is returned, but nothing after it is, as its
+/// length cannot be trusted. Padding records are skipped.
+
+uft_shm_rec *
+uft_shm_next (uft_shm * shm, uft_shm_rec * rec)
+{
+  uft_shm_hdr * hdr = shm->hdr;
+  uint64_t end = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+  uint64_t off;
+
+  if (end > hdr->size)
+    end = hdr->size;
+
+  if (rec == NULL) {
+    off = sizeof(uft_shm_hdr);
+  } else {
+    if (!__atomic_load_n(&rec->ready, __ATOMIC_ACQUIRE))
+      return NULL;
+    off = (char *) rec - (char *) hdr + rec->rec_len;
+  }
+
+  for (;;) {
+    if (off + sizeof(uft_shm_rec) > end)
+      return NULL;
+    rec = (uft_shm_rec *) ((char *) hdr + off);
+    if (!__atomic_load_n(&rec->ready, __ATOMIC_ACQUIRE) || rec->flags != 0)
+      return rec;
+    off += rec->rec_len;
+  }
+}
+
+
+/// Return the path (or error message) of a record.
+
+char *
+uft_shm_rec_path (uft_shm_rec * rec)
+{
+  return rec->bytes;
+}
+
+
+/// Return the metadata of a record.
+
+void *
+uft_shm_rec_meta (uft_shm_rec * rec)
+{
+  return rec->bytes + shm_align(sizeof(uft_shm_rec) + rec->path_len + 1) - sizeof(uft_shm_rec);
+}
+
+
+/// Return the data of a record.
+
+char *
+uft_shm_rec_data (uft_shm_rec * rec)
+{
+  return (char *) uft_shm_rec_meta(rec) + rec->meta_len;
+}
+
+
+/// Set or clear an OFD lock on one byte of the log.
+
+static int
+shm_lock (int fd, int cmd, short type, off_t start)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type   = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start  = start;
+  fl.l_len    = 1;
+
+  return fcntl(fd, cmd, &fl);
+}
+
+
+/// Round a length up to keep what follows it aligned.
+
+static size_t
+shm_align (size_t len)
+{
+  return (len + SHM_REC_ALIGN - 1) & ~(size_t) (SHM_REC_ALIGN - 1);
+}
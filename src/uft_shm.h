@@ -0,0 +1,72 @@
+/// libuft shared transaction log
+
+#ifndef UFT_SHM_INCLUDED
+#define UFT_SHM_INCLUDED
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define UFT_SHM_MAGIC   0x75667473
+#define UFT_SHM_VERSION 1
+
+#define UFT_SHM_OPEN    0
+#define UFT_SHM_SEALED  1
+
+#define UFT_SHM_REC_ERROR 0x80000000
+
+
+/// The header at the start of a shared transaction log. Records follow
+/// it, 'tail' being the offset at which the next record will be put.
+typedef struct uft_shm_hdr_st
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t  tx_id;
+  int32_t  owner_pid;
+  uint64_t size;
+  uint64_t tail;
+  uint32_t state;
+  uint32_t failed;
+} uft_shm_hdr;
+
+/// A record in a shared transaction log; an entity state (flags are the
+/// entity state flags) or an error message (UFT_SHM_REC_ERROR is set and
+/// the message is the path). The path is followed by 'meta_len' bytes of
+/// metadata (aligned) and then by 'data_len' bytes of data. 'ready' is
+/// set last, once the record is completely written.
+typedef struct uft_shm_rec_st
+{
+  uint32_t ready;
+  uint32_t flags;
+  uint32_t path_len;
+  uint32_t meta_len;
+  uint64_t rec_len;
+  uint64_t data_len;
+  char     bytes[];
+} uft_shm_rec;
+
+/// A processes view of a shared transaction log.
+typedef struct uft_shm_st
+{
+  int           fd;
+  int           owner;
+  uft_shm_hdr * hdr;
+} uft_shm;
+
+
+extern uft_shm *     uft_shm_create (int tx_id, size_t size);
+extern uft_shm *     uft_shm_attach (int fd, int tx_id);
+extern void          uft_shm_detach (uft_shm * shm);
+extern int           uft_shm_append (uft_shm * shm, int flags, const char * path, const void * meta, size_t meta_len, const char * data, size_t data_len);
+extern void          uft_shm_fail (uft_shm * shm);
+extern int           uft_shm_failed (uft_shm * shm);
+extern void          uft_shm_seal (uft_shm * shm);
+extern uft_shm_rec * uft_shm_next (uft_shm * shm, uft_shm_rec * rec);
+extern char *        uft_shm_rec_path (uft_shm_rec * rec);
+extern void *        uft_shm_rec_meta (uft_shm_rec * rec);
+extern char *        uft_shm_rec_data (uft_shm_rec * rec);
+
+
+#endif // UFT_SHM_INCLUDED
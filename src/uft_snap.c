@@ -0,0 +1,247 @@
+/// libuft snapshot cache
+///
+/// An optional process wide cache of the captured data of regular files,
+/// so a file enrolled by transaction after transaction, and not changed
+/// in between, is read once rather than every time. Snapshots are found
+/// by device and inode and are only used while the files size,
+/// modification time and change time are all as they were when it was
+/// read; one found not to be is dropped. The cache is bounded by memory
+/// (see 'uft_snap_cache'), the least recently used snapshots being
+/// dropped to stay within it, and is disabled (bounded to nothing) until
+/// a bound is set.
+///
+/// A file is only cached if its change time is before its capture began
+/// (by the coarse clock the kernel stamps files with), so that a change
+/// made while it was being read, or so soon before that the change time
+/// did not move, is never mistaken for the captured content.
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "uft.h"
+#include "uft_ht.h"
+#include "uft_ll.h"
+#include "uft_tx.h"
+#include "uft_snap.h"
+
+
+/// The part of a key snapshots are found by.
+#define SNAP_ID_LEN offsetof(uft_snap_key, size)
+
+
+static pthread_mutex_t snap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uft_ht *        snap_ht    = NULL;
+static uft_ll *        snap_lru   = NULL;
+static size_t          snap_cost  = 0;
+static size_t          snap_max   = 0;
+
+
+static void snap_key (uft_snap_key * key, struct stat * statbufp);
+static void snap_drop (uft_snap * snap);
+static void snap_trim (void);
+
+
+/// Set the most memory the snapshot cache may use, dropping the least
+/// recently used snapshots if it is now over, returning the previous
+/// maximum. The cache is disabled (and emptied) by a maximum of 0, which
+/// is the default.
+
+size_t
+uft_snap_cache (size_t max)
+{
+  pthread_mutex_lock(&snap_mutex);
+  size_t old_max = snap_max;
+  __atomic_store_n(&snap_max, max, __ATOMIC_RELAXED);
+  snap_trim();
+  pthread_mutex_unlock(&snap_mutex);
+
+  return old_max;
+}
+
+
+/// Return true if the snapshot cache is enabled.
+
+int
+uft_snap_enabled (void)
+{
+  return __atomic_load_n(&snap_max, __ATOMIC_RELAXED) > 0;
+}
+
+
+/// Return the time, in nanoseconds, by the clock files are stamped with,
+/// to be taken before a file is captured and passed to 'uft_snap_put'.
+
+uint64_t
+uft_snap_clock (void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/// Return a reference to the cached snapshot of the file 'statbufp' is
+/// the status of, or NULL if there is none, or the file has changed
+/// since (in which case the snapshot is dropped).
+
+uft_snap *
+uft_snap_get (struct stat * statbufp)
+{
+  uft_snap_key key;
+  uft_snap * snap = NULL;
+
+  if (!uft_snap_enabled())
+    return NULL;
+  snap_key(&key, statbufp);
+
+  pthread_mutex_lock(&snap_mutex);
+  if (snap_ht != NULL)
+    snap = uft_ht_get(snap_ht, &key, SNAP_ID_LEN);
+  if (snap != NULL && memcmp(&snap->key, &key, sizeof(key)) != 0) {
+    snap_drop(snap);
+    snap = NULL;
+  }
+  if (snap != NULL) {
+    snap->lru = uft_ll_move_tail(snap_lru, snap->lru);
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&snap_mutex);
+
+  return snap;
+}
+
+
+/// Cache a snapshot of the data just captured in to 'ent_state' from the
+/// regular file open as 'fd', 'statbufp' being its status before it was
+/// read and 'captured' the time (see 'uft_snap_clock') reading began,
+/// replacing any snapshot of it already cached. Nothing is cached if the
+/// file changed (or may have) while it was read, if the data was spooled
+/// rather than held in memory, or if it alone would not fit.
+
+void
+uft_snap_put (struct stat * statbufp, int fd, uint64_t captured, uft_ent_state * ent_state)
+{
+  struct stat after;
+  uft_snap_key key;
+  uft_snap_key after_key;
+
+  if (!uft_snap_enabled() || ent_state->spool_fd >= 0)
+    return;
+  if ((uint64_t) statbufp->st_ctim.tv_sec * 1000000000 + statbufp->st_ctim.tv_nsec >= captured)
+    return;
+  snap_key(&key, statbufp);
+  if (fstat(fd, &after) != 0)
+    return;
+  snap_key(&after_key, &after);
+  if (memcmp(&key, &after_key, sizeof(key)) != 0)
+    return;
+
+  size_t extents_len = sizeof(uft_extent) * ent_state->extent_count;
+  size_t cost = sizeof(uft_snap) + ent_state->data_len + extents_len;
+  if (cost > __atomic_load_n(&snap_max, __ATOMIC_RELAXED))
+    return;
+
+  uft_snap * snap = (uft_snap *) malloc(sizeof(uft_snap));
+  if (snap == NULL)
+    return;
+  snap->data = (char *) malloc(ent_state->data_len > 0 ? ent_state->data_len : 1);
+  snap->extents = (uft_extent *) malloc(extents_len > 0 ? extents_len : 1);
+  if (snap->data == NULL || snap->extents == NULL) {
+    free(snap->data);
+    free(snap->extents);
+    free(snap);
+    return;
+  }
+  memcpy(&snap->key, &key, sizeof(key));
+  memcpy(snap->data, ent_state->data, ent_state->data_len);
+  memcpy(snap->extents, ent_state->extents, extents_len);
+  snap->refs         = 1;
+  snap->data_len     = ent_state->data_len;
+  snap->extent_count = ent_state->extent_count;
+  snap->cost         = cost;
+
+  pthread_mutex_lock(&snap_mutex);
+  if (snap_ht == NULL && (snap_ht = uft_ht_create()) != NULL && (snap_lru = uft_ll_create()) == NULL) {
+    uft_ht_rm(snap_ht);
+    snap_ht = NULL;
+  }
+  uft_snap * old_snap = snap_ht != NULL ? uft_ht_get(snap_ht, &key, SNAP_ID_LEN) : NULL;
+  if (old_snap != NULL)
+    snap_drop(old_snap);
+  if (snap_ht == NULL || (snap->lru = uft_ll_insert_tail(snap_lru, snap)) == NULL) {
+    pthread_mutex_unlock(&snap_mutex);
+    uft_snap_unref(snap);
+    return;
+  }
+  if (uft_ht_put(snap_ht, &snap->key, SNAP_ID_LEN, snap) != 0) {
+    uft_ll_rmnode(snap->lru);
+    pthread_mutex_unlock(&snap_mutex);
+    uft_snap_unref(snap);
+    return;
+  }
+  snap_cost += cost;
+  snap_trim();
+  pthread_mutex_unlock(&snap_mutex);
+}
+
+
+/// Release a reference to a snapshot, freeing it when there are no more
+/// references.
+
+void
+uft_snap_unref (uft_snap * snap)
+{
+  if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(snap->data);
+    free(snap->extents);
+    free(snap);
+  }
+}
+
+
+/// Fill in a snapshot key from a files status.
+
+static void
+snap_key (uft_snap_key * key, struct stat * statbufp)
+{
+  memset(key, 0, sizeof(uft_snap_key));
+  key->dev   = statbufp->st_dev;
+  key->ino   = statbufp->st_ino;
+  key->size  = statbufp->st_size;
+  key->mtime = statbufp->st_mtim;
+  key->ctime = statbufp->st_ctim;
+}
+
+
+/// Drop a snapshot from the cache, releasing the caches reference. The
+/// caller holds the cache mutex.
+
+static void
+snap_drop (uft_snap * snap)
+{
+  uft_ht_del(snap_ht, &snap->key, SNAP_ID_LEN);
+  uft_ll_rmnode(snap->lru);
+  snap_cost -= snap->cost;
+  uft_snap_unref(snap);
+}
+
+
+/// Drop the least recently used snapshots until the cache is within its
+/// maximum. The caller holds the cache mutex.
+
+static void
+snap_trim (void)
+{
+  uft_ll_node * lln;
+
+  while (snap_cost > snap_max && (lln = uft_ll_head(snap_lru)) != NULL)
+    snap_drop(uft_ll_data(lln));
+}
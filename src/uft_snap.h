@@ -0,0 +1,49 @@
+/// libuft snapshot cache
+
+#ifndef UFT_SNAP_INCLUDED
+#define UFT_SNAP_INCLUDED
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include "uft_ll.h"
+#include "uft_tx.h"
+
+
+/// The key of a cached snapshot; the identity of the file and what
+/// changes whenever its content does.
+typedef struct uft_snap_key_st
+{
+  dev_t           dev;
+  ino_t           ino;
+  off_t           size;
+  struct timespec mtime;
+  struct timespec ctime;
+} uft_snap_key;
+
+/// An immutable, reference counted snapshot of the data of a regular
+/// file (its extents and their data, as captured in to an entity state),
+/// shared by every entity state of that file while it is unchanged.
+typedef struct uft_snap_st
+{
+  uft_snap_key  key;
+  int           refs;
+  char *        data;
+  off_t         data_len;
+  uft_extent *  extents;
+  int           extent_count;
+  size_t        cost;
+  uft_ll_node * lru;
+} uft_snap;
+
+
+extern int        uft_snap_enabled (void);
+extern uint64_t   uft_snap_clock (void);
+extern uft_snap * uft_snap_get (struct stat * statbufp);
+extern void       uft_snap_put (struct stat * statbufp, int fd, uint64_t captured, uft_ent_state * ent_state);
+extern void       uft_snap_unref (uft_snap * snap);
+
+
+#endif // UFT_SNAP_INCLUDED
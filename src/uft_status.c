@@ -23,7 +23,17 @@ uft_status_success (uft_status * status)
 int
 uft_status_error (uft_status * status)
 {
-  return status->code == UFT_STATUS_ERROR;
+  return (status->code & UFT_STATUS_ERROR) != 0;
+}
+
+
+/// Return true if the status condition is error because something was
+/// busy (locked by another transaction), so trying again may succeed.
+
+int
+uft_status_busy (uft_status * status)
+{
+  return (status->code & UFT_STATUS_BUSY) != 0;
 }
 
 
@@ -44,7 +54,7 @@ uft_status_set_success (uft_status * status, void * data)
 uft_status *
 uft_status_set_error(uft_status * status, const char * fmt, ...)
 {
-  static char msg[UFT_MAX_MSG_LEN];
+  static __thread char msg[UFT_MAX_MSG_LEN];
 
   va_list args;
   va_start(args, fmt);
@@ -4,9 +4,13 @@
 #ifndef UFT_STATUS_INCLUDED
 #define UFT_STATUS_INCLUDED
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define UFT_STATUS_SUCCESS 0x0001
 #define UFT_STATUS_ERROR   0x0002
+#define UFT_STATUS_BUSY    0x0004
 
 
 typedef struct uft_status_st {
@@ -18,10 +22,14 @@ typedef struct uft_status_st {
 
 extern int          uft_status_success (uft_status * status);
 extern int          uft_status_error (uft_status * status);
+extern int          uft_status_busy (uft_status * status);
 extern uft_status * uft_status_set_success (uft_status * status, void * data);
 extern uft_status * uft_status_set_error (uft_status * status, const char * fmt, ...);
 extern void *       uft_status_data (uft_status * status);
 extern char *       uft_status_error_msg (uft_status * status);
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif // UFT_STATUS_INCLUDED
@@ -0,0 +1,241 @@
+/// libuft trace recording
+///
+/// When tracing is on (see 'uft_trace_start', or set UFT_TRACE to a file
+/// path in the environment) every API call is appended to a compact
+/// binary trace (the format is described in uft_trace.h), which the
+/// uft-replay tool can run again. Records are encoded in to one buffer,
+/// under a mutex, and written out when it fills or tracing stops. When
+/// tracing is off, the cost to each call is one test of 'uft_trace_on'.
+
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include "uft.h"
+#include "uft_dir.h"
+#include "uft_metrics.h"
+#include "uft_trace.h"
+
+
+#define TRACE_BUF_LEN   65536
+#define TRACE_REC_MAX   (1 + 6 * 10 + 2 * (5 + PATH_MAX))
+
+
+int uft_trace_on = 0;
+
+static pthread_mutex_t trace_mutex       = PTHREAD_MUTEX_INITIALIZER;
+static int             trace_fd          = -1;
+static uint64_t        trace_last        = 0;
+static int             trace_next_thread = 0;
+static size_t          trace_len         = 0;
+static unsigned char   trace_buf[TRACE_BUF_LEN + TRACE_REC_MAX];
+
+static __thread int    trace_thread      = 0;
+
+
+static int             trace_flush (void);
+static unsigned char * trace_put (unsigned char * p, uint64_t value);
+static unsigned char * trace_put_path (unsigned char * p, const char * path);
+static void            trace_start_env (void) __attribute__ ((constructor));
+static void            trace_stop_env (void);
+
+
+/// Start tracing every call to 'path' (which is created or truncated).
+/// Returns 0 on success, or -1 (with errno set) on failure, or with
+/// errno EBUSY if tracing is already on.
+
+int
+uft_trace_start (const char * path)
+{
+  char cwd[PATH_MAX];
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_fd >= 0) {
+    pthread_mutex_unlock(&trace_mutex);
+    close(fd);
+    errno = EBUSY;
+    return -1;
+  }
+  trace_fd   = fd;
+  trace_last = uft_metrics_now();
+  memcpy(trace_buf, UFT_TRACE_MAGIC, 8);
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    cwd[0] = '\0';
+  trace_len  = trace_put_path(trace_buf + 8, cwd) - trace_buf;
+  __atomic_store_n(&uft_trace_on, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_mutex);
+
+  return 0;
+}
+
+
+/// Stop tracing, writing out the rest of the trace. Returns 0 on success,
+/// or -1 (with errno set) if the trace could not be written (or tracing
+/// was not on).
+
+int
+uft_trace_stop (void)
+{
+  int result = 0;
+
+  pthread_mutex_lock(&trace_mutex);
+  __atomic_store_n(&uft_trace_on, 0, __ATOMIC_RELEASE);
+  if (trace_fd < 0) {
+    pthread_mutex_unlock(&trace_mutex);
+    errno = EINVAL;
+    return -1;
+  }
+  if (trace_flush() != 0 || close(trace_fd) != 0)
+    result = -1;
+  trace_fd = -1;
+  pthread_mutex_unlock(&trace_mutex);
+
+  return result;
+}
+
+
+/// Record a call with no path.
+
+void
+uft_trace_tx (int op, int tx_id, uint64_t a, uint64_t b)
+{
+  uft_trace_call(op, tx_id, a, b, 0, NULL, NULL);
+}
+
+
+/// Record a call of 'op' by transaction 'tx_id', with arguments 'a', 'b'
+/// and 'c' and up to two paths (see uft_trace.h). Errors writing the
+/// trace out stop tracing.
+
+void
+uft_trace_call (int op, int tx_id, uint64_t a, uint64_t b, uint64_t c, const char * path, const char * path2)
+{
+  if (trace_thread == 0)
+    trace_thread = __atomic_add_fetch(&trace_next_thread, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_fd < 0) {
+    pthread_mutex_unlock(&trace_mutex);
+    return;
+  }
+
+  uint64_t now = uft_metrics_now();
+  unsigned char * p = trace_buf + trace_len;
+  *p++ = op;
+  p = trace_put(p, trace_thread);
+  p = trace_put(p, now - trace_last);
+  p = trace_put(p, tx_id);
+  p = trace_put(p, a);
+  p = trace_put(p, b);
+  p = trace_put(p, c);
+  if (path != NULL)
+    p = trace_put_path(p, path);
+  if (path2 != NULL)
+    p = trace_put_path(p, path2);
+  trace_len = p - trace_buf;
+  trace_last = now;
+
+  if (trace_len >= TRACE_BUF_LEN && trace_flush() != 0) {
+    __atomic_store_n(&uft_trace_on, 0, __ATOMIC_RELEASE);
+    close(trace_fd);
+    trace_fd = -1;
+  }
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+
+/// Record a call on the file open as 'fd', by its path.
+
+void
+uft_trace_fd_call (int op, int tx_id, uint64_t a, uint64_t b, int fd)
+{
+  char path[PATH_MAX];
+
+  uft_fd_path(fd, path, sizeof(path));
+  uft_trace_call(op, tx_id, a, b, 0, path, NULL);
+}
+
+
+/// Write out the buffered records. Called with 'trace_mutex' held.
+/// Returns 0 on success or -1 (with errno set).
+
+static int
+trace_flush (void)
+{
+  size_t done = 0;
+
+  while (done < trace_len) {
+    ssize_t result = write(trace_fd, trace_buf + done, trace_len - done);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += result;
+  }
+  trace_len = 0;
+
+  return 0;
+}
+
+
+/// Encode 'value' as an unsigned LEB128 varint at 'p', returning the
+/// position after it.
+
+static unsigned char *
+trace_put (unsigned char * p, uint64_t value)
+{
+  while (value >= 0x80) {
+    *p++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+
+  return p;
+}
+
+
+/// Encode a path (its length then its bytes) at 'p', returning the
+/// position after it.
+
+static unsigned char *
+trace_put_path (unsigned char * p, const char * path)
+{
+  size_t len = strnlen(path, PATH_MAX);
+
+  p = trace_put(p, len);
+  memcpy(p, path, len);
+
+  return p + len;
+}
+
+
+/// Start tracing if UFT_TRACE is set, when the library is loaded, and
+/// finish the trace when the process exits.
+
+static void
+trace_start_env (void)
+{
+  const char * path = getenv("UFT_TRACE");
+
+  if (path != NULL && path[0] != '\0' && uft_trace_start(path) == 0)
+    atexit(trace_stop_env);
+}
+
+
+static void
+trace_stop_env (void)
+{
+  if (trace_fd >= 0)
+    uft_trace_stop();
+}
@@ -0,0 +1,53 @@
+/// libuft trace recording
+///
+/// A trace starts with the 8 byte magic UFT_TRACE_MAGIC and the working
+/// directory of the process (encoded as a path, see below), then holds
+/// one record per call. A record is an op byte followed by unsigned LEB128
+/// varints: the recording thread, the nanoseconds since the previous
+/// record, the transaction ID and three op specific arguments (a, b and
+/// c, see below), then the ops paths (none, one, or for a rename two),
+/// each a varint length and the bytes of the path.
+
+#ifndef UFT_TRACE_INCLUDED
+#define UFT_TRACE_INCLUDED
+
+
+#include <stdint.h>
+
+
+#define UFT_TRACE_MAGIC "uft-trc1"
+
+#define UFT_TRACE_NEW     1  // uft_tx_new
+#define UFT_TRACE_CHILD   2  // uft_tx_child; a: parent ID
+#define UFT_TRACE_BEGIN   3  // uft_tx_begin (or a worker running uft_tx_begin_async)
+#define UFT_TRACE_DONE    4  // uft_tx_begin returning; a: code, b: nanoseconds taken
+#define UFT_TRACE_SUCCESS 5  // uft_tx_success
+#define UFT_TRACE_FAIL    6  // uft_tx_fail
+#define UFT_TRACE_RESET   7  // uft_tx_reset; a: new ID
+#define UFT_TRACE_END     8  // uft_tx_end
+#define UFT_TRACE_ADD_ENT 9  // uft_tx_add_ent(_at); a: flags, b: kind, c: size + 1; path
+#define UFT_TRACE_ADD_FD  10 // uft_tx_add_fd; b: kind, c: size + 1; path
+#define UFT_TRACE_MKDIR   11 // uft_mkdir; a: mode; path
+#define UFT_TRACE_OPEN    12 // uft_open; a: flags, b: mode; path
+#define UFT_TRACE_READ    13 // uft_read; a: length; path
+#define UFT_TRACE_WRITE   14 // uft_write; a: length, b: offset; path
+#define UFT_TRACE_UNLINK  15 // uft_unlink; path
+#define UFT_TRACE_RMTREE  16 // uft_rmtree; path
+#define UFT_TRACE_RENAME  17 // uft_rename; old path, new path
+
+/// What an enrolled entity was ('b' of UFT_TRACE_ADD_ENT and ADD_FD);
+/// zero if it could not be enrolled.
+#define UFT_TRACE_KIND_NOENT   1
+#define UFT_TRACE_KIND_FILE    2
+#define UFT_TRACE_KIND_SYMLINK 3
+#define UFT_TRACE_KIND_DIR     4 // added with UFT_META_ONLY
+
+
+extern int uft_trace_on;
+
+extern void uft_trace_tx (int op, int tx_id, uint64_t a, uint64_t b);
+extern void uft_trace_call (int op, int tx_id, uint64_t a, uint64_t b, uint64_t c, const char * path, const char * path2);
+extern void uft_trace_fd_call (int op, int tx_id, uint64_t a, uint64_t b, int fd);
+
+
+#endif // UFT_TRACE_INCLUDED
@@ -0,0 +1,467 @@
+/// libuft path trie
+///
+/// Paths are split in to components (empty and "." components are
+/// skipped, and an absolute path starts with a "/" component), each
+/// interned in the tries table of components so that they are compared
+/// by pointer. Looking a path up is one index lookup per node passed,
+/// O(depth). A path with a component the trie has never seen can not be
+/// in it, which is found out without touching the index.
+
+
+#include <limits.h>
+#include <malloc.h>
+#include <string.h>
+
+#include "uft_ht.h"
+#include "uft_trie.h"
+
+
+#define TRIE_MAX_DEPTH  (PATH_MAX / 2)
+#define TRIE_ATOMS_KEEP 4096
+
+
+static int             trie_split (uft_trie * trie, const char * path, const char ** atoms, int intern, int * completep);
+static uft_trie_node * trie_find (uft_trie * trie, const char ** atoms, int count, int * matchedp, int * label_offp);
+static uft_trie_node * trie_node_alloc (uft_trie * trie, int label_len);
+static uft_trie_node * trie_node_new (uft_trie * trie, uft_trie_node * parent, const char ** label, int label_len);
+static int             trie_node_split (uft_trie * trie, uft_trie_node * node, int off);
+static void            trie_free_atom (const void * key, int keylen, void * data, void * arg);
+
+
+/// Create a path trie.
+
+uft_trie *
+uft_trie_create ()
+{
+  uft_trie * trie = (uft_trie *) calloc(1, sizeof(uft_trie));
+
+  if (trie == NULL)
+    return NULL;
+
+  trie->atoms = uft_ht_create();
+  trie->index = uft_ht_create();
+  if (trie->atoms == NULL || trie->index == NULL) {
+    if (trie->atoms != NULL)
+      uft_ht_rm(trie->atoms);
+    if (trie->index != NULL)
+      uft_ht_rm(trie->index);
+    free(trie);
+    return NULL;
+  }
+
+  return trie;
+}
+
+
+/// Return the data stored against 'path', or NULL if there is none.
+
+void *
+uft_trie_get (uft_trie * trie, const char * path)
+{
+  const char * atoms[TRIE_MAX_DEPTH];
+  int complete, matched, label_off;
+
+  int count = trie_split(trie, path, atoms, 0, &complete);
+  if (!complete)
+    return NULL;
+
+  uft_trie_node * node = trie_find(trie, atoms, count, &matched, &label_off);
+
+  return matched == count && label_off == node->label_len ? node->data : NULL;
+}
+
+
+/// Store 'data' against 'path', replacing any data already stored
+/// against it. Returns zero on success, or -1 if memory could not be
+/// allocated (or the path is too deep).
+
+int
+uft_trie_put (uft_trie * trie, const char * path, void * data)
+{
+  const char * atoms[TRIE_MAX_DEPTH];
+  int complete, matched, label_off;
+
+  int count = trie_split(trie, path, atoms, 1, &complete);
+  if (!complete)
+    return -1;
+
+  uft_trie_node * node = trie_find(trie, atoms, count, &matched, &label_off);
+  if (label_off < node->label_len) {
+    if (trie_node_split(trie, node, label_off) != 0)
+      return -1;
+    node = node->key.parent;
+  }
+  if (matched < count) {
+    node = trie_node_new(trie, node, atoms + matched, count - matched);
+    if (node == NULL)
+      return -1;
+  }
+
+  if (node->data == NULL)
+    trie->count++;
+  node->data = data;
+
+  return 0;
+}
+
+
+/// Call 'fp' for the data stored against 'path' and against each of its
+/// ancestors, the shallowest first, passing the data, the depth (the
+/// number of components of the path it is stored against) and 'arg',
+/// until it returns something other than NULL, which is returned.
+
+void *
+uft_trie_each_prefix (uft_trie * trie, const char * path, void * (*fp)(void *, int, void *), void * arg)
+{
+  const char * atoms[TRIE_MAX_DEPTH];
+  int complete;
+  int depth = 0;
+
+  int count = trie_split(trie, path, atoms, 0, &complete);
+  uft_trie_node * node = &trie->root;
+
+  if (node->data != NULL) {
+    void * result = fp(node->data, 0, arg);
+    if (result != NULL)
+      return result;
+  }
+  while (depth < count) {
+    struct { uft_trie_node * parent; const char * first; } key = { node, atoms[depth] };
+    node = uft_ht_get(trie->index, &key, sizeof(key));
+    if (node == NULL || node->label_len > count - depth)
+      return NULL;
+    for (int i = 1; i < node->label_len; i++)
+      if (node->label[i] != atoms[depth + i])
+        return NULL;
+    depth += node->label_len;
+    if (node->data != NULL) {
+      void * result = fp(node->data, depth, arg);
+      if (result != NULL)
+        return result;
+    }
+  }
+
+  return NULL;
+}
+
+
+/// Call 'fp' for the data stored against 'path' and everything under
+/// it, passing the data and 'arg', parents before children or (if
+/// 'post') children before parents. 'fp' must not modify the trie.
+/// Returns the number of calls made.
+
+int
+uft_trie_each_under (uft_trie * trie, const char * path, int post, void (*fp)(void *, void *), void * arg)
+{
+  const char * atoms[TRIE_MAX_DEPTH];
+  int complete, matched, label_off;
+  int calls = 0;
+
+  int count = trie_split(trie, path, atoms, 0, &complete);
+  if (!complete)
+    return 0;
+  uft_trie_node * top = trie_find(trie, atoms, count, &matched, &label_off);
+  if (matched < count)
+    return 0;
+
+  // Walk the subtree without a stack, by the parent and sibling links.
+  uft_trie_node * node = top;
+  if (post)
+    while (node->child != NULL)
+      node = node->child;
+  for (;;) {
+    if (post) {
+      if (node->data != NULL) {
+        fp(node->data, arg);
+        calls++;
+      }
+      if (node == top)
+        break;
+      if (node->sibling != NULL) {
+        node = node->sibling;
+        while (node->child != NULL)
+          node = node->child;
+      } else {
+        node = node->key.parent;
+      }
+    } else {
+      if (node->data != NULL) {
+        fp(node->data, arg);
+        calls++;
+      }
+      if (node->child != NULL) {
+        node = node->child;
+        continue;
+      }
+      while (node != top && node->sibling == NULL)
+        node = node->key.parent;
+      if (node == top)
+        break;
+      node = node->sibling;
+    }
+  }
+
+  return calls;
+}
+
+
+/// Return the number of paths with data stored against them.
+
+int
+uft_trie_count (uft_trie * trie)
+{
+  return trie->count;
+}
+
+
+/// Remove every path from the trie, keeping the nodes (and, unless
+/// there are very many, the interned components) for reuse.
+
+void
+uft_trie_clear (uft_trie * trie)
+{
+  uft_trie_node * node = trie->root.child;
+
+  while (node != NULL) {
+    if (node->child != NULL) {
+      node = node->child;
+      continue;
+    }
+    uft_trie_node * parent = node->key.parent;
+    parent->child = node->sibling;
+    node->sibling = trie->spare;
+    trie->spare = node;
+    node = parent != &trie->root ? parent : parent->child;
+  }
+  trie->root.data = NULL;
+  trie->count = 0;
+  uft_ht_clear(trie->index);
+
+  if (uft_ht_count(trie->atoms) > TRIE_ATOMS_KEEP) {
+    uft_ht_each(trie->atoms, trie_free_atom, NULL);
+    uft_ht_clear(trie->atoms);
+  }
+}
+
+
+/// Delete an entire trie.
+
+void
+uft_trie_rm (uft_trie * trie)
+{
+  uft_trie_clear(trie);
+  while (trie->spare != NULL) {
+    uft_trie_node * next = trie->spare->sibling;
+    free(trie->spare->label);
+    free(trie->spare);
+    trie->spare = next;
+  }
+  uft_ht_each(trie->atoms, trie_free_atom, NULL);
+  uft_ht_rm(trie->atoms);
+  uft_ht_rm(trie->index);
+  free(trie);
+}
+
+
+/// Split 'path' in to interned components, in 'atoms', returning how
+/// many there are. Components not yet interned are interned if 'intern'
+/// is true, otherwise the path stops short of the first of them. Sets
+/// '*completep' false if the path was stopped short (or is too deep, or
+/// memory could not be allocated).
+
+static int
+trie_split (uft_trie * trie, const char * path, const char ** atoms, int intern, int * completep)
+{
+  int count = 0;
+  const char * p = path;
+
+  *completep = 1;
+  if (*p == '/') {
+    const char * atom = uft_ht_get(trie->atoms, "/", 1);
+    if (atom == NULL && intern) {
+      atom = strdup("/");
+      if (atom != NULL && uft_ht_put(trie->atoms, atom, 1, (void *) atom) != 0) {
+        free((void *) atom);
+        atom = NULL;
+      }
+    }
+    if (atom == NULL) {
+      *completep = 0;
+      return 0;
+    }
+    atoms[count++] = atom;
+  }
+
+  while (*p != '\0') {
+    while (*p == '/')
+      p++;
+    const char * end = strchrnul(p, '/');
+    int len = end - p;
+    if (len == 0 || (len == 1 && *p == '.')) {
+      p = end;
+      continue;
+    }
+
+    const char * atom = uft_ht_get(trie->atoms, p, len);
+    if (atom == NULL && intern) {
+      atom = strndup(p, len);
+      if (atom != NULL && uft_ht_put(trie->atoms, atom, len, (void *) atom) != 0) {
+        free((void *) atom);
+        atom = NULL;
+      }
+    }
+    if (atom == NULL || count == TRIE_MAX_DEPTH) {
+      *completep = 0;
+      return count;
+    }
+    atoms[count++] = atom;
+    p = end;
+  }
+
+  return count;
+}
+
+
+/// Follow 'atoms' down the trie as far as they go, returning the last
+/// node reached. '*matchedp' is set to the number of components matched
+/// and '*label_offp' to how many components of the returned nodes label
+/// were matched (its whole label unless the path ended or diverged part
+/// way along it).
+
+static uft_trie_node *
+trie_find (uft_trie * trie, const char ** atoms, int count, int * matchedp, int * label_offp)
+{
+  uft_trie_node * node = &trie->root;
+  int matched = 0;
+
+  *label_offp = 0;
+  while (matched < count) {
+    struct { uft_trie_node * parent; const char * first; } key = { node, atoms[matched] };
+    uft_trie_node * child = uft_ht_get(trie->index, &key, sizeof(key));
+    if (child == NULL)
+      break;
+    int off = 1;
+    while (off < child->label_len && matched + off < count && child->label[off] == atoms[matched + off])
+      off++;
+    node = child;
+    matched += off;
+    *label_offp = off;
+    if (off < child->label_len)
+      break;
+  }
+  if (node == &trie->root)
+    *label_offp = 0;
+  *matchedp = matched;
+
+  return node;
+}
+
+
+/// Take a node (from the spare nodes if there are any) with room for a
+/// label of 'label_len' components. Returns NULL if memory could not be
+/// allocated.
+
+static uft_trie_node *
+trie_node_alloc (uft_trie * trie, int label_len)
+{
+  uft_trie_node * node = trie->spare;
+
+  if (node != NULL) {
+    trie->spare = node->sibling;
+  } else {
+    node = (uft_trie_node *) calloc(1, sizeof(uft_trie_node));
+    if (node == NULL)
+      return NULL;
+  }
+  if (node->label_cap < label_len) {
+    const char ** new_label = (const char **) realloc(node->label, label_len * sizeof(const char *));
+    if (new_label == NULL) {
+      node->sibling = trie->spare;
+      trie->spare = node;
+      return NULL;
+    }
+    node->label = new_label;
+    node->label_cap = label_len;
+  }
+  node->child = NULL;
+  node->data  = NULL;
+
+  return node;
+}
+
+
+/// Add a node under 'parent' with the label given. Returns NULL if
+/// memory could not be allocated.
+
+static uft_trie_node *
+trie_node_new (uft_trie * trie, uft_trie_node * parent, const char ** label, int label_len)
+{
+  uft_trie_node * node = trie_node_alloc(trie, label_len);
+
+  if (node == NULL)
+    return NULL;
+
+  memcpy(node->label, label, label_len * sizeof(const char *));
+  node->label_len  = label_len;
+  node->key.parent = parent;
+  node->key.first  = label[0];
+  if (uft_ht_put(trie->index, &node->key, sizeof(node->key), node) != 0) {
+    node->sibling = trie->spare;
+    trie->spare = node;
+    return NULL;
+  }
+  node->sibling    = parent->child;
+  parent->child    = node;
+
+  return node;
+}
+
+
+/// Split a nodes label 'off' components along, putting a new node (with
+/// the first part of the label) between it and its parent. Returns zero
+/// on success or -1 if memory could not be allocated.
+
+static int
+trie_node_split (uft_trie * trie, uft_trie_node * node, int off)
+{
+  uft_trie_node * parent = node->key.parent;
+
+  uft_trie_node * mid = trie_node_alloc(trie, off);
+  if (mid == NULL)
+    return -1;
+  memcpy(mid->label, node->label, off * sizeof(const char *));
+  mid->label_len = off;
+  mid->key = node->key;
+
+  // The new node has the same key as the node it is put above, so it
+  // takes over its index entry without allocating.
+  uft_ht_put(trie->index, &mid->key, sizeof(mid->key), mid);
+  node->key.parent = mid;
+  node->key.first  = node->label[off];
+  if (uft_ht_put(trie->index, &node->key, sizeof(node->key), node) != 0) {
+    node->key = mid->key;
+    uft_ht_put(trie->index, &node->key, sizeof(node->key), node);
+    mid->sibling = trie->spare;
+    trie->spare = mid;
+    return -1;
+  }
+
+  uft_trie_node ** nodep;
+  for (nodep = &parent->child; *nodep != node; nodep = &(*nodep)->sibling)
+    ;
+  *nodep = mid;
+  mid->sibling = node->sibling;
+  mid->child = node;
+  node->sibling = NULL;
+  memmove(node->label, node->label + off, (node->label_len - off) * sizeof(const char *));
+  node->label_len -= off;
+
+  return 0;
+}
+
+
+static void
+trie_free_atom (const void * key, int keylen, void * data, void * arg)
+{
+  free(data);
+}
@@ -0,0 +1,53 @@
+/// libuft path trie
+
+#ifndef UFT_TRIE_INCLUDED
+#define UFT_TRIE_INCLUDED
+
+
+struct uft_ht_st;
+struct uft_trie_node_st;
+
+/// A node in a path trie. Its label is a run of (interned) path
+/// components, a chain of nodes with one child each being compressed in
+/// to one. The parent and the first component of the label are the
+/// nodes key in the tries index.
+typedef struct uft_trie_node_st
+{
+  struct
+  {
+    struct uft_trie_node_st * parent;
+    const char *              first;
+  }                         key;
+  const char **             label;
+  int                       label_len;
+  int                       label_cap;
+  struct uft_trie_node_st * child;
+  struct uft_trie_node_st * sibling;
+  void *                    data;
+} uft_trie_node;
+
+/// A path trie. Path components are interned, so labels are compared by
+/// pointer, and each child is found by one hash table lookup on its
+/// parent and first component. Nodes and interned components removed by
+/// 'uft_trie_clear' are kept for reuse rather than freed.
+typedef struct uft_trie_st
+{
+  uft_trie_node             root;
+  struct uft_ht_st *        atoms;
+  struct uft_ht_st *        index;
+  struct uft_trie_node_st * spare;
+  int                       count;
+} uft_trie;
+
+
+extern uft_trie * uft_trie_create ();
+extern void *     uft_trie_get (uft_trie * trie, const char * path);
+extern int        uft_trie_put (uft_trie * trie, const char * path, void * data);
+extern void *     uft_trie_each_prefix (uft_trie * trie, const char * path, void * (*fp)(void *, int, void *), void * arg);
+extern int        uft_trie_each_under (uft_trie * trie, const char * path, int post, void (*fp)(void *, void *), void * arg);
+extern int        uft_trie_count (uft_trie * trie);
+extern void       uft_trie_clear (uft_trie * trie);
+extern void       uft_trie_rm (uft_trie * trie);
+
+
+#endif // UFT_TRIE_INCLUDED
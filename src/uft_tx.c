@@ -3,11 +3,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 #include <malloc.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "uft.h"
@@ -15,55 +19,259 @@
 #include "config.h"
 #include "uft_status.h"
 #include "uft_ll.h"
+#include "uft_lock.h"
+#include "uft_io.h"
+#include "uft_rm.h"
+#include "uft_async.h"
+#include "uft_group.h"
+#include "uft_metrics.h"
+#include "uft_trace.h"
+#include "uft_walk.h"
+#include "uft_snap.h"
+
+
+/// Something in the trash, to be removed.
+typedef struct trash_item_st
+{
+  uft_dir * dir;
+  char      path[];
+} trash_item;
+
+/// What a walk adding entities (see 'tx_add_walk') is passed: the
+/// transaction and the flags to add with.
+typedef struct tx_walk_st
+{
+  uft_tx * tx;
+  int      flags;
+} tx_walk;
+
+/// An entity captured by a walk, or the error capturing it, and when
+/// the capture started.
+typedef struct tx_walk_result_st
+{
+  uft_ent_state * ent_state;
+  char *          error;
+  uint64_t        start;
+} tx_walk_result;
+
+/// What 'ent_each_path' is passed: the callers function and argument.
+typedef struct tx_each_st
+{
+  void   (*fp)(const char *, void *);
+  void * arg;
+} tx_each;
+
+/// What 'tx_rollback_noent_under' is passed: the transaction and the
+/// entity state whose path the walk is under.
+typedef struct tx_under_st
+{
+  uft_tx *      tx;
+  uft_ll_node * lln;
+} tx_under;
 
 
 static int uft_tx_next_id = 0;
+static int uft_trash_next_id = 0;
+
+static __thread uft_tx * tx_pool_head  = NULL;
+static __thread int      tx_pool_count = 0;
+static __thread int      tx_pool_max   = 0;
 
 
 uft_status * tx_add_ent (uft_tx * tx, uft_status * status);
+uft_status * tx_share_ent (uft_tx * tx, uft_status * status);
+uft_status * tx_add_ent_metered (uft_tx * tx, uft_status * status, uint64_t start, int op, char * path, int flags);
+int          ent_abs_path (uft_ent_state * ent_state, char * buf, int buf_len);
+void         tx_import_shared (uft_tx * tx);
+void         tx_detach_shared (uft_tx * tx);
+int          path_name_off (const char * path);
+uft_status * tx_add_covered (uft_tx * tx, char * path, int flags);
+int          tx_covered_under (uft_tx * tx, const char * path);
+void *       ent_noent_depth (void * data, int depth, void * arg);
+void         ent_each_path (void * data, void * arg);
+uft_dir *    tx_dir (uft_tx * tx, const char * dir_path, int dir_path_len);
+uft_dir *    tx_dir_fd (uft_tx * tx, int dirfd);
+void         tx_clear_dirs (uft_tx * tx);
+int          tx_lock (uft_tx * tx, dev_t dev, ino_t ino, unsigned int name_hash, int flags);
+int          tx_lock_ent (uft_tx * tx, uft_dir * dir, char * path, int name_off, struct stat * statbufp, int flags);
+uft_status * tx_lock_status (uft_status * status, char * path, int result);
+void         tx_release_locks (uft_tx * tx);
+void         tx_release_all_locks (uft_tx * tx);
+void         tx_unref_dir (const void * key, int keylen, void * data, void * arg);
+uft_status * tx_add_path (uft_tx * tx, char * path, int flags);
+uft_status * tx_add_walk (uft_tx * tx, uft_walk * walk, char * what, int flags);
+uft_status * tx_add_set_ent (uft_tx * tx, uft_enrol_set * set, uft_enrol_ent * ent, const char * dir_ok);
+void *       tx_walk_capture (const char * path, void ** ctxp, void * arg);
+void         tx_walk_fini (void * ctx, void * arg);
+uft_status * add_ent_at (uft_tx * tx, uft_dir * dir, char * path, int name_off, int flags);
 uft_status * add_ent_dir (uft_tx * tx, char * path);
-uft_status * add_ent_file (uft_tx * tx, char * path, int flags, struct stat * statbufp);
-uft_status * add_ent_symlink (uft_tx * tx, char * path, int flags, struct stat * statbufp);
-uft_status * add_ent_noent (uft_tx * tx, char * path, int flags);
+uft_status * add_ent_reg (uft_tx * tx, uft_dir * dir, char * path, int name_off, struct stat * statbufp, int flags);
+uft_status * add_ent_file (uft_tx * tx, uft_dir * dir, char * path, int name_off, int fd, struct stat * statbufp, int flags);
+uft_status * add_ent_snap (uft_tx * tx, uft_dir * dir, char * path, int name_off, uft_snap * snap);
+uft_status * ent_capture_file (uft_status * status, uft_ent_state * ent_state, int fd, struct stat * statbufp, int flags);
+int          tx_capture_async (uft_tx * tx, uft_ent_state * ent_state, int fd, struct stat * statbufp, int flags);
+void         capture_file_job (void * arg);
+void         capture_wait (uft_capture * capture);
+int          ent_capture_join (uft_ent_state * ent_state, char * msg, int msg_len);
+int          tx_capture_wait (uft_tx * tx, uft_ent_state * ent_state);
+void         tx_finish_captures (uft_tx * tx);
+int          tx_barrier (uft_tx * tx, dev_t dev, ino_t ino);
+uft_status * add_ent_append (uft_tx * tx, uft_dir * dir, char * path, int name_off, int fd, struct stat * statbufp);
+uft_status * add_ent_symlink (uft_tx * tx, uft_dir * dir, char * path, int name_off, int path_fd, struct stat * statbufp);
+uft_status * add_ent_noent (uft_tx * tx, uft_dir * dir, char * path, int name_off, int flags);
+uft_status * add_ent_meta (uft_tx * tx, uft_dir * dir, char * path, int name_off, int path_fd, struct stat * statbufp, int flags);
+int          ent_capture_xattrs (uft_ent_state * ent_state, int path_fd);
+int          ent_restore_xattrs (uft_ent_state * ent_state, int dirfd);
+int          ent_has_xattr (uft_ent_state * ent_state, const char * name);
+uft_tx *     tx_new (void * extra);
+uft_tx *     tx_alloc (void);
+void         tx_init (uft_tx * tx, void * extra);
+void         tx_release (uft_tx * tx);
+void         tx_release_descendants (uft_tx * tx);
+void         tx_clear (uft_tx * tx);
+uft_ent_state * tx_new_ent_state (uft_tx * tx, int flags, uft_dir * dir, const char * path, int name_off, off_t data_len);
+void         tx_discard_ent_state (uft_tx * tx, uft_ent_state * ent_state);
+int          ent_reserve_data (uft_ent_state * ent_state, off_t data_len);
+int          ent_add_extent (uft_ent_state * ent_state, off_t off, off_t len);
+void         tx_spare_ent (uft_tx * tx, uft_ll_node * lln);
 void         uft_tx_rollback (uft_tx * tx);
+void         tx_rollback_ents (uft_tx * tx);
+void         tx_rollback_ent (uft_tx * tx, uft_ll_node * lln);
+void         tx_rollback_noent_under (void * data, void * arg);
+void         tx_set_rollback_code (uft_tx * tx, int code);
+void         tx_merge_child (uft_tx * tx, uft_tx * child_tx);
+uft_ll *     tx_descendants (uft_tx * tx);
+void         destroy_tx (uft_tx * tx);
 void         destroy_ent_state (uft_ent_state * ent_state);
+void         destroy_ent_states (uft_ll * ents);
 void         destroy_tx_error (uft_tx_error * tx_error);
+void         destroy_tx_errors (uft_ll * errors);
+int          ent_dirfd (uft_ent_state * ent_state);
+int          ent_restore_data (uft_ent_state * ent_state, int fd, int patch);
+int          ent_file_extents (uft_ent_state * ent_state, char ** datap, uft_extent ** extentsp);
+int          punch_hole (int fd, off_t off, off_t len);
 void         uft_rollback_file (uft_tx * tx, uft_ent_state * es);
+void         uft_rollback_append (uft_tx * tx, uft_ent_state * es);
 void         uft_rollback_symlink (uft_tx * tx, uft_ent_state * es);
 void         uft_rollback_noent (uft_tx * tx, uft_ent_state * es);
+void         uft_rollback_trash (uft_tx * tx, uft_ent_state * es);
+void         uft_rollback_rename (uft_tx * tx, uft_ent_state * es);
+void         uft_rollback_meta (uft_tx * tx, uft_ent_state * es);
+uft_dir *    tx_path_dir (uft_tx * tx, char * path, int * name_offp);
+int          trash_item_path (uft_ent_state * ent_state, int dirfd, char * buf, int buf_len);
+void         tx_reap_trash (uft_tx * tx);
+void         tx_metrics (uft_tx * tx, uint64_t start);
+void         reap_trash (void * arg);
 
 
-/// Create a new transaction.
+/// Create a new transaction. If this thread has a pool of transactions
+/// (see 'uft_tx_pool') a recycled one is used.
 
 uft_tx *
 uft_tx_new (void * extra)
 {
-  uft_tx * tx = (uft_tx *) malloc(sizeof(uft_tx));
+  uft_tx * tx = tx_new(extra);
+
+  if (tx != NULL && uft_trace_on)
+    uft_trace_tx(UFT_TRACE_NEW, tx->id, 0, 0);
+
+  return tx;
+}
 
-  tx->id = uft_tx_next_id++;
+
+/// Create a new transaction, from the pool if there is one.
+
+uft_tx *
+tx_new (void * extra)
+{
+  uft_tx * tx = tx_pool_head;
+
+  if (tx != NULL) {
+    tx_pool_head = tx->parent;
+    tx_pool_count--;
+  } else {
+    tx = tx_alloc();
+    if (tx == NULL)
+      return NULL;
+  }
+  tx_init(tx, extra);
+
+  return tx;
+}
+
+
+/// Give a new (or pooled) transaction an ID and clear its state.
+
+void
+tx_init (uft_tx * tx, void * extra)
+{
+  tx->id = __atomic_fetch_add(&uft_tx_next_id, 1, __ATOMIC_RELAXED);
   tx->code = 0;
+  tx->group = NULL;
+  tx->group_cb = NULL;
+  tx->group_next = NULL;
+  tx->async = NULL;
+  tx->group_entry = NULL;
+  tx->group_joined = 0;
+  tx->parent = NULL;
   tx->extra = extra;
+}
+
+
+/// Allocate a transaction and its lists.
+
+uft_tx *
+tx_alloc (void)
+{
+  uft_tx * tx = (uft_tx *) malloc(sizeof(uft_tx));
 
   if (tx == NULL)
     return NULL;
-  tx->ents = uft_ll_create();
-  if (tx->ents == NULL) {
-    free(tx);
-    return NULL;
-  }
-  tx->errors = uft_ll_create();
-  if (tx->errors == NULL) {
-    free(tx->ents);
-    free(tx);
-    return NULL;
-  }
-  tx->children = uft_ll_create();
-  if (tx->children == NULL) {
-    free(tx->errors);
-    free(tx->ents);
+
+  tx->ents         = uft_ll_create();
+  tx->ent_trie     = uft_trie_create();
+  tx->dirs         = uft_ht_create();
+  tx->spare_dirs   = uft_ll_create();
+  tx->locks        = uft_ll_create();
+  tx->errors       = uft_ll_create();
+  tx->children     = uft_ll_create();
+  tx->spare_ents   = uft_ll_create();
+  tx->claimed_ents = uft_ll_create();
+  tx->spare_errors = uft_ll_create();
+  tx->shm          = NULL;
+  tx->captures     = 0;
+  tx->group        = NULL;
+  tx->async        = NULL;
+  tx->group_entry  = NULL;
+  tx->group_joined = 0;
+
+  if (tx->ents == NULL || tx->ent_trie == NULL || tx->dirs == NULL || tx->spare_dirs == NULL || tx->locks == NULL || tx->errors == NULL
+      || tx->children == NULL || tx->spare_ents == NULL || tx->claimed_ents == NULL || tx->spare_errors == NULL) {
+    if (tx->ents != NULL)
+      uft_ll_rm(tx->ents);
+    if (tx->ent_trie != NULL)
+      uft_trie_rm(tx->ent_trie);
+    if (tx->dirs != NULL)
+      uft_ht_rm(tx->dirs);
+    if (tx->spare_dirs != NULL)
+      uft_ll_rm(tx->spare_dirs);
+    if (tx->locks != NULL)
+      uft_ll_rm(tx->locks);
+    if (tx->errors != NULL)
+      uft_ll_rm(tx->errors);
+    if (tx->children != NULL)
+      uft_ll_rm(tx->children);
+    if (tx->spare_ents != NULL)
+      uft_ll_rm(tx->spare_ents);
+    if (tx->claimed_ents != NULL)
+      uft_ll_rm(tx->claimed_ents);
+    if (tx->spare_errors != NULL)
+      uft_ll_rm(tx->spare_errors);
     free(tx);
     return NULL;
   }
+  pthread_mutex_init(&tx->mutex, NULL);
+  pthread_cond_init(&tx->capture_cond, NULL);
 
   return tx;
 }
@@ -78,356 +286,3039 @@ uft_tx_id (uft_tx * tx)
 }
 
 
+/// Return the transactions result code (UFT_TX_SUCCESS, UFT_TX_ERROR and
+/// so on), as tested by 'uft_tx_ok' and the other result macros.
+
+int
+uft_tx_code (uft_tx * tx)
+{
+  return __atomic_load_n(&tx->code, __ATOMIC_RELAXED);
+}
+
+
 /// Begin / run the transaction.
 
 uft_tx *
 uft_tx_begin (uft_tx * tx, void (*txfp)(uft_tx *))
 {
+  uint64_t start = uft_metrics_now();
+
+  tx->group_joined = 0;
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_BEGIN, tx->id, 0, 0);
+
   txfp(tx);
+  tx_finish_captures(tx);
+
+  if (tx->shm != NULL && !tx->shm->owner) {
+    if (tx->code == 0 || ((tx->code & UFT_TX_ERROR) != 0))
+      uft_shm_fail(tx->shm);
+    tx_detach_shared(tx);
+    tx_metrics(tx, start);
+    return tx;
+  }
+  if (tx->shm != NULL)
+    tx_import_shared(tx);
 
   if (tx->code == 0 || ((tx->code & UFT_TX_ERROR) != 0)) {
     uft_tx_rollback(tx);
+    tx_release_all_locks(tx);
+  } else if (tx->parent != NULL) {
+    tx_merge_child(tx->parent, tx);
+  } else if (tx->group != NULL && uft_async_group_join(tx) == 0) {
+    // Once in the group the flusher owns the transaction (and finishes it
+    // if it is asynchronous).
+    tx_metrics(tx, start);
+    tx->group_joined = 1;
+    uft_group_add(tx->group, tx);
+    return tx;
+  } else if (tx->group != NULL) {
+    uft_tx_log_error(tx, "error committing transaction %d, could not join its group: %s", tx->id, strerror(errno));
+    uft_tx_fail(tx);
+    uft_tx_rollback(tx);
+    tx_release_all_locks(tx);
+  } else {
+    tx_release_all_locks(tx);
+    tx_reap_trash(tx);
   }
 
+  tx_metrics(tx, start);
+
   return tx;
 }
 
 
-/// Free up resources held by the transaction.
+/// Record the time a transaction took (from 'start') and count it, and
+/// whether it was rolled back and whether that failed (tracing it too).
 
 void
-uft_tx_end (uft_tx * tx)
+tx_metrics (uft_tx * tx, uint64_t start)
 {
-  for (uft_ll_node * lln = uft_ll_head(tx->children); lln != NULL; lln = uft_ll_head(tx->children)) {
-    uft_tx * child_tx = uft_ll_data(lln);
-    uft_tx_end(child_tx);
-    uft_ll_rmnode(lln);
-  }
-  uft_ll_rm(tx->children);
-  for (uft_ll_node * lln = uft_ll_head(tx->errors); lln != NULL; lln = uft_ll_head(tx->errors)) {
-    uft_tx_error * tx_error = uft_ll_data(lln);
-    destroy_tx_error(tx_error);
-    uft_ll_rmnode(lln);
-  }
-  uft_ll_rm(tx->errors);
-  for (uft_ll_node * lln = uft_ll_head(tx->ents); lln != NULL; lln = uft_ll_head(tx->ents)) {
-    uft_ent_state * ent_state = uft_ll_data(lln);
-    destroy_ent_state(ent_state);
-    uft_ll_rmnode(lln);
-  }
-  uft_ll_rm(tx->ents);
-  free(tx);
+  uft_metrics_time(UFT_HIST_TX, start);
+  uft_metrics_count(UFT_COUNT_TX);
+  if (uft_tx_rollback_attempted(tx))
+    uft_metrics_count(UFT_COUNT_TX_FAILED);
+  if (uft_tx_rollback_failed(tx))
+    uft_metrics_count(UFT_COUNT_ROLLBACK_FAILED);
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_DONE, tx->id, tx->code, uft_metrics_now() - start);
 }
 
 
-/// Create a child / subordinate transaction.
+/// Finish a successful top level transaction once its commit group has
+/// been flushed (see uft_group.c): if it was made durable, as any other
+/// successful transaction, otherwise (or if it was withdrawn from the
+/// group) by failing it and rolling it back.
 
-uft_tx *
-uft_tx_child (uft_tx * tx, void * extra)
+void
+uft_tx_group_done (uft_tx * tx, int ok)
 {
-  uft_tx * child_tx = uft_tx_new(extra);
-  uft_ll_insert_tail(tx->children, child_tx);
-
-  return child_tx;
+  if (ok) {
+    __atomic_or_fetch(&tx->code, UFT_TX_DURABLE, __ATOMIC_RELAXED);
+    tx_release_all_locks(tx);
+    tx_reap_trash(tx);
+  } else {
+    __atomic_or_fetch(&tx->code, UFT_TX_ERROR, __ATOMIC_RELAXED);
+    uft_tx_rollback(tx);
+    tx_release_all_locks(tx);
+    uft_metrics_count(UFT_COUNT_TX_FAILED);
+    if (uft_tx_rollback_failed(tx))
+      uft_metrics_count(UFT_COUNT_ROLLBACK_FAILED);
+  }
 }
 
 
-/// Destroy / free an entity state.
+/// Free up resources held by the transaction, and any children.
 
 void
-destroy_ent_state (uft_ent_state * ent_state)
+uft_tx_end (uft_tx * tx)
 {
-  free(ent_state->path);
-  free(ent_state->data);
-  free(ent_state);
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_END, tx->id, 0, 0);
+  tx_release_descendants(tx);
+  tx_release(tx);
 }
 
 
-/// Destroy / free a transaction error.
+/// Reset a transaction so that it may be used again, as if it had just
+/// been created by 'uft_tx_new' with the same 'extra' data (it is given
+/// a new ID). Child transactions are ended. Memory already allocated for
+/// entity states and errors is kept, for reuse by the next transaction.
 
 void
-destroy_tx_error (uft_tx_error * tx_error)
+uft_tx_reset (uft_tx * tx)
 {
-  free(tx_error->msg);
-  free(tx_error);
-}
-
+  tx_release_descendants(tx);
+  tx_clear(tx);
 
-/// Return the pointer that is the transactions 'extra' data.
+  int old_id = tx->id;
+  tx->id = __atomic_fetch_add(&uft_tx_next_id, 1, __ATOMIC_RELAXED);
+  tx->code = 0;
+  tx->group = NULL;
+  tx->group_cb = NULL;
+  tx->group_joined = 0;
 
-void *
-uft_tx_extra (uft_tx * tx)
-{
-  return tx->extra;
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_RESET, old_id, tx->id, 0);
 }
 
 
-/// Set the transactions 'extra' data pointer.
+/// Set the maximum number of finished transactions this thread keeps
+/// for reuse by 'uft_tx_new'. Zero (the default) disables pooling and
+/// frees any transactions already pooled, which should be done before
+/// the thread exits.
 
-void *
-uft_tx_set_extra (uft_tx * tx, void * extra)
+void
+uft_tx_pool (int max)
 {
-  void * old_extra = tx->extra;
-  tx->extra = extra;
+  tx_pool_max = max;
 
-  return old_extra;
+  while (tx_pool_count > max) {
+    uft_tx * tx = tx_pool_head;
+    tx_pool_head = tx->parent;
+    tx_pool_count--;
+    destroy_tx(tx);
+  }
 }
 
 
-/// Add a filesystem entity to the transaction.
+/// Release a single transaction, not including its children, to this
+/// threads pool if there is space, otherwise free it.
 
-uft_status *
-uft_tx_add_ent(uft_tx * tx, char * path, int flags)
+void
+tx_release (uft_tx * tx)
 {
-  struct stat statbuf;
-
-  if (lstat(path, &statbuf) == 0) {
-    if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
-      return tx_add_ent(tx, add_ent_dir(tx, path));
-    } else if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
-      return tx_add_ent(tx, add_ent_file(tx, path, flags, &statbuf));
-    } else if ((statbuf.st_mode & S_IFMT) == S_IFLNK) {
-      return tx_add_ent(tx, add_ent_symlink(tx, path, flags, &statbuf));
-    }
-  } else if (errno == ENOENT) {
-    return tx_add_ent(tx, add_ent_noent(tx, path, flags));
+  if (tx_pool_count < tx_pool_max) {
+    tx_clear(tx);
+    tx->parent = tx_pool_head;
+    tx_pool_head = tx;
+    tx_pool_count++;
+  } else {
+    destroy_tx(tx);
   }
 }
 
 
-uft_status *
-tx_add_ent(uft_tx * tx, uft_status * status)
+/// Release all of a transactions descendants.
+
+void
+tx_release_descendants (uft_tx * tx)
 {
-  if (uft_status_error(status)) {
-    uft_tx_log_error(tx, uft_status_error_msg(status));
-    return status;
+  uft_ll * work = tx_descendants(tx);
+
+  for (uft_ll_node * lln = uft_ll_head(work); lln != NULL; lln = uft_ll_head(work)) {
+    tx_release(uft_ll_data(lln));
+    uft_ll_rmnode(lln);
   }
+  uft_ll_rm(work);
 
-  uft_ll_insert_tail(tx->ents, uft_status_data(status));
-  return uft_status_set_success(status, tx);
+  while (uft_ll_head(tx->children) != NULL)
+    uft_ll_rmnode(uft_ll_head(tx->children));
 }
 
 
-uft_status *
-add_ent_dir(uft_tx * tx, char * path)
+/// Empty a transaction, moving its entity states and errors to its
+/// spare lists (children must already have been released).
+
+void
+tx_clear (uft_tx * tx)
 {
-  static uft_status status;
+  uft_ll_node * lln;
 
-  return uft_status_set_error(&status, "cannot add existing directory \"%s\" to transaction", path);
+  while ((lln = uft_ll_head(tx->children)) != NULL)
+    uft_ll_rmnode(lln);
+  while ((lln = uft_ll_head(tx->ents)) != NULL)
+    tx_spare_ent(tx, lln);
+  while ((lln = uft_ll_head(tx->errors)) != NULL)
+    uft_ll_move_tail(tx->spare_errors, lln);
+  uft_trie_clear(tx->ent_trie);
+  tx_clear_dirs(tx);
+  tx_release_locks(tx);
+  tx_detach_shared(tx);
 }
 
 
-uft_status *
-add_ent_file(uft_tx * tx, char * path, int flags, struct stat * statbufp)
+/// Destroy / free a single transaction, not including its children.
+
+void
+destroy_tx (uft_tx * tx)
 {
-  static uft_status status;
+  uft_ll_rm(tx->children);
+  destroy_tx_errors(tx->errors);
+  destroy_tx_errors(tx->spare_errors);
+  destroy_ent_states(tx->ents);
+  destroy_ent_states(tx->spare_ents);
+  destroy_ent_states(tx->claimed_ents);
+  uft_trie_rm(tx->ent_trie);
+  tx_clear_dirs(tx);
+  uft_ht_rm(tx->dirs);
+  uft_ll_rm(tx->spare_dirs);
+  tx_release_locks(tx);
+  uft_ll_rm(tx->locks);
+  tx_detach_shared(tx);
+  pthread_mutex_destroy(&tx->mutex);
+  pthread_cond_destroy(&tx->capture_cond);
+  free(tx);
+}
 
-  int fd = open(path, O_RDONLY);
-  if (fd < 0)
-    return uft_status_set_error(&status, "error adding file \"%s\", could not open for read: %s", path, strerror(errno));
 
-  char * file_data = (char *) malloc(statbufp->st_size);
-  if (read(fd, file_data, statbufp->st_size) != statbufp->st_size) {
-    free(file_data);
-    return uft_status_set_error(&status, "error adding file \"%s\", failed to read: %s", path, strerror(errno));
+/// Return a list of all the transactions descendants (children, their
+/// children and so on), parents always before their children. The list
+/// is built iteratively so arbitrarily deep nesting costs no stack. The
+/// caller must free the list with 'uft_ll_rm'.
+
+uft_ll *
+tx_descendants (uft_tx * tx)
+{
+  uft_ll * work = uft_ll_create();
+
+  for (uft_ll_node * lln = uft_ll_head(tx->children); lln != NULL; lln = uft_ll_next(lln))
+    uft_ll_insert_tail(work, uft_ll_data(lln));
+  for (uft_ll_node * lln = uft_ll_head(work); lln != NULL; lln = uft_ll_next(lln)) {
+    uft_tx * desc_tx = uft_ll_data(lln);
+    for (uft_ll_node * c_lln = uft_ll_head(desc_tx->children); c_lln != NULL; c_lln = uft_ll_next(c_lln))
+      uft_ll_insert_tail(work, uft_ll_data(c_lln));
   }
 
-  close(fd);
+  return work;
+}
 
-  uft_ent_state * ent_state = (uft_ent_state *) malloc(sizeof(uft_ent_state));
-  ent_state->flags = UFT_ES_FILE;
-  ent_state->path = (char *) malloc(strlen(path)+1);
-  strcpy(ent_state->path, path);
-  ent_state->data_len = statbufp->st_size;
-  ent_state->data = file_data;
 
-  return uft_status_set_success(&status, ent_state);
+/// Create a child / subordinate transaction.
+
+uft_tx *
+uft_tx_child (uft_tx * tx, void * extra)
+{
+  uft_tx * child_tx = tx_new(extra);
+  child_tx->parent = tx;
+  pthread_mutex_lock(&tx->mutex);
+  uft_ll_insert_tail(tx->children, child_tx);
+  pthread_mutex_unlock(&tx->mutex);
+
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_CHILD, child_tx->id, tx->id, 0);
+
+  return child_tx;
 }
 
 
-uft_status *
-add_ent_symlink(uft_tx * tx, char * path, int flags, struct stat * statbufp)
-{
-  static uft_status status;
+/// Share the transaction with other processes, returning a descriptor
+/// for its shared log (of 'size' bytes, or UFT_SHM_SIZE if 'size' is
+/// zero) which other processes may pass to 'uft_tx_join', or -1 (with
+/// errno set) on failure. From now on entities added by this process go
+/// to the shared log too, so that everything is rolled back in the order
+/// it was added, whichever process added it.
 
-  char * link_data = (char *) malloc(statbufp->st_size + 1);
-  if (readlink(path, link_data, statbufp->st_size) != statbufp->st_size) {
-    link_data[statbufp->st_size] = '\0';
-    free(link_data);
-    return uft_status_set_error(&status, "error adding symlink \"%s\", failed to read: %s", path, strerror(errno));
+int
+uft_tx_share (uft_tx * tx, size_t size)
+{
+  if (tx->shm == NULL) {
+    tx->shm = uft_shm_create(tx->id, size != 0 ? size : UFT_SHM_SIZE);
+    if (tx->shm == NULL)
+      return -1;
   }
 
-  uft_ent_state * ent_state = (uft_ent_state *) malloc(sizeof(uft_ent_state));
-  ent_state->flags |= UFT_ES_SYMLINK;
-  ent_state->path = (char *) malloc(strlen(path)+1);
-  strcpy(ent_state->path, path);
-  ent_state->data_len = statbufp->st_size;
-  ent_state->data = link_data;
-
-  return uft_status_set_success(&status, ent_state);
+  return tx->shm->fd;
 }
 
 
-uft_status *
-add_ent_noent(uft_tx * tx, char * path, int flags)
-{
-  static uft_status status;
+/// Join the shared transaction 'tx_id' whose log is open as 'fd' (see
+/// 'uft_tx_share'), returning a participant transaction, or NULL (with
+/// errno set) if the transaction cannot be joined. Entities added to the
+/// participant are appended to the shared log, for the owner to roll
+/// back; failing the participant fails the shared transaction. The
+/// participant stays attached, holding up the owner finishing, until it
+/// is begun or ended.
 
-  if ((flags & UFT_ALLOW_NOENT) == 0)
-    return uft_status_set_error(&status, "error adding non existent entity \"%s\", set UFT_ALLOW_NOENT if this is allowed", path);
+uft_tx *
+uft_tx_join (int fd, int tx_id, void * extra)
+{
+  uft_tx * tx = uft_tx_new(extra);
+  if (tx == NULL)
+    return NULL;
 
-  uft_ent_state * ent_state = (uft_ent_state *) malloc(sizeof(uft_ent_state));
-  ent_state->flags |= UFT_ES_NOENT;
-  ent_state->path = (char *) malloc(strlen(path)+1);
-  strcpy(ent_state->path, path);
-  ent_state->data_len = 0;
-  ent_state->data = NULL;
+  tx->shm = uft_shm_attach(fd, tx_id);
+  if (tx->shm == NULL) {
+    int join_errno = errno;
+    uft_tx_end(tx);
+    errno = join_errno;
+    return NULL;
+  }
 
-  return uft_status_set_success(&status, ent_state);
+  return tx;
 }
 
 
-/// Rollback the transaction. Should not be called directly, it is called
-/// by 'uft_tx_begin' if the transaction fails.
+/// Seal the transactions shared log, wait for participants to finish,
+/// and add everything in the log to the transaction. If a participant
+/// failed, or died part way through adding an entity, the transaction
+/// fails.
 
 void
-uft_tx_rollback (uft_tx * tx)
+tx_import_shared (uft_tx * tx)
 {
-  uft_ll_node * lln;
+  static __thread uft_status status;
+  uft_shm * shm = tx->shm;
 
-  while ((lln = uft_ll_tail(tx->children)) != NULL) {
-    uft_tx * child_tx = (uft_tx *) uft_ll_data(lln);
-    uft_tx_rollback(child_tx);
-    uft_ll_rmnode(lln);
-  }
+  uft_shm_seal(shm);
+  if (uft_shm_failed(shm))
+    uft_tx_fail(tx);
 
-  while ((lln = uft_ll_tail(tx->ents)) != NULL) {
-    uft_ent_state * ent_state = (uft_ent_state *) uft_ll_data(lln);
-    if ((ent_state->flags & UFT_ES_FILE) != 0) {
-      uft_rollback_file(tx, ent_state);
-    } else if ((ent_state->flags & UFT_ES_SYMLINK) != 0) {
-      uft_rollback_symlink(tx, ent_state);
-    } else if ((ent_state->flags & UFT_ES_NOENT) != 0) {
-      uft_rollback_noent(tx, ent_state);
+  tx->shm = NULL;
+
+  for (uft_shm_rec * rec = uft_shm_next(shm, NULL); rec != NULL; rec = uft_shm_next(shm, rec)) {
+    if (!__atomic_load_n(&rec->ready, __ATOMIC_ACQUIRE)) {
+      uft_tx_log_error(tx, "shared transaction %d, a participant died while adding an entity", tx->id);
+      uft_tx_fail(tx);
+      continue;
     }
-    destroy_ent_state(ent_state);
-    uft_ll_rmnode(lln);
+    if ((rec->flags & UFT_SHM_REC_ERROR) != 0) {
+      uft_tx_log_error(tx, "%s", uft_shm_rec_path(rec));
+      continue;
+    }
+
+    uft_ent_state * ent_state = tx_new_ent_state(tx, rec->flags, NULL, uft_shm_rec_path(rec), 0, rec->data_len + 1);
+    if (ent_state == NULL) {
+      uft_tx_log_error(tx, "error adding shared entity \"%s\", out of memory", uft_shm_rec_path(rec));
+      uft_tx_fail(tx);
+      continue;
+    }
+    memcpy(ent_state->data, uft_shm_rec_data(rec), rec->data_len);
+    ent_state->data[rec->data_len] = '\0';
+    ent_state->data_len = rec->data_len;
+    uft_extent * extents = uft_shm_rec_meta(rec);
+    int extent_count = (rec->flags & UFT_ES_META) != 0 ? 0 : rec->meta_len / sizeof(uft_extent);
+    if ((rec->flags & UFT_ES_META) != 0 && rec->meta_len == sizeof(uft_meta))
+      memcpy(&ent_state->meta, uft_shm_rec_meta(rec), sizeof(uft_meta));
+    for (int i = 0; i < extent_count - 1; i++) {
+      if (!ent_add_extent(ent_state, extents[i].off, extents[i].len)) {
+        tx_discard_ent_state(tx, ent_state);
+        ent_state = NULL;
+        break;
+      }
+    }
+    if (ent_state == NULL) {
+      uft_tx_log_error(tx, "error adding shared entity \"%s\", out of memory", uft_shm_rec_path(rec));
+      uft_tx_fail(tx);
+      continue;
+    }
+    if (extent_count > 0)
+      ent_state->size = extents[extent_count - 1].off;
+    tx_add_ent(tx, uft_status_set_success(&status, ent_state));
   }
 
-  if (tx->code & UFT_TX_ROLLBACK_FAILED)
-    tx->code &= ~UFT_TX_ROLLBACK_OK;
-  else
-    tx->code |= UFT_TX_ROLLBACK_OK;
+  uft_shm_detach(shm);
 }
 
 
+/// Detach the transaction from its shared log, if it has one.
+
 void
-uft_rollback_file (uft_tx * tx, uft_ent_state * ent_state)
+tx_detach_shared (uft_tx * tx)
 {
-  struct stat statbuf;
-  if (lstat(ent_state->path, &statbuf) == 0) {
-    if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
-      if (rmdir(ent_state->path) != 0) {
-        uft_tx_log_error(tx,
-                         "rolling back transaction %p, error %d restoring file \"%s\" by rmdir: %s",
-                         tx, errno, ent_state->path, strerror(errno));
-        return;
-      }
-    } else if ((statbuf.st_mode & S_IFMT) == S_IFLNK) {
-      if (unlink(ent_state->path) != 0) {
-        uft_tx_log_error(tx,
-                         "rolling back transaction %p, error %d restoring file \"%s\" by unlink symlink: %s",
-                         tx, errno, ent_state->path, strerror(errno));
-        return;
-      }
-    }
-  }
-
-  int fd = open(ent_state->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  if (fd < 0) {
-    uft_tx_log_error(tx,
-                     "rolling back transaction %p, error %d restoring file \"%s\": %s",
-                     tx, errno, ent_state->path, strerror(errno));
-    tx->code |= UFT_TX_ROLLBACK_FAILED;
-  }
-  if (write(fd, ent_state->data, ent_state->data_len) != ent_state->data_len) {
-    uft_tx_log_error(tx,
-                     "rolling back transaction %p, error %d restoring file \"%s\": %s",
-                     tx, errno, ent_state->path, strerror(errno));
-    tx->code |= UFT_TX_ROLLBACK_FAILED;
+  if (tx->shm != NULL) {
+    uft_shm_detach(tx->shm);
+    tx->shm = NULL;
   }
-  close(fd);
 }
 
 
+/// Fold a successful child transaction into its parent. The childs
+/// entities (and locks) are moved to the parent, except where the parent
+/// already holds an (older) state for the same path, in which case the
+/// childs state is discarded. Only states captured before a change are
+/// discarded so: a rename or a move to the trash is always moved to the
+/// parent, as only it can undo it (or reap the trash). The childs own children are handed to the parent
+/// too, so that the child is left holding only its status and errors
+/// (the caller still has the pointer and may inspect it).
+
 void
-uft_rollback_symlink (uft_tx * tx, uft_ent_state * ent_state)
+tx_merge_child (uft_tx * tx, uft_tx * child_tx)
 {
-  char * buf = (char *) malloc(ent_state->data_len + 1);
-  if (readlink(ent_state->path, buf, ent_state->data_len + 1) == ent_state->data_len)
-    if (strncmp(buf, ent_state->data, ent_state->data_len) == 0)
-      return;
+  uft_ll_node * lln;
 
-  if (unlink(ent_state->path) != 0 && errno != ENOENT) {
-    uft_tx_log_error(tx,
-                     "rolling back transaction %p, error %d restoring symlink \"%s\": %s",
-                     tx, errno, ent_state->path, strerror(errno));
-    tx->code |= UFT_TX_ROLLBACK_FAILED;
+  pthread_mutex_lock(&tx->mutex);
+  while ((lln = uft_ll_head(child_tx->ents)) != NULL) {
+    uft_ent_state * ent_state = uft_ll_data(lln);
+    int covered = uft_trie_get(tx->ent_trie, ent_state->path) != NULL;
+    if (covered && (ent_state->flags & (UFT_ES_TRASH | UFT_ES_RENAME)) == 0) {
+      tx_spare_ent(tx, lln);
+    } else {
+      if (!covered)
+        uft_trie_put(tx->ent_trie, ent_state->path, lln);
+      uft_ll_move_tail(tx->ents, lln);
+    }
   }
-  if (symlink(ent_state->data, ent_state->path) != 0) {
-    uft_tx_log_error(tx,
-                     "rolling back transaction %p, error %d restoring symlink \"%s\": %s",
-                     tx, errno, ent_state->path, strerror(errno));
-    tx->code |= UFT_TX_ROLLBACK_FAILED;
+  uft_trie_clear(child_tx->ent_trie);
+
+  while ((lln = uft_ll_head(child_tx->locks)) != NULL)
+    uft_ll_move_tail(tx->locks, lln);
+
+  while ((lln = uft_ll_head(child_tx->children)) != NULL) {
+    uft_tx * grandchild_tx = uft_ll_data(lln);
+    grandchild_tx->parent = tx;
+    uft_ll_move_tail(tx->children, lln);
   }
+  pthread_mutex_unlock(&tx->mutex);
 }
 
 
+/// Destroy / free an entity state.
+
 void
-uft_rollback_noent (uft_tx * tx, uft_ent_state * ent_state)
+destroy_ent_state (uft_ent_state * ent_state)
 {
-  struct stat statbuf;
-  if (lstat(ent_state->path, &statbuf) != 0 && errno != ENOENT) {
-    uft_tx_log_error(tx,
-                     "rolling back transaction %p, error %d restoring noent \"%s\": %s",
-                     tx, errno, ent_state->path, strerror(errno));
-    tx->code |= UFT_TX_ROLLBACK_FAILED;
-    return;
-  }
-
-  if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
-    if (rmdir(ent_state->path) != 0) {
-      uft_tx_log_error(tx,
-                       "rolling back transaction %p, error %d restoring noent dir \"%s\": %s",
-                       tx, errno, ent_state->path, strerror(errno));
-      tx->code |= UFT_TX_ROLLBACK_FAILED;
-    }
-  } else if (((statbuf.st_mode & S_IFMT) == S_IFREG) || ((statbuf.st_mode & S_IFMT) == S_IFLNK)) {
-    if (unlink(ent_state->path) != 0 && errno != ENOENT) {
-      uft_tx_log_error(tx,
-                       "rolling back transaction %p, error %d restoring noent \"%s\": %s",
-                       tx, errno, ent_state->path, strerror(errno));
-      tx->code |= UFT_TX_ROLLBACK_FAILED;
-    }
-  }
+  if (ent_state->capture != NULL)
+    ent_capture_join(ent_state, NULL, 0);
+  if (ent_state->dir != NULL)
+    uft_dir_unref(ent_state->dir);
+  if (ent_state->snap != NULL)
+    uft_snap_unref(ent_state->snap);
+  if (ent_state->spool_fd >= 0)
+    close(ent_state->spool_fd);
+  free(ent_state->path);
+  free(ent_state->data);
+  free(ent_state->extents);
+  free(ent_state);
 }
 
 
-/// Log / add an error to the transaction.
+/// Destroy / free a list of entity states.
 
-uft_tx *
+void
+destroy_ent_states (uft_ll * ents)
+{
+  for (uft_ll_node * lln = uft_ll_head(ents); lln != NULL; lln = uft_ll_head(ents)) {
+    destroy_ent_state(uft_ll_data(lln));
+    uft_ll_rmnode(lln);
+  }
+  uft_ll_rm(ents);
+}
+
+
+/// Destroy / free a transaction error.
+
+void
+destroy_tx_error (uft_tx_error * tx_error)
+{
+  free(tx_error->msg);
+  free(tx_error);
+}
+
+
+/// Destroy / free a list of transaction errors.
+
+void
+destroy_tx_errors (uft_ll * errors)
+{
+  for (uft_ll_node * lln = uft_ll_head(errors); lln != NULL; lln = uft_ll_head(errors)) {
+    destroy_tx_error(uft_ll_data(lln));
+    uft_ll_rmnode(lln);
+  }
+  uft_ll_rm(errors);
+}
+
+
+/// Return an entity state for the path given, located relative to 'dir'
+/// by the part of the path from 'name_off', with room for 'data_len'
+/// bytes of data. The transactions first spare entity state is reused
+/// if there is one (it is claimed, moving it to the claimed list until
+/// 'tx_add_ent' takes it, so no other thread can reuse it too), otherwise
+/// a new one is allocated. Returns NULL if memory cannot be allocated.
+
+uft_ent_state *
+tx_new_ent_state (uft_tx * tx, int flags, uft_dir * dir, const char * path, int name_off, off_t data_len)
+{
+  uft_ent_state * ent_state = NULL;
+
+  pthread_mutex_lock(&tx->mutex);
+  uft_ll_node * lln = uft_ll_head(tx->spare_ents);
+  if (lln != NULL) {
+    ent_state = uft_ll_data(lln);
+    ent_state->claim = uft_ll_move_tail(tx->claimed_ents, lln);
+  }
+  pthread_mutex_unlock(&tx->mutex);
+
+  if (ent_state == NULL) {
+    ent_state = (uft_ent_state *) malloc(sizeof(uft_ent_state));
+    if (ent_state == NULL)
+      return NULL;
+    ent_state->path = NULL;
+    ent_state->path_cap = 0;
+    ent_state->data = NULL;
+    ent_state->data_cap = 0;
+    ent_state->dir = NULL;
+    ent_state->extents = NULL;
+    ent_state->extent_cap = 0;
+    ent_state->spool_fd = -1;
+    ent_state->capture = NULL;
+    ent_state->claim = NULL;
+    ent_state->snap = NULL;
+  }
+
+  if (ent_state->dir != NULL) {
+    uft_dir_unref(ent_state->dir);
+    ent_state->dir = NULL;
+  }
+  if (ent_state->snap != NULL) {
+    uft_snap_unref(ent_state->snap);
+    ent_state->snap = NULL;
+  }
+
+  int path_len = strlen(path) + 1;
+  if (ent_state->path_cap < path_len) {
+    char * new_path = (char *) realloc(ent_state->path, path_len);
+    if (new_path == NULL) {
+      tx_discard_ent_state(tx, ent_state);
+      return NULL;
+    }
+    ent_state->path = new_path;
+    ent_state->path_cap = path_len;
+  }
+  if (!ent_reserve_data(ent_state, data_len)) {
+    tx_discard_ent_state(tx, ent_state);
+    return NULL;
+  }
+
+  ent_state->flags = flags;
+  strcpy(ent_state->path, path);
+  ent_state->name = ent_state->path + name_off;
+  ent_state->dir = dir != NULL ? uft_dir_ref(dir) : NULL;
+  ent_state->data_len = data_len;
+  ent_state->size = 0;
+  ent_state->extent_count = 0;
+
+  return ent_state;
+}
+
+
+/// Make sure an entity state has room for 'data_len' bytes of data.
+/// Returns false if memory cannot be allocated.
+
+int
+ent_reserve_data (uft_ent_state * ent_state, off_t data_len)
+{
+  if (ent_state->data_cap < data_len) {
+    char * new_data = (char *) realloc(ent_state->data, data_len);
+    if (new_data == NULL)
+      return 0;
+    ent_state->data = new_data;
+    ent_state->data_cap = data_len;
+  }
+
+  return 1;
+}
+
+
+/// Add a data extent to an entity state. Returns false if memory cannot
+/// be allocated.
+
+int
+ent_add_extent (uft_ent_state * ent_state, off_t off, off_t len)
+{
+  if (ent_state->extent_count == ent_state->extent_cap) {
+    int new_cap = ent_state->extent_cap > 0 ? ent_state->extent_cap * 2 : 4;
+    uft_extent * new_extents = (uft_extent *) realloc(ent_state->extents, sizeof(uft_extent) * new_cap);
+    if (new_extents == NULL)
+      return 0;
+    ent_state->extents = new_extents;
+    ent_state->extent_cap = new_cap;
+  }
+
+  ent_state->extents[ent_state->extent_count].off = off;
+  ent_state->extents[ent_state->extent_count].len = len;
+  ent_state->extent_count++;
+
+  return 1;
+}
+
+
+/// Give up on an entity state returned by 'tx_new_ent_state'.
+
+void
+tx_discard_ent_state (uft_tx * tx, uft_ent_state * ent_state)
+{
+  if (ent_state->claim == NULL) {
+    destroy_ent_state(ent_state);
+    return;
+  }
+
+  if (ent_state->spool_fd >= 0) {
+    close(ent_state->spool_fd);
+    ent_state->spool_fd = -1;
+  }
+  pthread_mutex_lock(&tx->mutex);
+  uft_ll_move_tail(tx->spare_ents, ent_state->claim);
+  ent_state->claim = NULL;
+  pthread_mutex_unlock(&tx->mutex);
+}
+
+
+/// Move an entity state node to the transactions spare list, dropping
+/// its spool file, and its data buffer if it is too big to be worth
+/// keeping. The caller holds the transactions mutex, or has the
+/// transaction to itself.
+
+void
+tx_spare_ent (uft_tx * tx, uft_ll_node * lln)
+{
+  uft_ent_state * ent_state = uft_ll_data(lln);
+
+  if (ent_state->capture != NULL) {
+    ent_capture_join(ent_state, NULL, 0);
+    __atomic_sub_fetch(&tx->captures, 1, __ATOMIC_RELAXED);
+  }
+  if (ent_state->dir != NULL) {
+    uft_dir_unref(ent_state->dir);
+    ent_state->dir = NULL;
+  }
+  if (ent_state->snap != NULL) {
+    uft_snap_unref(ent_state->snap);
+    ent_state->snap = NULL;
+  }
+  if (ent_state->spool_fd >= 0) {
+    close(ent_state->spool_fd);
+    ent_state->spool_fd = -1;
+  }
+  if (ent_state->data_cap > UFT_SPARE_DATA_MAX) {
+    free(ent_state->data);
+    ent_state->data = NULL;
+    ent_state->data_cap = 0;
+  }
+  uft_ll_move_tail(tx->spare_ents, lln);
+}
+
+
+/// Return the pointer that is the transactions 'extra' data.
+
+void *
+uft_tx_extra (uft_tx * tx)
+{
+  return tx->extra;
+}
+
+
+/// Set the transactions 'extra' data pointer.
+
+void *
+uft_tx_set_extra (uft_tx * tx, void * extra)
+{
+  void * old_extra = tx->extra;
+  tx->extra = extra;
+
+  return old_extra;
+}
+
+
+/// Add a filesystem entity to the transaction. Nothing is captured for
+/// a path under a directory already added that did not exist.
+
+uft_status *
+uft_tx_add_ent(uft_tx * tx, char * path, int flags)
+{
+  uft_status * covered = tx_add_covered(tx, path, flags);
+  if (covered != NULL)
+    return covered;
+
+  uint64_t start = uft_metrics_now();
+
+  return tx_add_ent_metered(tx, tx_add_path(tx, path, flags), start, UFT_TRACE_ADD_ENT, path, flags);
+}
+
+
+/// Capture the entity at 'path', relative to the transactions handle on
+/// its directory, returning the status of 'add_ent_at'.
+
+uft_status *
+tx_add_path (uft_tx * tx, char * path, int flags)
+{
+  int name_off = path_name_off(path);
+  uft_dir * dir = NULL;
+
+  if (name_off > 0)
+    dir = tx_dir(tx, path, name_off > 1 ? name_off - 1 : 1);
+  else if (name_off == 0)
+    dir = tx_dir(tx, ".", 1);
+  if (dir == NULL)
+    name_off = 0;
+
+  return add_ent_at(tx, dir, path, name_off, flags);
+}
+
+
+/// Add everything under the directory 'root' whose name matches 'filter'
+/// (an fnmatch pattern, or NULL for everything) to the transaction, as
+/// 'uft_tx_add_ent' would with 'flags'. Directories are added too with
+/// UFT_META_ONLY, otherwise they are only walked. See 'tx_add_walk'.
+
+uft_status *
+uft_tx_add_tree (uft_tx * tx, char * root, char * filter, int flags)
+{
+  uft_walk walk = { .root = root, .filter = filter };
+
+  return tx_add_walk(tx, &walk, root, flags);
+}
+
+
+/// Add everything matching the glob 'pattern' (as matched by fnmatch,
+/// component by component, so wildcards do not match a "/" or a leading
+/// ".") to the transaction, as 'uft_tx_add_ent' would with 'flags'.
+/// Directories are only added with UFT_META_ONLY. Matching nothing is
+/// not an error. See 'tx_add_walk'.
+
+uft_status *
+uft_tx_add_glob (uft_tx * tx, char * pattern, int flags)
+{
+  static __thread uft_status status;
+  char root[PATH_MAX];
+  struct stat statbuf;
+
+  int rest_off = uft_walk_glob_root(pattern, root, sizeof(root));
+  if (rest_off < 0) {
+    uft_tx_log_error(tx, "error adding \"%s\": path too long", pattern);
+    return uft_status_set_error(&status, "error adding \"%s\": path too long", pattern);
+  }
+  if (strpbrk(pattern, "*?[\\") == NULL) {
+    if (fstatat(AT_FDCWD, pattern, &statbuf, AT_SYMLINK_NOFOLLOW) != 0 && errno == ENOENT)
+      return uft_status_set_success(&status, tx);
+    return uft_tx_add_ent(tx, pattern, flags);
+  }
+  if (fstatat(AT_FDCWD, root, &statbuf, 0) != 0 && errno == ENOENT)
+    return uft_status_set_success(&status, tx);
+
+  uft_walk walk = { .root = root, .pattern = pattern + rest_off };
+
+  return tx_add_walk(tx, &walk, pattern, flags);
+}
+
+
+/// Prepare the paths in 'paths' (a NULL terminated array) to be added to
+/// transactions, with 'flags', by 'uft_tx_add_set', working out once
+/// what is otherwise worked out every time a path is added: the
+/// directory each is in is opened (once for all the paths in it) and
+/// held open by the set, and the type of each is found out. Relative
+/// paths are relative to the current directory as it is now. Returns
+/// NULL (with errno set) if memory cannot be allocated.
+
+uft_enrol_set *
+uft_enrol_set_prepare (char ** paths, int flags)
+{
+  struct stat statbuf;
+  int count = 0;
+
+  while (paths[count] != NULL)
+    count++;
+
+  uft_enrol_set * set = (uft_enrol_set *) calloc(1, sizeof(uft_enrol_set));
+  if (set == NULL)
+    return NULL;
+  set->flags = flags;
+  set->ents = (uft_enrol_ent *) calloc(count > 0 ? count : 1, sizeof(uft_enrol_ent));
+  set->dirs = (uft_dir **) calloc(count > 0 ? count : 1, sizeof(uft_dir *));
+  uft_ht * dir_idxs = uft_ht_create();
+  if (set->ents == NULL || set->dirs == NULL || dir_idxs == NULL) {
+    if (dir_idxs != NULL)
+      uft_ht_rm(dir_idxs);
+    uft_enrol_set_rm(set);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  for (int i = 0; i < count; i++) {
+    uft_enrol_ent * ent = &set->ents[i];
+    ent->path = strdup(paths[i]);
+    if (ent->path == NULL) {
+      uft_ht_rm(dir_idxs);
+      uft_enrol_set_rm(set);
+      errno = ENOMEM;
+      return NULL;
+    }
+    set->count++;
+    ent->name_off = path_name_off(ent->path);
+    ent->dir_idx = -1;
+    ent->type = 0;
+    if (ent->name_off < 0)
+      continue;
+
+    const char * dir_path = ent->name_off > 0 ? ent->path : ".";
+    int dir_path_len = ent->name_off > 1 ? ent->name_off - 1 : 1;
+    intptr_t dir_idx = (intptr_t) uft_ht_get(dir_idxs, dir_path, dir_path_len) - 1;
+    if (dir_idx < 0) {
+      uft_dir * dir = uft_dir_open(dir_path, dir_path_len);
+      if (dir == NULL)
+        continue;
+      dir_idx = set->dir_count;
+      set->dirs[set->dir_count++] = dir;
+      if (uft_ht_put(dir_idxs, dir->path, dir_path_len, (void *) (dir_idx + 1)) != 0) {
+        uft_ht_rm(dir_idxs);
+        uft_enrol_set_rm(set);
+        errno = ENOMEM;
+        return NULL;
+      }
+    }
+    ent->dir_idx = dir_idx;
+    if (fstatat(set->dirs[dir_idx]->fd, ent->path + ent->name_off, &statbuf, AT_SYMLINK_NOFOLLOW) == 0)
+      ent->type = statbuf.st_mode & S_IFMT;
+  }
+  uft_ht_rm(dir_idxs);
+
+  return set;
+}
+
+
+/// Free a prepared enrolment set, closing its directories (unless
+/// entities added from it are still using them).
+
+void
+uft_enrol_set_rm (uft_enrol_set * set)
+{
+  if (set->ents != NULL)
+    for (int i = 0; i < set->count; i++)
+      free(set->ents[i].path);
+  if (set->dirs != NULL)
+    for (int d = 0; d < set->dir_count; d++)
+      uft_dir_unref(set->dirs[d]);
+  free(set->ents);
+  free(set->dirs);
+  free(set);
+}
+
+
+/// Add every path of a prepared enrolment set to the transaction, as
+/// 'uft_tx_add_ent' would, with the flags the set was prepared with.
+/// Each of the sets directories is checked to still be the directory at
+/// its path, and where one is, a path in it that was a regular file and
+/// still is takes just one stat to find, before it is captured; anything
+/// else is added afresh. Every path is added even if some cannot be.
+
+uft_status *
+uft_tx_add_set (uft_tx * tx, uft_enrol_set * set)
+{
+  static __thread uft_status status;
+  struct stat statbuf;
+  char dir_ok[set->dir_count + 1];
+  int failed = 0;
+
+  for (int d = 0; d < set->dir_count; d++) {
+    uft_dir * dir = set->dirs[d];
+    dir_ok[d] = stat(dir->path, &statbuf) == 0 && statbuf.st_dev == dir->dev && statbuf.st_ino == dir->ino;
+  }
+
+  for (int i = 0; i < set->count; i++) {
+    uft_enrol_ent * ent = &set->ents[i];
+    uft_status * add_status = tx_add_covered(tx, ent->path, set->flags);
+    if (add_status == NULL) {
+      uint64_t start = uft_metrics_now();
+      add_status = tx_add_ent_metered(tx, tx_add_set_ent(tx, set, ent, dir_ok), start, UFT_TRACE_ADD_ENT, ent->path, set->flags);
+    }
+    if (uft_status_error(add_status))
+      failed++;
+  }
+
+  if (failed > 0)
+    return uft_status_set_error(&status, "error adding set, %d of %d entities could not be added", failed, set->count);
+
+  return uft_status_set_success(&status, tx);
+}
+
+
+/// Capture an entity of a prepared enrolment set, returning the status
+/// of 'add_ent_at' (or its equivalent), 'dir_ok' saying which of the
+/// sets directories are still as they were.
+
+uft_status *
+tx_add_set_ent (uft_tx * tx, uft_enrol_set * set, uft_enrol_ent * ent, const char * dir_ok)
+{
+  static __thread uft_status status;
+  struct stat statbuf;
+  int flags = set->flags;
+
+  if (ent->dir_idx < 0 || !dir_ok[ent->dir_idx])
+    return tx_add_path(tx, ent->path, flags);
+
+  uft_dir * dir = set->dirs[ent->dir_idx];
+  if (ent->type != S_IFREG || (flags & (UFT_META_ONLY | UFT_META_XATTRS)) != 0
+      || fstatat(dir->fd, ent->path + ent->name_off, &statbuf, AT_SYMLINK_NOFOLLOW) != 0
+      || (statbuf.st_mode & S_IFMT) != S_IFREG)
+    return add_ent_at(tx, dir, ent->path, ent->name_off, flags);
+
+  int lock_result = tx_lock_ent(tx, dir, ent->path, ent->name_off, &statbuf, flags);
+  if (lock_result != UFT_LOCK_OK)
+    return tx_lock_status(&status, ent->path, lock_result);
+
+  return add_ent_reg(tx, dir, ent->path, ent->name_off, &statbuf, flags);
+}
+
+
+/// Walk a tree, adding what the walk finds to the transaction. Unless
+/// locks are wanted or the transaction is shared, what is found is
+/// captured in parallel, as it is found, by the threads walking (each
+/// with a scratch transaction of its own). Either way the entities are
+/// added to the transaction in order of their paths, so the result does
+/// not depend on the order they were found in.
+
+uft_status *
+tx_add_walk (uft_tx * tx, uft_walk * walk, char * what, int flags)
+{
+  static __thread uft_status status;
+  char error_path[PATH_MAX];
+  uft_walk_ent * ents;
+  int count;
+  int failed = 0;
+
+  int parallel = (flags & (UFT_LOCK_SH | UFT_LOCK_EX)) == 0 && tx->shm == NULL;
+  tx_walk walk_arg = { tx, flags & ~UFT_ASYNC_CAPTURE };
+  walk->dirs = (flags & (UFT_META_ONLY | UFT_META_XATTRS)) != 0;
+  walk->fp   = parallel ? tx_walk_capture : NULL;
+  walk->fini = tx_walk_fini;
+  walk->arg  = &walk_arg;
+
+  int walk_error = uft_walk_run(walk, &ents, &count, error_path, sizeof(error_path)) != 0 ? errno : 0;
+  if (walk_error != 0)
+    uft_tx_log_error(tx, "error adding \"%s\", could not read \"%s\": %s", what, error_path, strerror(walk_error));
+
+  for (int i = 0; i < count; i++) {
+    uft_status * add_status;
+    if (!parallel) {
+      add_status = uft_tx_add_ent(tx, ents[i].path, flags);
+    } else {
+      tx_walk_result * result = (tx_walk_result *) ents[i].data;
+      if (result == NULL) {
+        add_status = tx_add_ent(tx, uft_status_set_error(&status, "error adding \"%s\", out of memory", ents[i].path));
+      } else if (result->ent_state != NULL && tx_covered_under(tx, ents[i].path)) {
+        destroy_ent_state(result->ent_state);
+        add_status = uft_status_set_success(&status, tx);
+      } else if (result->ent_state != NULL) {
+        add_status = tx_add_ent_metered(tx, uft_status_set_success(&status, result->ent_state), result->start, UFT_TRACE_ADD_ENT, ents[i].path, flags);
+      } else {
+        if (result->error != NULL)
+          uft_status_set_error(&status, "%s", result->error);
+        else
+          uft_status_set_error(&status, "error adding \"%s\", out of memory", ents[i].path);
+        add_status = tx_add_ent_metered(tx, &status, result->start, UFT_TRACE_ADD_ENT, ents[i].path, flags);
+      }
+      if (result != NULL) {
+        free(result->error);
+        free(result);
+      }
+    }
+    if (uft_status_error(add_status))
+      failed++;
+  }
+  uft_walk_ents_free(ents, count);
+
+  if (walk_error != 0)
+    return uft_status_set_error(&status, "error adding \"%s\", could not read \"%s\": %s", what, error_path, strerror(walk_error));
+  if (failed > 0)
+    return uft_status_set_error(&status, "error adding \"%s\", %d of %d entities could not be added", what, failed, count);
+
+  return uft_status_set_success(&status, tx);
+}
+
+
+/// Capture an entity found by a walk, in the walking threads scratch
+/// transaction, returning a 'tx_walk_result' (or NULL if there is no
+/// memory for one).
+
+void *
+tx_walk_capture (const char * path, void ** ctxp, void * arg)
+{
+  tx_walk * walk_arg = (tx_walk *) arg;
+  tx_walk_result * result = (tx_walk_result *) malloc(sizeof(tx_walk_result));
+
+  if (result == NULL)
+    return NULL;
+  result->ent_state = NULL;
+  result->error = NULL;
+  result->start = uft_metrics_now();
+
+  // Not from the pool, as it is destroyed (see tx_walk_fini) rather than
+  // pooled when the walk is done.
+  if (*ctxp == NULL && (*ctxp = tx_alloc()) != NULL)
+    tx_init((uft_tx *) *ctxp, NULL);
+  uft_tx * scratch_tx = (uft_tx *) *ctxp;
+  if (scratch_tx == NULL)
+    return result;
+
+  uft_status * status = tx_add_path(scratch_tx, (char *) path, walk_arg->flags);
+  if (uft_status_error(status)) {
+    result->error = strdup(uft_status_error_msg(status));
+    return result;
+  }
+
+  // The entity state is handed over as it is, not kept on the scratch
+  // transactions claimed list.
+  result->ent_state = uft_status_data(status);
+  if (result->ent_state->claim != NULL) {
+    uft_ll_rmnode(result->ent_state->claim);
+    result->ent_state->claim = NULL;
+  }
+
+  return result;
+}
+
+
+/// Free a walking threads scratch transaction.
+
+void
+tx_walk_fini (void * ctx, void * arg)
+{
+  destroy_tx((uft_tx *) ctx);
+}
+
+
+/// Add a filesystem entity to the transaction, located by 'name' relative
+/// to the directory open as 'dirfd' (which may be AT_FDCWD). The directory
+/// descriptor is duplicated, the caller may close 'dirfd' afterwards.
+
+uft_status *
+uft_tx_add_ent_at(uft_tx * tx, int dirfd, char * name, int flags)
+{
+  static __thread uft_status status;
+  char path[PATH_MAX];
+
+  if (dirfd == AT_FDCWD || name[0] == '/')
+    return uft_tx_add_ent(tx, name, flags);
+
+  uint64_t start = uft_metrics_now();
+  uft_dir * dir = tx_dir_fd(tx, dirfd);
+  if (dir == NULL)
+    return tx_add_ent_metered(tx, uft_status_set_error(&status, "error adding \"%s\" relative to FD %d: %s", name, dirfd, strerror(errno)), start, UFT_TRACE_ADD_ENT, name, flags);
+
+  int name_off = strlen(dir->path) + 1;
+  if (snprintf(path, sizeof(path), "%s/%s", dir->path, name) >= sizeof(path))
+    return tx_add_ent_metered(tx, uft_status_set_error(&status, "error adding \"%s\" relative to FD %d: path too long", name, dirfd), start, UFT_TRACE_ADD_ENT, name, flags);
+
+  uft_status * covered = tx_add_covered(tx, path, flags);
+  if (covered != NULL)
+    return covered;
+
+  return tx_add_ent_metered(tx, add_ent_at(tx, dir, path, name_off, flags), start, UFT_TRACE_ADD_ENT, path, flags);
+}
+
+
+/// Add the regular file open as 'fd' to the transaction. The content is
+/// read from the descriptor itself (without moving its offset), so it is
+/// exactly the file the caller has open that is captured.
+
+uft_status *
+uft_tx_add_fd(uft_tx * tx, int fd)
+{
+  static __thread uft_status status;
+  struct stat statbuf;
+  char path[PATH_MAX];
+  uint64_t start = uft_metrics_now();
+
+  uft_fd_path(fd, path, sizeof(path));
+
+  if (fstat(fd, &statbuf) != 0)
+    return tx_add_ent_metered(tx, uft_status_set_error(&status, "error adding FD %d (\"%s\"): %s", fd, path, strerror(errno)), start, UFT_TRACE_ADD_FD, path, 0);
+  if ((statbuf.st_mode & S_IFMT) != S_IFREG)
+    return tx_add_ent_metered(tx, uft_status_set_error(&status, "error adding FD %d (\"%s\"), not a regular file", fd, path), start, UFT_TRACE_ADD_FD, path, 0);
+  if (statbuf.st_nlink == 0 || path[0] != '/')
+    return tx_add_ent_metered(tx, uft_status_set_error(&status, "error adding FD %d (\"%s\"), file has no path", fd, path), start, UFT_TRACE_ADD_FD, path, 0);
+
+  uft_status * covered = tx_add_covered(tx, path, 0);
+  if (covered != NULL)
+    return covered;
+
+  int name_off = path_name_off(path);
+  uft_dir * dir = tx_dir(tx, path, name_off > 1 ? name_off - 1 : 1);
+  if (dir == NULL)
+    name_off = 0;
+
+  int read_fd = fd;
+  if ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_WRONLY) {
+    char proc_path[32];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    read_fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+    if (read_fd < 0)
+      return tx_add_ent_metered(tx, uft_status_set_error(&status, "error adding FD %d (\"%s\"), could not open for read: %s", fd, path, strerror(errno)), start, UFT_TRACE_ADD_FD, path, 0);
+  }
+
+  uft_status * add_status = add_ent_file(tx, dir, path, name_off, read_fd, &statbuf, 0);
+  if (read_fd != fd)
+    close(read_fd);
+
+  return tx_add_ent_metered(tx, add_status, start, UFT_TRACE_ADD_FD, path, 0);
+}
+
+
+/// As 'tx_add_ent', recording the time taken to enrol the entity since
+/// 'start' (by its size) or counting the failure to, and tracing the
+/// call ('op', with the 'path' and 'flags' it was given).
+
+uft_status *
+tx_add_ent_metered (uft_tx * tx, uft_status * status, uint64_t start, int op, char * path, int flags)
+{
+  int kind = 0;
+  off_t size = -1;
+
+  if (uft_status_error(status)) {
+    uft_metrics_count(UFT_COUNT_ENROL_FAILED);
+  } else {
+    uft_ent_state * ent_state = uft_status_data(status);
+    size = (ent_state->flags & UFT_ES_FILE) != 0 ? ent_state->size : ent_state->data_len;
+    uft_metrics_enrol(size, start);
+    mode_t type = (ent_state->flags & UFT_ES_META) != 0 ? ent_state->meta.mode & S_IFMT : 0;
+    if ((ent_state->flags & UFT_ES_NOENT) != 0)
+      kind = UFT_TRACE_KIND_NOENT;
+    else if ((ent_state->flags & UFT_ES_SYMLINK) != 0 || type == S_IFLNK)
+      kind = UFT_TRACE_KIND_SYMLINK;
+    else if (type == S_IFDIR)
+      kind = UFT_TRACE_KIND_DIR;
+    else
+      kind = UFT_TRACE_KIND_FILE;
+  }
+  if (uft_trace_on)
+    uft_trace_call(op, tx->id, flags, kind, size + 1, path, NULL);
+
+  return tx_add_ent(tx, status);
+}
+
+
+uft_status *
+tx_add_ent(uft_tx * tx, uft_status * status)
+{
+  if (uft_status_error(status)) {
+    uft_tx_log_error(tx, "%s", uft_status_error_msg(status));
+    return status;
+  }
+
+  if (tx->shm != NULL)
+    return tx_share_ent(tx, status);
+
+  uft_ent_state * ent_state = uft_status_data(status);
+  uft_ll_node * lln;
+  pthread_mutex_lock(&tx->mutex);
+  if (ent_state->claim != NULL)
+    lln = uft_ll_move_tail(tx->ents, ent_state->claim);
+  else
+    lln = uft_ll_insert_tail(tx->ents, ent_state);
+  ent_state->claim = NULL;
+  if (lln != NULL && uft_trie_get(tx->ent_trie, ent_state->path) == NULL)
+    uft_trie_put(tx->ent_trie, ent_state->path, lln);
+  pthread_mutex_unlock(&tx->mutex);
+
+  if (lln == NULL) {
+    uft_status_set_error(status, "error adding \"%s\", out of memory", ent_state->path);
+    if (ent_state->capture != NULL)
+      __atomic_sub_fetch(&tx->captures, 1, __ATOMIC_RELAXED);
+    destroy_ent_state(ent_state);
+    uft_tx_log_error(tx, "%s", uft_status_error_msg(status));
+    return status;
+  }
+
+  return uft_status_set_success(status, tx);
+}
+
+
+/// Append a newly captured entity state to the transactions shared log,
+/// by absolute path (so any process can restore it), and keep the
+/// entity state for reuse.
+
+uft_status *
+tx_share_ent (uft_tx * tx, uft_status * status)
+{
+  uft_ent_state * ent_state = uft_status_data(status);
+  char path[PATH_MAX];
+
+  int path_ok = ent_abs_path(ent_state, path, sizeof(path));
+  int append_result = -1;
+  int append_errno = errno;
+  if (path_ok) {
+    // The extents are followed by an empty extent at the files size.
+    // The metadata of an entity added with UFT_META_ONLY is shared as is.
+    char * data = ent_state->data;
+    uft_extent * file_extents = ent_state->extents;
+    int extent_count = ent_state->extent_count;
+    if ((ent_state->flags & UFT_ES_FILE) != 0)
+      extent_count = ent_file_extents(ent_state, &data, &file_extents);
+    uft_extent extents[extent_count + 1];
+    void * meta = extents;
+    int meta_len = 0;
+    if ((ent_state->flags & UFT_ES_FILE) != 0) {
+      memcpy(extents, file_extents, sizeof(uft_extent) * extent_count);
+      extents[extent_count].off = ent_state->size;
+      extents[extent_count].len = 0;
+      meta_len = sizeof(uft_extent) * (extent_count + 1);
+    } else if ((ent_state->flags & UFT_ES_META) != 0) {
+      meta = &ent_state->meta;
+      meta_len = sizeof(uft_meta);
+    }
+    if (ent_state->spool_fd >= 0) {
+      data = mmap(NULL, ent_state->data_len, PROT_READ, MAP_SHARED, ent_state->spool_fd, 0);
+      if (data == MAP_FAILED)
+        data = NULL;
+    }
+    if (data != NULL || ent_state->data_len == 0) {
+      append_result = uft_shm_append(tx->shm, ent_state->flags, path, meta, meta_len, data, ent_state->data_len);
+      append_errno = errno;
+    } else {
+      append_errno = errno;
+    }
+    if (ent_state->spool_fd >= 0 && data != NULL)
+      munmap(data, ent_state->data_len);
+  }
+
+  // The entity state may be freed below, so the error is made first.
+  if (!path_ok)
+    uft_status_set_error(status, "error adding \"%s\" to shared transaction, path too long", ent_state->path);
+  else if (append_result != 0)
+    uft_status_set_error(status, "error adding \"%s\" to shared transaction: %s", path, strerror(append_errno));
+
+  pthread_mutex_lock(&tx->mutex);
+  uft_ll_node * lln = ent_state->claim;
+  if (lln == NULL)
+    lln = uft_ll_insert_tail(tx->spare_ents, ent_state);
+  ent_state->claim = NULL;
+  if (lln != NULL)
+    tx_spare_ent(tx, lln);
+  else
+    destroy_ent_state(ent_state);
+  pthread_mutex_unlock(&tx->mutex);
+
+  if (uft_status_error(status)) {
+    uft_tx_log_error(tx, "%s", uft_status_error_msg(status));
+    return status;
+  }
+
+  return uft_status_set_success(status, tx);
+}
+
+
+/// Put the absolute path of an entity in 'buf'. Returns false if it does
+/// not fit.
+
+int
+ent_abs_path (uft_ent_state * ent_state, char * buf, int buf_len)
+{
+  char dir_path[PATH_MAX];
+  int len;
+
+  if (ent_state->dir != NULL) {
+    uft_fd_path(ent_state->dir->fd, dir_path, sizeof(dir_path));
+    len = snprintf(buf, buf_len, "%s/%s", strcmp(dir_path, "/") == 0 ? "" : dir_path, ent_state->name);
+  } else if (ent_state->path[0] == '/') {
+    len = snprintf(buf, buf_len, "%s", ent_state->path);
+  } else {
+    if (getcwd(dir_path, sizeof(dir_path)) == NULL)
+      return 0;
+    len = snprintf(buf, buf_len, "%s/%s", strcmp(dir_path, "/") == 0 ? "" : dir_path, ent_state->path);
+  }
+
+  return len < buf_len;
+}
+
+
+/// Return the offset of the last component of a path, or -1 if the last
+/// component is empty, "." or ".." (so the path cannot be split).
+
+int
+path_name_off (const char * path)
+{
+  const char * name = strrchr(path, '/');
+
+  name = name == NULL ? path : name + 1;
+  if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    return -1;
+
+  return name - path;
+}
+
+
+/// Return true if rolling back the transaction would return 'path' to
+/// how it is now: if it has been added to the transaction, or is under
+/// a directory added to it that did not exist then (which rolling back
+/// removes along with everything in it). Only entities added in this
+/// process are known of.
+
+int
+uft_tx_covers (uft_tx * tx, char * path)
+{
+  pthread_mutex_lock(&tx->mutex);
+  int added = uft_trie_get(tx->ent_trie, path) != NULL;
+  pthread_mutex_unlock(&tx->mutex);
+
+  return added || tx_covered_under(tx, path);
+}
+
+
+/// Call 'fp' with the path of every entity added to the transaction at
+/// or under 'path' (or every entity, if 'path' is empty), parents before
+/// children, passing 'arg' too. Returns the number of calls made. The
+/// transaction is locked meanwhile, so 'fp' must not add to it.
+
+int
+uft_tx_each_enrolled (uft_tx * tx, char * path, void (*fp)(const char *, void *), void * arg)
+{
+  tx_each each = { fp, arg };
+
+  pthread_mutex_lock(&tx->mutex);
+  int count = uft_trie_each_under(tx->ent_trie, path, 0, ent_each_path, &each);
+  pthread_mutex_unlock(&tx->mutex);
+
+  return count;
+}
+
+
+void
+ent_each_path (void * data, void * arg)
+{
+  tx_each * each = (tx_each *) arg;
+  uft_ent_state * ent_state = (uft_ent_state *) uft_ll_data((uft_ll_node *) data);
+
+  each->fp(ent_state->path, each->arg);
+}
+
+
+/// If adding 'path' to the transaction would add nothing, because it is
+/// under a directory added to it that did not exist, return a successful
+/// status without capturing it, otherwise NULL. A path to be locked, or
+/// added to a shared transaction, is always added.
+
+uft_status *
+tx_add_covered (uft_tx * tx, char * path, int flags)
+{
+  static __thread uft_status status;
+
+  if ((flags & (UFT_LOCK_SH | UFT_LOCK_EX)) != 0 || tx->shm != NULL || !tx_covered_under(tx, path))
+    return NULL;
+
+  return uft_status_set_success(&status, tx);
+}
+
+
+/// Return true if 'path' is under a directory added to the transaction
+/// that did not exist, and that directory (and each directory between it
+/// and 'path') is a directory now, not a symlink, so removing it removes
+/// 'path' too.
+
+int
+tx_covered_under (uft_tx * tx, const char * path)
+{
+  char dir_path[PATH_MAX];
+  struct stat statbuf;
+  int dir_path_len = 0;
+  int count = 0;
+
+  pthread_mutex_lock(&tx->mutex);
+  int depth = uft_trie_count(tx->ent_trie) == 0 ? -1 : (int) (intptr_t) uft_trie_each_prefix(tx->ent_trie, path, ent_noent_depth, NULL) - 1;
+  pthread_mutex_unlock(&tx->mutex);
+  if (depth < 0)
+    return 0;
+
+  // Walk the components of the path as the trie splits it, checking each
+  // directory from the one added down to the parent of the path.
+  const char * p = path;
+  if (*p == '/') {
+    dir_path[dir_path_len++] = '/';
+    count++;
+  }
+  while (*p != '\0') {
+    while (*p == '/')
+      p++;
+    const char * end = strchrnul(p, '/');
+    int len = end - p;
+    if (len == 0 || (len == 1 && *p == '.')) {
+      p = end;
+      continue;
+    }
+    if (count >= depth) {
+      if (len == 2 && p[0] == '.' && p[1] == '.')
+        return 0;
+      dir_path[dir_path_len] = '\0';
+      if (fstatat(AT_FDCWD, dir_path, &statbuf, AT_SYMLINK_NOFOLLOW) != 0 || (statbuf.st_mode & S_IFMT) != S_IFDIR)
+        return 0;
+    }
+    if (dir_path_len + len + 2 > sizeof(dir_path))
+      return 0;
+    if (dir_path_len > 0 && dir_path[dir_path_len - 1] != '/')
+      dir_path[dir_path_len++] = '/';
+    memcpy(dir_path + dir_path_len, p, len);
+    dir_path_len += len;
+    count++;
+    p = end;
+  }
+
+  return count > depth;
+}
+
+
+/// For 'uft_trie_each_prefix', return one more than the depth of an
+/// entity state of a path that did not exist, or NULL for any other.
+
+void *
+ent_noent_depth (void * data, int depth, void * arg)
+{
+  uft_ent_state * ent_state = (uft_ent_state *) uft_ll_data((uft_ll_node *) data);
+
+  return (ent_state->flags & UFT_ES_NOENT) != 0 ? (void *) (intptr_t) (depth + 1) : NULL;
+}
+
+
+/// Return the transactions handle on the directory that is the first
+/// 'dir_path_len' bytes of 'dir_path', opening it if it is not already
+/// open. Returns NULL if the directory cannot be opened (for example it
+/// does not exist, or there are no file descriptors left). The directory
+/// is opened without the transaction locked; if another thread opens it
+/// too meanwhile, its handle is used and this one dropped.
+
+uft_dir *
+tx_dir (uft_tx * tx, const char * dir_path, int dir_path_len)
+{
+  pthread_mutex_lock(&tx->mutex);
+  uft_dir * dir = uft_ht_get(tx->dirs, dir_path, dir_path_len);
+  pthread_mutex_unlock(&tx->mutex);
+  if (dir != NULL)
+    return dir;
+
+  uft_dir * new_dir = uft_dir_open(dir_path, dir_path_len);
+  if (new_dir == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&tx->mutex);
+  dir = uft_ht_get(tx->dirs, dir_path, dir_path_len);
+  if (dir == NULL)
+    uft_ht_put(tx->dirs, new_dir->path, dir_path_len, new_dir);
+  pthread_mutex_unlock(&tx->mutex);
+  if (dir == NULL)
+    return new_dir;
+
+  uft_dir_unref(new_dir);
+  return dir;
+}
+
+
+/// Return the transactions handle on the directory open as 'dirfd'.
+
+uft_dir *
+tx_dir_fd (uft_tx * tx, int dirfd)
+{
+  struct stat statbuf;
+  char dir_path[PATH_MAX];
+  int dir_path_len = uft_fd_path(dirfd, dir_path, sizeof(dir_path));
+
+  if (fstat(dirfd, &statbuf) != 0)
+    return NULL;
+
+  pthread_mutex_lock(&tx->mutex);
+  uft_dir * dir = uft_ht_get(tx->dirs, dir_path, dir_path_len);
+  pthread_mutex_unlock(&tx->mutex);
+  if (dir != NULL && dir->dev == statbuf.st_dev && dir->ino == statbuf.st_ino)
+    return dir;
+
+  uft_dir * new_dir = uft_dir_dup(dirfd);
+  if (new_dir == NULL)
+    return NULL;
+  pthread_mutex_lock(&tx->mutex);
+  if (uft_ht_get(tx->dirs, dir_path, dir_path_len) == NULL)
+    uft_ht_put(tx->dirs, new_dir->path, dir_path_len, new_dir);
+  else
+    uft_ll_insert_tail(tx->spare_dirs, new_dir);
+  pthread_mutex_unlock(&tx->mutex);
+
+  return new_dir;
+}
+
+
+/// Release the transactions directory handles.
+
+void
+tx_clear_dirs (uft_tx * tx)
+{
+  uft_ll_node * lln;
+
+  uft_ht_each(tx->dirs, tx_unref_dir, NULL);
+  uft_ht_clear(tx->dirs);
+  while ((lln = uft_ll_head(tx->spare_dirs)) != NULL)
+    uft_dir_unref(uft_ll_rmnode(lln));
+}
+
+
+void
+tx_unref_dir (const void * key, int keylen, void * data, void * arg)
+{
+  uft_dir_unref(data);
+}
+
+
+/// Lock an entity for the transaction, if 'flags' asks for a lock. The
+/// lock is owned by the top level transaction, so a transaction and its
+/// children never conflict with each other. Returns UFT_LOCK_OK if the
+/// lock is acquired (or not wanted).
+
+int
+tx_lock (uft_tx * tx, dev_t dev, ino_t ino, unsigned int name_hash, int flags)
+{
+  if ((flags & (UFT_LOCK_SH | UFT_LOCK_EX)) == 0)
+    return UFT_LOCK_OK;
+
+  uft_tx_lock * held = (uft_tx_lock *) malloc(sizeof(uft_tx_lock));
+  if (held == NULL)
+    return UFT_LOCK_NOMEM;
+  held->key.dev = dev;
+  held->key.ino = ino;
+  held->key.name_hash = name_hash;
+
+  uft_tx * root_tx = tx;
+  while (root_tx->parent != NULL)
+    root_tx = root_tx->parent;
+  held->owner = root_tx->id;
+
+  int result = uft_lock_acquire(&held->key, held->owner, (flags & UFT_LOCK_EX) != 0, (flags & UFT_LOCK_TRY) != 0);
+  if (result == UFT_LOCK_OK) {
+    pthread_mutex_lock(&tx->mutex);
+    uft_ll_insert_tail(tx->locks, held);
+    pthread_mutex_unlock(&tx->mutex);
+  } else {
+    free(held);
+  }
+
+  return result;
+}
+
+
+/// Return an error status for a lock that could not be acquired.
+
+/// Lock an entity for the transaction, as 'flags' ask, by its name in
+/// its directory ('path' + 'name_off' relative to 'dir'), and if it
+/// exists ('statbufp' being its status) by its device and inode too. So
+/// a path locked before it existed is still locked once it does, and a
+/// file is locked whichever of its names it is added by. Returns the
+/// result of 'tx_lock'; if the second lock fails the first is kept until
+/// the transaction finishes, as any other.
+
+int
+tx_lock_ent (uft_tx * tx, uft_dir * dir, char * path, int name_off, struct stat * statbufp, int flags)
+{
+  char * name = path + name_off;
+
+  int result = dir != NULL
+    ? tx_lock(tx, dir->dev, dir->ino, uft_ht_hash(name, strlen(name)) | 1, flags)
+    : tx_lock(tx, 0, 0, uft_ht_hash(path, strlen(path)) | 1, flags);
+  if (result != UFT_LOCK_OK || statbufp == NULL)
+    return result;
+
+  return tx_lock(tx, statbufp->st_dev, statbufp->st_ino, 0, flags);
+}
+
+
+uft_status *
+tx_lock_status (uft_status * status, char * path, int result)
+{
+  if (result == UFT_LOCK_NOMEM)
+    return uft_status_set_error(status, "error locking \"%s\", out of memory", path);
+
+  uft_status_set_error(status, result == UFT_LOCK_BUSY
+                               ? "error locking \"%s\", it is locked by another transaction"
+                               : "error locking \"%s\", it is locked by an older transaction (would deadlock)",
+                       path);
+  status->code |= UFT_STATUS_BUSY;
+
+  return status;
+}
+
+
+/// Release all the locks held by a transaction.
+
+void
+tx_release_locks (uft_tx * tx)
+{
+  uft_ll_node * lln;
+
+  while ((lln = uft_ll_tail(tx->locks)) != NULL) {
+    uft_tx_lock * held = uft_ll_rmnode(lln);
+    uft_lock_release(&held->key, held->owner);
+    free(held);
+  }
+}
+
+
+/// Release all the locks held by a transaction and its descendants.
+
+void
+tx_release_all_locks (uft_tx * tx)
+{
+  uft_ll * work = tx_descendants(tx);
+
+  for (uft_ll_node * lln = uft_ll_head(work); lln != NULL; lln = uft_ll_next(lln))
+    tx_release_locks(uft_ll_data(lln));
+  uft_ll_rm(work);
+
+  tx_release_locks(tx);
+}
+
+
+/// Add the entity 'path' to the transaction, where the entity is at
+/// 'path' + 'name_off' relative to 'dir' (or to the current directory
+/// if 'dir' is NULL). The entity is opened with O_PATH and examined via
+/// that descriptor, so the type seen is the type of what is captured.
+
+uft_status *
+add_ent_at(uft_tx * tx, uft_dir * dir, char * path, int name_off, int flags)
+{
+  static __thread uft_status status;
+  struct stat statbuf;
+  int dirfd = dir != NULL ? dir->fd : AT_FDCWD;
+  char * name = path + name_off;
+
+  int path_fd = openat(dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  if (path_fd < 0) {
+    if (errno == ENOENT)
+      return add_ent_noent(tx, dir, path, name_off, flags);
+    return uft_status_set_error(&status, "error adding \"%s\", could not open: %s", path, strerror(errno));
+  }
+  if (fstatat(path_fd, "", &statbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) != 0) {
+    close(path_fd);
+    return uft_status_set_error(&status, "error adding \"%s\", could not stat: %s", path, strerror(errno));
+  }
+  if ((statbuf.st_mode & S_IFMT) != S_IFDIR) {
+    int lock_result = tx_lock_ent(tx, dir, path, name_off, &statbuf, flags);
+    if (lock_result != UFT_LOCK_OK) {
+      close(path_fd);
+      return tx_lock_status(&status, path, lock_result);
+    }
+  }
+
+  uft_status * add_status;
+  if ((flags & (UFT_META_ONLY | UFT_META_XATTRS)) != 0) {
+    add_status = add_ent_meta(tx, dir, path, name_off, path_fd, &statbuf, flags);
+  } else if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
+    add_status = add_ent_dir(tx, path);
+  } else if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
+    add_status = add_ent_reg(tx, dir, path, name_off, &statbuf, flags);
+  } else if ((statbuf.st_mode & S_IFMT) == S_IFLNK) {
+    add_status = add_ent_symlink(tx, dir, path, name_off, path_fd, &statbuf);
+  } else {
+    add_status = uft_status_set_error(&status, "cannot add \"%s\" to transaction, unsupported file type", path);
+  }
+
+  close(path_fd);
+
+  return add_status;
+}
+
+
+/// Add the regular file 'path' (at 'path' + 'name_off' relative to
+/// 'dir'), 'statbufp' being its status as found by path. If it was
+/// locked it is looked at again, as it may have been changed while the
+/// lock was waited for. Unless it is found unchanged in the snapshot
+/// cache it is opened for read, and must still be the same file.
+
+uft_status *
+add_ent_reg (uft_tx * tx, uft_dir * dir, char * path, int name_off, struct stat * statbufp, int flags)
+{
+  static __thread uft_status status;
+  struct stat fd_statbuf;
+  struct stat locked_statbuf;
+  uft_status * add_status;
+
+  if ((flags & (UFT_LOCK_SH | UFT_LOCK_EX)) != 0) {
+    if (fstatat(dir != NULL ? dir->fd : AT_FDCWD, path + name_off, &locked_statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+      return uft_status_set_error(&status, "error adding \"%s\", could not stat: %s", path, strerror(errno));
+    if (locked_statbuf.st_dev != statbufp->st_dev || locked_statbuf.st_ino != statbufp->st_ino)
+      return uft_status_set_error(&status, "error adding file \"%s\", it was replaced while being added", path);
+    statbufp = &locked_statbuf;
+  }
+
+  uft_snap * snap = (flags & (UFT_APPEND_ONLY | UFT_NOCACHE | UFT_DIRECT_IO)) == 0 ? uft_snap_get(statbufp) : NULL;
+  int fd = snap == NULL ? openat(dir != NULL ? dir->fd : AT_FDCWD, path + name_off, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+  if (snap != NULL) {
+    add_status = add_ent_snap(tx, dir, path, name_off, snap);
+  } else if (fd < 0) {
+    return uft_status_set_error(&status, "error adding file \"%s\", could not open for read: %s", path, strerror(errno));
+  } else if (fstat(fd, &fd_statbuf) != 0 || fd_statbuf.st_dev != statbufp->st_dev || fd_statbuf.st_ino != statbufp->st_ino) {
+    add_status = uft_status_set_error(&status, "error adding file \"%s\", it was replaced while being added", path);
+  } else if ((flags & UFT_APPEND_ONLY) != 0) {
+    add_status = add_ent_append(tx, dir, path, name_off, fd, &fd_statbuf);
+  } else {
+    add_status = add_ent_file(tx, dir, path, name_off, fd, &fd_statbuf, flags);
+  }
+  if (fd >= 0)
+    close(fd);
+
+  if (uft_status_success(add_status) && (flags & (UFT_DIFF_ROLLBACK | UFT_APPEND_ONLY)) == UFT_DIFF_ROLLBACK)
+    ((uft_ent_state *) uft_status_data(add_status))->flags |= UFT_ES_DIFF;
+
+  return add_status;
+}
+
+
+uft_status *
+add_ent_dir(uft_tx * tx, char * path)
+{
+  static __thread uft_status status;
+
+  return uft_status_set_error(&status, "cannot add existing directory \"%s\" to transaction", path);
+}
+
+
+/// Capture only the metadata of an entity (see UFT_META_ONLY) of any
+/// type, taken from the stat already made of it, and with
+/// UFT_META_XATTRS in 'flags' its extended attributes too (unless it is
+/// a symlink, which can not be given any).
+
+uft_status *
+add_ent_meta (uft_tx * tx, uft_dir * dir, char * path, int name_off, int path_fd, struct stat * statbufp, int flags)
+{
+  static __thread uft_status status;
+  int xattrs = (flags & UFT_META_XATTRS) != 0 && (statbufp->st_mode & S_IFMT) != S_IFLNK;
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, xattrs ? UFT_ES_META | UFT_ES_XATTRS : UFT_ES_META, dir, path, name_off, 0);
+  if (ent_state == NULL)
+    return uft_status_set_error(&status, "error adding metadata of \"%s\", out of memory", path);
+  ent_state->meta.mode  = statbufp->st_mode;
+  ent_state->meta.uid   = statbufp->st_uid;
+  ent_state->meta.gid   = statbufp->st_gid;
+  ent_state->meta.atime = statbufp->st_atim;
+  ent_state->meta.mtime = statbufp->st_mtim;
+
+  if (xattrs && ent_capture_xattrs(ent_state, path_fd) != 0) {
+    uft_status_set_error(&status, "error adding extended attributes of \"%s\": %s", path, strerror(errno));
+    tx_discard_ent_state(tx, ent_state);
+    return &status;
+  }
+
+  return uft_status_set_success(&status, ent_state);
+}
+
+
+/// Capture the extended attributes of the entity open (with O_PATH) as
+/// 'path_fd' as the data of 'ent_state'. An entity on a file system
+/// without extended attributes has none. Returns 0 on success or -1
+/// (with errno set).
+
+int
+ent_capture_xattrs (uft_ent_state * ent_state, int path_fd)
+{
+  char proc_path[32];
+  off_t data_len = 0;
+
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", path_fd);
+  ssize_t names_len = listxattr(proc_path, NULL, 0);
+  if (names_len <= 0)
+    return names_len == 0 || errno == ENOTSUP ? 0 : -1;
+  char names[names_len];
+  names_len = listxattr(proc_path, names, names_len);
+  if (names_len < 0)
+    return -1;
+
+  for (char * name = names; name < names + names_len; name += strlen(name) + 1) {
+    int name_len = strlen(name) + 1;
+    ssize_t value_len = getxattr(proc_path, name, NULL, 0);
+    if (value_len >= 0 && !ent_reserve_data(ent_state, data_len + name_len + sizeof(uint32_t) + value_len)) {
+      errno = ENOMEM;
+      return -1;
+    }
+    if (value_len >= 0)
+      value_len = getxattr(proc_path, name, ent_state->data + data_len + name_len + sizeof(uint32_t), value_len);
+    if (value_len < 0) {
+      if (errno == ENODATA)
+        continue;
+      return -1;
+    }
+    uint32_t len = value_len;
+    memcpy(ent_state->data + data_len, name, name_len);
+    memcpy(ent_state->data + data_len + name_len, &len, sizeof(len));
+    data_len += name_len + sizeof(len) + value_len;
+  }
+  ent_state->data_len = data_len;
+
+  return 0;
+}
+
+
+/// Capture a regular file open as 'fd'. Only the files data extents are
+/// read and kept, holes are found with SEEK_DATA / SEEK_HOLE (on a file
+/// system without them the whole file is one extent). The descriptors
+/// offset is left as it was. If there is more than UFT_SPOOL_MIN bytes
+/// of data it is copied, in chunks, to a spool file rather than read in
+/// to memory. With UFT_NOCACHE (or UFT_DIRECT_IO) in 'flags' the file
+/// (and spool file) is dropped from the page cache once copied, and with
+/// UFT_DIRECT_IO it is read with O_DIRECT if the file system allows.
+/// With UFT_ASYNC_CAPTURE the copying is left to a worker (see
+/// 'tx_capture_async'). Either way, what is read is offered to the
+/// snapshot cache, if it is enabled (unless UFT_NOCACHE or UFT_DIRECT_IO
+/// is given).
+
+uft_status *
+add_ent_file(uft_tx * tx, uft_dir * dir, char * path, int name_off, int fd, struct stat * statbufp, int flags)
+{
+  static __thread uft_status status;
+  int nocache = (flags & (UFT_NOCACHE | UFT_DIRECT_IO)) != 0;
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, nocache ? UFT_ES_FILE | UFT_ES_NOCACHE : UFT_ES_FILE, dir, path, name_off, 0);
+  if (ent_state == NULL)
+    return uft_status_set_error(&status, "error adding file \"%s\", out of memory", path);
+  ent_state->size = statbufp->st_size;
+
+  if ((flags & UFT_ASYNC_CAPTURE) != 0 && tx->shm == NULL && tx_capture_async(tx, ent_state, fd, statbufp, flags))
+    return uft_status_set_success(&status, ent_state);
+
+  if (uft_status_error(ent_capture_file(&status, ent_state, fd, statbufp, flags))) {
+    tx_discard_ent_state(tx, ent_state);
+    return &status;
+  }
+
+  return &status;
+}
+
+
+/// Add a regular file found unchanged in the snapshot cache, taking over
+/// the reference to its snapshot, rather than reading it.
+
+uft_status *
+add_ent_snap (uft_tx * tx, uft_dir * dir, char * path, int name_off, uft_snap * snap)
+{
+  static __thread uft_status status;
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, UFT_ES_FILE, dir, path, name_off, 0);
+  if (ent_state == NULL) {
+    uft_snap_unref(snap);
+    return uft_status_set_error(&status, "error adding file \"%s\", out of memory", path);
+  }
+  ent_state->snap = snap;
+  ent_state->size = snap->key.size;
+  ent_state->data_len = snap->data_len;
+
+  return uft_status_set_success(&status, ent_state);
+}
+
+
+/// Capture the data of a regular file open as 'fd' in to 'ent_state' (as
+/// described for 'add_ent_file'), setting 'status' to success or to the
+/// error. On error the entity state is left to be discarded.
+
+uft_status *
+ent_capture_file (uft_status * status, uft_ent_state * ent_state, int fd, struct stat * statbufp, int flags)
+{
+  char * path = ent_state->path;
+  off_t size = statbufp->st_size;
+  off_t fd_off = lseek(fd, 0, SEEK_CUR);
+  off_t off = 0;
+  off_t data_len = 0;
+  int nocache = (flags & (UFT_NOCACHE | UFT_DIRECT_IO)) != 0;
+  int direct_fd = -1;
+  uint64_t captured = !nocache && uft_snap_enabled() ? uft_snap_clock() : 0;
+
+  while (off < size) {
+    off_t data_off = lseek(fd, off, SEEK_DATA);
+    off_t hole_off;
+    if (data_off < 0) {
+      if (errno == ENXIO)
+        break;
+      data_off = off;
+      hole_off = size;
+    } else {
+      hole_off = lseek(fd, data_off, SEEK_HOLE);
+      if (hole_off < 0 || hole_off > size)
+        hole_off = size;
+    }
+    if (data_off >= size)
+      break;
+    if (!ent_add_extent(ent_state, data_off, hole_off - data_off))
+      return uft_status_set_error(status, "error adding file \"%s\", out of memory", path);
+    data_len += hole_off - data_off;
+    off = hole_off;
+  }
+  if (fd_off >= 0)
+    lseek(fd, fd_off, SEEK_SET);
+
+  if (data_len > UFT_SPOOL_MIN) {
+    ent_state->spool_fd = uft_io_spool();
+    if (ent_state->spool_fd < 0)
+      return uft_status_set_error(status, "error adding file \"%s\", could not create spool file: %s", path, strerror(errno));
+  } else if (!ent_reserve_data(ent_state, data_len)) {
+    return uft_status_set_error(status, "error adding file \"%s\", out of memory", path);
+  }
+  ent_state->data_len = data_len;
+
+  if (nocache)
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+  if ((flags & UFT_DIRECT_IO) != 0 && data_len > 0) {
+    char proc_path[32];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    direct_fd = open(proc_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+  }
+
+  off_t store_off = 0;
+  for (int i = 0; i < ent_state->extent_count; i++) {
+    uft_extent * extent = &ent_state->extents[i];
+    off_t got = -1;
+    errno = 0;
+    if (direct_fd >= 0) {
+      got = uft_io_copy_direct(direct_fd, extent->off, ent_state->spool_fd, ent_state->data + store_off, store_off, extent->len);
+      if (got < 0 && errno == EINVAL) {
+        close(direct_fd);
+        direct_fd = -1;
+      }
+    }
+    if (direct_fd < 0)
+      got = ent_state->spool_fd >= 0
+        ? uft_io_copy(fd, extent->off, ent_state->spool_fd, store_off, extent->len)
+        : uft_io_pread(fd, ent_state->data + store_off, extent->len, extent->off);
+    if (got != extent->len) {
+      if (direct_fd >= 0)
+        close(direct_fd);
+      if (got >= 0)
+        return uft_status_set_error(status, "error adding file \"%s\", it was truncated while being read", path);
+      return uft_status_set_error(status, "error adding file \"%s\", failed to read: %s", path, strerror(errno));
+    }
+    store_off += extent->len;
+  }
+
+  if (direct_fd >= 0)
+    close(direct_fd);
+  if (nocache) {
+    uft_io_nocache(fd, 0, size, 0);
+    if (ent_state->spool_fd >= 0)
+      uft_io_nocache(ent_state->spool_fd, 0, data_len, 1);
+  }
+  if (captured != 0)
+    uft_snap_put(statbufp, fd, captured, ent_state);
+
+  return uft_status_set_success(status, ent_state);
+}
+
+
+/// Have a worker capture the data of a regular file open as 'fd' in to
+/// 'ent_state', from a duplicate of the descriptor. Until the capture
+/// is joined (see 'tx_capture_wait') nothing but the entity states path
+/// and flags may be used. Returns false, having done nothing, if the
+/// capture cannot be handed to a worker, or if the caller is itself a
+/// worker (an asynchronous transaction), which would otherwise wait on
+/// the pool it is holding.
+
+int
+tx_capture_async (uft_tx * tx, uft_ent_state * ent_state, int fd, struct stat * statbufp, int flags)
+{
+  if (uft_async_on_worker())
+    return 0;
+
+  uft_capture * capture = (uft_capture *) malloc(sizeof(uft_capture));
+  if (capture == NULL)
+    return 0;
+
+  capture->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (capture->fd < 0) {
+    free(capture);
+    return 0;
+  }
+  pthread_mutex_init(&capture->mutex, NULL);
+  pthread_cond_init(&capture->cond, NULL);
+  capture->done      = 0;
+  capture->joining   = 0;
+  capture->failed    = 0;
+  capture->error     = NULL;
+  capture->flags     = flags;
+  capture->statbuf   = *statbufp;
+  capture->ent_state = ent_state;
+
+  ent_state->capture = capture;
+  if (uft_async_submit(capture_file_job, capture) != 0) {
+    ent_state->capture = NULL;
+    close(capture->fd);
+    pthread_mutex_destroy(&capture->mutex);
+    pthread_cond_destroy(&capture->cond);
+    free(capture);
+    return 0;
+  }
+  __atomic_add_fetch(&tx->captures, 1, __ATOMIC_RELAXED);
+
+  return 1;
+}
+
+
+/// A worker pool job capturing a files data.
+
+void
+capture_file_job (void * arg)
+{
+  uft_capture * capture = (uft_capture *) arg;
+  uft_status status;
+
+  if (uft_status_error(ent_capture_file(&status, capture->ent_state, capture->fd, &capture->statbuf, capture->flags))) {
+    capture->failed = 1;
+    capture->error = strdup(uft_status_error_msg(&status));
+  }
+  close(capture->fd);
+
+  pthread_mutex_lock(&capture->mutex);
+  capture->done = 1;
+  pthread_cond_broadcast(&capture->cond);
+  pthread_mutex_unlock(&capture->mutex);
+}
+
+
+/// Wait for a background capture to finish.
+
+void
+capture_wait (uft_capture * capture)
+{
+  pthread_mutex_lock(&capture->mutex);
+  while (!capture->done)
+    pthread_cond_wait(&capture->cond, &capture->mutex);
+  pthread_mutex_unlock(&capture->mutex);
+}
+
+
+/// Wait for the background capture of an entity state to finish and
+/// free it. If it failed, its error message is put in 'msg' (if not
+/// NULL) and the entity state is left with nothing to restore. Returns
+/// 0 on success or -1 on failure.
+
+int
+ent_capture_join (uft_ent_state * ent_state, char * msg, int msg_len)
+{
+  uft_capture * capture = ent_state->capture;
+
+  capture_wait(capture);
+
+  int failed = capture->failed;
+  if (failed) {
+    ent_state->flags = 0;
+    if (msg != NULL)
+      snprintf(msg, msg_len, "%s", capture->error != NULL ? capture->error : "error adding file, capture failed");
+  }
+
+  ent_state->capture = NULL;
+  pthread_mutex_destroy(&capture->mutex);
+  pthread_cond_destroy(&capture->cond);
+  free(capture->error);
+  free(capture);
+
+  return failed ? -1 : 0;
+}
+
+
+/// Join the background capture of one of the transactions entity states,
+/// logging its error if it failed. Returns false if it failed.
+
+int
+tx_capture_wait (uft_tx * tx, uft_ent_state * ent_state)
+{
+  char msg[UFT_MAX_MSG_LEN];
+
+  __atomic_sub_fetch(&tx->captures, 1, __ATOMIC_RELAXED);
+  if (ent_capture_join(ent_state, msg, sizeof(msg)) == 0)
+    return 1;
+
+  uft_tx_log_error(tx, "%s", msg);
+  return 0;
+}
+
+
+/// Join every background capture still going for the transaction,
+/// failing it if any failed.
+
+void
+tx_finish_captures (uft_tx * tx)
+{
+  if (tx->captures == 0)
+    return;
+
+  for (uft_ll_node * lln = uft_ll_head(tx->ents); lln != NULL && tx->captures > 0; lln = uft_ll_next(lln)) {
+    uft_ent_state * ent_state = uft_ll_data(lln);
+    if (ent_state->capture != NULL && !tx_capture_wait(tx, ent_state))
+      uft_tx_fail(tx);
+  }
+}
+
+
+/// Wait for any background capture of the file at 'path' (following
+/// symlinks) by the transaction or its ancestors to finish, so that it
+/// is safe to change the file. Returns 0, or -1 if a capture failed (in
+/// which case the transaction is failed and the error logged).
+
+int
+uft_tx_barrier (uft_tx * tx, char * path)
+{
+  struct stat statbuf;
+  uft_tx * a_tx;
+
+  for (a_tx = tx; a_tx != NULL && __atomic_load_n(&a_tx->captures, __ATOMIC_RELAXED) == 0; a_tx = a_tx->parent)
+    ;
+  if (a_tx == NULL || stat(path, &statbuf) != 0)
+    return 0;
+
+  return tx_barrier(tx, statbuf.st_dev, statbuf.st_ino);
+}
+
+
+/// As 'uft_tx_barrier', for the file open as 'fd'.
+
+int
+uft_tx_barrier_fd (uft_tx * tx, int fd)
+{
+  struct stat statbuf;
+  uft_tx * a_tx;
+
+  for (a_tx = tx; a_tx != NULL && __atomic_load_n(&a_tx->captures, __ATOMIC_RELAXED) == 0; a_tx = a_tx->parent)
+    ;
+  if (a_tx == NULL || fstat(fd, &statbuf) != 0)
+    return 0;
+
+  return tx_barrier(tx, statbuf.st_dev, statbuf.st_ino);
+}
+
+
+/// Join the background captures, by the transaction or its ancestors,
+/// of the file identified by 'dev' and 'ino'. A capture is marked as
+/// being joined under the transactions mutex (so no other thread joins
+/// it too, a barrier finding it so waiting on 'capture_cond' instead),
+/// waited for without the mutex, and then freed under it. Its entities
+/// are looked through again after each.
+
+int
+tx_barrier (uft_tx * tx, dev_t dev, ino_t ino)
+{
+  char msg[UFT_MAX_MSG_LEN];
+  int result = 0;
+
+  for (uft_tx * a_tx = tx; a_tx != NULL; a_tx = a_tx->parent) {
+    uft_ent_state * ent_state;
+    pthread_mutex_lock(&a_tx->mutex);
+    do {
+      ent_state = NULL;
+      for (uft_ll_node * lln = uft_ll_head(a_tx->ents); lln != NULL && a_tx->captures > 0 && ent_state == NULL; lln = uft_ll_next(lln)) {
+        uft_capture * capture = ((uft_ent_state *) uft_ll_data(lln))->capture;
+        if (capture != NULL && capture->statbuf.st_dev == dev && capture->statbuf.st_ino == ino)
+          ent_state = uft_ll_data(lln);
+      }
+      if (ent_state == NULL)
+        break;
+      if (ent_state->capture->joining) {
+        pthread_cond_wait(&a_tx->capture_cond, &a_tx->mutex);
+        continue;
+      }
+
+      ent_state->capture->joining = 1;
+      pthread_mutex_unlock(&a_tx->mutex);
+      capture_wait(ent_state->capture);
+      pthread_mutex_lock(&a_tx->mutex);
+      __atomic_sub_fetch(&a_tx->captures, 1, __ATOMIC_RELAXED);
+      int failed = ent_capture_join(ent_state, msg, sizeof(msg)) != 0;
+      pthread_cond_broadcast(&a_tx->capture_cond);
+      if (failed) {
+        pthread_mutex_unlock(&a_tx->mutex);
+        uft_tx_log_error(a_tx, "%s", msg);
+        uft_tx_fail(a_tx);
+        result = -1;
+        pthread_mutex_lock(&a_tx->mutex);
+      }
+    } while (ent_state != NULL);
+    pthread_mutex_unlock(&a_tx->mutex);
+  }
+  if (result != 0)
+    uft_tx_fail(tx);
+
+  return result;
+}
+
+
+/// Capture a regular file that will only be appended to. Only its size
+/// and last UFT_APPEND_CHECK_LEN bytes are kept, so rollback can check
+/// the original content is still there and truncate the file back to it.
+
+uft_status *
+add_ent_append(uft_tx * tx, uft_dir * dir, char * path, int name_off, int fd, struct stat * statbufp)
+{
+  static __thread uft_status status;
+  off_t check_len = statbufp->st_size < UFT_APPEND_CHECK_LEN ? statbufp->st_size : UFT_APPEND_CHECK_LEN;
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, UFT_ES_FILE | UFT_ES_APPEND, dir, path, name_off, check_len);
+  if (ent_state == NULL)
+    return uft_status_set_error(&status, "error adding file \"%s\", out of memory", path);
+  ent_state->size = statbufp->st_size;
+
+  if (uft_io_pread(fd, ent_state->data, check_len, statbufp->st_size - check_len) != check_len) {
+    tx_discard_ent_state(tx, ent_state);
+    return uft_status_set_error(&status, "error adding file \"%s\", failed to read: %s", path, strerror(errno));
+  }
+
+  return uft_status_set_success(&status, ent_state);
+}
+
+
+uft_status *
+add_ent_symlink(uft_tx * tx, uft_dir * dir, char * path, int name_off, int path_fd, struct stat * statbufp)
+{
+  static __thread uft_status status;
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, UFT_ES_SYMLINK, dir, path, name_off, statbufp->st_size + 1);
+  if (ent_state == NULL)
+    return uft_status_set_error(&status, "error adding symlink \"%s\", out of memory", path);
+
+  if (readlinkat(path_fd, "", ent_state->data, statbufp->st_size) != statbufp->st_size) {
+    tx_discard_ent_state(tx, ent_state);
+    return uft_status_set_error(&status, "error adding symlink \"%s\", failed to read: %s", path, strerror(errno));
+  }
+  ent_state->data[statbufp->st_size] = '\0';
+  ent_state->data_len = statbufp->st_size;
+
+  return uft_status_set_success(&status, ent_state);
+}
+
+
+uft_status *
+add_ent_noent(uft_tx * tx, uft_dir * dir, char * path, int name_off, int flags)
+{
+  static __thread uft_status status;
+
+  if ((flags & UFT_ALLOW_NOENT) == 0)
+    return uft_status_set_error(&status, "error adding non existent entity \"%s\", set UFT_ALLOW_NOENT if this is allowed", path);
+
+  int lock_result = tx_lock_ent(tx, dir, path, name_off, NULL, flags);
+  if (lock_result != UFT_LOCK_OK)
+    return tx_lock_status(&status, path, lock_result);
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, UFT_ES_NOENT, dir, path, name_off, 0);
+  if (ent_state == NULL)
+    return uft_status_set_error(&status, "error adding non existent entity \"%s\", out of memory", path);
+
+  return uft_status_set_success(&status, ent_state);
+}
+
+
+/// Rollback the transaction. Should not be called directly, it is called
+/// by 'uft_tx_begin' if the transaction fails.
+///
+/// Successful children have already been folded in to this transaction
+/// so there is normally just the one list of entities to restore. Any
+/// descendant still holding entities of its own (one that was never
+/// begun) is restored first, latest first. Descendants are walked
+/// iteratively, not recursively.
+
+void
+uft_tx_rollback (uft_tx * tx)
+{
+  uint64_t start = uft_metrics_now();
+  uft_ll * work = tx_descendants(tx);
+  uft_ll_node * lln;
+
+  for (lln = uft_ll_tail(work); lln != NULL; lln = uft_ll_prev(lln)) {
+    uft_tx * desc_tx = uft_ll_data(lln);
+    if (uft_ll_count(desc_tx->ents) > 0) {
+      tx_rollback_ents(desc_tx);
+      tx_set_rollback_code(desc_tx, desc_tx->code);
+    }
+  }
+
+  tx_rollback_ents(tx);
+  tx_set_rollback_code(tx, tx->code);
+
+  for (lln = uft_ll_head(work); lln != NULL; lln = uft_ll_next(lln)) {
+    uft_tx * desc_tx = uft_ll_data(lln);
+    if (!uft_tx_rollback_attempted(desc_tx))
+      tx_set_rollback_code(desc_tx, tx->code);
+  }
+
+  uft_ll_rm(work);
+  uft_metrics_time(UFT_HIST_ROLLBACK, start);
+}
+
+
+/// Restore (and free) every entity state held by the transaction, the
+/// most recently added first, except that before a path that did not
+/// exist is removed, anything added under it that did not exist either is
+/// removed first, children before parents.
+
+void
+tx_rollback_ents (uft_tx * tx)
+{
+  uft_ll_node * lln;
+
+  while ((lln = uft_ll_tail(tx->ents)) != NULL) {
+    uft_ent_state * ent_state = (uft_ent_state *) uft_ll_data(lln);
+    if ((ent_state->flags & UFT_ES_NOENT) != 0 && uft_trie_count(tx->ent_trie) > 1) {
+      tx_under under = { tx, lln };
+      uft_trie_each_under(tx->ent_trie, ent_state->path, 1, tx_rollback_noent_under, &under);
+    }
+    tx_rollback_ent(tx, lln);
+  }
+  uft_trie_clear(tx->ent_trie);
+}
+
+
+/// Restore (and free) one entity state held by the transaction.
+
+void
+tx_rollback_ent (uft_tx * tx, uft_ll_node * lln)
+{
+  uft_ent_state * ent_state = (uft_ent_state *) uft_ll_data(lln);
+  if (ent_state->capture != NULL && !tx_capture_wait(tx, ent_state))
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  if ((ent_state->flags & UFT_ES_RENAME) != 0) {
+    uft_rollback_rename(tx, ent_state);
+  } else if ((ent_state->flags & UFT_ES_TRASH) != 0) {
+    uft_rollback_trash(tx, ent_state);
+  } else if ((ent_state->flags & UFT_ES_META) != 0) {
+    uft_rollback_meta(tx, ent_state);
+  } else if ((ent_state->flags & UFT_ES_APPEND) != 0) {
+    uft_rollback_append(tx, ent_state);
+  } else if ((ent_state->flags & UFT_ES_FILE) != 0) {
+    uft_rollback_file(tx, ent_state);
+  } else if ((ent_state->flags & UFT_ES_SYMLINK) != 0) {
+    uft_rollback_symlink(tx, ent_state);
+  } else if ((ent_state->flags & UFT_ES_NOENT) != 0) {
+    uft_rollback_noent(tx, ent_state);
+  }
+  tx_spare_ent(tx, lln);
+}
+
+
+/// Roll back an entity state found under a path that did not exist, if
+/// it is still to be rolled back and is of a path that did not exist
+/// either (other than the one whose path it is under).
+
+void
+tx_rollback_noent_under (void * data, void * arg)
+{
+  tx_under * under = (tx_under *) arg;
+  uft_ll_node * lln = (uft_ll_node *) data;
+  uft_ent_state * ent_state = (uft_ent_state *) uft_ll_data(lln);
+
+  if (lln != under->lln && lln->list == under->tx->ents && (ent_state->flags & UFT_ES_NOENT) != 0)
+    tx_rollback_ent(under->tx, lln);
+}
+
+
+/// Set the rollback result bits of a transaction, as success unless
+/// the 'code' given has the rollback failed bit set.
+
+void
+tx_set_rollback_code (uft_tx * tx, int code)
+{
+  if (code & UFT_TX_ROLLBACK_FAILED)
+    tx->code = (tx->code & ~UFT_TX_ROLLBACK_OK) | UFT_TX_ROLLBACK_FAILED;
+  else
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_OK, __ATOMIC_RELAXED);
+}
+
+
+/// Return the directory descriptor an entity is located relative to.
+/// If the directory has been removed in the meantime, the entity is
+/// located by its path from then on.
+
+int
+ent_dirfd (uft_ent_state * ent_state)
+{
+  if (ent_state->dir == NULL)
+    return AT_FDCWD;
+
+  if (uft_dir_deleted(ent_state->dir)) {
+    uft_dir_unref(ent_state->dir);
+    ent_state->dir = NULL;
+    ent_state->name = ent_state->path;
+    return AT_FDCWD;
+  }
+
+  return ent_state->dir->fd;
+}
+
+
+void
+uft_rollback_file (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+  struct stat statbuf;
+  int patch = 0;
+
+  if (fstatat(dirfd, ent_state->name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+    if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
+      patch = (ent_state->flags & UFT_ES_DIFF) != 0;
+    } else if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
+      if (unlinkat(dirfd, ent_state->name, AT_REMOVEDIR) != 0) {
+        uft_tx_log_error(tx,
+                         "rolling back transaction %p, error %d restoring file \"%s\" by rmdir: %s",
+                         tx, errno, ent_state->path, strerror(errno));
+        __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+        return;
+      }
+    } else if ((statbuf.st_mode & S_IFMT) == S_IFLNK) {
+      if (unlinkat(dirfd, ent_state->name, 0) != 0) {
+        uft_tx_log_error(tx,
+                         "rolling back transaction %p, error %d restoring file \"%s\" by unlink symlink: %s",
+                         tx, errno, ent_state->path, strerror(errno));
+        __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+  }
+
+  int fd = patch
+    ? openat(dirfd, ent_state->name, O_RDWR | O_NOFOLLOW | O_CLOEXEC)
+    : openat(dirfd, ent_state->name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring file \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+
+  int nocache = (ent_state->flags & UFT_ES_NOCACHE) != 0;
+  if (nocache && ent_state->spool_fd >= 0)
+    posix_fadvise(ent_state->spool_fd, 0, ent_state->data_len, POSIX_FADV_SEQUENTIAL);
+
+  if (ent_restore_data(ent_state, fd, patch) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring file \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  } else if (nocache) {
+    uft_io_nocache(fd, 0, ent_state->size, 1);
+    if (ent_state->spool_fd >= 0)
+      uft_io_nocache(ent_state->spool_fd, 0, ent_state->data_len, 0);
+  }
+  close(fd);
+}
+
+
+/// Write a files captured extents back to it, open as 'fd', and set its
+/// size. The file is either empty (just truncated), so anywhere not
+/// written is left a hole, or if 'patch' is set it is the current file,
+/// which is compared with the captured data and only changed chunks are
+/// written, holes being punched where the captured file had them.
+/// Returns 0 on success or -1 (with errno set) on failure.
+
+int
+ent_restore_data (uft_ent_state * ent_state, int fd, int patch)
+{
+  char * data;
+  uft_extent * extents;
+  int extent_count = ent_file_extents(ent_state, &data, &extents);
+  off_t store_off = 0;
+  off_t hole_off = 0;
+
+  for (int i = 0; i <= extent_count; i++) {
+    off_t off = i < extent_count ? extents[i].off : ent_state->size;
+    off_t len = i < extent_count ? extents[i].len : 0;
+    off_t put;
+
+    if (patch && off > hole_off && punch_hole(fd, hole_off, off - hole_off) != 0)
+      return -1;
+    if (patch)
+      put = uft_io_patch(fd, off, ent_state->spool_fd >= 0 ? NULL : data + store_off, ent_state->spool_fd, store_off, len);
+    else if (ent_state->spool_fd >= 0)
+      put = uft_io_copy(ent_state->spool_fd, store_off, fd, off, len);
+    else
+      put = uft_io_pwrite(fd, data + store_off, len, off);
+    if (put != len) {
+      if (put >= 0)
+        errno = EIO;
+      return -1;
+    }
+
+    store_off += len;
+    hole_off = off + len;
+  }
+
+  return ftruncate(fd, ent_state->size);
+}
+
+
+/// Point 'datap' and 'extentsp' at the captured data and extents of a
+/// file, which are its snapshots if it has one, returning the number of
+/// extents.
+
+int
+ent_file_extents (uft_ent_state * ent_state, char ** datap, uft_extent ** extentsp)
+{
+  if (ent_state->snap != NULL) {
+    *datap = ent_state->snap->data;
+    *extentsp = ent_state->snap->extents;
+    return ent_state->snap->extent_count;
+  }
+
+  *datap = ent_state->data;
+  *extentsp = ent_state->extents;
+  return ent_state->extent_count;
+}
+
+
+/// Make a range of a file a hole, or if the file system cannot, zeros
+/// (writing only what is not already zero).
+
+int
+punch_hole (int fd, off_t off, off_t len)
+{
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+    return 0;
+  if (errno != EOPNOTSUPP)
+    return -1;
+
+  return uft_io_patch(fd, off, NULL, -1, 0, len) == len ? 0 : -1;
+}
+
+
+/// Roll back an append only file, by truncating it to its original size,
+/// but only if the end of its original content is still as it was
+/// (otherwise it was not only appended to, and cannot be restored).
+
+void
+uft_rollback_append (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+  struct stat statbuf;
+  char buf[UFT_APPEND_CHECK_LEN];
+
+  int fd = openat(dirfd, ent_state->name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring append only file \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if (fstat(fd, &statbuf) != 0 || (statbuf.st_mode & S_IFMT) != S_IFREG || statbuf.st_size < ent_state->size
+      || uft_io_pread(fd, buf, ent_state->data_len, ent_state->size - ent_state->data_len) != ent_state->data_len
+      || memcmp(buf, ent_state->data, ent_state->data_len) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, cannot restore append only file \"%s\", its original content has changed",
+                     tx, ent_state->path);
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  } else if (ftruncate(fd, ent_state->size) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring append only file \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+  close(fd);
+}
+
+
+void
+uft_rollback_symlink (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+  char buf[ent_state->data_len + 1];
+
+  if (readlinkat(dirfd, ent_state->name, buf, ent_state->data_len + 1) == ent_state->data_len)
+    if (strncmp(buf, ent_state->data, ent_state->data_len) == 0)
+      return;
+
+  if (unlinkat(dirfd, ent_state->name, 0) != 0 && errno != ENOENT) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring symlink \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+  if (symlinkat(ent_state->data, dirfd, ent_state->name) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring symlink \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+}
+
+
+void
+uft_rollback_noent (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+  struct stat statbuf;
+
+  if (fstatat(dirfd, ent_state->name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+    if (errno == ENOENT)
+      return;
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring noent \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
+    if (uft_rm_tree(dirfd, ent_state->name) != 0) {
+      uft_tx_log_error(tx,
+                       "rolling back transaction %p, error %d restoring noent dir \"%s\": %s",
+                       tx, errno, ent_state->path, strerror(errno));
+      __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    }
+  } else if (((statbuf.st_mode & S_IFMT) == S_IFREG) || ((statbuf.st_mode & S_IFMT) == S_IFLNK)) {
+    if (unlinkat(dirfd, ent_state->name, 0) != 0 && errno != ENOENT) {
+      uft_tx_log_error(tx,
+                       "rolling back transaction %p, error %d restoring noent \"%s\": %s",
+                       tx, errno, ent_state->path, strerror(errno));
+      __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+/// Put back the metadata of an entity added with UFT_META_ONLY: its owner
+/// and group, then its permissions (which a change of owner may clear
+/// setuid bits from), its extended attributes if they were captured and
+/// lastly its times. Nothing is done to an entity that is no longer of
+/// the same type.
+
+void
+uft_rollback_meta (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+  uft_meta * meta = &ent_state->meta;
+  struct stat statbuf;
+
+  if (fstatat(dirfd, ent_state->name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring metadata of \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+  if ((statbuf.st_mode & S_IFMT) != (meta->mode & S_IFMT)) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error restoring metadata of \"%s\": it has been replaced",
+                     tx, ent_state->path);
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+
+  int chowned = statbuf.st_uid != meta->uid || statbuf.st_gid != meta->gid;
+  if (chowned && fchownat(dirfd, ent_state->name, meta->uid, meta->gid, AT_SYMLINK_NOFOLLOW) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring owner of \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+  if ((meta->mode & S_IFMT) != S_IFLNK && (chowned || (statbuf.st_mode & 07777) != (meta->mode & 07777))
+      && fchmodat(dirfd, ent_state->name, meta->mode & 07777, 0) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring permissions of \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+  if ((ent_state->flags & UFT_ES_XATTRS) != 0 && ent_restore_xattrs(ent_state, dirfd) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring extended attributes of \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+
+  struct timespec times[2] = { meta->atime, meta->mtime };
+  if (utimensat(dirfd, ent_state->name, times, AT_SYMLINK_NOFOLLOW) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring times of \"%s\": %s",
+                     tx, errno, ent_state->path, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+}
+
+
+/// Put back the extended attributes captured in 'ent_state', removing any
+/// added since and setting any changed or removed. Returns 0 on success
+/// or -1 (with errno set).
+
+int
+ent_restore_xattrs (uft_ent_state * ent_state, int dirfd)
+{
+  char proc_path[32];
+  int result = 0;
+  int saved_errno = 0;
+
+  int path_fd = openat(dirfd, ent_state->name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  if (path_fd < 0)
+    return -1;
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", path_fd);
+
+  ssize_t names_len = listxattr(proc_path, NULL, 0);
+  if (names_len > 0) {
+    char names[names_len];
+    names_len = listxattr(proc_path, names, names_len);
+    for (char * name = names; names_len > 0 && name < names + names_len; name += strlen(name) + 1) {
+      if (!ent_has_xattr(ent_state, name) && removexattr(proc_path, name) != 0 && errno != ENODATA) {
+        saved_errno = errno;
+        result = -1;
+      }
+    }
+  }
+
+  char * p = ent_state->data;
+  while (p < ent_state->data + ent_state->data_len) {
+    char * name = p;
+    uint32_t value_len;
+    p += strlen(name) + 1;
+    memcpy(&value_len, p, sizeof(value_len));
+    p += sizeof(value_len);
+    char value[value_len + 1];
+    if ((getxattr(proc_path, name, value, value_len + 1) != value_len || memcmp(value, p, value_len) != 0)
+        && setxattr(proc_path, name, p, value_len, 0) != 0) {
+      saved_errno = errno;
+      result = -1;
+    }
+    p += value_len;
+  }
+
+  close(path_fd);
+  errno = saved_errno;
+
+  return result;
+}
+
+
+/// Return true if an extended attribute called 'name' was captured in
+/// 'ent_state'.
+
+int
+ent_has_xattr (uft_ent_state * ent_state, const char * name)
+{
+  char * p = ent_state->data;
+
+  while (p < ent_state->data + ent_state->data_len) {
+    uint32_t value_len;
+    int name_len = strlen(p) + 1;
+    if (strcmp(p, name) == 0)
+      return 1;
+    memcpy(&value_len, p + name_len, sizeof(value_len));
+    p += name_len + sizeof(value_len) + value_len;
+  }
+
+  return 0;
+}
+
+
+/// Delete 'path' as part of the transaction, by moving it to the trash,
+/// a directory (per top level transaction) in the same directory, from
+/// where a rollback moves it back and success removes it. A directory
+/// (and everything in it) may be deleted only if 'dirs_ok' is set.
+
+uft_status *
+uft_tx_trash (uft_tx * tx, char * path, int dirs_ok)
+{
+  static __thread uft_status status;
+  struct stat statbuf;
+  char item[64];
+
+  int name_off;
+  uft_dir * dir = tx_path_dir(tx, path, &name_off);
+  if (dir == NULL)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error deleting \"%s\": %s", path, strerror(errno)));
+  char * name = path + name_off;
+
+  if (fstatat(dir->fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error deleting \"%s\": %s", path, strerror(errno)));
+  if ((statbuf.st_mode & S_IFMT) == S_IFDIR && !dirs_ok)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error deleting \"%s\": %s", path, strerror(EISDIR)));
+
+  uft_tx * root_tx = tx;
+  while (root_tx->parent != NULL)
+    root_tx = root_tx->parent;
+  int trash_len = snprintf(item, sizeof(item), ".uft-trash-%d-%d", getpid(), root_tx->id);
+  if (mkdirat(dir->fd, item, 0700) != 0 && errno != EEXIST)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error deleting \"%s\", could not create trash: %s", path, strerror(errno)));
+  snprintf(item + trash_len, sizeof(item) - trash_len, "/%d", __atomic_fetch_add(&uft_trash_next_id, 1, __ATOMIC_RELAXED));
+
+  // The trash directory is removed again if nothing is put in it (unless
+  // it holds what was trashed before).
+  uft_ent_state * ent_state = tx_new_ent_state(tx, UFT_ES_TRASH, dir, path, name_off, strlen(item) + 1);
+  if (ent_state == NULL) {
+    item[trash_len] = '\0';
+    unlinkat(dir->fd, item, AT_REMOVEDIR);
+    return tx_add_ent(tx, uft_status_set_error(&status, "error deleting \"%s\", out of memory", path));
+  }
+  strcpy(ent_state->data, item);
+  ent_state->data_len = strlen(item);
+
+  if (renameat(dir->fd, name, dir->fd, item) != 0) {
+    int rename_errno = errno;
+    tx_discard_ent_state(tx, ent_state);
+    item[trash_len] = '\0';
+    unlinkat(dir->fd, item, AT_REMOVEDIR);
+    return tx_add_ent(tx, uft_status_set_error(&status, "error deleting \"%s\", could not move to trash: %s", path, strerror(rename_errno)));
+  }
+
+  return tx_add_ent(tx, uft_status_set_success(&status, ent_state));
+}
+
+
+/// Rename 'old_path' to 'new_path' as part of the transaction. If there
+/// is already something at 'new_path' it is moved to the trash first (see
+/// 'uft_tx_trash'), and a rollback renames the entity back and then
+/// restores whatever it replaced. No content is read. If both paths
+/// name the same file (or hard links to it) nothing is done, as with
+/// rename(2).
+
+uft_status *
+uft_tx_rename (uft_tx * tx, char * old_path, char * new_path)
+{
+  static __thread uft_status status;
+  struct stat statbuf;
+  struct stat new_statbuf;
+  char abs_old_path[PATH_MAX];
+  int old_name_off;
+  int new_name_off;
+
+  uft_dir * old_dir = tx_path_dir(tx, old_path, &old_name_off);
+  if (old_dir == NULL)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error renaming \"%s\": %s", old_path, strerror(errno)));
+  uft_dir * new_dir = tx_path_dir(tx, new_path, &new_name_off);
+  if (new_dir == NULL)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error renaming \"%s\" to \"%s\": %s", old_path, new_path, strerror(errno)));
+  char * old_name = old_path + old_name_off;
+  char * new_name = new_path + new_name_off;
+
+  if (fstatat(old_dir->fd, old_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error renaming \"%s\": %s", old_path, strerror(errno)));
+
+  uft_fd_path(old_dir->fd, abs_old_path, sizeof(abs_old_path));
+  if (abs_old_path[0] != '/' || strlen(abs_old_path) + strlen(old_name) + 2 > sizeof(abs_old_path))
+    return tx_add_ent(tx, uft_status_set_error(&status, "error renaming \"%s\", could not find its absolute path", old_path));
+  if (strcmp(abs_old_path, "/") != 0)
+    strcat(abs_old_path, "/");
+  strcat(abs_old_path, old_name);
+
+  if (fstatat(new_dir->fd, new_name, &new_statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+    // Like rename(2), renaming a file to itself or to another of its hard
+    // links changes nothing.
+    if (new_statbuf.st_dev == statbuf.st_dev && new_statbuf.st_ino == statbuf.st_ino)
+      return uft_status_set_success(&status, tx);
+    uft_status * trash_status = uft_tx_trash(tx, new_path, 1);
+    if (uft_status_error(trash_status))
+      return trash_status;
+  }
+
+  uft_ent_state * ent_state = tx_new_ent_state(tx, UFT_ES_RENAME, new_dir, new_path, new_name_off, strlen(abs_old_path) + 1);
+  if (ent_state == NULL)
+    return tx_add_ent(tx, uft_status_set_error(&status, "error renaming \"%s\", out of memory", old_path));
+  strcpy(ent_state->data, abs_old_path);
+  ent_state->data_len = strlen(abs_old_path);
+
+  if (renameat(old_dir->fd, old_name, new_dir->fd, new_name) != 0) {
+    tx_discard_ent_state(tx, ent_state);
+    return tx_add_ent(tx, uft_status_set_error(&status, "error renaming \"%s\" to \"%s\": %s", old_path, new_path, strerror(errno)));
+  }
+
+  return tx_add_ent(tx, uft_status_set_success(&status, ent_state));
+}
+
+
+/// Return the transactions handle on the directory containing 'path',
+/// and put the offset of the last component of 'path' in 'name_offp'.
+/// Returns NULL (with errno set) if 'path' has no last component or the
+/// directory cannot be opened.
+
+uft_dir *
+tx_path_dir (uft_tx * tx, char * path, int * name_offp)
+{
+  int name_off = path_name_off(path);
+
+  if (name_off < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  *name_offp = name_off;
+
+  return name_off > 0 ? tx_dir(tx, path, name_off > 1 ? name_off - 1 : 1) : tx_dir(tx, ".", 1);
+}
+
+
+void
+uft_rollback_rename (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+
+  if (renameat(dirfd, ent_state->name, AT_FDCWD, ent_state->data) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d renaming \"%s\" back to \"%s\": %s",
+                     tx, errno, ent_state->path, ent_state->data, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+  }
+}
+
+
+/// Put the path, relative to 'dirfd' (as returned by 'ent_dirfd'), of an
+/// entity in the trash in 'buf'. Returns false if it does not fit.
+
+int
+trash_item_path (uft_ent_state * ent_state, int dirfd, char * buf, int buf_len)
+{
+  int dir_len = 0;
+
+  if (dirfd == AT_FDCWD) {
+    dir_len = path_name_off(ent_state->path);
+    if (dir_len < 0)
+      dir_len = 0;
+  }
+
+  return snprintf(buf, buf_len, "%.*s%s", dir_len, ent_state->path, ent_state->data) < buf_len;
+}
+
+
+void
+uft_rollback_trash (uft_tx * tx, uft_ent_state * ent_state)
+{
+  int dirfd = ent_dirfd(ent_state);
+  char item[PATH_MAX];
+
+  if (!trash_item_path(ent_state, dirfd, item, sizeof(item))) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error restoring deleted \"%s\", path too long",
+                     tx, ent_state->path);
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if (renameat(dirfd, item, dirfd, ent_state->name) != 0) {
+    uft_tx_log_error(tx,
+                     "rolling back transaction %p, error %d restoring deleted \"%s\" from \"%s\": %s",
+                     tx, errno, ent_state->path, item, strerror(errno));
+    __atomic_or_fetch(&tx->code, UFT_TX_ROLLBACK_FAILED, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // Remove the trash directory, if that was the last thing in it.
+  *strrchr(item, '/') = '\0';
+  unlinkat(dirfd, item, AT_REMOVEDIR);
+}
+
+
+/// Remove everything a successful (top level) transaction moved to the
+/// trash. This is done in the background, on the worker pool, unless it
+/// cannot be.
+
+void
+tx_reap_trash (uft_tx * tx)
+{
+  uft_ll * reap = NULL;
+
+  for (uft_ll_node * lln = uft_ll_head(tx->ents); lln != NULL; lln = uft_ll_next(lln)) {
+    uft_ent_state * ent_state = uft_ll_data(lln);
+    if ((ent_state->flags & UFT_ES_TRASH) == 0)
+      continue;
+
+    char path[PATH_MAX];
+    trash_item * item = NULL;
+    if (trash_item_path(ent_state, ent_dirfd(ent_state), path, sizeof(path)))
+      item = (trash_item *) malloc(sizeof(trash_item) + strlen(path) + 1);
+    if (item == NULL || (reap == NULL && (reap = uft_ll_create()) == NULL)) {
+      free(item);
+      uft_tx_log_error(tx, "error removing \"%s\" from the trash (at \"%s\")", ent_state->path, ent_state->data);
+      continue;
+    }
+    strcpy(item->path, path);
+    item->dir = ent_state->dir != NULL ? uft_dir_ref(ent_state->dir) : NULL;
+    uft_ll_insert_tail(reap, item);
+  }
+
+  if (reap != NULL && uft_async_submit(reap_trash, reap) != 0)
+    reap_trash(reap);
+}
+
+
+/// Remove a list of things from the trash, and the trash directories
+/// they were in once they are empty.
+
+void
+reap_trash (void * arg)
+{
+  uft_ll * reap = arg;
+  uft_ll_node * lln;
+
+  while ((lln = uft_ll_head(reap)) != NULL) {
+    trash_item * item = uft_ll_rmnode(lln);
+    int dirfd = item->dir != NULL ? item->dir->fd : AT_FDCWD;
+    uft_rm_tree(dirfd, item->path);
+    *strrchr(item->path, '/') = '\0';
+    unlinkat(dirfd, item->path, AT_REMOVEDIR);
+    if (item->dir != NULL)
+      uft_dir_unref(item->dir);
+    free(item);
+  }
+  uft_ll_rm(reap);
+}
+
+
+/// Log / add an error to the transaction.
+
+uft_tx *
 uft_tx_log_error(uft_tx * tx, const char * fmt, ...)
 {
-  char * msg = (char *) malloc(UFT_MAX_MSG_LEN);
+  char msg[UFT_MAX_MSG_LEN];
+  uft_tx_error * tx_error;
+
   va_list args;
   va_start(args, fmt);
-  vsnprintf(msg, UFT_MAX_MSG_LEN, fmt, args);
+  vsnprintf(msg, sizeof(msg), fmt, args);
   va_end(args);
 
-  uft_tx_error * tx_error = (uft_tx_error *) malloc(sizeof(uft_tx_error));
-  tx_error->msg = msg;
+  pthread_mutex_lock(&tx->mutex);
+  uft_ll_node * lln = uft_ll_head(tx->spare_errors);
+  if (lln != NULL) {
+    tx_error = uft_ll_data(lln);
+    uft_ll_move_tail(tx->errors, lln);
+  } else {
+    tx_error = (uft_tx_error *) malloc(sizeof(uft_tx_error));
+    tx_error->msg = (char *) malloc(UFT_MAX_MSG_LEN);
+    uft_ll_insert_tail(tx->errors, tx_error);
+  }
+  memcpy(tx_error->msg, msg, sizeof(msg));
+  pthread_mutex_unlock(&tx->mutex);
 
-  uft_ll_insert_tail(tx->errors, tx_error);
+  if (tx->shm != NULL && !tx->shm->owner)
+    uft_shm_append(tx->shm, UFT_SHM_REC_ERROR, msg, NULL, 0, NULL, 0);
 
   return tx;
 }
@@ -438,7 +3329,9 @@ uft_tx_log_error(uft_tx * tx, const char * fmt, ...)
 void
 uft_tx_success(uft_tx * tx)
 {
-  tx->code |= UFT_TX_SUCCESS;
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_SUCCESS, tx->id, 0, 0);
+  __atomic_or_fetch(&tx->code, UFT_TX_SUCCESS, __ATOMIC_RELAXED);
 
   return;
 }
@@ -449,7 +3342,11 @@ uft_tx_success(uft_tx * tx)
 void
 uft_tx_fail(uft_tx * tx)
 {
-  tx->code |= UFT_TX_ERROR;
+  if (uft_trace_on)
+    uft_trace_tx(UFT_TRACE_FAIL, tx->id, 0, 0);
+  __atomic_or_fetch(&tx->code, UFT_TX_ERROR, __ATOMIC_RELAXED);
+  if (tx->shm != NULL)
+    uft_shm_fail(tx->shm);
 
   return;
 }
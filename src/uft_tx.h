@@ -5,35 +5,173 @@
 #define UFT_INCLUDED
 
 
+#include <sys/stat.h>
+#include <pthread.h>
+
 #include "uft_ll.h"
+#include "uft_ht.h"
+#include "uft_dir.h"
+#include "uft_lock.h"
+#include "uft_shm.h"
+#include "uft_trie.h"
 
 
 #define UFT_ES_NOENT   0x00000001
 #define UFT_ES_FILE    0x00000002
 #define UFT_ES_SYMLINK 0x00000004
+#define UFT_ES_DIFF    0x00000008
+#define UFT_ES_APPEND  0x00000010
+#define UFT_ES_TRASH   0x00000020
+#define UFT_ES_RENAME  0x00000040
+#define UFT_ES_NOCACHE 0x00000080
+#define UFT_ES_META    0x00000100
+#define UFT_ES_XATTRS  0x00000200
 
 
+/// A transaction. Its 'mutex' guards its lists, entity trie and directory
+/// table (but is never held while anything is captured), so threads may
+/// add entities to it, log errors, fail it and create children all at
+/// once; 'code' is only changed by atomic OR while it runs. 'capture_cond'
+/// is signalled when a barrier has joined a background capture.
 typedef struct uft_tx_st {
-  int      id;
-  int      code;
-  uft_ll * ents;
-  uft_ll * errors;
-  uft_ll * children;
-  void *   extra;
+  int                   id;
+  int                   code;
+  uft_ll *              ents;
+  uft_trie *            ent_trie;
+  uft_ht *              dirs;
+  uft_ll *              spare_dirs;
+  uft_ll *              locks;
+  uft_ll *              errors;
+  uft_ll *              children;
+  uft_ll *              spare_ents;
+  uft_ll *              claimed_ents;
+  uft_ll *              spare_errors;
+  uft_shm *             shm;
+  int                   captures;
+  struct uft_group_st * group;
+  void                  (*group_cb)(struct uft_tx_st *);
+  struct uft_tx_st *    group_next;
+  void *                async;
+  void *                group_entry;
+  int                   group_joined;
+  struct uft_tx_st *    parent;
+  void *                extra;
+  pthread_mutex_t       mutex;
+  pthread_cond_t        capture_cond;
 } uft_tx;
 
 
+typedef struct uft_tx_lock_st {
+  uft_lock_key key;
+  int          owner;
+} uft_tx_lock;
+
+
 typedef struct uft_tx_error_st {
   char * msg;
 } uft_tx_error;
 
 
+/// A data extent of a file; 'len' bytes at offset 'off' (everything not
+/// in an extent is a hole).
+typedef struct uft_extent_st {
+  off_t off;
+  off_t len;
+} uft_extent;
+
+
+/// The metadata of an entity added with UFT_META_ONLY; its type and
+/// permissions, owner and group, and access and modification times.
+typedef struct uft_meta_st {
+  mode_t          mode;
+  uid_t           uid;
+  gid_t           gid;
+  struct timespec atime;
+  struct timespec mtime;
+} uft_meta;
+
+
+/// A background capture of a files data (see UFT_ASYNC_CAPTURE), read
+/// from 'fd' by a worker. The entity state it fills must not be used
+/// until it is 'done'; 'error' then holds the error message if it
+/// 'failed' (or is NULL if there was no memory to keep it). 'joining' is
+/// set (under the transactions mutex) by a barrier waiting for it.
+typedef struct uft_capture_st {
+  pthread_mutex_t           mutex;
+  pthread_cond_t            cond;
+  int                       done;
+  int                       joining;
+  int                       failed;
+  char *                    error;
+  int                       fd;
+  int                       flags;
+  struct stat               statbuf;
+  struct uft_ent_state_st * ent_state;
+} uft_capture;
+
+
+/// The state of an entity, captured so it can be restored. The data of a
+/// file is the data of its extents, one after another, kept in memory or
+/// (if there is more than UFT_SPOOL_MIN bytes) in a spool file, or for a
+/// file only ever appended to (UFT_ES_APPEND) just the last bytes, to
+/// check against; the data of a symlink is its destination; the data of
+/// an entity moved to the trash is where it is in the trash (relative to
+/// the directory it was in); the data of a renamed entity is the absolute
+/// path it was renamed from. Only the 'meta' of an entity added with
+/// UFT_META_ONLY is kept, and its data is its extended attributes (if
+/// UFT_ES_XATTRS), each a name, its terminating NUL, a 4 byte value
+/// length and the value. The data and extents of a file found in the
+/// snapshot cache are those of its 'snap' instead of its own. A spare
+/// entity state being reused is held on the transactions claimed list,
+/// by its 'claim' node, until it is added (or given up on).
 typedef struct uft_ent_state_st {
-  int    flags;
-  char * path;
-  char * data;
-  int    data_len;
+  int                  flags;
+  char *               path;
+  int                  path_cap;
+  char *               name;
+  uft_dir *            dir;
+  char *               data;
+  off_t                data_len;
+  off_t                data_cap;
+  int                  spool_fd;
+  off_t                size;
+  uft_extent *         extents;
+  int                  extent_count;
+  int                  extent_cap;
+  uft_capture *        capture;
+  uft_meta             meta;
+  uft_ll_node *        claim;
+  struct uft_snap_st * snap;
 } uft_ent_state;
 
 
+/// A path of a prepared enrolment set; the index of its directory in the
+/// sets directories (or -1 if that could not be opened) and the type of
+/// what was at the path when the set was prepared (0 if nothing was).
+typedef struct uft_enrol_ent_st {
+  char * path;
+  int    name_off;
+  int    dir_idx;
+  mode_t type;
+} uft_enrol_ent;
+
+
+/// A prepared enrolment set (see 'uft_enrol_set_prepare'); its paths,
+/// to be added with 'flags', and a handle on each distinct directory
+/// they are in. Once prepared it is never changed, so any number of
+/// transactions may add it at once.
+typedef struct uft_enrol_set_st {
+  int             flags;
+  int             count;
+  uft_enrol_ent * ents;
+  int             dir_count;
+  uft_dir **      dirs;
+} uft_enrol_set;
+
+
+extern uft_status * uft_tx_trash (uft_tx * tx, char * path, int dirs_ok);
+extern uft_status * uft_tx_rename (uft_tx * tx, char * old_path, char * new_path);
+extern void         uft_tx_group_done (uft_tx * tx, int ok);
+
+
 #endif // UFT_INCLUDED
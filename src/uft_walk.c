@@ -0,0 +1,486 @@
+/// libuft parallel tree walks
+///
+/// Directories waiting to be read are kept on one stack, shared by the
+/// thread walking the tree and helpers from the worker pool. Each takes a
+/// directory, reads it with 'getdents64' in large batches (using the
+/// directory entry type, so only entries of unknown type are stat'ed),
+/// pushes its subdirectories and calls the walks function for what it
+/// finds, until the stack is empty and nobody is reading a directory that
+/// could add to it. What was found is then sorted by path, so the result
+/// does not depend on which thread found what.
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "uft_async.h"
+#include "uft_walk.h"
+
+
+#define WALK_DENTS_LEN 32768
+#define WALK_BATCH     64
+
+
+/// A directory waiting to be read; 'depth' is the number of components
+/// in its path relative to the root.
+typedef struct walk_dir_st
+{
+  char * path;
+  int    depth;
+} walk_dir;
+
+/// A walk shared between the thread walking and helpers in the worker
+/// pool. Helpers only take part while 'active'; the last reference
+/// frees it.
+typedef struct walk_share_st
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  uft_walk *      walk;
+  int             rel_off;
+  walk_dir *      dirs;
+  int             dirs_count;
+  int             dirs_cap;
+  int             busy;
+  uft_walk_ent *  ents;
+  int             ents_count;
+  int             ents_cap;
+  int             refs;
+  int             active;
+  int             closed;
+  int             error;
+  char            error_path[PATH_MAX];
+} walk_share;
+
+/// What one thread has found but not yet added to the share.
+typedef struct walk_batch_st
+{
+  walk_dir     dirs[WALK_BATCH];
+  int          dirs_count;
+  uft_walk_ent ents[WALK_BATCH];
+  int          ents_count;
+} walk_batch;
+
+
+static void walk_help (void * arg);
+static void walk_work (walk_share * share);
+static void walk_read (walk_share * share, walk_dir * dir, walk_batch * batch, void ** ctxp);
+static int  walk_match (walk_share * share, const char * rel, int depth, int is_dir, int * descendp);
+static void walk_flush (walk_share * share, walk_batch * batch);
+static void walk_error (walk_share * share, const char * path, int error);
+static void walk_unref (walk_share * share);
+static int  walk_cmp (const void * a, const void * b);
+
+
+/// Walk a tree, with the help of the worker pool. On return '*entsp'
+/// holds the '*countp' entities found, sorted by path (free them with
+/// 'uft_walk_ents_free'). Returns 0 on success or -1 (with errno set) if
+/// the root or a directory under it could not be read, in which case
+/// its path is put in 'error_path', and what was found is still
+/// returned.
+
+int
+uft_walk_run (uft_walk * walk, uft_walk_ent ** entsp, int * countp, char * error_path, int error_path_len)
+{
+  walk_share * share = (walk_share *) calloc(1, sizeof(walk_share));
+
+  *entsp = NULL;
+  *countp = 0;
+  if (share == NULL)
+    return -1;
+
+  int root_len = strlen(walk->root);
+  while (root_len > 1 && walk->root[root_len - 1] == '/')
+    root_len--;
+  share->dirs = (walk_dir *) malloc(16 * sizeof(walk_dir));
+  char * root = strndup(walk->root, root_len);
+  if (share->dirs == NULL || root == NULL) {
+    free(share->dirs);
+    free(root);
+    free(share);
+    return -1;
+  }
+
+  pthread_mutex_init(&share->mutex, NULL);
+  pthread_cond_init(&share->cond, NULL);
+  share->walk = walk;
+  share->rel_off = strcmp(root, ".") == 0 ? 0 : strcmp(root, "/") == 0 ? 1 : root_len + 1;
+  share->dirs[0].path  = root;
+  share->dirs[0].depth = 0;
+  share->dirs_count = 1;
+  share->dirs_cap   = 16;
+  share->refs       = 1;
+  share->active     = 1;
+
+  for (int i = 0; i < UFT_ASYNC_THREADS; i++) {
+    pthread_mutex_lock(&share->mutex);
+    share->refs++;
+    pthread_mutex_unlock(&share->mutex);
+    if (uft_async_submit(walk_help, share) != 0) {
+      walk_unref(share);
+      break;
+    }
+  }
+
+  walk_work(share);
+
+  pthread_mutex_lock(&share->mutex);
+  while (share->active > 0)
+    pthread_cond_wait(&share->cond, &share->mutex);
+  for (int i = 0; i < share->dirs_count; i++)
+    free(share->dirs[i].path);
+  *entsp = share->ents;
+  *countp = share->ents_count;
+  int error = share->error;
+  if (error != 0)
+    snprintf(error_path, error_path_len, "%s", share->error_path);
+  pthread_mutex_unlock(&share->mutex);
+
+  walk_unref(share);
+
+  qsort(*entsp, *countp, sizeof(uft_walk_ent), walk_cmp);
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/// Free what a walk found (but not what its function returned).
+
+void
+uft_walk_ents_free (uft_walk_ent * ents, int count)
+{
+  for (int i = 0; i < count; i++)
+    free(ents[i].path);
+  free(ents);
+}
+
+
+/// Put the directory part of 'pattern' that has no wildcards in it in
+/// 'root' ("." if there is none), returning the offset in 'pattern' of
+/// the rest of it, or -1 if 'root' is too short.
+
+int
+uft_walk_glob_root (const char * pattern, char * root, int root_len)
+{
+  int rest_off = 0;
+
+  for (const char * p = pattern; *p != '\0'; p++) {
+    if (*p == '*' || *p == '?' || *p == '[' || *p == '\\')
+      break;
+    if (*p == '/')
+      rest_off = p - pattern + 1;
+  }
+
+  int len = rest_off;
+  while (len > 1 && pattern[len - 1] == '/')
+    len--;
+  if (len == 0)
+    return snprintf(root, root_len, ".") < root_len ? 0 : -1;
+  if (len >= root_len)
+    return -1;
+  memcpy(root, pattern, len);
+  root[len] = '\0';
+
+  return rest_off;
+}
+
+
+/// A worker pool job helping with a walk. Helpers that only get to run
+/// once the walk is over do nothing.
+
+static void
+walk_help (void * arg)
+{
+  walk_share * share = (walk_share *) arg;
+
+  pthread_mutex_lock(&share->mutex);
+  int closed = share->closed;
+  if (!closed)
+    share->active++;
+  pthread_mutex_unlock(&share->mutex);
+
+  if (!closed)
+    walk_work(share);
+
+  walk_unref(share);
+}
+
+
+/// Take and read directories until there are none left and none being
+/// read. Called with 'share->active' counting the caller, which it
+/// uncounts.
+
+static void
+walk_work (walk_share * share)
+{
+  uft_walk * walk = share->walk;
+  walk_batch batch;
+  void * ctx = NULL;
+
+  batch.dirs_count = 0;
+  batch.ents_count = 0;
+
+  pthread_mutex_lock(&share->mutex);
+  for (;;) {
+    while (share->dirs_count == 0 && share->busy > 0)
+      pthread_cond_wait(&share->cond, &share->mutex);
+    if (share->dirs_count == 0)
+      break;
+    walk_dir dir = share->dirs[--share->dirs_count];
+    share->busy++;
+    pthread_mutex_unlock(&share->mutex);
+
+    walk_read(share, &dir, &batch, &ctx);
+    free(dir.path);
+
+    pthread_mutex_lock(&share->mutex);
+    share->busy--;
+    if (share->busy == 0 && share->dirs_count == 0)
+      pthread_cond_broadcast(&share->cond);
+  }
+  share->closed = 1;
+  pthread_mutex_unlock(&share->mutex);
+
+  if (walk->fini != NULL && ctx != NULL)
+    walk->fini(ctx, walk->arg);
+
+  pthread_mutex_lock(&share->mutex);
+  if (--share->active == 0)
+    pthread_cond_broadcast(&share->cond);
+  pthread_mutex_unlock(&share->mutex);
+}
+
+
+/// Read one directory, calling the walks function for what matches and
+/// batching up its subdirectories to be read and what was found. The
+/// batch is added to the share before returning, so other threads can
+/// take the subdirectories.
+
+static void
+walk_read (walk_share * share, walk_dir * dir, walk_batch * batch, void ** ctxp)
+{
+  uft_walk * walk = share->walk;
+  char dents[WALK_DENTS_LEN] __attribute__ ((aligned (8)));
+  char path[PATH_MAX];
+  ssize_t len;
+
+  int fd = open(dir->path, dir->depth > 0 ? O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC : O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT || dir->depth == 0)
+      walk_error(share, dir->path, errno);
+    return;
+  }
+  int prefix_len = 0;
+  if (dir->depth > 0 || share->rel_off > 0)
+    prefix_len = snprintf(path, sizeof(path), "%s/", strcmp(dir->path, "/") == 0 ? "" : dir->path);
+
+  while ((len = getdents64(fd, dents, sizeof(dents))) > 0) {
+    for (ssize_t off = 0; off < len; ) {
+      struct dirent64 * dent = (struct dirent64 *) (dents + off);
+      char * name = dent->d_name;
+      off += dent->d_reclen;
+
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      if (prefix_len + strlen(name) >= sizeof(path)) {
+        walk_error(share, dir->path, ENAMETOOLONG);
+        continue;
+      }
+      strcpy(path + prefix_len, name);
+
+      int is_dir = dent->d_type == DT_DIR;
+      if (dent->d_type == DT_UNKNOWN) {
+        struct stat statbuf;
+        if (fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+          continue;
+        is_dir = (statbuf.st_mode & S_IFMT) == S_IFDIR;
+      }
+
+      int descend;
+      if (walk_match(share, path + share->rel_off, dir->depth + 1, is_dir, &descend)) {
+        if (batch->ents_count == WALK_BATCH)
+          walk_flush(share, batch);
+        uft_walk_ent * ent = &batch->ents[batch->ents_count];
+        ent->path = strdup(path);
+        if (ent->path == NULL) {
+          walk_error(share, path, ENOMEM);
+          continue;
+        }
+        ent->data = walk->fp != NULL ? walk->fp(path, ctxp, walk->arg) : NULL;
+        batch->ents_count++;
+      }
+      if (descend) {
+        if (batch->dirs_count == WALK_BATCH)
+          walk_flush(share, batch);
+        walk_dir * subdir = &batch->dirs[batch->dirs_count];
+        subdir->path = strdup(path);
+        subdir->depth = dir->depth + 1;
+        if (subdir->path == NULL)
+          walk_error(share, path, ENOMEM);
+        else
+          batch->dirs_count++;
+      }
+    }
+  }
+  if (len < 0)
+    walk_error(share, dir->path, errno);
+  close(fd);
+
+  walk_flush(share, batch);
+}
+
+
+/// Return true if the entity at 'rel' (relative to the root, 'depth'
+/// components deep) is to be found, and set '*descendp' to whether it is
+/// a directory to be read.
+
+static int
+walk_match (walk_share * share, const char * rel, int depth, int is_dir, int * descendp)
+{
+  uft_walk * walk = share->walk;
+  char prefix[PATH_MAX];
+
+  *descendp = is_dir;
+  if (walk->pattern != NULL) {
+    // Only directories that match the start of the pattern can hold
+    // anything that matches all of it.
+    const char * end = walk->pattern;
+    for (int i = 0; i < depth && end != NULL; i++)
+      end = strchr(end + (i > 0), '/');
+    if (end != NULL) {
+      if (!is_dir || end - walk->pattern >= sizeof(prefix)) {
+        *descendp = 0;
+        return 0;
+      }
+      memcpy(prefix, walk->pattern, end - walk->pattern);
+      prefix[end - walk->pattern] = '\0';
+      *descendp = fnmatch(prefix, rel, FNM_PATHNAME | FNM_PERIOD) == 0;
+      return 0;
+    }
+    *descendp = 0;
+    if (fnmatch(walk->pattern, rel, FNM_PATHNAME | FNM_PERIOD) != 0)
+      return 0;
+  }
+  if (walk->filter != NULL) {
+    const char * name = strrchr(rel, '/');
+    if (fnmatch(walk->filter, name != NULL ? name + 1 : rel, FNM_PERIOD) != 0)
+      return 0;
+  }
+
+  return !is_dir || walk->dirs;
+}
+
+
+/// Add a batch of subdirectories and entities found to the share.
+
+static void
+walk_flush (walk_share * share, walk_batch * batch)
+{
+  pthread_mutex_lock(&share->mutex);
+
+  if (share->dirs_count + batch->dirs_count > share->dirs_cap) {
+    int cap = share->dirs_cap * 2;
+    while (cap < share->dirs_count + batch->dirs_count)
+      cap *= 2;
+    walk_dir * dirs = (walk_dir *) realloc(share->dirs, cap * sizeof(walk_dir));
+    if (dirs != NULL) {
+      share->dirs = dirs;
+      share->dirs_cap = cap;
+    }
+  }
+  if (share->dirs_count + batch->dirs_count <= share->dirs_cap) {
+    memcpy(share->dirs + share->dirs_count, batch->dirs, batch->dirs_count * sizeof(walk_dir));
+    share->dirs_count += batch->dirs_count;
+    if (batch->dirs_count > 0)
+      pthread_cond_broadcast(&share->cond);
+  } else {
+    for (int i = 0; i < batch->dirs_count; i++)
+      free(batch->dirs[i].path);
+    if (share->error == 0) {
+      share->error = ENOMEM;
+      snprintf(share->error_path, sizeof(share->error_path), "%s", share->walk->root);
+    }
+  }
+
+  if (share->ents_count + batch->ents_count > share->ents_cap) {
+    int cap = share->ents_cap > 0 ? share->ents_cap * 2 : 256;
+    while (cap < share->ents_count + batch->ents_count)
+      cap *= 2;
+    uft_walk_ent * ents = (uft_walk_ent *) realloc(share->ents, cap * sizeof(uft_walk_ent));
+    if (ents != NULL) {
+      share->ents = ents;
+      share->ents_cap = cap;
+    }
+  }
+  if (share->ents_count + batch->ents_count <= share->ents_cap) {
+    memcpy(share->ents + share->ents_count, batch->ents, batch->ents_count * sizeof(uft_walk_ent));
+    share->ents_count += batch->ents_count;
+  } else {
+    // What the walks function returned for these is dropped.
+    for (int i = 0; i < batch->ents_count; i++)
+      free(batch->ents[i].path);
+    if (share->error == 0) {
+      share->error = ENOMEM;
+      snprintf(share->error_path, sizeof(share->error_path), "%s", share->walk->root);
+    }
+  }
+
+  pthread_mutex_unlock(&share->mutex);
+  batch->dirs_count = 0;
+  batch->ents_count = 0;
+}
+
+
+/// Keep the first error of a walk, and the path it happened at.
+
+static void
+walk_error (walk_share * share, const char * path, int error)
+{
+  pthread_mutex_lock(&share->mutex);
+  if (share->error == 0) {
+    share->error = error;
+    snprintf(share->error_path, sizeof(share->error_path), "%s", path);
+  }
+  pthread_mutex_unlock(&share->mutex);
+}
+
+
+/// Drop a reference to a share, freeing it with the last.
+
+static void
+walk_unref (walk_share * share)
+{
+  pthread_mutex_lock(&share->mutex);
+  int refs = --share->refs;
+  pthread_mutex_unlock(&share->mutex);
+
+  if (refs == 0) {
+    pthread_mutex_destroy(&share->mutex);
+    pthread_cond_destroy(&share->cond);
+    free(share->dirs);
+    free(share);
+  }
+}
+
+
+static int
+walk_cmp (const void * a, const void * b)
+{
+  return strcmp(((const uft_walk_ent *) a)->path, ((const uft_walk_ent *) b)->path);
+}
@@ -0,0 +1,39 @@
+/// libuft parallel tree walks
+
+#ifndef UFT_WALK_INCLUDED
+#define UFT_WALK_INCLUDED
+
+
+/// A walk of the tree under 'root', finding everything under it (not
+/// 'root' itself) whose name matches 'filter', or whose path relative to
+/// 'root' matches 'pattern' (fnmatch patterns, either may be NULL to
+/// match everything), and directories only if 'dirs'. 'fp' is called
+/// for each entity found, on whichever thread found it, with its path
+/// and a pointer to a per thread context (NULL to start with, 'fini' is
+/// called with it once the thread is done), and what it returns is kept
+/// with the path.
+typedef struct uft_walk_st
+{
+  const char * root;
+  const char * filter;
+  const char * pattern;
+  int          dirs;
+  void *       (*fp)(const char * path, void ** ctxp, void * arg);
+  void         (*fini)(void * ctx, void * arg);
+  void *       arg;
+} uft_walk;
+
+/// An entity found by a walk, and what 'fp' returned for it.
+typedef struct uft_walk_ent_st
+{
+  char * path;
+  void * data;
+} uft_walk_ent;
+
+
+extern int  uft_walk_run (uft_walk * walk, uft_walk_ent ** entsp, int * countp, char * error_path, int error_path_len);
+extern void uft_walk_ents_free (uft_walk_ent * ents, int count);
+extern int  uft_walk_glob_root (const char * pattern, char * root, int root_len);
+
+
+#endif // UFT_WALK_INCLUDED
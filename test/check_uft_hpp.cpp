@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <check.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "uft_check.h"
+#include "uft.hpp"
+
+
+// Helpers.
+
+void
+write_test_file (const char * path, const char * content)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert(fd >= 0);
+  ck_assert(write(fd, content, strlen(content)) == (ssize_t) strlen(content));
+  close(fd);
+}
+
+
+std::string
+read_test_file (const char * path)
+{
+  char buf[64];
+
+  int fd = open(path, O_RDONLY);
+  ck_assert(fd >= 0);
+  ssize_t len = read(fd, buf, sizeof(buf));
+  close(fd);
+  ck_assert(len >= 0);
+
+  return std::string(buf, len);
+}
+
+
+void
+setup_test_files (void)
+{
+  if (mkdir(".test_hpp_dir", 0755) != 0)
+    perror("mkdir .test_hpp_dir");
+  write_test_file(".test_hpp_dir/file1.txt", "one\n");
+  write_test_file(".test_hpp_dir/file2.txt", "two\n");
+  write_test_file(".test_hpp_dir/file3.txt", "three\n");
+}
+
+
+void
+teardown_test_files (void)
+{
+  unlink(".test_hpp_dir/file1.txt");
+  unlink(".test_hpp_dir/file2.txt");
+  unlink(".test_hpp_dir/file3.txt");
+  if (rmdir(".test_hpp_dir") != 0)
+    perror("rmdir .test_hpp_dir");
+}
+
+
+// Tests.
+
+START_TEST (test_moved_transaction_keeps_running)
+{
+  uft::transaction<> tx;
+  uft_tx * c_tx = tx.get();
+
+  uft::transaction<> moved(std::move(tx));
+  ck_assert_ptr_eq(tx.get(), nullptr);
+  ck_assert_ptr_eq(moved.get(), c_tx);
+
+  uft::transaction<> assigned;
+  assigned = std::move(moved);
+  ck_assert_ptr_eq(moved.get(), nullptr);
+  ck_assert_ptr_eq(assigned.get(), c_tx);
+
+  assigned.begin([] (auto & tx) {
+    ck_assert(tx.add(".test_hpp_dir/file1.txt"));
+    write_test_file(".test_hpp_dir/file1.txt", "changed\n");
+    return false;
+  });
+  ck_assert(assigned.rollback_ok());
+  ck_assert(read_test_file(".test_hpp_dir/file1.txt") == "one\n");
+}
+END_TEST
+
+
+START_TEST (test_exception_rolls_back_then_rethrows)
+{
+  uft::transaction<> tx;
+  bool caught = false;
+
+  try {
+    tx.begin([] (auto & tx) {
+      ck_assert(tx.add(".test_hpp_dir/file1.txt"));
+      write_test_file(".test_hpp_dir/file1.txt", "changed\n");
+      throw std::runtime_error("broke");
+    });
+  } catch (const std::runtime_error & e) {
+    caught = true;
+    ck_assert_str_eq(e.what(), "broke");
+    ck_assert(read_test_file(".test_hpp_dir/file1.txt") == "one\n");
+  }
+  ck_assert(caught);
+  ck_assert(tx.rollback_ok());
+}
+END_TEST
+
+
+START_TEST (test_add_all_takes_vector_and_array)
+{
+  uft::transaction<> tx;
+
+  tx.begin([] (auto & tx) {
+    std::vector<std::string> strings = { ".test_hpp_dir/file1.txt", ".test_hpp_dir/file2.txt" };
+    const char * c_strings[] = { ".test_hpp_dir/file3.txt" };
+    ck_assert(tx.add_all(strings));
+    ck_assert(tx.add_all(c_strings));
+    ck_assert(tx.covers(".test_hpp_dir/file2.txt"));
+    ck_assert(!tx.add_all(std::array<std::string_view, 1> { ".test_hpp_dir/none.txt" }));
+
+    write_test_file(".test_hpp_dir/file1.txt", "changed\n");
+    write_test_file(".test_hpp_dir/file2.txt", "changed\n");
+    write_test_file(".test_hpp_dir/file3.txt", "changed\n");
+    tx.fail();
+  });
+
+  ck_assert(tx.rollback_ok());
+  ck_assert(read_test_file(".test_hpp_dir/file1.txt") == "one\n");
+  ck_assert(read_test_file(".test_hpp_dir/file2.txt") == "two\n");
+  ck_assert(read_test_file(".test_hpp_dir/file3.txt") == "three\n");
+}
+END_TEST
+
+
+START_TEST (test_errors_iterates_logged_errors)
+{
+  uft::transaction<> tx;
+  std::vector<std::string> msgs;
+
+  tx.begin([] (auto & tx) {
+    tx.log_error("broke");
+    tx.log_error(std::string("badly"));
+    tx.fail();
+  });
+
+  uft::error_list errors = tx.errors();
+  ck_assert_int_eq(errors.size(), 2);
+  for (std::string_view msg : errors)
+    msgs.emplace_back(msg);
+  ck_assert(msgs[0] == "broke");
+  ck_assert(msgs[1] == "badly");
+}
+END_TEST
+
+
+START_TEST (test_group_wait_until_durable)
+{
+  uft_group * group = uft_group_new(NULL, 100000, 100);
+  ck_assert(group != NULL);
+
+  {
+    uft::transaction<uft::capture::full, uft::durability::group> tx({ group });
+    tx.begin([] (auto & tx) {
+      ck_assert(tx.add(".test_hpp_dir/file1.txt"));
+      write_test_file(".test_hpp_dir/file1.txt", "changed\n");
+      return true;
+    });
+    ck_assert(tx.pending());
+    ck_assert(!tx.durable());
+
+    tx.wait();
+    ck_assert(!tx.pending());
+    ck_assert(tx.ok() && tx.durable());
+  }
+
+  uft_group_rm(group);
+  ck_assert(read_test_file(".test_hpp_dir/file1.txt") == "changed\n");
+}
+END_TEST
+
+
+START_TEST (test_group_failure_is_not_pending)
+{
+  uft_group * group = uft_group_new(NULL, 100000, 100);
+  ck_assert(group != NULL);
+
+  {
+    uft::transaction<uft::capture::full, uft::durability::group> tx({ group });
+    tx.begin([] (auto & tx) {
+      ck_assert(tx.add(".test_hpp_dir/file1.txt"));
+      write_test_file(".test_hpp_dir/file1.txt", "changed\n");
+      return false;
+    });
+    ck_assert(!tx.pending());
+    ck_assert(tx.rollback_ok());
+  }
+
+  uft_group_rm(group);
+  ck_assert(read_test_file(".test_hpp_dir/file1.txt") == "one\n");
+}
+END_TEST
+
+
+START_TEST (test_group_without_group_throws)
+{
+  uft::transaction<uft::capture::full, uft::durability::group> tx;
+  bool called = false;
+  bool caught = false;
+
+  try {
+    tx.begin([&called] (auto & tx) { called = true; });
+  } catch (const std::invalid_argument &) {
+    caught = true;
+  }
+  ck_assert(caught);
+  ck_assert(!called);
+  ck_assert(!tx.pending());
+}
+END_TEST
+
+
+Suite *
+uft_hpp_suite (void)
+{
+  Suite * s = suite_create("binding");
+
+  TCase * tc_hpp = tcase_create("transaction");
+  tcase_add_checked_fixture(tc_hpp, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_hpp, test_moved_transaction_keeps_running);
+  tcase_add_test(tc_hpp, test_exception_rolls_back_then_rethrows);
+  tcase_add_test(tc_hpp, test_add_all_takes_vector_and_array);
+  tcase_add_test(tc_hpp, test_errors_iterates_logged_errors);
+  tcase_add_test(tc_hpp, test_group_wait_until_durable);
+  tcase_add_test(tc_hpp, test_group_failure_is_not_pending);
+  tcase_add_test(tc_hpp, test_group_without_group_throws);
+
+  suite_add_tcase(s, tc_hpp);
+
+  return s;
+}
+
+
+int
+main (int argc, char ** argv)
+{
+  int num_failed;
+  Suite * s = uft_hpp_suite();
+  SRunner * sr = srunner_create(s);
+
+  srunner_run_all(sr, UFT_CHECK_SRUNNER_FLAGS);
+  num_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  exit(num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
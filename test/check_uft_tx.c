@@ -7,6 +7,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #include "uft_check.h"
 
@@ -14,6 +23,8 @@
 #include "uft_tx.h"
 #include "uft_ll.h"
 #include "uft_status.h"
+#include "uft_trace.h"
+#include "uft_rm.h"
 
 
 int g_txfp_called;
@@ -243,331 +254,2195 @@ tx_do_fail_with_new_dir (uft_tx * tx)
   return;
 }
 
+
 void
-tx_do_child_ok_parent_fail (uft_tx * tx)
+tx_do_fail_with_new_tree (uft_tx * tx)
 {
-  void * extra = uft_tx_extra(tx);
+  char path[64];
 
-  uft_tx * child_tx = uft_tx_child(tx, extra);
-  uft_tx_begin(child_tx, tx_do_succeed);
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".no_test_dir2", UFT_ALLOW_NOENT)));
 
-  uft_tx_set_extra(tx, child_tx);
+  ck_assert(mkdir(".no_test_dir2", 0755) == 0);
+  for (int i = 0; i < 8; i++) {
+    snprintf(path, sizeof(path), ".no_test_dir2/d%d", i);
+    ck_assert(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), ".no_test_dir2/d%d/e", i);
+    ck_assert(mkdir(path, 0755) == 0);
+    for (int j = 0; j < 50; j++) {
+      snprintf(path, sizeof(path), ".no_test_dir2/d%d/e/f%d", i, j);
+      int fd = open(path, O_WRONLY | O_CREAT, 0644);
+      ck_assert(fd >= 0);
+      close(fd);
+    }
+    snprintf(path, sizeof(path), ".no_test_dir2/l%d", i);
+    ck_assert(symlink("/", path) == 0);
+  }
 
   uft_tx_fail(tx);
 }
 
+void
+write_test_file (const char * path, const char * content)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert(fd >= 0);
+  ck_assert(write(fd, content, strlen(content)) == strlen(content));
+  close(fd);
+}
 
-// Tests.
+void
+write_test_tree (const char * content)
+{
+  char path[64];
+  const char * top[] = { "top.conf", "top2.conf", ".hidden.conf", "top.txt" };
 
-START_TEST (test_new_tx_not_null)
+  mkdir(".test_dir1/t", 0755);
+  for (int i = 0; i < 4; i++) {
+    snprintf(path, sizeof(path), ".test_dir1/t/%s", top[i]);
+    write_test_file(path, content);
+  }
+  for (int i = 0; i < 16; i++) {
+    snprintf(path, sizeof(path), ".test_dir1/t/d%02d", i);
+    mkdir(path, 0755);
+    for (int j = 0; j < 4; j++) {
+      snprintf(path, sizeof(path), ".test_dir1/t/d%02d/f%d.%s", i, j, j % 2 == 0 ? "conf" : "txt");
+      write_test_file(path, content);
+    }
+  }
+}
+
+void
+tx_do_fail_with_tree_edits (uft_tx * tx)
 {
-  uft_tx * tx = uft_tx_new(NULL);
-  ck_assert(tx != NULL);
+  write_test_tree("orig");
+
+  ck_assert(uft_status_success(uft_tx_add_tree(tx, ".test_dir1/t/", "*.conf", 0)));
+  ck_assert_int_eq(uft_ll_count(tx->ents), 34);
+  for (uft_ll_node * lln = uft_ll_head(tx->ents); uft_ll_next(lln) != NULL; lln = uft_ll_next(lln)) {
+    uft_ent_state * ent_state = uft_ll_data(lln);
+    uft_ent_state * next_ent_state = uft_ll_data(uft_ll_next(lln));
+    ck_assert(ent_state->flags == UFT_ES_FILE && ent_state->data_len == 4);
+    ck_assert(strcmp(ent_state->path, next_ent_state->path) < 0);
+  }
+  ck_assert_str_eq(((uft_ent_state *) uft_ll_data(uft_ll_head(tx->ents)))->path, ".test_dir1/t/d00/f0.conf");
+  ck_assert(!uft_tx_covers(tx, ".test_dir1/t/.hidden.conf"));
+  ck_assert(!uft_tx_covers(tx, ".test_dir1/t/d00/f1.txt"));
+
+  ck_assert(uft_status_success(uft_tx_add_glob(tx, ".test_dir1/t/d0*/f?.txt", 0)));
+  ck_assert_int_eq(uft_ll_count(tx->ents), 54);
+  ck_assert(uft_tx_covers(tx, ".test_dir1/t/d09/f3.txt"));
+  ck_assert(!uft_tx_covers(tx, ".test_dir1/t/d10/f3.txt"));
+  ck_assert(uft_status_success(uft_tx_add_glob(tx, ".test_dir1/t/*/none*", 0)));
+  ck_assert(uft_status_success(uft_tx_add_glob(tx, ".no_test_dir1/*", 0)));
+  ck_assert(uft_status_error(uft_tx_add_tree(tx, ".no_test_dir1", NULL, 0)));
+  ck_assert_int_eq(uft_ll_count(tx->ents), 54);
+
+  write_test_tree("changed");
+
+  uft_tx_fail(tx);
+}
+
+void
+tx_do_create_new_file (uft_tx * tx)
+{
+  char * path = (char *) uft_tx_extra(tx);
+
+  if (uft_status_success(uft_tx_add_ent(tx, path, UFT_ALLOW_NOENT))) {
+    write_test_file(path, "new");
+    uft_tx_success(tx);
+  }
+}
+
+void *
+thread_edit_tree_dirs (void * arg)
+{
+  uft_tx * tx = ((void **) arg)[0];
+  int first = (intptr_t) ((void **) arg)[1];
+  char path[64];
+  char new_path[64];
+
+  for (int i = first; i < first + 2; i++) {
+    for (int j = 0; j < 4; j++) {
+      snprintf(path, sizeof(path), ".test_dir1/t/d%02d/f%d.%s", i, j, j % 2 == 0 ? "conf" : "txt");
+      if (uft_status_error(uft_tx_add_ent(tx, path, j % 2 == 0 ? UFT_ASYNC_CAPTURE : 0)) || uft_tx_barrier(tx, path) != 0)
+        return NULL;
+      write_test_file(path, "changed");
+    }
+    snprintf(new_path, sizeof(new_path), ".test_dir1/t/d%02d/new", i);
+    uft_tx * child_tx = uft_tx_child(tx, new_path);
+    if (!uft_tx_ok(uft_tx_begin(child_tx, tx_do_create_new_file)))
+      return NULL;
+  }
+  uft_tx_log_error(tx, "thread editing d%02d and d%02d done", first, first + 1);
+
+  return tx;
+}
+
+void
+tx_do_fail_with_threaded_edits (uft_tx * tx)
+{
+  pthread_t threads[8];
+  void * args[8][2];
+  void * result;
+
+  write_test_tree("orig");
+
+  for (int i = 0; i < 8; i++) {
+    args[i][0] = tx;
+    args[i][1] = (void *) (intptr_t) (i * 2);
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, thread_edit_tree_dirs, args[i]), 0);
+  }
+  for (int i = 0; i < 8; i++) {
+    ck_assert_int_eq(pthread_join(threads[i], &result), 0);
+    ck_assert(result == tx);
+  }
+
+  ck_assert_int_eq(uft_ll_count(tx->ents), 16 * 5);
+  ck_assert_int_eq(uft_ll_count(tx->errors), 8);
+  ck_assert(uft_tx_covers(tx, ".test_dir1/t/d07/new"));
+  ck_assert(uft_tx_ok(tx));
+
+  uft_tx_fail(tx);
+}
+
+void
+tx_do_fail_with_meta_edits (uft_tx * tx)
+{
+  struct timespec times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", UFT_META_ONLY)));
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_tail(tx->ents));
+  ck_assert_int_eq(ent_state->flags, UFT_ES_META);
+  ck_assert_int_eq(ent_state->data_len, 0);
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2", UFT_META_XATTRS)));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_symlink1.txt", UFT_META_ONLY)));
+
+  ck_assert(chmod(".test_dir2/test_file1.txt", 04600) == 0);
+  ck_assert(utimensat(AT_FDCWD, ".test_dir2/test_file1.txt", times, 0) == 0);
+  if (geteuid() == 0)
+    ck_assert(chown(".test_dir2/test_file1.txt", 1, 1) == 0);
+  ck_assert(chmod(".test_dir2", 0700) == 0);
+  setxattr(".test_dir2", "user.uft_test", "x", 1, 0);
+  ck_assert(utimensat(AT_FDCWD, ".test_dir2/test_symlink1.txt", times, AT_SYMLINK_NOFOLLOW) == 0);
+
+  uft_tx_fail(tx);
+}
+
+void
+count_enrolled (const char * path, void * arg)
+{
+  if (g_txfp_called++ == 0)
+    ck_assert_str_eq(path, (char *) arg);
+}
+
+void
+tx_do_fail_with_covered_fd (uft_tx * tx)
+{
+  char path[PATH_MAX];
+
+  // The descriptor's path is absolute, so the directory is added by its
+  // absolute path too.
+  ck_assert(getcwd(path, sizeof(path)) != NULL);
+  strcat(path, "/.no_test_dir2");
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, path, UFT_ALLOW_NOENT)));
+  ck_assert(mkdir(".no_test_dir2", 0755) == 0);
+  int fd = open(".no_test_dir2/f", O_WRONLY | O_CREAT, 0644);
+  ck_assert(fd >= 0);
+
+  ck_assert(uft_status_success(uft_tx_add_fd(tx, fd)));
+  ck_assert(uft_status_success(uft_tx_add_fd(tx, fd)));
+  close(fd);
+  ck_assert_int_eq(uft_ll_count(tx->ents), 1);
+
+  uft_tx_fail(tx);
+}
+
+void
+tx_do_fail_with_covered_tree (uft_tx * tx)
+{
+  // Added before its directory, so rolled back before it in spite of
+  // being added first.
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".no_test_dir2/x/y", UFT_ALLOW_NOENT)));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".no_test_dir2", UFT_ALLOW_NOENT)));
+  ck_assert(mkdir(".no_test_dir2", 0755) == 0);
+  ck_assert(mkdir(".no_test_dir2/x", 0755) == 0);
+  int fd = open(".no_test_dir2/x/y", O_WRONLY | O_CREAT, 0644);
+  ck_assert(fd >= 0);
+  close(fd);
+
+  // Under a directory that did not exist, so nothing need be captured,
+  // unless it is reached through a symlink.
+  ck_assert(uft_tx_covers(tx, ".no_test_dir2/f"));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".no_test_dir2/f", UFT_ALLOW_NOENT)));
+  ck_assert(symlink("../.test_dir2", ".no_test_dir2/l") == 0);
+  ck_assert(!uft_tx_covers(tx, ".no_test_dir2/l/test_file1.txt"));
+  ck_assert(!uft_tx_covers(tx, ".no_test_dir2/../.test_dir2/test_file1.txt"));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".no_test_dir2/l/test_file1.txt", 0)));
+  ck_assert(uft_tx_covers(tx, ".no_test_dir2/l/test_file1.txt"));
+  ck_assert(!uft_tx_covers(tx, ".test_dir2/test_file2.txt"));
+
+  g_txfp_called = 0;
+  ck_assert_int_eq(uft_tx_each_enrolled(tx, "./.no_test_dir2/", count_enrolled, ".no_test_dir2"), 3);
+  ck_assert_int_eq(g_txfp_called, 3);
+  ck_assert_int_eq(uft_tx_each_enrolled(tx, ".no_test_dir2/x", count_enrolled, NULL), 1);
+  ck_assert_int_eq(uft_tx_each_enrolled(tx, ".test_dir2", count_enrolled, NULL), 0);
+
+  fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_TRUNC);
+  ck_assert(fd >= 0);
+  close(fd);
+
+  uft_tx_fail(tx);
+}
+
+void
+tx_do_fail_with_file_edit_at (uft_tx * tx)
+{
+  g_txfp_called++;
+
+  int dirfd = open(".test_dir2", O_RDONLY | O_DIRECTORY);
+  ck_assert_msg(dirfd >= 0, strerror(errno));
+  ck_assert(uft_status_success(uft_tx_add_ent_at(tx, dirfd, "test_file1.txt", 0)));
+  ck_assert(uft_status_success(uft_tx_add_ent_at(tx, dirfd, "test_file2.txt", UFT_ALLOW_NOENT)));
+  close(dirfd);
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert_msg(write(fd, "abc\n", 4) == 4, strerror(errno));
+  close(fd);
+  fd = open(".test_dir2/test_file2.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  close(fd);
+
+  uft_tx_fail(tx);
+
+  return;
+}
+
+
+void
+fail_with_sparse_file_fill (uft_tx * tx, int flags)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_sparse1.img", flags)));
+
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_tail(tx->ents));
+  ck_assert_int_eq(ent_state->size, 2 << 20);
+  ck_assert_int_eq(ent_state->extent_count, 2);
+  ck_assert(ent_state->data_len < (1 << 20));
+
+  int fd = open(".test_dir2/test_sparse1.img", O_WRONLY);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert(pwrite(fd, "!!!", 3, 512 << 10) == 3);
+  ck_assert(pwrite(fd, "xy!", 3, 1 << 20) == 3);
+  ck_assert(ftruncate(fd, 3 << 20) == 0);
+  close(fd);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_fail_with_sparse_file_fill (uft_tx * tx)
+{
+  fail_with_sparse_file_fill(tx, 0);
+}
+
+
+void
+tx_do_fail_with_sparse_file_fill_diff (uft_tx * tx)
+{
+  fail_with_sparse_file_fill(tx, UFT_DIFF_ROLLBACK);
+}
+
+
+void
+fail_with_large_file_edit (uft_tx * tx, int flags)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_large1.dat", flags)));
+
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_tail(tx->ents));
+  ck_assert(ent_state->spool_fd >= 0);
+  ck_assert_int_eq(ent_state->data_len, 3 << 20);
+
+  int fd = open(".test_dir2/test_large1.dat", O_WRONLY | O_TRUNC);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert(write(fd, "gone", 4) == 4);
+  close(fd);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_fail_with_large_file_edit (uft_tx * tx)
+{
+  fail_with_large_file_edit(tx, 0);
+}
+
+
+void
+tx_do_fail_with_direct_io_edits (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", UFT_DIRECT_IO)));
+
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_tail(tx->ents));
+  ck_assert((ent_state->flags & UFT_ES_NOCACHE) != 0);
+  ck_assert_int_eq(ent_state->data_len, 12);
+  ck_assert(strncmp(ent_state->data, "foo\nbar\nbaz\n", 12) == 0);
+  ck_assert(truncate(".test_dir2/test_file1.txt", 0) == 0);
+
+  fail_with_large_file_edit(tx, UFT_DIRECT_IO);
+}
+
+
+void
+tx_do_fail_with_async_capture (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_large1.dat", UFT_ASYNC_CAPTURE)));
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_tail(tx->ents));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", UFT_ASYNC_CAPTURE)));
+
+  int fd = uft_open(tx, ".test_dir2/test_large1.dat", O_WRONLY | O_TRUNC, 0);
+  ck_assert(fd >= 0);
+  ck_assert(ent_state->capture == NULL);
+  ck_assert(ent_state->spool_fd >= 0);
+  ck_assert_int_eq(ent_state->data_len, 3 << 20);
+  ck_assert_int_eq(uft_write(tx, fd, "gone", 4), 4);
+  close(fd);
+
+  ck_assert_int_eq(uft_tx_barrier(tx, ".test_dir2/test_file1.txt"), 0);
+  ck_assert_int_eq(tx->captures, 0);
+  ck_assert(truncate(".test_dir2/test_file1.txt", 0) == 0);
+
+  uft_tx_fail(tx);
+}
+
+
+void *
+thread_barrier_large_file (void * arg)
+{
+  ck_assert_int_eq(uft_tx_barrier((uft_tx *) arg, ".test_dir2/test_large1.dat"), 0);
+
+  return NULL;
+}
+
+
+void
+tx_do_fail_with_concurrent_barriers (uft_tx * tx)
+{
+  pthread_t threads[4];
+
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_large1.dat", UFT_ASYNC_CAPTURE)));
+  for (int i = 0; i < 4; i++)
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, thread_barrier_large_file, tx), 0);
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+  for (int i = 0; i < 4; i++)
+    ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+  ck_assert_int_eq(tx->captures, 0);
+
+  ck_assert(truncate(".test_dir2/test_large1.dat", 0) == 0);
+  ck_assert(truncate(".test_dir2/test_file1.txt", 0) == 0);
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_fail_with_file_append (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", UFT_APPEND_ONLY)));
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_APPEND);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert(write(fd, "qux\n", 4) == 4);
+  close(fd);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_fail_with_append_only_file_edit (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", UFT_APPEND_ONLY)));
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert(write(fd, "FOO\nBAR\nBAZ\nQUX\n", 16) == 16);
+  close(fd);
+
+  uft_tx_fail(tx);
+}
+
+
+int
+dir_entry_count (const char * path, const char * prefix)
+{
+  int count = 0;
+  DIR * dir = opendir(path);
+
+  ck_assert_ptr_ne(dir, NULL);
+  for (struct dirent * dirent = readdir(dir); dirent != NULL; dirent = readdir(dir))
+    if (strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0)
+      if (prefix == NULL || strncmp(dirent->d_name, prefix, strlen(prefix)) == 0)
+        count++;
+  closedir(dir);
+
+  return count;
+}
+
+
+void
+tx_do_fail_with_unlink (uft_tx * tx)
+{
+  struct stat statbuf;
+
+  ck_assert_int_eq(uft_unlink(tx, ".test_dir2/test_file1.txt"), 0);
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) != 0);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_fail_with_rmtree (uft_tx * tx)
+{
+  struct stat statbuf;
+
+  ck_assert_int_eq(uft_unlink(tx, ".test_dir2"), -1);
+  ck_assert_int_eq(uft_rmtree(tx, ".test_dir2"), 0);
+  ck_assert(stat(".test_dir2", &statbuf) != 0);
+}
+
+
+void
+tx_do_fail_with_renames (uft_tx * tx)
+{
+  struct stat statbuf;
+
+  ck_assert_int_eq(uft_rename(tx, ".test_dir2/test_file1.txt", ".test_dir1/moved.txt"), 0);
+  ck_assert_int_eq(uft_rename(tx, ".test_dir2/test_symlink1.txt", ".test_dir2/test_file1.txt"), 0);
+  ck_assert_int_eq(uft_rename(tx, ".test_dir1/moved.txt", ".test_dir2/test_file1.txt"), 0);
+  ck_assert(lstat(".test_dir2/test_file1.txt", &statbuf) == 0 && S_ISREG(statbuf.st_mode));
+  ck_assert_int_eq(uft_rename(tx, ".test_dir1/moved.txt", ".test_dir2/test_file1.txt"), -1);
+}
+
+
+void
+tx_do_fail_with_same_file_renames (uft_tx * tx)
+{
+  ck_assert(link(".test_dir2/test_file1.txt", ".test_dir1/link.txt") == 0);
+  ck_assert_int_eq(uft_rename(tx, ".test_dir2/test_file1.txt", ".test_dir2/test_file1.txt"), 0);
+  ck_assert_int_eq(uft_rename(tx, ".test_dir2/test_file1.txt", ".test_dir1/link.txt"), 0);
+  ck_assert_int_eq(dir_entry_count(".test_dir1", NULL), 1);
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 2);
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_unlink_and_succeed (uft_tx * tx)
+{
+  ck_assert_int_eq(uft_unlink(tx, ".test_dir2/test_file1.txt"), 0);
+
+  uft_tx_success(tx);
+}
+
+
+void
+tx_do_child_unlink_and_succeed (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+
+  uft_tx * child_tx = uft_tx_child(tx, NULL);
+  uft_tx_begin(child_tx, tx_do_unlink_and_succeed);
+  ck_assert(uft_tx_ok(child_tx));
+
+  uft_tx_success(tx);
+}
+
+
+void
+tx_do_fail_to_trash (uft_tx * tx)
+{
+  ck_assert_int_eq(uft_unlink(tx, ".test_dir2/test_file1.txt"), -1);
+}
+
+
+/// Set or clear the immutable attribute of 'path', returning false if
+/// the file system (or the lack of privilege) does not allow it.
+int
+set_immutable (const char * path, int on)
+{
+  int attr;
+
+  int fd = open(path, O_RDONLY);
+  ck_assert(fd >= 0);
+  int ok = ioctl(fd, FS_IOC_GETFLAGS, &attr) == 0;
+  attr = on ? attr | FS_IMMUTABLE_FL : attr & ~FS_IMMUTABLE_FL;
+  ok = ok && ioctl(fd, FS_IOC_SETFLAGS, &attr) == 0;
+  close(fd);
+
+  return ok;
+}
+
+
+void
+tx_do_lock_and_succeed (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", UFT_LOCK_EX)));
+
+  uft_tx * child_tx = uft_tx_child(tx, NULL);
+  ck_assert(uft_status_success(uft_tx_add_ent(child_tx, ".test_dir2/test_file1.txt", UFT_LOCK_EX)));
+
+  uft_tx_success(tx);
+}
+
+
+void *
+thread_lock_file (void * arg)
+{
+  return uft_tx_add_ent((uft_tx *) arg, ".test_dir2/test_file1.txt", UFT_LOCK_EX);
+}
+
+
+void
+tx_do_child_ok_parent_fail (uft_tx * tx)
+{
+  void * extra = uft_tx_extra(tx);
+
+  uft_tx * child_tx = uft_tx_child(tx, extra);
+  uft_tx_begin(child_tx, tx_do_succeed);
+
+  uft_tx_set_extra(tx, child_tx);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_child_edit_succeed (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert_msg(write(fd, "child\n", 6) == 6, strerror(errno));
+  close(fd);
+
+  uft_tx_success(tx);
+}
+
+
+void
+tx_do_child_edit_parent_fail (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert_msg(fd >= 0, strerror(errno));
+  ck_assert_msg(write(fd, "parent\n", 7) == 7, strerror(errno));
+  close(fd);
+
+  uft_tx * child_tx = uft_tx_child(tx, NULL);
+  uft_tx_begin(child_tx, tx_do_child_edit_succeed);
+  uft_tx_set_extra(tx, child_tx);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_child_rename_succeed (uft_tx * tx)
+{
+  ck_assert_int_eq(uft_rename(tx, ".test_dir1/old.txt", ".test_dir2/test_file1.txt"), 0);
+
+  uft_tx_success(tx);
+}
+
+
+void
+tx_do_child_rename_parent_fail (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+  write_test_file(".test_dir1/old.txt", "old\n");
+
+  uft_tx * child_tx = uft_tx_child(tx, NULL);
+  uft_tx_begin(child_tx, tx_do_child_rename_succeed);
+  ck_assert(uft_tx_ok(child_tx));
+
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_nest_deeply_succeed (uft_tx * tx)
+{
+  int * depth = uft_tx_extra(tx);
+
+  if (--(*depth) > 0)
+    uft_tx_begin(uft_tx_child(tx, depth), tx_do_nest_deeply_succeed);
+
+  uft_tx_success(tx);
+}
+
+
+void
+tx_do_nest_deeply_parent_fail (uft_tx * tx)
+{
+  uft_tx_begin(uft_tx_child(tx, uft_tx_extra(tx)), tx_do_nest_deeply_succeed);
+
+  uft_tx_fail(tx);
+}
+
+
+void
+participant_edit (int shm_fd, int tx_id, int fail)
+{
+  uft_tx * tx = uft_tx_join(shm_fd, tx_id, NULL);
+  if (tx == NULL)
+    _exit(1);
+
+  if (!uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0))
+      || !uft_status_success(uft_tx_add_ent(tx, ".test_dir1/test_file2.txt", UFT_ALLOW_NOENT)))
+    _exit(2);
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_TRUNC);
+  if (fd < 0 || write(fd, "abc\n", 4) != 4)
+    _exit(3);
+  close(fd);
+  fd = open(".test_dir1/test_file2.txt", O_WRONLY | O_CREAT, 0644);
+  if (fd < 0)
+    _exit(4);
+  close(fd);
+
+  if (fail)
+    uft_tx_fail(tx);
+  uft_tx_end(tx);
+  _exit(0);
+}
+
+
+void
+tx_do_share_and_fork (uft_tx * tx, int participant_fail)
+{
+  int status;
+  int shm_fd = uft_tx_share(tx, 0);
+  ck_assert_msg(shm_fd >= 0, strerror(errno));
+
+  pid_t pid = fork();
+  if (pid == 0)
+    participant_edit(shm_fd, uft_tx_id(tx), participant_fail);
+
+  ck_assert(waitpid(pid, &status, 0) == pid);
+  ck_assert(WIFEXITED(status));
+  ck_assert_int_eq(WEXITSTATUS(status), 0);
+}
+
+
+void
+tx_do_share_then_fail (uft_tx * tx)
+{
+  tx_do_share_and_fork(tx, 0);
+  uft_tx_fail(tx);
+}
+
+
+void
+tx_do_share_with_failing_participant (uft_tx * tx)
+{
+  tx_do_share_and_fork(tx, 1);
+  uft_tx_success(tx);
+}
+
+
+void
+tx_async_done (uft_tx * tx)
+{
+  g_txfp_called += 100;
+}
+
+
+void
+tx_async_done_durable (uft_tx * tx)
+{
+  g_txfp_called += uft_tx_durable(tx) ? 1000 : 1;
+}
+
+
+void
+tx_do_edit_and_succeed (uft_tx * tx)
+{
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_TRUNC);
+  ck_assert(fd >= 0);
+  ck_assert(write(fd, "new\n", 4) == 4);
+  close(fd);
+
+  uft_tx_success(tx);
+}
+
+
+void
+tx_do_fail_with_pooled_capture (uft_tx * tx)
+{
+  static int next = 0;
+  char path[64];
+
+  snprintf(path, sizeof(path), ".test_dir1/async%d.txt", __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, path, UFT_ASYNC_CAPTURE)));
+  ck_assert_int_eq(uft_tx_barrier(tx, path), 0);
+  write_test_file(path, "changed");
+  uft_tx_fail(tx);
+}
+
+
+int
+async_wait_dispatch (void)
+{
+  struct pollfd pfd = { .fd = uft_async_fd(), .events = POLLIN };
+
+  ck_assert_int_eq(poll(&pfd, 1, 5000), 1);
+
+  return uft_async_dispatch();
+}
+
+
+// Tests.
+
+START_TEST (test_new_tx_not_null)
+{
+  uft_tx * tx = uft_tx_new(NULL);
+  ck_assert(tx != NULL);
+}
+END_TEST
+
+
+START_TEST (test_new_tx_stores_extra_data)
+{
+  uft_tx * tx = uft_tx_new((void *) 100);
+  ck_assert(tx->extra == (void *) 100);
+}
+END_TEST
+
+
+START_TEST (test_extra_returns_extra_data)
+{
+  uft_tx * tx = uft_tx_new((void *) 123456);
+  ck_assert_ptr_eq(uft_tx_extra(tx), (void *) 123456);
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_returns_tx)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_nothing);
+  ck_assert(tx == g_tx);
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_calls_exec_fun)
+{
+  uft_tx_begin(g_tx, tx_do_nothing);
+  ck_assert(g_txfp_called == 1);
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_rollback_when_no_update)
+{
+  uft_tx_begin(g_tx, tx_do_nothing);
+  ck_assert(uft_tx_rollback_attempted(g_tx));
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_rollback_when_failed)
+{
+  uft_tx_begin(g_tx, tx_do_fail);
+  ck_assert(uft_tx_rollback_attempted(g_tx));
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_no_rollback_when_succeeded)
+{
+  uft_tx_begin(g_tx, tx_do_succeed);
+  ck_assert(uft_tx_ok(g_tx));
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_error_msg_recorded)
+{
+  uft_tx_begin(g_tx, tx_do_fail_with_error_msg);
+  ck_assert(uft_ll_count(g_tx->errors) == 1);
+  ck_assert_str_eq((char *) uft_tx_error_msg(uft_ll_data(uft_ll_nth(g_tx->errors, 0))), "broke");
+}
+END_TEST
+
+
+START_TEST (test_begin_tx_multiple_error_msgs_recorded)
+{
+  uft_tx_begin(g_tx, tx_do_fail_with_two_error_msgs);
+  ck_assert(uft_ll_count(g_tx->errors) == 2);
+  ck_assert_str_eq((char *) uft_tx_error_msg(uft_ll_data(uft_ll_nth(g_tx->errors, 0))), "broke");
+  ck_assert_str_eq((char *) uft_tx_error_msg(uft_ll_data(uft_ll_nth(g_tx->errors, 1))), "badly");
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_dir_fails)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir1", 0);
+  ck_assert(uft_status_error(status));
+}
+END_TEST
+
+
+START_TEST (test_add_ent_nonexisting_fails_without_flag)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".no_test_dir1", 0);
+  ck_assert(uft_status_error(status));
+}
+END_TEST
+
+
+START_TEST (test_add_ent_nonexisting_succeeds)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".no_test_dir1", UFT_ALLOW_NOENT);
+  ck_assert(uft_status_success(status));
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_file_succeeds)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0);
+  ck_assert(uft_status_success(status));
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_file_adds_file)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0);
+  ck_assert(uft_ll_count(g_tx->ents) == 1);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
+  ck_assert((ent_state->flags & UFT_ES_FILE) == UFT_ES_FILE);
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_file_records_file_data)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0);
+  ck_assert(uft_ll_count(g_tx->ents) == 1);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
+  ck_assert((ent_state->flags & UFT_ES_FILE) == UFT_ES_FILE);
+  ck_assert(ent_state->data_len == 12);
+  ck_assert(strncmp(ent_state->data, "foo\nbar\nbaz\n", ent_state->data_len) == 0);
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_symlink_succeeds)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_symlink1.txt", 0);
+  ck_assert(uft_status_success(status));
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_symlink_adds_symlink)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_symlink1.txt", 0);
+  ck_assert(uft_ll_count(g_tx->ents) == 1);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
+  ck_assert((ent_state->flags & UFT_ES_SYMLINK) == UFT_ES_SYMLINK);
+}
+END_TEST
+
+
+START_TEST (test_add_ent_existing_symlink_records_linkdest)
+{
+  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_symlink1.txt", 0);
+  ck_assert(uft_ll_count(g_tx->ents) == 1);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
+  ck_assert((ent_state->flags & UFT_ES_SYMLINK) == UFT_ES_SYMLINK);
+  ck_assert(ent_state->data_len == strlen("test_file1.txt"));
+  ck_assert(strncmp(ent_state->data, "test_file1.txt", ent_state->data_len) == 0);
+}
+END_TEST
+
+
+START_TEST (test_add_ent_at_records_file_data)
+{
+  int dirfd = open(".test_dir2", O_RDONLY | O_DIRECTORY);
+  ck_assert(dirfd >= 0);
+  uft_status * status = uft_tx_add_ent_at(g_tx, dirfd, "test_file1.txt", 0);
+  close(dirfd);
+
+  ck_assert(uft_status_success(status));
+  ck_assert(uft_ll_count(g_tx->ents) == 1);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
+  ck_assert((ent_state->flags & UFT_ES_FILE) == UFT_ES_FILE);
+  ck_assert_str_eq(ent_state->name, "test_file1.txt");
+  ck_assert(strstr(ent_state->path, "/.test_dir2/test_file1.txt") != NULL);
+  ck_assert(ent_state->data_len == 12);
+  ck_assert(strncmp(ent_state->data, "foo\nbar\nbaz\n", ent_state->data_len) == 0);
+}
+END_TEST
+
+
+START_TEST (test_add_fd_records_file_data)
+{
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY);
+  ck_assert(fd >= 0);
+  uft_status * status = uft_tx_add_fd(g_tx, fd);
+
+  ck_assert(uft_status_success(status));
+  ck_assert_int_eq(lseek(fd, 0, SEEK_CUR), 0);
+  close(fd);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
+  ck_assert((ent_state->flags & UFT_ES_FILE) == UFT_ES_FILE);
+  ck_assert(ent_state->data_len == 12);
+  ck_assert(strncmp(ent_state->data, "foo\nbar\nbaz\n", ent_state->data_len) == 0);
+}
+END_TEST
+
+
+START_TEST (test_add_fd_of_dir_fails)
+{
+  int fd = open(".test_dir1", O_RDONLY | O_DIRECTORY);
+  ck_assert(fd >= 0);
+  ck_assert(uft_status_error(uft_tx_add_fd(g_tx, fd)));
+  close(fd);
+}
+END_TEST
+
+
+void
+tx_do_fail_with_set_edits (uft_tx * tx)
+{
+  uft_enrol_set * set = uft_tx_extra(tx);
+
+  ck_assert(uft_status_success(uft_tx_add_set(tx, set)));
+  ck_assert_int_eq(uft_ll_count(tx->ents), 2);
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_head(tx->ents));
+  ck_assert_ptr_eq(ent_state->dir, set->dirs[set->ents[0].dir_idx]);
+  ck_assert(uft_tx_covers(tx, ".test_dir1/new_file"));
+
+  write_test_file(".test_dir2/test_file1.txt", "changed");
+  write_test_file(".test_dir1/new_file", "new");
+  uft_tx_fail(tx);
+}
+
+
+START_TEST (test_add_set_rolls_back_every_run)
+{
+  char * paths[] = { ".test_dir2/test_file1.txt", ".test_dir1/new_file", NULL };
+  struct stat statbuf;
+  char buf[13];
+
+  uft_enrol_set * set = uft_enrol_set_prepare(paths, UFT_ALLOW_NOENT);
+  ck_assert_ptr_ne(set, NULL);
+  ck_assert_int_eq(set->count, 2);
+  ck_assert_int_eq(set->dir_count, 2);
+  ck_assert_int_eq(set->ents[0].type, S_IFREG);
+  ck_assert_int_eq(set->ents[1].type, 0);
+
+  for (int run = 0; run < 3; run++) {
+    uft_tx * tx = uft_tx_new(set);
+    uft_tx_begin(tx, tx_do_fail_with_set_edits);
+    ck_assert(uft_tx_rollback_ok(tx));
+    uft_tx_end(tx);
+
+    int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+    ck_assert(fd >= 0);
+    ck_assert_int_eq(read(fd, buf, 13), 12);
+    close(fd);
+    ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+    ck_assert(stat(".test_dir1/new_file", &statbuf) != 0);
+  }
+
+  // A directory replaced since the set was prepared is looked up afresh.
+  ck_assert_int_eq(rename(".test_dir1", ".test_dir3"), 0);
+  ck_assert_int_eq(mkdir(".test_dir1", 0755), 0);
+  ck_assert_int_eq(stat(".test_dir1", &statbuf), 0);
+  ck_assert(uft_status_success(uft_tx_add_set(g_tx, set)));
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_tail(g_tx->ents));
+  ck_assert_str_eq(ent_state->path, ".test_dir1/new_file");
+  ck_assert(ent_state->dir->ino == statbuf.st_ino);
+  ck_assert_int_eq(rmdir(".test_dir3"), 0);
+
+  uft_enrol_set_rm(set);
+}
+END_TEST
+
+
+START_TEST (test_lock_try_fails_when_locked)
+{
+  uft_tx * other_tx = uft_tx_new(NULL);
+
+  ck_assert(uft_status_success(uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", UFT_LOCK_EX)));
+  uft_status * status = uft_tx_add_ent(other_tx, ".test_dir2/test_file1.txt", UFT_LOCK_SH | UFT_LOCK_TRY);
+  ck_assert(uft_status_error(status));
+  ck_assert(uft_status_busy(status));
+  ck_assert_int_eq(uft_ll_count(other_tx->ents), 0);
+
+  uft_tx_end(other_tx);
+}
+END_TEST
+
+
+START_TEST (test_lock_younger_tx_dies)
+{
+  uft_tx * other_tx = uft_tx_new(NULL);
+
+  ck_assert(uft_status_success(uft_tx_add_ent(g_tx, ".test_dir2/test_file2.txt", UFT_ALLOW_NOENT | UFT_LOCK_EX)));
+  uft_status * status = uft_tx_add_ent(other_tx, ".test_dir2/test_file2.txt", UFT_ALLOW_NOENT | UFT_LOCK_EX);
+  ck_assert(uft_status_busy(status));
+
+  uft_tx_end(other_tx);
+}
+END_TEST
+
+
+START_TEST (test_lock_on_noent_holds_once_created)
+{
+  uft_tx * other_tx = uft_tx_new(NULL);
+
+  ck_assert(uft_status_success(uft_tx_add_ent(g_tx, ".test_dir2/test_file2.txt", UFT_ALLOW_NOENT | UFT_LOCK_EX)));
+  write_test_file(".test_dir2/test_file2.txt", "created");
+  uft_status * status = uft_tx_add_ent(other_tx, ".test_dir2/test_file2.txt", UFT_LOCK_EX | UFT_LOCK_TRY);
+  ck_assert(uft_status_busy(status));
+  ck_assert_int_eq(uft_ll_count(other_tx->ents), 0);
+
+  uft_tx_end(other_tx);
+  ck_assert_int_eq(unlink(".test_dir2/test_file2.txt"), 0);
+}
+END_TEST
+
+
+START_TEST (test_lock_shared_locks_compatible)
+{
+  uft_tx * other_tx = uft_tx_new(NULL);
+
+  ck_assert(uft_status_success(uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", UFT_LOCK_SH)));
+  ck_assert(uft_status_success(uft_tx_add_ent(other_tx, ".test_dir2/test_file1.txt", UFT_LOCK_SH | UFT_LOCK_TRY)));
+
+  uft_tx_end(other_tx);
+}
+END_TEST
+
+
+START_TEST (test_lock_released_when_tx_done)
+{
+  uft_tx_begin(g_tx, tx_do_lock_and_succeed);
+  ck_assert(uft_tx_ok(g_tx));
+
+  uft_tx * other_tx = uft_tx_new(NULL);
+  ck_assert(uft_status_success(uft_tx_add_ent(other_tx, ".test_dir2/test_file1.txt", UFT_LOCK_EX | UFT_LOCK_TRY)));
+  uft_tx_end(other_tx);
+}
+END_TEST
+
+
+START_TEST (test_lock_older_tx_waits)
+{
+  pthread_t thread;
+  void * status;
+  uft_tx * other_tx = uft_tx_new(NULL);
+
+  ck_assert(uft_status_success(uft_tx_add_ent(other_tx, ".test_dir2/test_file1.txt", UFT_LOCK_EX)));
+  ck_assert_int_eq(pthread_create(&thread, NULL, thread_lock_file, g_tx), 0);
+  usleep(50000);
+  ck_assert_int_eq(uft_ll_count(g_tx->ents), 0);
+  uft_tx_end(other_tx);
+  ck_assert_int_eq(pthread_join(thread, &status), 0);
+
+  ck_assert(uft_status_success((uft_status *) status));
+  ck_assert_int_eq(uft_ll_count(g_tx->ents), 1);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_changed_files)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_edit);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[12];
+  ck_assert_int_eq(read(fd, buf, 12), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_deleted_files)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_rm);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[12];
+  ck_assert_int_eq(read(fd, buf, 12), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_dir_replaced_files)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_dir_replace);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[12];
+  ck_assert_int_eq(read(fd, buf, 12), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_symlink_replaced_files)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_symlink_replace);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[12];
+  ck_assert_int_eq(read(fd, buf, 12), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_changed_symlinks)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_symlink_edit);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  char buf[15];
+  ck_assert(readlink(".test_dir2/test_symlink1.txt", buf, 15) == 14);
+  buf[14] = '\0';
+  ck_assert_str_eq(buf, "test_file1.txt");
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_replaced_symlinks)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_symlink_replacement);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  char buf[15];
+  ck_assert(readlink(".test_dir2/test_symlink1.txt", buf, 15) == 14);
+  buf[14] = '\0';
+  ck_assert_str_eq(buf, "test_file1.txt");
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_deleted_symlinks)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_symlink_rm);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  char buf[15];
+  ck_assert(readlink(".test_dir2/test_symlink1.txt", buf, 15) == 14);
+  buf[14] = '\0';
+  ck_assert_str_eq(buf, "test_file1.txt");
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_files_added_at)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_edit_at);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[12];
+  ck_assert_int_eq(read(fd, buf, 12), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+
+  struct stat statbuf;
+  ck_assert(lstat(".test_dir2/test_file2.txt", &statbuf) != 0);
+}
+END_TEST
+
+
+/// Returns the physical offset of the extent holding `off` in `path`, or
+/// zero if it is a hole or the file system cannot map extents.
+off_t
+file_extent_physical (const char * path, off_t off)
+{
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } req;
+  off_t physical = 0;
+
+  int fd = open(path, O_RDONLY);
+  ck_assert(fd >= 0);
+  memset(&req, 0, sizeof(req));
+  req.map.fm_start = off;
+  req.map.fm_length = 1;
+  req.map.fm_flags = FIEMAP_FLAG_SYNC;
+  req.map.fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, &req.map) == 0 && req.map.fm_mapped_extents == 1
+      && (req.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN) == 0)
+    physical = req.extent.fe_physical + (off - req.extent.fe_logical);
+  close(fd);
+
+  return physical;
+}
+
+
+void
+check_sparse_file_rollback (void (*txfp)(uft_tx *), int in_place)
+{
+  struct stat statbuf;
+  blkcnt_t blocks;
+  off_t physical;
+  char buf[3];
+
+  int fd = open(".test_dir2/test_sparse1.img", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert(fd >= 0);
+  ck_assert(pwrite(fd, "abc", 3, 0) == 3);
+  ck_assert(pwrite(fd, "xyz", 3, 1 << 20) == 3);
+  ck_assert(ftruncate(fd, 2 << 20) == 0);
+  close(fd);
+  ck_assert(stat(".test_dir2/test_sparse1.img", &statbuf) == 0);
+  blocks = statbuf.st_blocks;
+  physical = file_extent_physical(".test_dir2/test_sparse1.img", 0);
+
+  uft_tx_begin(g_tx, txfp);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert(stat(".test_dir2/test_sparse1.img", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_size, 2 << 20);
+  ck_assert(statbuf.st_blocks * 512 < (1 << 20));
+  fd = open(".test_dir2/test_sparse1.img", O_RDONLY);
+  ck_assert(pread(fd, buf, 3, 512 << 10) == 3);
+  ck_assert(memcmp(buf, "\0\0\0", 3) == 0);
+  ck_assert(pread(fd, buf, 3, 1 << 20) == 3);
+  ck_assert(memcmp(buf, "xyz", 3) == 0);
+  close(fd);
+  if (in_place) {
+    // The extent the transaction left alone keeps its blocks and the hole it
+    // filled is punched again rather than written out as zeroes.
+    ck_assert(statbuf.st_blocks <= blocks);
+    ck_assert(file_extent_physical(".test_dir2/test_sparse1.img", 0) == physical);
+    ck_assert(physical == 0 || file_extent_physical(".test_dir2/test_sparse1.img", 512 << 10) == 0);
+  }
+  unlink(".test_dir2/test_sparse1.img");
+}
+
+
+START_TEST (test_failure_rolls_back_sparse_files)
+{
+  check_sparse_file_rollback(tx_do_fail_with_sparse_file_fill, 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_sparse_files_by_diff)
+{
+  check_sparse_file_rollback(tx_do_fail_with_sparse_file_fill_diff, 1);
+}
+END_TEST
+
+
+void
+check_large_file_rollback (void (*txfp)(uft_tx *))
+{
+  struct stat statbuf;
+  int len = 3 << 20;
+  char * buf = malloc(len);
+  char * read_buf = malloc(len);
+
+  for (int i = 0; i < len; i++)
+    buf[i] = 'a' + i % 23;
+  int fd = open(".test_dir2/test_large1.dat", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert(fd >= 0);
+  ck_assert(write(fd, buf, len) == len);
+  close(fd);
+
+  uft_tx_begin(g_tx, txfp);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert(stat(".test_dir2/test_large1.dat", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_size, len);
+  fd = open(".test_dir2/test_large1.dat", O_RDONLY);
+  ck_assert(read(fd, read_buf, len) == len);
+  close(fd);
+  ck_assert(memcmp(buf, read_buf, len) == 0);
+  unlink(".test_dir2/test_large1.dat");
+  free(buf);
+  free(read_buf);
+}
+
+
+START_TEST (test_failure_rolls_back_large_files)
+{
+  check_large_file_rollback(tx_do_fail_with_large_file_edit);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_async_captures)
+{
+  struct stat statbuf;
+
+  check_large_file_rollback(tx_do_fail_with_async_capture);
+
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_size, 12);
+}
+END_TEST
+
+
+START_TEST (test_barriers_join_a_capture_once)
+{
+  struct stat statbuf;
+
+  check_large_file_rollback(tx_do_fail_with_concurrent_barriers);
+
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_size, 12);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_direct_io_files)
+{
+  struct stat statbuf;
+
+  check_large_file_rollback(tx_do_fail_with_direct_io_edits);
+
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_size, 12);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_meta_only)
+{
+  struct stat file_before, dir_before, link_before, statbuf;
+  char value[8];
+
+  ck_assert(stat(".test_dir2/test_file1.txt", &file_before) == 0);
+  ck_assert(stat(".test_dir2", &dir_before) == 0);
+  ck_assert(lstat(".test_dir2/test_symlink1.txt", &link_before) == 0);
+
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_meta_edits);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_mode, file_before.st_mode);
+  ck_assert_int_eq(statbuf.st_uid, file_before.st_uid);
+  ck_assert_int_eq(statbuf.st_gid, file_before.st_gid);
+  ck_assert_int_eq(statbuf.st_mtim.tv_sec, file_before.st_mtim.tv_sec);
+  ck_assert_int_eq(statbuf.st_mtim.tv_nsec, file_before.st_mtim.tv_nsec);
+  ck_assert_int_eq(statbuf.st_size, 12);
+  ck_assert(stat(".test_dir2", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_mode, dir_before.st_mode);
+  ck_assert(getxattr(".test_dir2", "user.uft_test", value, sizeof(value)) < 0);
+  ck_assert(lstat(".test_dir2/test_symlink1.txt", &statbuf) == 0);
+  ck_assert_int_eq(statbuf.st_mtim.tv_sec, link_before.st_mtim.tv_sec);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_appends)
+{
+  uft_tx_begin(g_tx, tx_do_fail_with_file_append);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[16];
+  ck_assert_int_eq(read(fd, buf, 16), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_append_only_detects_edits)
+{
+  uft_tx_begin(g_tx, tx_do_fail_with_append_only_file_edit);
+
+  ck_assert(uft_tx_rollback_failed(g_tx));
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_unlink)
+{
+  uft_tx_begin(g_tx, tx_do_fail_with_unlink);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 2);
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[13];
+  ck_assert_int_eq(read(fd, buf, 13), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_rmtree)
+{
+  uft_tx_begin(g_tx, tx_do_fail_with_rmtree);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 2);
+  ck_assert_int_eq(dir_entry_count(".", ".uft-trash-"), 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_renames)
+{
+  struct stat statbuf;
+
+  uft_tx_begin(g_tx, tx_do_fail_with_renames);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(dir_entry_count(".test_dir1", NULL), 0);
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 2);
+  ck_assert(lstat(".test_dir2/test_symlink1.txt", &statbuf) == 0 && S_ISLNK(statbuf.st_mode));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY | O_NOFOLLOW);
+  ck_assert(fd >= 0);
+  char buf[13];
+  ck_assert_int_eq(read(fd, buf, 13), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+}
+END_TEST
+
+
+START_TEST (test_rename_to_same_file_changes_nothing)
+{
+  struct stat statbuf;
+
+  uft_tx_begin(g_tx, tx_do_fail_with_same_file_renames);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert(lstat(".test_dir2/test_file1.txt", &statbuf) == 0 && S_ISREG(statbuf.st_mode));
+  ck_assert_int_eq(statbuf.st_nlink, 2);
+  ck_assert(unlink(".test_dir1/link.txt") == 0);
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 2);
+}
+END_TEST
+
+
+START_TEST (test_success_reaps_child_trash)
+{
+  struct stat statbuf;
+
+  uft_tx_begin(g_tx, tx_do_child_unlink_and_succeed);
+
+  ck_assert(uft_tx_ok(g_tx));
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) != 0);
+  for (int i = 0; i < 500 && dir_entry_count(".test_dir2", NULL) > 1; i++)
+    usleep(10000);
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 1);
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_CREAT, 0644);
+  close(fd);
+}
+END_TEST
+
+
+START_TEST (test_failed_trash_leaves_no_trash)
+{
+  // an immutable file cannot be moved to the trash
+  if (!set_immutable(".test_dir2/test_file1.txt", 1))
+    return;
+  uft_tx_begin(g_tx, tx_do_fail_to_trash);
+  ck_assert(set_immutable(".test_dir2/test_file1.txt", 0));
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(dir_entry_count(".test_dir2", ".uft-trash-"), 0);
+}
+END_TEST
+
+
+START_TEST (test_success_reaps_trash)
+{
+  struct stat statbuf;
+
+  uft_tx_begin(g_tx, tx_do_unlink_and_succeed);
+
+  ck_assert(uft_tx_ok(g_tx));
+  ck_assert(stat(".test_dir2/test_file1.txt", &statbuf) != 0);
+  for (int i = 0; i < 500 && dir_entry_count(".test_dir2", NULL) > 1; i++)
+    usleep(10000);
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 1);
+
+  int fd = open(".test_dir2/test_file1.txt", O_WRONLY | O_CREAT, 0644);
+  close(fd);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_noent)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_new_file);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  struct stat statbuf;
+  ck_assert(lstat(".test_dir2/test_file2.txt", &statbuf) != 0);
+  ck_assert_int_eq(errno, ENOENT);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_noent_with_mkdir)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_new_dir);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  struct stat statbuf;
+  ck_assert(lstat(".no_test_dir2", &statbuf) != 0);
+  ck_assert_int_eq(errno, ENOENT);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_noent_with_tree)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_new_tree);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  struct stat statbuf;
+  ck_assert(lstat(".no_test_dir2", &statbuf) != 0);
+  ck_assert_int_eq(errno, ENOENT);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_tree_and_glob)
+{
+  char buf[8];
+
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_tree_edits);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+  const char * paths[] = { ".test_dir1/t/top.conf", ".test_dir1/t/d15/f2.conf", ".test_dir1/t/d03/f1.txt", ".test_dir1/t/d12/f1.txt", ".test_dir1/t/top.txt" };
+  const char * want[] = { "orig", "orig", "orig", "changed", "changed" };
+  for (int i = 0; i < 5; i++) {
+    int fd = open(paths[i], O_RDONLY);
+    ck_assert(fd >= 0);
+    int len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[len > 0 ? len : 0] = '\0';
+    ck_assert_str_eq(buf, want[i]);
+  }
+  ck_assert(uft_rm_tree(AT_FDCWD, ".test_dir1/t") == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_threaded_edits)
+{
+  char path[64];
+  char buf[8];
+
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_threaded_edits);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+  for (int i = 0; i < 16; i++) {
+    for (int j = 0; j < 4; j++) {
+      snprintf(path, sizeof(path), ".test_dir1/t/d%02d/f%d.%s", i, j, j % 2 == 0 ? "conf" : "txt");
+      int fd = open(path, O_RDONLY);
+      ck_assert(fd >= 0);
+      int len = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      buf[len > 0 ? len : 0] = '\0';
+      ck_assert_str_eq(buf, "orig");
+    }
+    snprintf(path, sizeof(path), ".test_dir1/t/d%02d/new", i);
+    ck_assert(access(path, F_OK) != 0);
+  }
+  ck_assert(uft_rm_tree(AT_FDCWD, ".test_dir1/t") == 0);
+}
+END_TEST
+
+
+START_TEST (test_failure_rolls_back_covered_tree)
+{
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_covered_tree);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+
+  struct stat statbuf;
+  ck_assert(lstat(".no_test_dir2", &statbuf) != 0);
+  ck_assert_int_eq(errno, ENOENT);
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[12];
+  ck_assert_int_eq(read(fd, buf, 12), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
 }
 END_TEST
 
 
-START_TEST (test_new_tx_stores_extra_data)
+START_TEST (test_failure_rolls_back_covered_fd)
 {
-  uft_tx * tx = uft_tx_new((void *) 100);
-  ck_assert(tx->extra == (void *) 100);
-}
-END_TEST
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_covered_fd);
 
+  ck_assert(uft_tx_rollback_ok(tx));
 
-START_TEST (test_extra_returns_extra_data)
-{
-  uft_tx * tx = uft_tx_new((void *) 123456);
-  ck_assert_ptr_eq(uft_tx_extra(tx), (void *) 123456);
+  struct stat statbuf;
+  ck_assert(lstat(".no_test_dir2", &statbuf) != 0);
+  ck_assert_int_eq(errno, ENOENT);
 }
 END_TEST
 
 
-START_TEST (test_begin_tx_returns_tx)
+START_TEST (test_group_commits_batch_durably)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_nothing);
-  ck_assert(tx == g_tx);
-}
-END_TEST
+  char buf[64];
+  char want[64];
+
+  uft_group * group = uft_group_new(".test_dir1/journal", 10000000, 2);
+  ck_assert_msg(group != NULL, strerror(errno));
+  uft_tx * tx1 = uft_tx_new(NULL);
+  uft_tx * tx2 = uft_tx_new(NULL);
+  uft_tx_group(tx1, group, tx_async_done);
+  uft_tx_group(tx2, group, tx_async_done);
+  g_txfp_called = 0;
 
+  uft_tx_begin(tx1, tx_do_edit_and_succeed);
+  ck_assert(!uft_tx_durable(tx1));
+  uft_tx_begin(tx2, tx_do_edit_and_succeed);
 
-START_TEST (test_begin_tx_calls_exec_fun)
-{
-  uft_tx_begin(g_tx, tx_do_nothing);
-  ck_assert(g_txfp_called == 1);
+  for (int dispatched = 0; dispatched < 2; )
+    dispatched += async_wait_dispatch();
+  ck_assert_int_eq(g_txfp_called, 200);
+  ck_assert(uft_tx_ok(tx1) && uft_tx_durable(tx1));
+  ck_assert(uft_tx_ok(tx2) && uft_tx_durable(tx2));
+
+  int fd = open(".test_dir1/journal", O_RDONLY);
+  ck_assert(fd >= 0);
+  int len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  ck_assert(len > 0);
+  buf[len] = '\0';
+  snprintf(want, sizeof(want), "%d\n%d\n", uft_tx_id(tx1), uft_tx_id(tx2));
+  ck_assert_str_eq(buf, want);
+
+  uft_group_rm(group);
+  uft_tx_end(tx1);
+  uft_tx_end(tx2);
+  unlink(".test_dir1/journal");
 }
 END_TEST
 
 
-START_TEST (test_begin_tx_rollback_when_no_update)
+START_TEST (test_group_notifies_before_async_use)
 {
-  uft_tx_begin(g_tx, tx_do_nothing);
-  ck_assert(uft_tx_rollback_attempted(g_tx));
+  uft_group * group = uft_group_new(NULL, 0, 1);
+  ck_assert(group != NULL);
+  uft_tx_group(g_tx, group, tx_async_done);
+
+  // the flusher queues the callback before anything else has started
+  // the worker pool
+  uft_tx_begin(g_tx, tx_do_edit_and_succeed);
+  usleep(100000);
+  ck_assert_int_eq(async_wait_dispatch(), 1);
+  ck_assert_int_eq(g_txfp_called, 100);
+  ck_assert(uft_tx_ok(g_tx) && uft_tx_durable(g_tx));
+
+  uft_group_rm(group);
 }
 END_TEST
 
 
-START_TEST (test_begin_tx_rollback_when_failed)
+START_TEST (test_group_cancel_rolls_back)
 {
-  uft_tx_begin(g_tx, tx_do_fail);
-  ck_assert(uft_tx_rollback_attempted(g_tx));
+  char buf[13];
+
+  uft_group * group = uft_group_new(NULL, 10000000, 100);
+  ck_assert(group != NULL);
+  uft_tx_group(g_tx, group, NULL);
+
+  uft_tx_begin(g_tx, tx_do_edit_and_succeed);
+  ck_assert(!uft_tx_durable(g_tx));
+  ck_assert_int_eq(uft_group_cancel(g_tx), 0);
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(uft_group_cancel(g_tx), -1);
+  ck_assert_int_eq(errno, EBUSY);
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  ck_assert_int_eq(read(fd, buf, 13), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+
+  uft_group_rm(group);
 }
 END_TEST
 
 
-START_TEST (test_begin_tx_no_rollback_when_succeeded)
+START_TEST (test_group_finishes_async_transaction_once_durable)
 {
-  uft_tx_begin(g_tx, tx_do_succeed);
-  ck_assert(uft_tx_ok(g_tx));
+  uft_group * group = uft_group_new(NULL, 100000, 100);
+  ck_assert(group != NULL);
+  uft_tx_group(g_tx, group, tx_async_done);
+
+  ck_assert_ptr_eq(uft_tx_begin_async(g_tx, tx_do_edit_and_succeed, tx_async_done_durable), g_tx);
+  for (int dispatched = 0; dispatched < 2; )
+    dispatched += async_wait_dispatch();
+  ck_assert_int_eq(g_txfp_called, 1100);
+  ck_assert(uft_tx_ok(g_tx) && uft_tx_durable(g_tx));
+
+  uft_group_rm(group);
 }
 END_TEST
 
 
-START_TEST (test_begin_tx_error_msg_recorded)
+void
+check_metrics_dump (int format, const char ** expected)
 {
-  uft_tx_begin(g_tx, tx_do_fail_with_error_msg);
-  ck_assert(uft_ll_count(g_tx->errors) == 1);
-  ck_assert_str_eq((char *) uft_tx_error_msg(uft_ll_data(uft_ll_nth(g_tx->errors, 0))), "broke");
+  char buf[65536];
+
+  FILE * tmp = tmpfile();
+  ck_assert(tmp != NULL);
+  ck_assert_int_eq(uft_metrics_dump(fileno(tmp), format), 0);
+  ssize_t len = pread(fileno(tmp), buf, sizeof(buf) - 1, 0);
+  fclose(tmp);
+  ck_assert(len > 0);
+  buf[len] = '\0';
+
+  for (int i = 0; expected[i] != NULL; i++)
+    ck_assert_msg(strstr(buf, expected[i]) != NULL, "metrics dump is missing \"%s\"", expected[i]);
 }
-END_TEST
 
-
-START_TEST (test_begin_tx_multiple_error_msgs_recorded)
+START_TEST (test_metrics_dump_records_tx_and_enrolment)
 {
-  uft_tx_begin(g_tx, tx_do_fail_with_two_error_msgs);
-  ck_assert(uft_ll_count(g_tx->errors) == 2);
-  ck_assert_str_eq((char *) uft_tx_error_msg(uft_ll_data(uft_ll_nth(g_tx->errors, 0))), "broke");
-  ck_assert_str_eq((char *) uft_tx_error_msg(uft_ll_data(uft_ll_nth(g_tx->errors, 1))), "badly");
+  const char * prometheus[] = {
+    "# TYPE uft_tx_seconds summary\n",
+    "uft_tx_seconds{quantile=\"0.99\"} ",
+    "uft_rollback_seconds_count ",
+    "uft_enrol_seconds{size=\"4k\",quantile=\"0.999\"} ",
+    "uft_enrol_failed_total ",
+    NULL
+  };
+  const char * json[] = { "\"tx_seconds\":{\"count\":", "\"enrol_seconds\":{\"4k\":{", "\"tx_failed_total\":", NULL };
+
+  uft_tx_begin(g_tx, tx_do_fail_with_file_edit);
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert(uft_status_error(uft_tx_add_ent(g_tx, ".no_test_dir1", 0)));
+
+  check_metrics_dump(UFT_METRICS_PROMETHEUS, prometheus);
+  check_metrics_dump(UFT_METRICS_JSON, json);
+
+  ck_assert_int_eq(uft_metrics_dump(1, 0), -1);
+  ck_assert_int_eq(errno, EINVAL);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_dir_fails)
+START_TEST (test_trace_records_calls)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir1", 0);
-  ck_assert(uft_status_error(status));
+  char trace_path[] = "/tmp/uft_check_trace.XXXXXX";
+  char buf[4096];
+  char cwd[100];
+
+  int fd = mkstemp(trace_path);
+  ck_assert(fd >= 0);
+  ck_assert_int_eq(uft_trace_start(trace_path), 0);
+  ck_assert_int_eq(uft_trace_start(trace_path), -1);
+  ck_assert_int_eq(errno, EBUSY);
+
+  uft_tx_begin(g_tx, tx_do_fail_with_file_edit);
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(uft_trace_stop(), 0);
+  ck_assert_int_eq(uft_trace_stop(), -1);
+
+  ssize_t len = read(fd, buf, sizeof(buf));
+  close(fd);
+  unlink(trace_path);
+  ck_assert(len > 8);
+  ck_assert(memcmp(buf, UFT_TRACE_MAGIC, 8) == 0);
+  ck_assert(getcwd(cwd, sizeof(cwd)) != NULL);
+  ck_assert_int_eq(buf[8], strlen(cwd));
+  ck_assert(memcmp(buf + 9, cwd, strlen(cwd)) == 0);
+  ck_assert_int_eq(buf[9 + strlen(cwd)], UFT_TRACE_BEGIN);
+  ck_assert(memmem(buf, len, ".test_dir2/test_file1.txt", 25) != NULL);
+  ck_assert(memmem(buf, len, ".test_dir2/test_symlink1.txt", 28) != NULL);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_nonexisting_fails_without_flag)
+START_TEST (test_rollback_rolls_back_children)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".no_test_dir1", 0);
-  ck_assert(uft_status_error(status));
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_child_ok_parent_fail);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+  uft_tx * child_tx = uft_tx_extra(tx);
+  ck_assert(uft_tx_rollback_ok(child_tx));
 }
 END_TEST
 
-
-START_TEST (test_add_ent_nonexisting_succeeds)
+START_TEST (test_child_success_merges_ents_into_parent)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".no_test_dir1", UFT_ALLOW_NOENT);
-  ck_assert(uft_status_success(status));
+  uft_tx * child_tx = uft_tx_child(g_tx, NULL);
+  uft_tx_begin(child_tx, tx_do_child_edit_succeed);
+
+  ck_assert(uft_tx_ok(child_tx));
+  ck_assert_int_eq(uft_ll_count(child_tx->ents), 0);
+  ck_assert_int_eq(uft_ll_count(g_tx->ents), 1);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_file_succeeds)
+START_TEST (test_child_merge_keeps_oldest_state)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0);
-  ck_assert(uft_status_success(status));
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_child_edit_parent_fail);
+
+  ck_assert_int_eq(uft_ll_count(tx->ents), 0);
+  ck_assert(uft_tx_rollback_ok(tx));
+  uft_tx * child_tx = uft_tx_extra(tx);
+  ck_assert(uft_tx_rollback_ok(child_tx));
+
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[13];
+  ck_assert_int_eq(read(fd, buf, 13), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_file_adds_file)
+START_TEST (test_child_merge_keeps_renames)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0);
-  ck_assert(uft_ll_count(g_tx->ents) == 1);
-  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
-  ck_assert((ent_state->flags & UFT_ES_FILE) == UFT_ES_FILE);
+  char buf[13];
+
+  uft_tx * tx = uft_tx_begin(g_tx, tx_do_child_rename_parent_fail);
+
+  ck_assert(uft_tx_rollback_ok(tx));
+  int fd = open(".test_dir1/old.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  ck_assert_int_eq(read(fd, buf, 13), 4);
+  close(fd);
+  ck_assert(strncmp(buf, "old\n", 4) == 0);
+  ck_assert(unlink(".test_dir1/old.txt") == 0);
+
+  fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  ck_assert_int_eq(read(fd, buf, 13), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+  ck_assert_int_eq(dir_entry_count(".test_dir2", NULL), 2);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_file_records_file_data)
+START_TEST (test_rollback_deeply_nested_children)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0);
-  ck_assert(uft_ll_count(g_tx->ents) == 1);
-  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
-  ck_assert((ent_state->flags & UFT_ES_FILE) == UFT_ES_FILE);
-  ck_assert(ent_state->data_len == 12);
-  ck_assert(strncmp(ent_state->data, "foo\nbar\nbaz\n", ent_state->data_len) == 0);
+  int depth = 10000;
+
+  uft_tx_set_extra(g_tx, &depth);
+  uft_tx_begin(g_tx, tx_do_nest_deeply_parent_fail);
+
+  ck_assert_int_eq(depth, 0);
+  ck_assert(uft_tx_rollback_ok(g_tx));
+  ck_assert_int_eq(uft_ll_count(g_tx->children), 10000);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_symlink_succeeds)
+START_TEST (test_reset_clears_tx_keeping_capacity)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_symlink1.txt", 0);
-  ck_assert(uft_status_success(status));
+  int old_id = uft_tx_id(g_tx);
+
+  ck_assert(uft_status_success(uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0)));
+  uft_tx_begin(g_tx, tx_do_fail_with_error_msg);
+  uft_tx_reset(g_tx);
+
+  ck_assert_int_ne(uft_tx_id(g_tx), old_id);
+  ck_assert_int_eq(g_tx->code, 0);
+  ck_assert_int_eq(uft_ll_count(g_tx->ents), 0);
+  ck_assert_int_eq(uft_ll_count(g_tx->errors), 0);
+  ck_assert_int_eq(uft_ll_count(g_tx->spare_ents), 1);
+  ck_assert_int_eq(uft_ll_count(g_tx->spare_errors), 1);
+
+  uft_ent_state * spare_ent_state = uft_ll_data(uft_ll_head(g_tx->spare_ents));
+  ck_assert(uft_status_success(uft_tx_add_ent(g_tx, ".test_dir2/test_file1.txt", 0)));
+  ck_assert_ptr_eq(uft_ll_data(uft_ll_head(g_tx->ents)), spare_ent_state);
+  ck_assert(strncmp(spare_ent_state->data, "foo\nbar\nbaz\n", 12) == 0);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_symlink_adds_symlink)
+START_TEST (test_pool_recycles_ended_tx)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_symlink1.txt", 0);
-  ck_assert(uft_ll_count(g_tx->ents) == 1);
-  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
-  ck_assert((ent_state->flags & UFT_ES_SYMLINK) == UFT_ES_SYMLINK);
+  uft_tx_pool(1);
+
+  uft_tx * tx = uft_tx_new(NULL);
+  int old_id = uft_tx_id(tx);
+  uft_tx_begin(tx, tx_do_fail_with_error_msg);
+  uft_tx_end(tx);
+
+  uft_tx * next_tx = uft_tx_new((void *) 1);
+  ck_assert_ptr_eq(next_tx, tx);
+  ck_assert_int_ne(uft_tx_id(next_tx), old_id);
+  ck_assert_ptr_eq(uft_tx_extra(next_tx), (void *) 1);
+  ck_assert_int_eq(next_tx->code, 0);
+  ck_assert_int_eq(uft_ll_count(next_tx->errors), 0);
+  uft_tx_end(next_tx);
+
+  uft_tx_pool(0);
+  ck_assert_ptr_ne(uft_tx_new(NULL), NULL);
 }
 END_TEST
 
 
-START_TEST (test_add_ent_existing_symlink_records_linkdest)
+void
+tx_do_fail_with_snap_file_edit (uft_tx * tx)
 {
-  uft_status * status = uft_tx_add_ent(g_tx, ".test_dir2/test_symlink1.txt", 0);
-  ck_assert(uft_ll_count(g_tx->ents) == 1);
-  uft_ent_state * ent_state = uft_ll_data(uft_ll_nth(g_tx->ents, 0));
-  ck_assert((ent_state->flags & UFT_ES_SYMLINK) == UFT_ES_SYMLINK);
-  ck_assert(ent_state->data_len == strlen("test_file1.txt"));
-  ck_assert(strncmp(ent_state->data, "test_file1.txt", ent_state->data_len) == 0);
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, ".test_dir2/test_file1.txt", 0)));
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_head(tx->ents));
+  ck_assert_ptr_ne(ent_state->snap, NULL);
+  ck_assert_int_eq(ent_state->size, 12);
+  write_test_file(".test_dir2/test_file1.txt", "changed");
+  uft_tx_fail(tx);
 }
-END_TEST
 
 
-START_TEST (test_failure_rolls_back_changed_files)
+int
+snap_cached (const char * path)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_edit);
+  uft_tx * tx = uft_tx_new(NULL);
 
-  ck_assert(uft_tx_rollback_ok(tx));
+  ck_assert(uft_status_success(uft_tx_add_ent(tx, (char *) path, 0)));
+  int cached = ((uft_ent_state *) uft_ll_data(uft_ll_head(tx->ents)))->snap != NULL;
+  uft_tx_end(tx);
 
-  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
-  ck_assert(fd >= 0);
-  char buf[12];
-  ck_assert_int_eq(read(fd, buf, 12), 12);
-  close(fd);
-  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+  return cached;
 }
-END_TEST
 
 
-START_TEST (test_failure_rolls_back_deleted_files)
+START_TEST (test_snap_cache_shares_unchanged_files)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_rm);
+  // let the change time of the file just written fall behind the clock
+  usleep(20000);
+  ck_assert_int_eq(uft_snap_cache(1 << 20), 0);
 
-  ck_assert(uft_tx_rollback_ok(tx));
+  ck_assert(!snap_cached(".test_dir2/test_file1.txt"));
+  ck_assert(snap_cached(".test_dir2/test_file1.txt"));
 
+  uft_tx_begin(g_tx, tx_do_fail_with_snap_file_edit);
+  ck_assert(uft_tx_rollback_ok(g_tx));
   int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
   ck_assert(fd >= 0);
-  char buf[12];
-  ck_assert_int_eq(read(fd, buf, 12), 12);
+  char buf[13];
+  ck_assert_int_eq(read(fd, buf, 13), 12);
   close(fd);
   ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+
+  // rolled back, so changed, and too recently changed to cache again
+  ck_assert(!snap_cached(".test_dir2/test_file1.txt"));
+  ck_assert(!snap_cached(".test_dir2/test_file1.txt"));
+  usleep(20000);
+  ck_assert(!snap_cached(".test_dir2/test_file1.txt"));
+  ck_assert(snap_cached(".test_dir2/test_file1.txt"));
+
+  ck_assert_int_eq(uft_snap_cache(0), 1 << 20);
+  ck_assert(!snap_cached(".test_dir2/test_file1.txt"));
 }
 END_TEST
 
 
-START_TEST (test_failure_rolls_back_dir_replaced_files)
+START_TEST (test_snap_cache_misses_file_changed_while_locked)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_dir_replace);
-
-  ck_assert(uft_tx_rollback_ok(tx));
-
-  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
-  ck_assert(fd >= 0);
-  char buf[12];
-  ck_assert_int_eq(read(fd, buf, 12), 12);
-  close(fd);
-  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+  pthread_t thread;
+  void * status;
+
+  usleep(20000);
+  ck_assert_int_eq(uft_snap_cache(1 << 20), 0);
+  ck_assert(!snap_cached(".test_dir2/test_file1.txt"));
+  ck_assert(snap_cached(".test_dir2/test_file1.txt"));
+
+  // g_tx finds the file as cached, then waits for the lock while it is
+  // changed, so must capture it afresh
+  uft_tx * other_tx = uft_tx_new(NULL);
+  ck_assert(uft_status_success(uft_tx_add_ent(other_tx, ".test_dir2/test_file1.txt", UFT_LOCK_EX)));
+  ck_assert_int_eq(pthread_create(&thread, NULL, thread_lock_file, g_tx), 0);
+  usleep(50000);
+  write_test_file(".test_dir2/test_file1.txt", "committed\n");
+  uft_tx_end(other_tx);
+  ck_assert_int_eq(pthread_join(thread, &status), 0);
+
+  ck_assert(uft_status_success((uft_status *) status));
+  uft_ent_state * ent_state = uft_ll_data(uft_ll_head(g_tx->ents));
+  ck_assert(ent_state->snap == NULL);
+  ck_assert_int_eq(ent_state->size, 10);
+  ck_assert(memcmp(ent_state->data, "committed\n", 10) == 0);
+  uft_snap_cache(0);
 }
 END_TEST
 
 
-START_TEST (test_failure_rolls_back_symlink_replaced_files)
+START_TEST (test_share_rolls_back_participant_changes)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_file_symlink_replace);
+  struct stat statbuf;
 
-  ck_assert(uft_tx_rollback_ok(tx));
+  uft_tx_begin(g_tx, tx_do_share_then_fail);
+
+  ck_assert(uft_tx_rollback_ok(g_tx));
 
   int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
   ck_assert(fd >= 0);
-  char buf[12];
-  ck_assert_int_eq(read(fd, buf, 12), 12);
+  char buf[13];
+  ck_assert_int_eq(read(fd, buf, 13), 12);
   close(fd);
   ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
+  ck_assert(stat(".test_dir1/test_file2.txt", &statbuf) != 0);
 }
 END_TEST
 
 
-START_TEST (test_failure_rolls_back_changed_symlinks)
+START_TEST (test_share_participant_failure_fails_tx)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_symlink_edit);
-
-  ck_assert(uft_tx_rollback_ok(tx));
+  uft_tx_begin(g_tx, tx_do_share_with_failing_participant);
 
-  char buf[15];
-  ck_assert(readlink(".test_dir2/test_symlink1.txt", buf, 15) == 14);
-  buf[14] = '\0';
-  ck_assert_str_eq(buf, "test_file1.txt");
+  ck_assert((g_tx->code & UFT_TX_ERROR) != 0);
+  ck_assert(uft_tx_rollback_ok(g_tx));
 }
 END_TEST
 
 
-START_TEST (test_failure_rolls_back_replaced_symlinks)
+START_TEST (test_join_checks_tx_id)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_symlink_replacement);
-
-  ck_assert(uft_tx_rollback_ok(tx));
+  int shm_fd = uft_tx_share(g_tx, 4096);
+  ck_assert(shm_fd >= 0);
 
-  char buf[15];
-  ck_assert(readlink(".test_dir2/test_symlink1.txt", buf, 15) == 14);
-  buf[14] = '\0';
-  ck_assert_str_eq(buf, "test_file1.txt");
+  ck_assert_ptr_eq(uft_tx_join(shm_fd, uft_tx_id(g_tx) + 1, NULL), NULL);
+  uft_tx * tx = uft_tx_join(shm_fd, uft_tx_id(g_tx), NULL);
+  ck_assert_ptr_ne(tx, NULL);
+  uft_tx_end(tx);
 }
 END_TEST
 
 
-START_TEST (test_failure_rolls_back_deleted_symlinks)
+START_TEST (test_begin_async_rolls_back_and_dispatches)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_symlink_rm);
-
-  ck_assert(uft_tx_rollback_ok(tx));
-
-  char buf[15];
-  ck_assert(readlink(".test_dir2/test_symlink1.txt", buf, 15) == 14);
-  buf[14] = '\0';
-  ck_assert_str_eq(buf, "test_file1.txt");
-}
-END_TEST
+  ck_assert_ptr_eq(uft_tx_begin_async(g_tx, tx_do_fail_with_file_edit, tx_async_done), g_tx);
 
+  int dispatched = 0;
+  while (dispatched == 0)
+    dispatched = async_wait_dispatch();
 
-START_TEST (test_failure_rolls_back_noent)
-{
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_new_file);
-
-  ck_assert(uft_tx_rollback_ok(tx));
+  ck_assert_int_eq(dispatched, 1);
+  ck_assert_int_eq(g_txfp_called, 101);
+  ck_assert(uft_tx_rollback_ok(g_tx));
 
-  struct stat statbuf;
-  ck_assert(lstat(".test_dir2/test_file2.txt", &statbuf) != 0);
-  ck_assert_int_eq(errno, ENOENT);
+  int fd = open(".test_dir2/test_file1.txt", O_RDONLY);
+  ck_assert(fd >= 0);
+  char buf[13];
+  ck_assert_int_eq(read(fd, buf, 13), 12);
+  close(fd);
+  ck_assert(strncmp(buf, "foo\nbar\nbaz\n", 12) == 0);
 }
 END_TEST
 
 
-START_TEST (test_failure_rolls_back_noent_with_mkdir)
+START_TEST (test_begin_async_captures_without_exhausting_pool)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_fail_with_new_dir);
-
-  ck_assert(uft_tx_rollback_ok(tx));
+  // More transactions than the pool has workers, each capturing a file.
+  uft_tx * txs[16];
+  char path[64];
+  char buf[8];
+  int n = 16;
+
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), ".test_dir1/async%d.txt", i);
+    write_test_file(path, "orig");
+  }
+  for (int i = 0; i < n; i++) {
+    txs[i] = i == 0 ? g_tx : uft_tx_new(NULL);
+    ck_assert_ptr_eq(uft_tx_begin_async(txs[i], tx_do_fail_with_pooled_capture, tx_async_done), txs[i]);
+  }
 
-  struct stat statbuf;
-  ck_assert(lstat(".no_test_dir2", &statbuf) != 0);
-  ck_assert_int_eq(errno, ENOENT);
+  for (int dispatched = 0; dispatched < n; )
+    dispatched += async_wait_dispatch();
+  ck_assert_int_eq(g_txfp_called, 100 * n);
+  for (int i = 0; i < n; i++) {
+    ck_assert(uft_tx_rollback_ok(txs[i]));
+    if (i > 0)
+      uft_tx_end(txs[i]);
+    snprintf(path, sizeof(path), ".test_dir1/async%d.txt", i);
+    int fd = open(path, O_RDONLY);
+    ck_assert(fd >= 0);
+    int len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[len > 0 ? len : 0] = '\0';
+    ck_assert_str_eq(buf, "orig");
+    unlink(path);
+  }
 }
 END_TEST
 
 
-START_TEST (test_rollback_rolls_back_children)
+START_TEST (test_begin_async_limits_in_flight)
 {
-  uft_tx * tx = uft_tx_begin(g_tx, tx_do_child_ok_parent_fail);
+  uft_tx * tx = uft_tx_new(NULL);
 
-  ck_assert(uft_tx_rollback_ok(tx));
-  uft_tx * child_tx = uft_tx_extra(tx);
-  ck_assert(uft_tx_rollback_ok(child_tx));
+  uft_async_limit(1);
+  ck_assert_ptr_eq(uft_tx_begin_async(g_tx, tx_do_succeed, NULL), g_tx);
+  ck_assert_ptr_eq(uft_tx_begin_async(tx, tx_do_succeed, NULL), NULL);
+  ck_assert_int_eq(errno, EAGAIN);
+
+  while (async_wait_dispatch() == 0)
+    ;
+  ck_assert_ptr_eq(uft_tx_begin_async(tx, tx_do_succeed, NULL), tx);
+  while (async_wait_dispatch() == 0)
+    ;
+  ck_assert(uft_tx_ok(tx));
+  uft_tx_end(tx);
 }
 END_TEST
 
+
 START_TEST (test_error_msgs_returns_logged_errors)
 {
   uft_tx_begin(g_tx, tx_do_fail_with_two_error_msgs);
@@ -688,9 +2563,26 @@ uft_tx_suite ()
   tcase_add_test(tc_tx_add_ent, test_add_ent_existing_symlink_succeeds);
   tcase_add_test(tc_tx_add_ent, test_add_ent_existing_symlink_adds_symlink);
   tcase_add_test(tc_tx_add_ent, test_add_ent_existing_symlink_records_linkdest);
+  tcase_add_test(tc_tx_add_ent, test_add_ent_at_records_file_data);
+  tcase_add_test(tc_tx_add_ent, test_add_fd_records_file_data);
+  tcase_add_test(tc_tx_add_ent, test_add_fd_of_dir_fails);
+  tcase_add_test(tc_tx_add_ent, test_add_set_rolls_back_every_run);
 
   suite_add_tcase(s, tc_tx_add_ent);
 
+  TCase * tc_tx_lock = tcase_create("lock");
+  tcase_add_checked_fixture(tc_tx_lock, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_lock, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_lock, test_lock_try_fails_when_locked);
+  tcase_add_test(tc_tx_lock, test_lock_younger_tx_dies);
+  tcase_add_test(tc_tx_lock, test_lock_on_noent_holds_once_created);
+  tcase_add_test(tc_tx_lock, test_lock_shared_locks_compatible);
+  tcase_add_test(tc_tx_lock, test_lock_released_when_tx_done);
+  tcase_add_test(tc_tx_lock, test_lock_older_tx_waits);
+
+  suite_add_tcase(s, tc_tx_lock);
+
   TCase * tc_tx_failure = tcase_create("failure");
   tcase_add_checked_fixture(tc_tx_failure, setup_new, teardown_new);
   tcase_add_checked_fixture(tc_tx_failure, setup_test_files, teardown_test_files);
@@ -702,8 +2594,30 @@ uft_tx_suite ()
   tcase_add_test(tc_tx_failure, test_failure_rolls_back_replaced_symlinks);
   tcase_add_test(tc_tx_failure, test_failure_rolls_back_changed_symlinks);
   tcase_add_test(tc_tx_failure, test_failure_rolls_back_deleted_symlinks);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_files_added_at);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_sparse_files);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_sparse_files_by_diff);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_large_files);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_direct_io_files);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_async_captures);
+  tcase_add_test(tc_tx_failure, test_barriers_join_a_capture_once);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_meta_only);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_appends);
+  tcase_add_test(tc_tx_failure, test_failure_append_only_detects_edits);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_unlink);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_rmtree);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_renames);
+  tcase_add_test(tc_tx_failure, test_rename_to_same_file_changes_nothing);
+  tcase_add_test(tc_tx_failure, test_success_reaps_trash);
+  tcase_add_test(tc_tx_failure, test_success_reaps_child_trash);
+  tcase_add_test(tc_tx_failure, test_failed_trash_leaves_no_trash);
   tcase_add_test(tc_tx_failure, test_failure_rolls_back_noent);
   tcase_add_test(tc_tx_failure, test_failure_rolls_back_noent_with_mkdir);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_noent_with_tree);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_covered_tree);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_covered_fd);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_tree_and_glob);
+  tcase_add_test(tc_tx_failure, test_failure_rolls_back_threaded_edits);
 
   suite_add_tcase(s, tc_tx_failure);
 
@@ -711,9 +2625,71 @@ uft_tx_suite ()
   tcase_add_checked_fixture(tc_tx_rollback, setup_new, teardown_new);
 
   tcase_add_test(tc_tx_rollback, test_rollback_rolls_back_children);
+  tcase_add_test(tc_tx_rollback, test_rollback_deeply_nested_children);
 
   suite_add_tcase(s, tc_tx_rollback);
 
+  TCase * tc_tx_merge = tcase_create("merge");
+  tcase_add_checked_fixture(tc_tx_merge, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_merge, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_merge, test_child_success_merges_ents_into_parent);
+  tcase_add_test(tc_tx_merge, test_child_merge_keeps_oldest_state);
+  tcase_add_test(tc_tx_merge, test_child_merge_keeps_renames);
+
+  suite_add_tcase(s, tc_tx_merge);
+
+  TCase * tc_tx_reuse = tcase_create("reuse");
+  tcase_add_checked_fixture(tc_tx_reuse, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_reuse, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_reuse, test_reset_clears_tx_keeping_capacity);
+  tcase_add_test(tc_tx_reuse, test_pool_recycles_ended_tx);
+  tcase_add_test(tc_tx_reuse, test_snap_cache_shares_unchanged_files);
+  tcase_add_test(tc_tx_reuse, test_snap_cache_misses_file_changed_while_locked);
+
+  suite_add_tcase(s, tc_tx_reuse);
+
+  TCase * tc_tx_group = tcase_create("group");
+  tcase_add_checked_fixture(tc_tx_group, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_group, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_group, test_group_commits_batch_durably);
+  tcase_add_test(tc_tx_group, test_group_cancel_rolls_back);
+  tcase_add_test(tc_tx_group, test_group_notifies_before_async_use);
+  tcase_add_test(tc_tx_group, test_group_finishes_async_transaction_once_durable);
+
+  suite_add_tcase(s, tc_tx_group);
+
+  TCase * tc_tx_metrics = tcase_create("metrics");
+  tcase_add_checked_fixture(tc_tx_metrics, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_metrics, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_metrics, test_metrics_dump_records_tx_and_enrolment);
+  tcase_add_test(tc_tx_metrics, test_trace_records_calls);
+
+  suite_add_tcase(s, tc_tx_metrics);
+
+  TCase * tc_tx_share = tcase_create("share");
+  tcase_add_checked_fixture(tc_tx_share, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_share, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_share, test_share_rolls_back_participant_changes);
+  tcase_add_test(tc_tx_share, test_share_participant_failure_fails_tx);
+  tcase_add_test(tc_tx_share, test_join_checks_tx_id);
+
+  suite_add_tcase(s, tc_tx_share);
+
+  TCase * tc_tx_async = tcase_create("async");
+  tcase_add_checked_fixture(tc_tx_async, setup_new, teardown_new);
+  tcase_add_checked_fixture(tc_tx_async, setup_test_files, teardown_test_files);
+
+  tcase_add_test(tc_tx_async, test_begin_async_rolls_back_and_dispatches);
+  tcase_add_test(tc_tx_async, test_begin_async_captures_without_exhausting_pool);
+  tcase_add_test(tc_tx_async, test_begin_async_limits_in_flight);
+
+  suite_add_tcase(s, tc_tx_async);
+
   TCase * tc_tx_error_msgs = tcase_create("error_msgs");
   tcase_add_checked_fixture(tc_tx_error_msgs, setup_new, teardown_new);
 
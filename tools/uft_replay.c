@@ -0,0 +1,769 @@
+/// uft-replay: run a libuft trace (see uft_trace_start) again
+///
+/// The trace is read in to memory and its records shared out between
+/// threads, one per thread that recorded them. Before anything runs the
+/// entities the trace enrolled are created under the scratch directory,
+/// as they were when first enrolled (files of the same size, symlinks
+/// with targets of the same length), and every path in the trace is
+/// taken as relative to the scratch directory (paths in the recording
+/// processes working directory being made relative to it first). Records
+/// with a path that has a ".." component, which could reach outside the
+/// scratch directory, are left out (and counted in the report). Each thread then calls
+/// what was recorded, in order, at the recorded times (divided by the
+/// speed) or as fast as it can. Calls made on one transaction from more
+/// than one thread are kept in the recorded order. Finally the
+/// throughput and the latency of transactions (against the recorded
+/// latency) are reported.
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "uft.h"
+#include "uft_tx.h"
+#include "uft_status.h"
+#include "uft_trace.h"
+
+
+#define REPLAY_FILL_LEN 65536
+
+
+/// A decoded trace record. 'tx_seq' is the records place among those
+/// of its transaction.
+typedef struct replay_rec_st
+{
+  int      op;
+  int      thread;
+  uint64_t time;
+  int      tx;
+  int      tx_seq;
+  uint64_t a;
+  uint64_t b;
+  uint64_t c;
+  char *   path;
+  char *   path2;
+} replay_rec;
+
+/// A replaying thread: its records, and what it has measured.
+typedef struct replay_thread_st
+{
+  pthread_t    thread;
+  replay_rec * recs;
+  int          count;
+  int          pos;
+  uint64_t *   latencies;
+  uint64_t *   recorded;
+  int          tx_count;
+  int          rolled_back;
+  int          rollback_failed;
+  int          mismatched;
+  int          enrols;
+  int          enrols_failed;
+  char *       buf;
+  size_t       buf_len;
+} replay_thread;
+
+
+static replay_rec *    recs            = NULL;
+static int             rec_count       = 0;
+static int             rejected        = 0;
+static int             max_tx          = -1;
+static int             thread_count    = 0;
+static replay_thread * threads         = NULL;
+static char *          scratch         = NULL;
+static char *          trace_cwd       = NULL;
+static double          speed           = 1;
+static uint64_t        replay_start    = 0;
+static uint64_t        trace_start     = 0;
+
+static pthread_mutex_t txs_mutex       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  txs_cond        = PTHREAD_COND_INITIALIZER;
+static uft_tx **       txs             = NULL;
+static int *           txs_executed    = NULL;
+
+static __thread replay_thread * self   = NULL;
+
+
+static int      replay_read (const char * trace_path);
+static int      replay_get (unsigned char ** pp, unsigned char * end, uint64_t * valuep);
+static char *   replay_get_path (unsigned char ** pp, unsigned char * end);
+static int      replay_path_escapes (const char * path);
+static int      replay_prepare (void);
+static int      replay_mkdirs (char * path, int parent_only);
+static int      replay_create (replay_rec * rec);
+static void *   replay_run (void * arg);
+static void     replay_op (replay_rec * rec);
+static void     replay_begin (replay_rec * rec, uft_tx * tx);
+static void     replay_txfp (uft_tx * tx);
+static uft_tx * replay_tx_wait (replay_rec * rec);
+static void     replay_tx_done (replay_rec * rec, uft_tx * tx, int new_id);
+static char *   replay_fill (size_t len);
+static uint64_t replay_now (void);
+static int      replay_cmp (const void * a, const void * b);
+static void     replay_report (uint64_t elapsed, int metrics);
+static void     replay_report_latency (const char * what, uint64_t * latencies, int count);
+
+
+int
+main (int argc, char ** argv)
+{
+  int metrics = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:m")) != -1) {
+    if (opt == 's') {
+      speed = atof(optarg);
+    } else if (opt == 'm') {
+      metrics = 1;
+    } else {
+      fprintf(stderr, "usage: %s [-s speed] [-m] trace scratch_dir\n", argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 2 || speed < 0) {
+    fprintf(stderr, "usage: %s [-s speed] [-m] trace scratch_dir\n", argv[0]);
+    return 2;
+  }
+  scratch = argv[optind + 1];
+
+  if (mkdir(scratch, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "error creating scratch directory %s: %s\n", scratch, strerror(errno));
+    return 1;
+  }
+  if (replay_read(argv[optind]) != 0 || replay_prepare() != 0)
+    return 1;
+
+  replay_start = replay_now();
+  for (int t = 0; t < thread_count; t++) {
+    int result = pthread_create(&threads[t].thread, NULL, replay_run, &threads[t]);
+    if (result != 0) {
+      fprintf(stderr, "error starting replay thread: %s\n", strerror(result));
+      return 1;
+    }
+  }
+  for (int t = 0; t < thread_count; t++)
+    pthread_join(threads[t].thread, NULL);
+
+  replay_report(replay_now() - replay_start, metrics);
+
+  return 0;
+}
+
+
+/// Read and decode a trace, and share its records out between threads.
+/// Returns 0 on success, or -1 (having said why) on failure.
+
+static int
+replay_read (const char * trace_path)
+{
+  struct stat statbuf;
+
+  int fd = open(trace_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &statbuf) != 0) {
+    fprintf(stderr, "error opening trace %s: %s\n", trace_path, strerror(errno));
+    return -1;
+  }
+  unsigned char * data = (unsigned char *) malloc(statbuf.st_size > 0 ? statbuf.st_size : 1);
+  ssize_t len = 0;
+  while (data != NULL && len < statbuf.st_size) {
+    ssize_t result = read(fd, data + len, statbuf.st_size - len);
+    if (result <= 0)
+      break;
+    len += result;
+  }
+  close(fd);
+  if (data == NULL || len < 8 || memcmp(data, UFT_TRACE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s is not a libuft trace\n", trace_path);
+    free(data);
+    return -1;
+  }
+
+  int rec_cap = 1024;
+  recs = (replay_rec *) malloc(rec_cap * sizeof(replay_rec));
+  int * tx_seqs = NULL;
+  int tx_cap = 0;
+  uint64_t time = 0;
+
+  unsigned char * p = data + 8;
+  unsigned char * end = data + len;
+  uint64_t cwd_len;
+  if (replay_get(&p, end, &cwd_len) != 0 || cwd_len > (uint64_t) (end - p) || (trace_cwd = strndup((char *) p, cwd_len)) == NULL) {
+    fprintf(stderr, "%s is not a libuft trace\n", trace_path);
+    free(data);
+    return -1;
+  }
+  p += cwd_len;
+  while (p < end && recs != NULL) {
+    replay_rec rec;
+    uint64_t thread, delta, tx;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.op = *p++;
+    if (replay_get(&p, end, &thread) != 0 || replay_get(&p, end, &delta) != 0 || replay_get(&p, end, &tx) != 0
+        || replay_get(&p, end, &rec.a) != 0 || replay_get(&p, end, &rec.b) != 0 || replay_get(&p, end, &rec.c) != 0)
+      break;
+    if (rec.op >= UFT_TRACE_ADD_ENT && (rec.path = replay_get_path(&p, end)) == NULL)
+      break;
+    if (rec.op == UFT_TRACE_RENAME && (rec.path2 = replay_get_path(&p, end)) == NULL)
+      break;
+    time += delta;
+    if ((rec.path != NULL && replay_path_escapes(rec.path)) || (rec.path2 != NULL && replay_path_escapes(rec.path2))) {
+      free(rec.path);
+      free(rec.path2);
+      rejected++;
+      continue;
+    }
+    rec.time = time;
+    rec.thread = thread;
+    rec.tx = tx;
+
+    int id = rec.op == UFT_TRACE_RESET && rec.a > tx ? rec.a : rec.tx;
+    if (id >= tx_cap) {
+      int new_cap = tx_cap > 0 ? tx_cap : 1024;
+      while (new_cap <= id)
+        new_cap *= 2;
+      int * new_seqs = (int *) realloc(tx_seqs, new_cap * sizeof(int));
+      if (new_seqs == NULL)
+        break;
+      memset(new_seqs + tx_cap, 0, (new_cap - tx_cap) * sizeof(int));
+      tx_seqs = new_seqs;
+      tx_cap = new_cap;
+    }
+    if (id > max_tx)
+      max_tx = id;
+    rec.tx_seq = tx_seqs[rec.tx]++;
+    if (rec.op == UFT_TRACE_RESET)
+      tx_seqs[rec.a] = 1;
+    if (rec.thread > thread_count)
+      thread_count = rec.thread;
+
+    if (rec_count == rec_cap) {
+      rec_cap *= 2;
+      replay_rec * new_recs = (replay_rec *) realloc(recs, rec_cap * sizeof(replay_rec));
+      if (new_recs == NULL)
+        break;
+      recs = new_recs;
+    }
+    recs[rec_count++] = rec;
+  }
+  if (p < end)
+    fprintf(stderr, "warning: trace %s is truncated or corrupt, replaying the first %d records\n", trace_path, rec_count);
+  free(tx_seqs);
+  free(data);
+  if (recs == NULL)
+    return -1;
+
+  threads = (replay_thread *) calloc(thread_count, sizeof(replay_thread));
+  txs = (uft_tx **) calloc(max_tx + 1, sizeof(uft_tx *));
+  txs_executed = (int *) calloc(max_tx + 1, sizeof(int));
+  if ((thread_count > 0 && threads == NULL) || txs == NULL || txs_executed == NULL) {
+    fprintf(stderr, "error reading trace %s: %s\n", trace_path, strerror(ENOMEM));
+    return -1;
+  }
+
+  for (int r = 0; r < rec_count; r++)
+    threads[recs[r].thread - 1].count++;
+  for (int t = 0; t < thread_count; t++) {
+    replay_thread * thread = &threads[t];
+    thread->recs = (replay_rec *) malloc((thread->count + 1) * sizeof(replay_rec));
+    thread->latencies = (uint64_t *) malloc((thread->count + 1) * sizeof(uint64_t));
+    thread->recorded = (uint64_t *) malloc((thread->count + 1) * sizeof(uint64_t));
+    if (thread->recs == NULL || thread->latencies == NULL || thread->recorded == NULL) {
+      fprintf(stderr, "error reading trace %s: %s\n", trace_path, strerror(ENOMEM));
+      return -1;
+    }
+    thread->count = 0;
+  }
+  for (int r = 0; r < rec_count; r++) {
+    replay_thread * thread = &threads[recs[r].thread - 1];
+    thread->recs[thread->count++] = recs[r];
+  }
+  if (rec_count > 0)
+    trace_start = recs[0].time;
+
+  return 0;
+}
+
+
+/// Decode a varint at '*pp' in to '*valuep'. Returns -1 if it runs off
+/// the end of the trace.
+
+static int
+replay_get (unsigned char ** pp, unsigned char * end, uint64_t * valuep)
+{
+  uint64_t value = 0;
+  int shift = 0;
+
+  while (*pp < end && shift < 64) {
+    unsigned char byte = *(*pp)++;
+    value |= (uint64_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *valuep = value;
+      return 0;
+    }
+    shift += 7;
+  }
+
+  return -1;
+}
+
+
+/// Decode a path at '*pp', returning it as a path under the scratch
+/// directory (newly allocated), or NULL if it runs off the end of the
+/// trace.
+
+static char *
+replay_get_path (unsigned char ** pp, unsigned char * end)
+{
+  uint64_t len;
+
+  if (replay_get(pp, end, &len) != 0 || len > (uint64_t) (end - *pp))
+    return NULL;
+
+  size_t cwd_len = strlen(trace_cwd);
+  if (cwd_len > 1 && len > cwd_len && memcmp(*pp, trace_cwd, cwd_len) == 0 && (*pp)[cwd_len] == '/') {
+    *pp += cwd_len + 1;
+    len -= cwd_len + 1;
+  }
+
+  char * path = (char *) malloc(strlen(scratch) + len + 2);
+  if (path == NULL)
+    return NULL;
+  int off = sprintf(path, "%s%s", scratch, len > 0 && **pp == '/' ? "" : "/");
+  memcpy(path + off, *pp, len);
+  path[off + len] = '\0';
+  *pp += len;
+
+  return path;
+}
+
+
+/// Return true if a path from 'replay_get_path' has a ".." component
+/// after the scratch directory.
+
+static int
+replay_path_escapes (const char * path)
+{
+  for (const char * p = path + strlen(scratch); *p != '\0'; ) {
+    while (*p == '/')
+      p++;
+    size_t len = strcspn(p, "/");
+    if (len == 2 && p[0] == '.' && p[1] == '.')
+      return 1;
+    p += len;
+  }
+
+  return 0;
+}
+
+
+/// Create what the trace expects to find in the scratch directory: each
+/// enrolled entity as it was when it was first enrolled, and the parent
+/// directories of every path. Returns 0 on success, or -1 (having said
+/// why) on failure.
+
+static int
+replay_prepare (void)
+{
+  for (int r = 0; r < rec_count; r++) {
+    replay_rec * rec = &recs[r];
+    int seen = 0;
+
+    if (rec->path == NULL)
+      continue;
+    for (int s = 0; s < r && !seen; s++)
+      seen = (recs[s].path != NULL && strcmp(recs[s].path, rec->path) == 0)
+          || (recs[s].path2 != NULL && strcmp(recs[s].path2, rec->path) == 0);
+    if (seen)
+      continue;
+
+    if (replay_mkdirs(rec->path, 1) != 0 || (rec->path2 != NULL && replay_mkdirs(rec->path2, 1) != 0) || replay_create(rec) != 0) {
+      fprintf(stderr, "error preparing %s: %s\n", rec->path, strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/// Create the directories of 'path' (not the last component if
+/// 'parent_only'). Returns 0 on success or -1 (with errno set).
+
+static int
+replay_mkdirs (char * path, int parent_only)
+{
+  char * slash = path;
+
+  while ((slash = strchr(slash + 1, '/')) != NULL) {
+    *slash = '\0';
+    int result = mkdir(path, 0755);
+    *slash = '/';
+    if (result != 0 && errno != EEXIST)
+      return -1;
+  }
+
+  if (!parent_only && mkdir(path, 0755) != 0 && errno != EEXIST)
+    return -1;
+
+  return 0;
+}
+
+
+/// Create the entity the first record of its path expects. Returns 0 on
+/// success or -1 (with errno set).
+
+static int
+replay_create (replay_rec * rec)
+{
+  if ((rec->op == UFT_TRACE_ADD_ENT || rec->op == UFT_TRACE_ADD_FD) && rec->b == UFT_TRACE_KIND_FILE) {
+    off_t size = rec->c - 1;
+    int fd = open(rec->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return -1;
+    char * fill = replay_fill(size < REPLAY_FILL_LEN ? size : REPLAY_FILL_LEN);
+    for (off_t off = 0; off < size; ) {
+      ssize_t result = write(fd, fill, size - off < REPLAY_FILL_LEN ? size - off : REPLAY_FILL_LEN);
+      if (result < 0) {
+        close(fd);
+        return -1;
+      }
+      off += result;
+    }
+    return close(fd);
+  }
+
+  if (rec->op == UFT_TRACE_ADD_ENT && rec->b == UFT_TRACE_KIND_SYMLINK) {
+    char target[PATH_MAX];
+    size_t len = rec->c - 1 < sizeof(target) - 1 ? rec->c - 1 : sizeof(target) - 1;
+    memset(target, 't', len);
+    target[len] = '\0';
+    if (symlink(len > 0 ? target : "t", rec->path) != 0 && errno != EEXIST)
+      return -1;
+    return 0;
+  }
+
+  if (rec->op == UFT_TRACE_RMTREE || (rec->op == UFT_TRACE_ADD_ENT && rec->b == UFT_TRACE_KIND_DIR))
+    return replay_mkdirs(rec->path, 0);
+
+  if (rec->op == UFT_TRACE_UNLINK || rec->op == UFT_TRACE_RENAME || rec->op == UFT_TRACE_READ || rec->op == UFT_TRACE_WRITE) {
+    int fd = open(rec->path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      return -1;
+    return close(fd);
+  }
+
+  return 0;
+}
+
+
+/// A replaying thread.
+
+static void *
+replay_run (void * arg)
+{
+  self = (replay_thread *) arg;
+
+  while (self->pos < self->count)
+    replay_op(&self->recs[self->pos++]);
+
+  return NULL;
+}
+
+
+/// Replay one record, once its time has come and once everything
+/// recorded before it on its transaction has been replayed.
+
+static void
+replay_op (replay_rec * rec)
+{
+  if (speed > 0) {
+    uint64_t due = replay_start + (uint64_t) ((rec->time - trace_start) / speed);
+    struct timespec ts = { due / 1000000000, due % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+  }
+
+  uft_tx * tx = replay_tx_wait(rec);
+  int fd;
+
+  switch (rec->op) {
+  case UFT_TRACE_NEW:
+    tx = uft_tx_new((void *) (intptr_t) rec->tx);
+    break;
+  case UFT_TRACE_CHILD: {
+    pthread_mutex_lock(&txs_mutex);
+    uft_tx * parent = rec->a <= (uint64_t) max_tx ? txs[rec->a] : NULL;
+    pthread_mutex_unlock(&txs_mutex);
+    tx = parent != NULL ? uft_tx_child(parent, (void *) (intptr_t) rec->tx) : uft_tx_new((void *) (intptr_t) rec->tx);
+    break;
+  }
+  case UFT_TRACE_BEGIN:
+    if (tx == NULL)
+      tx = uft_tx_new((void *) (intptr_t) rec->tx);
+    replay_tx_done(rec, tx, -1);
+    replay_begin(rec, tx);
+    return;
+  case UFT_TRACE_SUCCESS:
+    if (tx != NULL)
+      uft_tx_success(tx);
+    break;
+  case UFT_TRACE_FAIL:
+    if (tx != NULL)
+      uft_tx_fail(tx);
+    break;
+  case UFT_TRACE_RESET:
+    if (tx != NULL) {
+      uft_tx_reset(tx);
+      uft_tx_set_extra(tx, (void *) (intptr_t) rec->a);
+      replay_tx_done(rec, tx, rec->a);
+    }
+    return;
+  case UFT_TRACE_END:
+    if (tx != NULL)
+      uft_tx_end(tx);
+    tx = NULL;
+    break;
+  default:
+    if (tx == NULL)
+      break;
+    switch (rec->op) {
+    case UFT_TRACE_ADD_ENT:
+      self->enrols++;
+      if (uft_status_error(uft_tx_add_ent(tx, rec->path, rec->a)))
+        self->enrols_failed++;
+      break;
+    case UFT_TRACE_ADD_FD:
+      self->enrols++;
+      fd = open(rec->path, O_RDONLY);
+      if (fd < 0 || uft_status_error(uft_tx_add_fd(tx, fd)))
+        self->enrols_failed++;
+      if (fd >= 0)
+        close(fd);
+      break;
+    case UFT_TRACE_MKDIR:
+      uft_mkdir(tx, rec->path, rec->a);
+      break;
+    case UFT_TRACE_OPEN:
+      fd = uft_open(tx, rec->path, rec->a, rec->b);
+      if (fd >= 0)
+        close(fd);
+      break;
+    case UFT_TRACE_READ:
+      fd = open(rec->path, O_RDONLY);
+      if (fd >= 0) {
+        uft_read(tx, fd, replay_fill(rec->a), rec->a);
+        close(fd);
+      }
+      break;
+    case UFT_TRACE_WRITE:
+      fd = open(rec->path, O_WRONLY);
+      if (fd >= 0) {
+        lseek(fd, rec->b, SEEK_SET);
+        uft_write(tx, fd, replay_fill(rec->a), rec->a);
+        close(fd);
+      }
+      break;
+    case UFT_TRACE_UNLINK:
+      uft_unlink(tx, rec->path);
+      break;
+    case UFT_TRACE_RMTREE:
+      uft_rmtree(tx, rec->path);
+      break;
+    case UFT_TRACE_RENAME:
+      uft_rename(tx, rec->path, rec->path2);
+      break;
+    }
+  }
+
+  replay_tx_done(rec, tx, -1);
+}
+
+
+/// Run a transaction, replaying the records up to the end of it in its
+/// function, and then compare how it went with how it went before.
+
+static void
+replay_begin (replay_rec * rec, uft_tx * tx)
+{
+  uint64_t start = replay_now();
+  uft_tx_begin(tx, replay_txfp);
+  uint64_t latency = replay_now() - start;
+
+  if (self->pos < self->count && self->recs[self->pos].op == UFT_TRACE_DONE && self->recs[self->pos].tx == rec->tx) {
+    replay_rec * done = &self->recs[self->pos++];
+    int rolled_back = uft_tx_rollback_attempted(tx);
+    self->latencies[self->tx_count] = latency;
+    self->recorded[self->tx_count] = done->b;
+    self->tx_count++;
+    if (rolled_back)
+      self->rolled_back++;
+    if (uft_tx_rollback_failed(tx))
+      self->rollback_failed++;
+    if ((rolled_back != 0) != ((done->a & UFT_TX_ROLLBACK) != 0))
+      self->mismatched++;
+    replay_tx_done(done, tx, -1);
+  }
+}
+
+
+/// The function of every replayed transaction.
+
+static void
+replay_txfp (uft_tx * tx)
+{
+  int id = (int) (intptr_t) uft_tx_extra(tx);
+
+  while (self->pos < self->count) {
+    replay_rec * rec = &self->recs[self->pos];
+    if (rec->op == UFT_TRACE_DONE && rec->tx == id)
+      return;
+    self->pos++;
+    replay_op(rec);
+  }
+}
+
+
+/// Wait until everything recorded before 'rec' on its transaction has
+/// been replayed, and return the transaction (NULL if there is none).
+
+static uft_tx *
+replay_tx_wait (replay_rec * rec)
+{
+  pthread_mutex_lock(&txs_mutex);
+  while (txs_executed[rec->tx] < rec->tx_seq)
+    pthread_cond_wait(&txs_cond, &txs_mutex);
+  uft_tx * tx = txs[rec->tx];
+  pthread_mutex_unlock(&txs_mutex);
+
+  return tx;
+}
+
+
+/// Note that 'rec' has been replayed, leaving its transaction as 'tx'
+/// (and as 'new_id' too, if that is not -1).
+
+static void
+replay_tx_done (replay_rec * rec, uft_tx * tx, int new_id)
+{
+  pthread_mutex_lock(&txs_mutex);
+  txs[rec->tx] = tx;
+  txs_executed[rec->tx]++;
+  if (new_id >= 0) {
+    txs[new_id] = tx;
+    txs_executed[new_id] = 1;
+  }
+  pthread_cond_broadcast(&txs_cond);
+  pthread_mutex_unlock(&txs_mutex);
+}
+
+
+/// Return this threads buffer of at least 'len' bytes of fill data.
+
+static char *
+replay_fill (size_t len)
+{
+  replay_thread * thread = self != NULL ? self : &threads[0];
+
+  if (len > thread->buf_len || thread->buf == NULL) {
+    char * buf = (char *) realloc(thread->buf, len + 1);
+    if (buf == NULL) {
+      fprintf(stderr, "error allocating %zu bytes\n", len);
+      exit(1);
+    }
+    memset(buf, 'x', len + 1);
+    thread->buf = buf;
+    thread->buf_len = len;
+  }
+
+  return thread->buf;
+}
+
+
+static uint64_t
+replay_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int
+replay_cmp (const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/// Print what was replayed and how long it took, and the libufts own
+/// metrics if 'metrics'.
+
+static void
+replay_report (uint64_t elapsed, int metrics)
+{
+  int tx_count = 0, rolled_back = 0, rollback_failed = 0, mismatched = 0, enrols = 0, enrols_failed = 0;
+
+  for (int t = 0; t < thread_count; t++) {
+    tx_count        += threads[t].tx_count;
+    rolled_back     += threads[t].rolled_back;
+    rollback_failed += threads[t].rollback_failed;
+    mismatched      += threads[t].mismatched;
+    enrols          += threads[t].enrols;
+    enrols_failed   += threads[t].enrols_failed;
+  }
+
+  uint64_t * latencies = (uint64_t *) malloc((tx_count + 1) * sizeof(uint64_t));
+  uint64_t * recorded = (uint64_t *) malloc((tx_count + 1) * sizeof(uint64_t));
+  int n = 0;
+  for (int t = 0; t < thread_count && latencies != NULL && recorded != NULL; t++) {
+    memcpy(latencies + n, threads[t].latencies, threads[t].tx_count * sizeof(uint64_t));
+    memcpy(recorded + n, threads[t].recorded, threads[t].tx_count * sizeof(uint64_t));
+    n += threads[t].tx_count;
+  }
+
+  double seconds = elapsed / 1e9;
+  printf("records:          %d (%d threads)\n", rec_count, thread_count);
+  printf("elapsed:          %.3f s (speed %g%s)\n", seconds, speed, speed > 0 ? "" : ", unpaced");
+  printf("transactions:     %d (%.1f/s), %d rolled back, %d rollbacks failed, %d outcomes differing from the trace\n",
+         tx_count, seconds > 0 ? tx_count / seconds : 0, rolled_back, rollback_failed, mismatched);
+  printf("enrolments:       %d (%.1f/s), %d failed\n", enrols, seconds > 0 ? enrols / seconds : 0, enrols_failed);
+  if (rejected > 0)
+    printf("rejected:         %d records with a \"..\" path component, not replayed\n", rejected);
+  if (latencies != NULL && recorded != NULL && n > 0) {
+    replay_report_latency("latency replayed", latencies, n);
+    replay_report_latency("latency recorded", recorded, n);
+  }
+  free(latencies);
+  free(recorded);
+
+  if (metrics) {
+    fflush(stdout);
+    uft_metrics_dump(1, UFT_METRICS_PROMETHEUS);
+  }
+}
+
+
+static void
+replay_report_latency (const char * what, uint64_t * latencies, int count)
+{
+  qsort(latencies, count, sizeof(uint64_t), replay_cmp);
+  printf("%s: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", what,
+         latencies[(int) (count * 0.5)] / 1e3, latencies[(int) (count * 0.9)] / 1e3, latencies[(int) (count * 0.99)] / 1e3,
+         latencies[(int) (count * 0.999)] / 1e3, latencies[count - 1] / 1e3);
+}